@@ -162,7 +162,7 @@ else
 endif
 
 ifeq ($(UNAME),Linux)
-	BROKER_LDADD:=$(BROKER_LDADD) -lrt
+	BROKER_LDADD:=$(BROKER_LDADD) -lrt -lpthread
 	BROKER_LDFLAGS:=$(BROKER_LDFLAGS) -Wl,--dynamic-list=linker.syms
 	LIB_LIBADD:=$(LIB_LIBADD) -lrt
 endif
@@ -34,39 +34,38 @@ int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int p
     return mosquitto_publish_v5(mosq, mid, topic, payloadlen, payload, qos, retain, NULL);
 }
 
-int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *properties)
+/* Work out the properties to send with a PUBLISH. Properties that weren't
+ * created by the client are copied in to local_property first. */
+static int publish__properties_get(struct mosquitto *mosq, const mosquitto_property *properties, mosquitto_property *local_property, const mosquitto_property **outgoing_properties)
+{
+    *outgoing_properties = NULL;
+    if(!properties) return MOSQ_ERR_SUCCESS;
+    if(mosq->protocol != mosq_p_mqtt5) return MOSQ_ERR_NOT_SUPPORTED;
+
+    if(properties->client_generated){
+        *outgoing_properties = properties;
+    }else{
+        memcpy(local_property, properties, sizeof(mosquitto_property));
+        local_property->client_generated = true;
+        local_property->next = NULL;
+        *outgoing_properties = local_property;
+    }
+    return mosquitto_property_check_all(CMD_PUBLISH, *outgoing_properties);
+}
+
+
+/* Check that a PUBLISH can be sent, before anything is queued. */
+static int publish__check(struct mosquitto *mosq, const char *topic, int payloadlen, int qos, const mosquitto_property *outgoing_properties)
 {
-    struct mosquitto_message_all *message;
-    uint16_t local_mid;
     const mosquitto_property *p;
-    const mosquitto_property *outgoing_properties = NULL;
-    mosquitto_property *properties_copy = NULL;
-    mosquitto_property local_property;
     bool have_topic_alias;
-    int rc;
     int tlen = 0;
     uint32_t remaining_length;
 
-    if(!mosq || qos<0 || qos>2) return MOSQ_ERR_INVAL;
-    if(mosq->protocol != mosq_p_mqtt5 && properties) return MOSQ_ERR_NOT_SUPPORTED;
+    if(qos<0 || qos>2) return MOSQ_ERR_INVAL;
     if(qos > mosq->maximum_qos) return MOSQ_ERR_QOS_NOT_SUPPORTED;
 
-    if(properties){
-        if(properties->client_generated){
-            outgoing_properties = properties;
-        }else{
-            memcpy(&local_property, properties, sizeof(mosquitto_property));
-            local_property.client_generated = true;
-            local_property.next = NULL;
-            outgoing_properties = &local_property;
-        }
-        rc = mosquitto_property_check_all(CMD_PUBLISH, outgoing_properties);
-        if(rc) return rc;
-    }
-
     if(!topic || STREMPTY(topic)){
-        if(topic) topic = NULL;
-
         if(mosq->protocol == mosq_p_mqtt5){
             p = outgoing_properties;
             have_topic_alias = false;
@@ -87,7 +86,7 @@ int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, const char *topic, in
         tlen = strlen(topic);
         if(mosquitto_validate_utf8(topic, tlen)) return MOSQ_ERR_MALFORMED_UTF8;
         if(payloadlen < 0 || payloadlen > MQTT_MAX_PAYLOAD) return MOSQ_ERR_PAYLOAD_SIZE;
-        if(mosquitto_pub_topic_check(topic) != MOSQ_ERR_SUCCESS){
+        if(mosquitto_pub_topic_check2(topic, tlen) != MOSQ_ERR_SUCCESS){
             return MOSQ_ERR_INVAL;
         }
     }
@@ -101,6 +100,19 @@ int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, const char *topic, in
             return MOSQ_ERR_OVERSIZE_PACKET;
         }
     }
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Send or queue a PUBLISH that has passed publish__check(). */
+static int publish__send(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *outgoing_properties)
+{
+    struct mosquitto_message_all *message;
+    uint16_t local_mid;
+    mosquitto_property *properties_copy = NULL;
+    int rc;
+
+    if(topic && STREMPTY(topic)) topic = NULL;
 
     local_mid = mosquitto__mid_generate(mosq);
     if(mid){
@@ -108,7 +120,7 @@ int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, const char *topic, in
     }
 
     if(qos == 0){
-        return send__publish(mosq, local_mid, topic, payloadlen, payload, qos, retain, false, outgoing_properties, NULL, 0);
+        return send__publish(mosq, local_mid, topic, payloadlen, payload, qos, retain, false, outgoing_properties, NULL, 0, NULL);
     }else{
         if(outgoing_properties){
             rc = mosquitto_property_copy_all(&properties_copy, outgoing_properties);
@@ -151,13 +163,65 @@ int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, const char *topic, in
 
         pthread_mutex_lock(&mosq->msgs_out.mutex);
         message->state = mosq_ms_invalid;
-        message__queue(mosq, message, mosq_md_out);
+        rc = message__queue(mosq, message, mosq_md_out);
         pthread_mutex_unlock(&mosq->msgs_out.mutex);
-        return MOSQ_ERR_SUCCESS;
+        return rc;
     }
 }
 
 
+int mosquitto_publish_v5(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain, const mosquitto_property *properties)
+{
+    const mosquitto_property *outgoing_properties;
+    mosquitto_property local_property;
+    int rc;
+
+    if(!mosq || qos<0 || qos>2) return MOSQ_ERR_INVAL;
+
+    rc = publish__properties_get(mosq, properties, &local_property, &outgoing_properties);
+    if(rc) return rc;
+    rc = publish__check(mosq, topic, payloadlen, qos, outgoing_properties);
+    if(rc) return rc;
+
+    return publish__send(mosq, mid, topic, payloadlen, payload, qos, retain, outgoing_properties);
+}
+
+
+int mosquitto_publish_batch(struct mosquitto *mosq, struct mosquitto_message *messages, int count, const mosquitto_property *properties)
+{
+    const mosquitto_property *outgoing_properties;
+    mosquitto_property local_property;
+    int i;
+    int rc, rc2;
+
+    if(!mosq || count < 0 || (count > 0 && !messages)) return MOSQ_ERR_INVAL;
+
+    rc = publish__properties_get(mosq, properties, &local_property, &outgoing_properties);
+    if(rc) return rc;
+
+    /* Check everything before queuing anything, so a bad message doesn't
+     * leave the batch half sent. */
+    for(i=0; i<count; i++){
+        rc = publish__check(mosq, messages[i].topic, messages[i].payloadlen, messages[i].qos, outgoing_properties);
+        if(rc) return rc;
+    }
+
+    /* Hold the packets back until they are all queued, so the network thread
+     * is woken once and they go out in a single writev(). */
+    packet__cork(mosq);
+    for(i=0; i<count; i++){
+        rc = publish__send(mosq, &messages[i].mid, messages[i].topic,
+                messages[i].payloadlen, messages[i].payload,
+                messages[i].qos, messages[i].retain, outgoing_properties);
+        if(rc) break;
+    }
+    rc2 = packet__uncork(mosq);
+
+    if(rc) return rc;
+    return rc2;
+}
+
+
 int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const char *sub, int qos)
 {
     return mosquitto_subscribe_multiple(mosq, mid, 1, (char *const *const)&sub, qos, 0, NULL);
@@ -199,8 +263,8 @@ int mosquitto_subscribe_multiple(struct mosquitto *mosq, int *mid, int sub_count
     }
 
     for(i=0; i<sub_count; i++){
-        if(mosquitto_sub_topic_check(sub[i])) return MOSQ_ERR_INVAL;
         slen = strlen(sub[i]);
+        if(mosquitto_sub_topic_check2(sub[i], slen)) return MOSQ_ERR_INVAL;
         if(mosquitto_validate_utf8(sub[i], slen)) return MOSQ_ERR_MALFORMED_UTF8;
         remaining_length += 2+slen + 1;
     }
@@ -256,8 +320,8 @@ int mosquitto_unsubscribe_multiple(struct mosquitto *mosq, int *mid, int sub_cou
     }
 
     for(i=0; i<sub_count; i++){
-        if(mosquitto_sub_topic_check(sub[i])) return MOSQ_ERR_INVAL;
         slen = strlen(sub[i]);
+        if(mosquitto_sub_topic_check2(sub[i], slen)) return MOSQ_ERR_INVAL;
         if(mosquitto_validate_utf8(sub[i], slen)) return MOSQ_ERR_MALFORMED_UTF8;
         remaining_length += 2+slen;
     }
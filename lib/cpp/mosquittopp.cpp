@@ -272,6 +272,11 @@ int mosquittopp::publish(int *mid, const char *topic, int payloadlen, const void
     return mosquitto_publish(m_mosq, mid, topic, payloadlen, payload, qos, retain);
 }
 
+int mosquittopp::publish_batch(struct mosquitto_message *messages, int count, const mosquitto_property *properties)
+{
+    return mosquitto_publish_batch(m_mosq, messages, count, properties);
+}
+
 void mosquittopp::reconnect_delay_set(unsigned int reconnect_delay, unsigned int reconnect_delay_max, bool reconnect_exponential_backoff)
 {
     mosquitto_reconnect_delay_set(m_mosq, reconnect_delay, reconnect_delay_max, reconnect_exponential_backoff);
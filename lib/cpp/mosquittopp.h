@@ -99,6 +99,7 @@ class mosqpp_EXPORT DEPRECATED mosquittopp {
         int DEPRECATED reconnect_async();
         int DEPRECATED disconnect();
         int DEPRECATED publish(int *mid, const char *topic, int payloadlen=0, const void *payload=NULL, int qos=0, bool retain=false);
+        int DEPRECATED publish_batch(struct mosquitto_message *messages, int count, const mosquitto_property *properties=NULL);
         int DEPRECATED subscribe(int *mid, const char *sub, int qos=0);
         int DEPRECATED unsubscribe(int *mid, const char *sub);
         void DEPRECATED reconnect_delay_set(unsigned int reconnect_delay, unsigned int reconnect_delay_max, bool reconnect_exponential_backoff);
@@ -154,12 +154,12 @@ int handle__publish(struct mosquitto *mosq)
         case 2:
             message->properties = properties;
             util__decrement_receive_quota(mosq);
-            rc = send__pubrec(mosq, message->msg.mid, 0);
             pthread_mutex_lock(&mosq->msgs_in.mutex);
             message->state = mosq_ms_wait_for_pubrel;
-            message__queue(mosq, message, mosq_md_in);
+            rc = message__queue(mosq, message, mosq_md_in);
             pthread_mutex_unlock(&mosq->msgs_in.mutex);
-            return rc;
+            if(rc) return rc;
+            return send__pubrec(mosq, mid, 0);
         default:
             message__cleanup(&message);
             mosquitto_property_free_all(&properties);
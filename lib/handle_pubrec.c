@@ -70,7 +70,7 @@ int handle__pubrec(struct mosquitto_db *db, struct mosquitto *mosq)
     log__printf(NULL, MOSQ_LOG_DEBUG, "Received PUBREC from %s (Mid: %d)", mosq->id, mid);
 
     if(reason_code < 0x80){
-        rc = db__message_update_outgoing(mosq, mid, mosq_ms_wait_for_pubcomp, 2);
+        rc = db__message_update_outgoing(db, mosq, mid, mosq_ms_wait_for_pubcomp, 2);
     }else{
         return db__message_delete_outgoing(db, mosq, mid, mosq_ms_wait_for_pubrec, 2);
     }
@@ -16,6 +16,8 @@ Contributors:
 
 #include "config.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -158,3 +160,211 @@ char *mosquitto__strdup(const char *s)
     return str;
 }
 
+
+#ifdef WITH_BROKER
+/* Number of objects carved out of each slab. */
+#define POOL_SLAB_OBJECTS 64
+
+/* A slab is this header followed by POOL_SLAB_OBJECTS objects. Each object is
+ * preceded by a pointer back to its slab, so that a freed object goes back on
+ * the free list of the slab it came from, and the slab itself can be released
+ * once all of its objects have been freed.
+ *
+ * The slabs of a pool are kept on a list with every slab that has a free
+ * object ahead of every slab that is full, so allocating only ever needs to
+ * look at the first slab. */
+struct pool__slab{
+    struct pool__slab *prev;
+    struct pool__slab *next;
+    void *free_list;
+    unsigned int in_use;
+};
+
+/* Every pool that has had a slab allocated, for stats and cleanup. */
+static struct mosquitto__pool *pools = NULL;
+
+static size_t pool__object_size(struct mosquitto__pool *pool)
+{
+    /* Room for the free list link, and keep every object 8 byte aligned. */
+    if(pool->size < sizeof(void *)){
+        return sizeof(void *);
+    }
+    return (pool->size + 7) & ~(size_t)7;
+}
+
+
+static void pool__slab_unlink(struct mosquitto__pool *pool, struct pool__slab *slab)
+{
+    if(slab->prev){
+        slab->prev->next = slab->next;
+    }else{
+        pool->slabs = slab->next;
+    }
+    if(slab->next){
+        slab->next->prev = slab->prev;
+    }else{
+        pool->slabs_tail = slab->prev;
+    }
+    slab->prev = NULL;
+    slab->next = NULL;
+}
+
+
+static void pool__slab_push_head(struct mosquitto__pool *pool, struct pool__slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = pool->slabs;
+    if(pool->slabs){
+        pool->slabs->prev = slab;
+    }else{
+        pool->slabs_tail = slab;
+    }
+    pool->slabs = slab;
+}
+
+
+static void pool__slab_push_tail(struct mosquitto__pool *pool, struct pool__slab *slab)
+{
+    slab->next = NULL;
+    slab->prev = pool->slabs_tail;
+    if(pool->slabs_tail){
+        pool->slabs_tail->next = slab;
+    }else{
+        pool->slabs = slab;
+    }
+    pool->slabs_tail = slab;
+}
+
+
+static int pool__grow(struct mosquitto__pool *pool)
+{
+    struct pool__slab *slab;
+    char *obj;
+    size_t stride;
+    int i;
+
+    stride = sizeof(struct pool__slab *) + pool__object_size(pool);
+
+    slab = mosquitto__malloc(sizeof(struct pool__slab) + stride*POOL_SLAB_OBJECTS);
+    if(!slab){
+        return 1;
+    }
+    if(pool->slabs == NULL){
+        pool->next = pools;
+        pools = pool;
+    }
+    slab->free_list = NULL;
+    slab->in_use = 0;
+
+    obj = (char *)slab + sizeof(struct pool__slab);
+    for(i=POOL_SLAB_OBJECTS-1; i>=0; i--){
+        *(struct pool__slab **)&obj[i*stride] = slab;
+        *(void **)&obj[i*stride + sizeof(struct pool__slab *)] = slab->free_list;
+        slab->free_list = &obj[i*stride + sizeof(struct pool__slab *)];
+    }
+    pool__slab_push_head(pool, slab);
+    pool->available += POOL_SLAB_OBJECTS;
+
+    return 0;
+}
+#endif
+
+
+void *mosquitto__pool_calloc(struct mosquitto__pool *pool)
+{
+#ifdef WITH_BROKER
+    struct pool__slab *slab;
+    void *mem;
+
+    if((pool->slabs == NULL || pool->slabs->free_list == NULL) && pool__grow(pool)){
+        return NULL;
+    }
+    slab = pool->slabs;
+    mem = slab->free_list;
+    slab->free_list = *(void **)mem;
+    slab->in_use++;
+    pool->available--;
+    pool->in_use++;
+
+    if(slab->free_list == NULL && slab->next){
+        /* Full, keep it behind the slabs that still have room. */
+        pool__slab_unlink(pool, slab);
+        pool__slab_push_tail(pool, slab);
+    }
+
+    memset(mem, 0, pool->size);
+    return mem;
+#else
+    return mosquitto__calloc(1, pool->size);
+#endif
+}
+
+
+void mosquitto__pool_free(struct mosquitto__pool *pool, void *mem)
+{
+#ifdef WITH_BROKER
+    struct pool__slab *slab;
+    bool was_full;
+#endif
+
+    if(!mem){
+        return;
+    }
+#ifdef WITH_BROKER
+    slab = *(struct pool__slab **)((char *)mem - sizeof(struct pool__slab *));
+    was_full = (slab->free_list == NULL);
+
+    *(void **)mem = slab->free_list;
+    slab->free_list = mem;
+    slab->in_use--;
+    pool->available++;
+    pool->in_use--;
+
+    if(slab->in_use == 0 && pool->available >= 2*POOL_SLAB_OBJECTS){
+        /* Every object is back and there is at least another slab's worth
+         * free elsewhere, so give the memory back rather than hold on to it
+         * after a burst. */
+        pool__slab_unlink(pool, slab);
+        pool->available -= POOL_SLAB_OBJECTS;
+        mosquitto__free(slab);
+    }else if(was_full && slab != pool->slabs){
+        pool__slab_unlink(pool, slab);
+        pool__slab_push_head(pool, slab);
+    }
+#else
+    mosquitto__free(mem);
+#endif
+}
+
+
+#ifdef WITH_BROKER
+struct mosquitto__pool *memory__pools(void)
+{
+    return pools;
+}
+
+
+/* Release every slab. Only safe once nothing allocated from a pool is in use
+ * any more. */
+void memory__pools_cleanup(void)
+{
+    struct mosquitto__pool *pool, *next_pool;
+    struct pool__slab *slab, *next;
+
+    for(pool=pools; pool; pool=next_pool){
+        next_pool = pool->next;
+        slab = pool->slabs;
+        while(slab){
+            next = slab->next;
+            mosquitto__free(slab);
+            slab = next;
+        }
+        pool->slabs = NULL;
+        pool->slabs_tail = NULL;
+        pool->next = NULL;
+        pool->in_use = 0;
+        pool->available = 0;
+    }
+    pools = NULL;
+}
+#endif
@@ -34,8 +34,38 @@ unsigned long mosquitto__max_memory_used(void);
 void *mosquitto__realloc(void *ptr, size_t size);
 char *mosquitto__strdup(const char *s);
 
+/* Pool of fixed size objects, for types that are allocated and freed often.
+ * In the broker objects are carved out of larger slabs and kept on a free list
+ * when released, rather than going back to malloc. A slab is returned once
+ * all of its objects have been freed, as long as the pool has at least one
+ * other slab's worth of free objects, so memory taken during a burst is given
+ * back afterwards. Pools are not thread safe, the broker only uses them with
+ * the db lock held. Elsewhere they are a thin wrapper around
+ * mosquitto__calloc() and mosquitto__free().
+ *
+ * Objects from a pool must only be freed with mosquitto__pool_free() on the
+ * same pool. */
+struct pool__slab;
+
+struct mosquitto__pool{
+    const char *name;
+    size_t size;
+    struct mosquitto__pool *next;
+    struct pool__slab *slabs;
+    struct pool__slab *slabs_tail;
+    unsigned long in_use;
+    unsigned long available;
+};
+
+#define MOSQUITTO__POOL_INIT(name, type) {(name), sizeof(type), NULL, NULL, NULL, 0, 0}
+
+void *mosquitto__pool_calloc(struct mosquitto__pool *pool);
+void mosquitto__pool_free(struct mosquitto__pool *pool, void *mem);
+
 #ifdef WITH_BROKER
 void memory__set_limit(size_t lim);
+struct mosquitto__pool *memory__pools(void);
+void memory__pools_cleanup(void);
 #endif
 
 #endif
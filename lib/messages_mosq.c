@@ -25,6 +25,7 @@ Contributors:
 #include "mosquitto.h"
 #include "memory_mosq.h"
 #include "messages_mosq.h"
+#include "mid_index_mosq.h"
 #include "send_mosq.h"
 #include "time_mosq.h"
 #include "util_mosq.h"
@@ -57,6 +58,8 @@ void message__cleanup_all(struct mosquitto *mosq)
         DL_DELETE(mosq->msgs_out.inflight, tail);
         message__cleanup(&tail);
     }
+    mid_index__cleanup(&mosq->msgs_in.inflight_index);
+    mid_index__cleanup(&mosq->msgs_out.inflight_index);
 }
 
 int mosquitto_message_copy(struct mosquitto_message *dst, const struct mosquitto_message *src)
@@ -117,22 +120,32 @@ void mosquitto_message_free_contents(struct mosquitto_message *message)
     mosquitto__free(message->payload);
 }
 
+/* Takes ownership of message, which is freed if it can't be queued. Failing
+ * to send the message straight away isn't an error, it is sent on retry. */
 int message__queue(struct mosquitto *mosq, struct mosquitto_message_all *message, enum mosquitto_msg_direction dir)
 {
     /* mosq->*_message_mutex should be locked before entering this function */
+    struct mosquitto_msg_data *msg_data;
+
     assert(mosq);
     assert(message);
     assert(message->msg.qos != 0);
 
     if(dir == mosq_md_out){
-        DL_APPEND(mosq->msgs_out.inflight, message);
-        mosq->msgs_out.queue_len++;
+        msg_data = &mosq->msgs_out;
     }else{
-        DL_APPEND(mosq->msgs_in.inflight, message);
-        mosq->msgs_in.queue_len++;
+        msg_data = &mosq->msgs_in;
+    }
+
+    if(mid_index__add(&msg_data->inflight_index, message->msg.mid, message)){
+        message__cleanup(&message);
+        return MOSQ_ERR_NOMEM;
     }
+    DL_APPEND(msg_data->inflight, message);
+    msg_data->queue_len++;
 
-    return message__release_to_inflight(mosq, dir);
+    message__release_to_inflight(mosq, dir);
+    return MOSQ_ERR_SUCCESS;
 }
 
 void message__reconnect_reset(struct mosquitto *mosq)
@@ -147,6 +160,7 @@ void message__reconnect_reset(struct mosquitto *mosq)
         mosq->msgs_in.queue_len++;
         message->timestamp = 0;
         if(message->msg.qos != 2){
+            mid_index__remove(&mosq->msgs_in.inflight_index, message->msg.mid, message);
             DL_DELETE(mosq->msgs_in.inflight, message);
             message__cleanup(&message);
         }else{
@@ -200,7 +214,7 @@ int message__release_to_inflight(struct mosquitto *mosq, enum mosquitto_msg_dire
                     }else if(cur->msg.qos == 2){
                         cur->state = mosq_ms_wait_for_pubrec;
                     }
-                    rc = send__publish(mosq, cur->msg.mid, cur->msg.topic, cur->msg.payloadlen, cur->msg.payload, cur->msg.qos, cur->msg.retain, cur->dup, cur->properties, NULL, 0);
+                    rc = send__publish(mosq, cur->msg.mid, cur->msg.topic, cur->msg.payloadlen, cur->msg.payload, cur->msg.qos, cur->msg.retain, cur->dup, cur->properties, NULL, 0, NULL);
                     if(rc){
                         return rc;
                     }
@@ -218,57 +232,34 @@ int message__release_to_inflight(struct mosquitto *mosq, enum mosquitto_msg_dire
 
 int message__remove(struct mosquitto *mosq, uint16_t mid, enum mosquitto_msg_direction dir, struct mosquitto_message_all **message, int qos)
 {
-    struct mosquitto_message_all *cur, *tmp;
-    bool found = false;
+    struct mosquitto_msg_data *msg_data;
+    struct mosquitto_message_all *cur;
     assert(mosq);
     assert(message);
 
     if(dir == mosq_md_out){
-        pthread_mutex_lock(&mosq->msgs_out.mutex);
-
-        DL_FOREACH_SAFE(mosq->msgs_out.inflight, cur, tmp){
-            if(found == false && cur->msg.mid == mid){
-                if(cur->msg.qos != qos){
-                    pthread_mutex_unlock(&mosq->msgs_out.mutex);
-                    return MOSQ_ERR_PROTOCOL;
-                }
-                DL_DELETE(mosq->msgs_out.inflight, cur);
-
-                *message = cur;
-                mosq->msgs_out.queue_len--;
-                found = true;
-                break;
-            }
-        }
-        pthread_mutex_unlock(&mosq->msgs_out.mutex);
-        if(found){
-            return MOSQ_ERR_SUCCESS;
-        }else{
-            return MOSQ_ERR_NOT_FOUND;
-        }
+        msg_data = &mosq->msgs_out;
     }else{
-        pthread_mutex_lock(&mosq->msgs_in.mutex);
-        DL_FOREACH_SAFE(mosq->msgs_in.inflight, cur, tmp){
-            if(cur->msg.mid == mid){
-                if(cur->msg.qos != qos){
-                    pthread_mutex_unlock(&mosq->msgs_in.mutex);
-                    return MOSQ_ERR_PROTOCOL;
-                }
-                DL_DELETE(mosq->msgs_in.inflight, cur);
-                *message = cur;
-                mosq->msgs_in.queue_len--;
-                found = true;
-                break;
-            }
-        }
+        msg_data = &mosq->msgs_in;
+    }
 
-        pthread_mutex_unlock(&mosq->msgs_in.mutex);
-        if(found){
-            return MOSQ_ERR_SUCCESS;
-        }else{
-            return MOSQ_ERR_NOT_FOUND;
-        }
+    pthread_mutex_lock(&msg_data->mutex);
+    cur = mid_index__find(&msg_data->inflight_index, mid);
+    if(!cur){
+        pthread_mutex_unlock(&msg_data->mutex);
+        return MOSQ_ERR_NOT_FOUND;
+    }
+    if(cur->msg.qos != qos){
+        pthread_mutex_unlock(&msg_data->mutex);
+        return MOSQ_ERR_PROTOCOL;
     }
+    mid_index__remove(&msg_data->inflight_index, mid, cur);
+    DL_DELETE(msg_data->inflight, cur);
+    msg_data->queue_len--;
+    pthread_mutex_unlock(&msg_data->mutex);
+
+    *message = cur;
+    return MOSQ_ERR_SUCCESS;
 }
 
 void message__retry_check(struct mosquitto *mosq)
@@ -287,7 +278,7 @@ void message__retry_check(struct mosquitto *mosq)
             case mosq_ms_publish_qos2:
                 msg->timestamp = now;
                 msg->dup = true;
-                send__publish(mosq, msg->msg.mid, msg->msg.topic, msg->msg.payloadlen, msg->msg.payload, msg->msg.qos, msg->msg.retain, msg->dup, msg->properties, NULL, 0);
+                send__publish(mosq, msg->msg.mid, msg->msg.topic, msg->msg.payloadlen, msg->msg.payload, msg->msg.qos, msg->msg.retain, msg->dup, msg->properties, NULL, 0, NULL);
                 break;
             case mosq_ms_wait_for_pubrel:
                 msg->timestamp = now;
@@ -318,24 +309,23 @@ void mosquitto_message_retry_set(struct mosquitto *mosq, unsigned int message_re
 
 int message__out_update(struct mosquitto *mosq, uint16_t mid, enum mosquitto_msg_state state, int qos)
 {
-    struct mosquitto_message_all *message, *tmp;
+    struct mosquitto_message_all *message;
     assert(mosq);
 
     pthread_mutex_lock(&mosq->msgs_out.mutex);
-    DL_FOREACH_SAFE(mosq->msgs_out.inflight, message, tmp){
-        if(message->msg.mid == mid){
-            if(message->msg.qos != qos){
-                pthread_mutex_unlock(&mosq->msgs_out.mutex);
-                return MOSQ_ERR_PROTOCOL;
-            }
-            message->state = state;
-            message->timestamp = mosquitto_time();
-            pthread_mutex_unlock(&mosq->msgs_out.mutex);
-            return MOSQ_ERR_SUCCESS;
-        }
+    message = mid_index__find(&mosq->msgs_out.inflight_index, mid);
+    if(!message){
+        pthread_mutex_unlock(&mosq->msgs_out.mutex);
+        return MOSQ_ERR_NOT_FOUND;
+    }
+    if(message->msg.qos != qos){
+        pthread_mutex_unlock(&mosq->msgs_out.mutex);
+        return MOSQ_ERR_PROTOCOL;
     }
+    message->state = state;
+    message->timestamp = mosquitto_time();
     pthread_mutex_unlock(&mosq->msgs_out.mutex);
-    return MOSQ_ERR_NOT_FOUND;
+    return MOSQ_ERR_SUCCESS;
 }
 
 int mosquitto_max_inflight_messages_set(struct mosquitto *mosq, unsigned int max_inflight_messages)
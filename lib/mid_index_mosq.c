@@ -0,0 +1,159 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "mosquitto.h"
+#include "memory_mosq.h"
+#include "mid_index_mosq.h"
+
+/* Index of the messages in an inflight list by mid, so that an acknowledgement
+ * can be matched to its message without walking the list.
+ *
+ * This is a hash table with linear probing. Mids are mostly handed out in
+ * sequence, so the mid itself is a good enough hash and consecutive mids land
+ * in consecutive slots. The table is doubled when it gets half full and halved
+ * when it is an eighth full, so it stays in proportion to the number of
+ * messages in flight rather than the 65536 possible mids.
+ *
+ * Messages with mid 0, which are QoS 0 messages waiting to be written, are
+ * counted but not stored because nothing is ever looked up by mid 0. The
+ * count is then the length of the list. More than one message can have the
+ * same mid, in which case mid_index__find() returns the one added first.
+ */
+
+#define MID_INDEX_MIN_SIZE 16
+
+
+static int mid_index__resize(struct mosquitto__mid_index *index, int size)
+{
+    struct mosquitto__mid_slot *slots;
+    int i, j;
+
+    slots = mosquitto__calloc(size, sizeof(struct mosquitto__mid_slot));
+    if(!slots) return MOSQ_ERR_NOMEM;
+
+    for(i=0; i<index->size; i++){
+        if(index->slots[i].msg){
+            j = index->slots[i].mid & (size-1);
+            while(slots[j].msg){
+                j = (j+1) & (size-1);
+            }
+            slots[j] = index->slots[i];
+        }
+    }
+    mosquitto__free(index->slots);
+    index->slots = slots;
+    index->size = size;
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+int mid_index__add(struct mosquitto__mid_index *index, uint16_t mid, void *msg)
+{
+    int i;
+    int size;
+
+    if(mid != 0){
+        if(index->stored*2 >= index->size){
+            size = index->size ? index->size*2 : MID_INDEX_MIN_SIZE;
+            if(mid_index__resize(index, size)) return MOSQ_ERR_NOMEM;
+        }
+
+        i = mid & (index->size-1);
+        while(index->slots[i].msg){
+            i = (i+1) & (index->size-1);
+        }
+        index->slots[i].msg = msg;
+        index->slots[i].mid = mid;
+        index->stored++;
+    }
+    index->count++;
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+void *mid_index__find(const struct mosquitto__mid_index *index, uint16_t mid)
+{
+    int i;
+
+    if(mid == 0 || index->size == 0) return NULL;
+
+    i = mid & (index->size-1);
+    while(index->slots[i].msg){
+        if(index->slots[i].mid == mid){
+            return index->slots[i].msg;
+        }
+        i = (i+1) & (index->size-1);
+    }
+    return NULL;
+}
+
+
+int mid_index__remove(struct mosquitto__mid_index *index, uint16_t mid, void *msg)
+{
+    int i, j, home;
+    int mask;
+
+    if(mid == 0){
+        index->count--;
+        return MOSQ_ERR_SUCCESS;
+    }
+    if(index->size == 0) return MOSQ_ERR_NOT_FOUND;
+
+    mask = index->size-1;
+    i = mid & mask;
+    while(index->slots[i].msg != msg){
+        if(index->slots[i].msg == NULL){
+            return MOSQ_ERR_NOT_FOUND;
+        }
+        i = (i+1) & mask;
+    }
+
+    /* Move back any later entries in the same run that would no longer be
+     * found with a gap at i. */
+    j = i;
+    while(1){
+        j = (j+1) & mask;
+        if(index->slots[j].msg == NULL) break;
+
+        home = index->slots[j].mid & mask;
+        if(((j - home) & mask) >= ((j - i) & mask)){
+            index->slots[i] = index->slots[j];
+            i = j;
+        }
+    }
+    index->slots[i].msg = NULL;
+    index->stored--;
+    index->count--;
+
+    if(index->size > MID_INDEX_MIN_SIZE && index->stored*8 < index->size){
+        /* Failing to shrink isn't a problem. */
+        mid_index__resize(index, index->size/2);
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+void mid_index__cleanup(struct mosquitto__mid_index *index)
+{
+    mosquitto__free(index->slots);
+    memset(index, 0, sizeof(struct mosquitto__mid_index));
+}
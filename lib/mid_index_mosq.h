@@ -0,0 +1,27 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#ifndef MID_INDEX_MOSQ_H
+#define MID_INDEX_MOSQ_H
+
+#include "mosquitto_internal.h"
+
+int mid_index__add(struct mosquitto__mid_index *index, uint16_t mid, void *msg);
+void *mid_index__find(const struct mosquitto__mid_index *index, uint16_t mid);
+int mid_index__remove(struct mosquitto__mid_index *index, uint16_t mid, void *msg);
+void mid_index__cleanup(struct mosquitto__mid_index *index);
+
+#endif
@@ -270,10 +270,12 @@ void mosquitto__destroy(struct mosquitto *mosq)
         }
 
         packet__cleanup(packet);
-        mosquitto__free(packet);
+        mosquitto__pool_free(&packet_pool, packet);
     }
 
     packet__cleanup(&mosq->in_packet);
+    mosquitto__free(mosq->in_buf);
+    mosq->in_buf = NULL;
     if(mosq->sockpairR != INVALID_SOCKET){
         COMPAT_CLOSE(mosq->sockpairR);
         mosq->sockpairR = INVALID_SOCKET;
@@ -321,6 +323,8 @@ bool mosquitto_want_write(struct mosquitto *mosq)
 const char *mosquitto_strerror(int mosq_errno)
 {
     switch(mosq_errno){
+        case MOSQ_ERR_PLUGIN_PENDING:
+            return "Plugin check pending.";
         case MOSQ_ERR_AUTH_CONTINUE:
             return "Continue with authentication.";
         case MOSQ_ERR_NO_SUBSCRIBERS:
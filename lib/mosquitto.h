@@ -52,6 +52,7 @@ extern "C" {
 
 /* Error values */
 enum mosq_err_t {
+    MOSQ_ERR_PLUGIN_PENDING = -5,
     MOSQ_ERR_AUTH_CONTINUE = -4,
     MOSQ_ERR_NO_SUBSCRIBERS = -3,
     MOSQ_ERR_SUB_EXISTS = -2,
@@ -797,6 +798,59 @@ libmosq_EXPORT int mosquitto_publish_v5(
         const mosquitto_property *properties);
 
 
+/*
+ * Function: mosquitto_publish_batch
+ *
+ * Publish a number of messages at once. This is equivalent to calling
+ * <mosquitto_publish_v5> for each message in turn, but the packets are sent
+ * together, with a single write where possible, and in threaded mode the
+ * network thread is only woken once for the whole batch.
+ *
+ * Every message is checked before any are published, so if one of them is
+ * invalid then none are sent. If an error occurs after some of the messages
+ * have been published, such as running out of memory, then the messages
+ * before the one that failed have been published and have their mid set.
+ *
+ * Parameters:
+ *     mosq -       a valid mosquitto instance.
+ *     messages -   an array of count messages. The topic, payload, payloadlen,
+ *                  qos and retain members of each are used as for
+ *                  <mosquitto_publish>. On return, the mid member of each
+ *                  message that was published is set to its message id, for
+ *                  use with the publish callback.
+ *     count -      the number of messages in the array.
+ *     properties - a valid mosquitto_property list, or NULL. These properties
+ *                  are sent with every message in the batch, and require the
+ *                  mosquitto instance to be connected with MQTT 5.
+ *
+ * Returns:
+ *     MOSQ_ERR_SUCCESS -        on success.
+ *     MOSQ_ERR_INVAL -          if the input parameters were invalid.
+ *     MOSQ_ERR_NOMEM -          if an out of memory condition occurred.
+ *     MOSQ_ERR_NO_CONN -        if the client isn't connected to a broker.
+ *    MOSQ_ERR_PROTOCOL -       if there is a protocol error communicating with the
+ *                            broker.
+ *     MOSQ_ERR_PAYLOAD_SIZE -   if a payloadlen is too large.
+ *     MOSQ_ERR_MALFORMED_UTF8 - if a topic is not valid UTF-8
+ *    MOSQ_ERR_DUPLICATE_PROPERTY - if a property is duplicated where it is forbidden.
+ *    MOSQ_ERR_PROTOCOL - if any property is invalid for use with PUBLISH.
+ *    MOSQ_ERR_NOT_SUPPORTED - if properties are given and the client isn't
+ *                             using MQTT 5.
+ *    MOSQ_ERR_QOS_NOT_SUPPORTED - if a QoS is greater than that supported by
+ *                                 the broker.
+ *    MOSQ_ERR_OVERSIZE_PACKET - if a resulting packet would be larger than
+ *                               supported by the broker.
+ *
+ * See Also:
+ *    <mosquitto_publish_v5>
+ */
+libmosq_EXPORT int mosquitto_publish_batch(
+        struct mosquitto *mosq,
+        struct mosquitto_message *messages,
+        int count,
+        const mosquitto_property *properties);
+
+
 /*
  * Function: mosquitto_subscribe
  *
@@ -2367,7 +2421,8 @@ libmosq_EXPORT int mosquitto_pub_topic_check(const char *topic);
  *
  * Returns:
  *   MOSQ_ERR_SUCCESS -        for a valid topic
- *   MOSQ_ERR_INVAL -          if the topic contains a + or a #, or if it is too long.
+ *   MOSQ_ERR_INVAL -          if the topic contains a +, a # or a NUL
+ *                             character, or if it is too long.
  *      MOSQ_ERR_MALFORMED_UTF8 - if sub or topic is not valid UTF-8
  *
  * See Also:
@@ -2424,7 +2479,8 @@ libmosq_EXPORT int mosquitto_sub_topic_check(const char *topic);
  * Returns:
  *   MOSQ_ERR_SUCCESS -        for a valid topic
  *   MOSQ_ERR_INVAL -          if the topic contains a + or a # that is in an
- *                             invalid position, or if it is too long.
+ *                             invalid position, contains a NUL character, or
+ *                             if it is too long.
  *      MOSQ_ERR_MALFORMED_UTF8 - if topic is not valid UTF-8
  *
  * See Also:
@@ -121,15 +121,27 @@ struct mosquitto__alias{
     uint16_t alias;
 };
 
-struct session_expiry_list {
-    struct mosquitto *context;
-    struct session_expiry_list *prev;
-    struct session_expiry_list *next;
+struct mosquitto_db;
+
+struct mosquitto__timer {
+    struct mosquitto__timer *prev;
+    struct mosquitto__timer *next;
+    struct mosquitto__timer **list;
+    void (*callback)(struct mosquitto_db *db, struct mosquitto__timer *timer);
+    void *data;
+    time_t expiry;
 };
 
 struct mosquitto__packet{
     uint8_t *payload;
     struct mosquitto__packet *next;
+    /* If body is set, the last body_length bytes of the packet are written
+     * from there rather than from payload. */
+    const uint8_t *body;
+    /* Holds a reference while body is in use, broker only. Not conditional on
+     * WITH_BROKER so the layout is the same for code built without it. */
+    struct mosquitto_msg_store *store;
+    uint32_t body_length;
     uint32_t remaining_mult;
     uint32_t remaining_length;
     uint32_t packet_length;
@@ -138,6 +150,7 @@ struct mosquitto__packet{
     uint16_t mid;
     uint8_t command;
     int8_t remaining_count;
+    bool payload_borrowed; /* payload points in to the receive buffer */
 };
 
 struct mosquitto_message_all{
@@ -159,16 +172,44 @@ enum mosquitto__keyform {
 };
 #endif
 
-struct will_delay_list {
-    struct mosquitto *context;
-    struct will_delay_list *prev;
-    struct will_delay_list *next;
+struct mosquitto__mid_slot{
+    void *msg;
+    uint16_t mid;
+};
+
+/* Inflight messages by mid, see mid_index_mosq.c. count is the number of
+ * messages in the inflight list, stored those with a non-zero mid. */
+struct mosquitto__mid_index{
+    struct mosquitto__mid_slot *slots;
+    int size;
+    int count;
+    int stored;
+};
+
+/* Ring of messages waiting to go in flight, see src/msg_queue.c. */
+struct mosquitto__msg_queue{
+    struct mosquitto_client_msg **msgs;
+    int size;
+    int head;
+    int count;
+};
+
+/* Queued messages that have been spilled to disk, see src/spill.c. head and
+ * tail are file offsets, the counts are part of those in mosquitto_msg_data. */
+struct mosquitto__spill{
+    uint64_t head;
+    uint64_t tail;
+    unsigned long bytes;
+    unsigned long bytes12;
+    int count;
+    int count12;
 };
 
 struct mosquitto_msg_data{
 #ifdef WITH_BROKER
     struct mosquitto_client_msg *inflight;
-    struct mosquitto_client_msg *queued;
+    struct mosquitto__msg_queue queued;
+    struct mosquitto__spill spilled;
     unsigned long msg_bytes;
     unsigned long msg_bytes12;
     int msg_count;
@@ -180,6 +221,7 @@ struct mosquitto_msg_data{
     pthread_mutex_t mutex;
 #endif
 #endif
+    struct mosquitto__mid_index inflight_index;
     int inflight_quota;
     uint16_t inflight_maximum;
 };
@@ -205,11 +247,14 @@ struct mosquitto {
     time_t next_msg_out;
     time_t ping_t;
     struct mosquitto__packet in_packet;
+    uint8_t *in_buf; /* Receive buffer, see packet__read() */
+    uint32_t in_buf_pos; /* Start of the data not yet handled */
+    uint32_t in_buf_len; /* End of the data read so far */
     struct mosquitto__packet *current_out_packet;
     struct mosquitto__packet *out_packet;
+    bool out_corked; /* See packet__cork() */
     struct mosquitto_message_all *will;
     struct mosquitto__alias *aliases;
-    struct will_delay_list *will_delay_entry;
     uint32_t maximum_packet_size;
     int alias_count;
     uint32_t will_delay_interval;
@@ -258,6 +303,9 @@ struct mosquitto {
     struct mosquitto_msg_data msgs_in;
     struct mosquitto_msg_data msgs_out;
     struct mosquitto__acl_user *acl_list;
+    struct mosquitto__acl_cache *acl_cache;
+    int acl_cache_size;
+    struct mosquitto__plugin_pending *plugin_pending;
     struct mosquitto__listener *listener;
     struct mosquitto__packet *out_packet_last;
     struct mosquitto__subhier **subs;
@@ -321,7 +369,12 @@ struct mosquitto {
     UT_hash_handle hh_id;
     UT_hash_handle hh_sock;
     struct mosquitto *for_free_next;
-    struct session_expiry_list *expiry_list_item;
+    struct mosquitto *wake_next;
+    bool wake_pending;
+    uint64_t last_dest_db_id; /* See db__message_insert() */
+    struct mosquitto__timer keepalive_timer;
+    struct mosquitto__timer session_expiry_timer;
+    struct mosquitto__timer will_delay_timer;
 #endif
     uint32_t events;
 };
@@ -202,17 +202,20 @@ int net__socket_close(struct mosquitto *mosq)
         if(mosq->sock != INVALID_SOCKET){
 #ifdef WITH_BROKER
             HASH_DELETE(hh_sock, db->contexts_by_sock, mosq);
+            /* Only counted once, however many times the client is closed. */
+            if(mosq->listener){
+                mosq->listener->client_count--;
+            }
 #endif
             rc = COMPAT_CLOSE(mosq->sock);
             mosq->sock = INVALID_SOCKET;
         }
     }
 
-#ifdef WITH_BROKER
-    if(mosq->listener){
-        mosq->listener->client_count--;
-    }
-#endif
+    mosquitto__free(mosq->in_buf);
+    mosq->in_buf = NULL;
+    mosq->in_buf_pos = 0;
+    mosq->in_buf_len = 0;
 
     return rc;
 }
@@ -902,6 +905,22 @@ ssize_t net__write(struct mosquitto *mosq, void *buf, size_t count)
 }
 
 
+/* Gather write. With TLS only the first buffer is written, as each
+ * SSL_write() would be sent as a separate record anyway. */
+ssize_t net__writev(struct mosquitto *mosq, struct iovec *iov, int iovcnt)
+{
+    assert(mosq);
+
+#ifdef WITH_TLS
+    if(mosq->ssl){
+        return net__write(mosq, iov[0].iov_base, iov[0].iov_len);
+    }
+#endif
+    errno = 0;
+    return writev(mosq->sock, iov, iovcnt);
+}
+
+
 int net__socket_nonblock(mosq_sock_t *sock)
 {
     int opt;
@@ -16,6 +16,7 @@ Contributors:
 #ifndef NET_MOSQ_H
 #define NET_MOSQ_H
 
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include "mosquitto_internal.h"
@@ -56,6 +57,7 @@ int net__socketpair(mosq_sock_t *sp1, mosq_sock_t *sp2);
 
 ssize_t net__read(struct mosquitto *mosq, void *buf, size_t count);
 ssize_t net__write(struct mosquitto *mosq, void *buf, size_t count);
+ssize_t net__writev(struct mosquitto *mosq, struct iovec *iov, int iovcnt);
 
 #ifdef WITH_TLS
 void net__print_ssl_error(struct mosquitto *mosq);
@@ -37,10 +37,10 @@ Contributors:
 #ifdef WITH_BROKER
 #include "sys_tree.h"
 #else
-#define G_BYTES_RECEIVED_INC(A)
-#define G_BYTES_SENT_INC(A)
+#define G_BYTES_RECEIVED_INC(M, A)
+#define G_BYTES_SENT_INC(M, A)
 #define G_MSGS_SENT_INC(A)
-#define G_PUB_MSGS_SENT_INC(A)
+#define G_PUB_MSGS_SENT_INC(M, A)
 #endif
 
 
@@ -18,6 +18,7 @@ Contributors:
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 
 #ifdef WITH_BROKER
@@ -39,12 +40,26 @@ Contributors:
 #include "sys_tree.h"
 #include "send_mosq.h"
 #else
-#define G_BYTES_RECEIVED_INC(A)
-#define G_BYTES_SENT_INC(A)
+#define G_BYTES_RECEIVED_INC(M, A)
+#define G_BYTES_SENT_INC(M, A)
 #define G_MSGS_SENT_INC(A)
-#define G_PUB_MSGS_SENT_INC(A)
+#define G_PUB_MSGS_SENT_INC(M, A)
+#define G_WRITE_CALLS_INC(A)
 #endif
 
+/* Size of the per connection receive buffer. Packets that fit are handled
+ * straight from the buffer, larger ones get an allocation of their own. */
+#define PACKET_IN_BUF_SIZE 4096
+
+/* Largest number of iovecs passed to a single writev() */
+#if defined(IOV_MAX) && IOV_MAX < 256
+#  define PACKET_IOV_MAX IOV_MAX
+#else
+#  define PACKET_IOV_MAX 256
+#endif
+
+struct mosquitto__pool packet_pool = MOSQUITTO__POOL_INIT("packets", struct mosquitto__packet);
+
 int packet__alloc(struct mosquitto__packet *packet)
 {
     uint8_t remaining_bytes[5], byte;
@@ -68,10 +83,11 @@ int packet__alloc(struct mosquitto__packet *packet)
     }while(remaining_length > 0 && packet->remaining_count < 5);
     if(packet->remaining_count == 5) return MOSQ_ERR_PAYLOAD_SIZE;
     packet->packet_length = packet->remaining_length + 1 + packet->remaining_count;
+    /* Anything in body isn't stored in payload. */
 #ifdef WITH_WEBSOCKETS
-    packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length + LWS_SEND_BUFFER_PRE_PADDING + LWS_SEND_BUFFER_POST_PADDING);
+    packet->payload = mosquitto__malloc(sizeof(uint8_t)*(packet->packet_length - packet->body_length) + LWS_SEND_BUFFER_PRE_PADDING + LWS_SEND_BUFFER_POST_PADDING);
 #else
-    packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length);
+    packet->payload = mosquitto__malloc(sizeof(uint8_t)*(packet->packet_length - packet->body_length));
 #endif
     if(!packet->payload) return MOSQ_ERR_NOMEM;
 
@@ -93,8 +109,19 @@ void packet__cleanup(struct mosquitto__packet *packet)
     packet->remaining_count = 0;
     packet->remaining_mult = 1;
     packet->remaining_length = 0;
-    mosquitto__free(packet->payload);
+    if(!packet->payload_borrowed){
+        mosquitto__free(packet->payload);
+    }
     packet->payload = NULL;
+    packet->payload_borrowed = false;
+    packet->body = NULL;
+    packet->body_length = 0;
+#ifdef WITH_BROKER
+    if(packet->store){
+        db__msg_store_ref_dec(mosquitto__get_db(), &packet->store);
+        packet->store = NULL;
+    }
+#endif
     packet->to_process = 0;
     packet->pos = 0;
 }
@@ -121,7 +148,7 @@ void packet__cleanup_all(struct mosquitto *mosq)
         }
 
         packet__cleanup(packet);
-        mosquitto__free(packet);
+        mosquitto__pool_free(&packet_pool, packet);
     }
 
     packet__cleanup(&mosq->in_packet);
@@ -131,11 +158,41 @@ void packet__cleanup_all(struct mosquitto *mosq)
 }
 
 
-int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
+/* Start sending whatever is queued for mosq, or arrange for it to be sent. */
+static int packet__queue_flush(struct mosquitto *mosq)
 {
-#ifndef WITH_BROKER
+#ifdef WITH_BROKER
+    int rc;
+
+    rc = packet__write(mosq);
+    if(rc == MOSQ_ERR_SUCCESS && mosq->current_out_packet){
+        /* Partial write, the main loop needs to wait for EPOLLOUT. */
+        worker__wake(mosq);
+    }
+    return rc;
+#else
     char sockpair_data = 0;
+
+    /* Write a single byte to sockpairW (connected to sockpairR) to break out
+     * of select() if in threaded mode. */
+    if(mosq->sockpairW != INVALID_SOCKET){
+        if(write(mosq->sockpairW, &sockpair_data, 1)){
+        }
+    }
+
+    if(mosq->in_callback == false && mosq->threaded == mosq_ts_none){
+        return packet__write(mosq);
+    }else{
+        return MOSQ_ERR_SUCCESS;
+    }
 #endif
+}
+
+
+int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
+{
+    bool corked;
+
     assert(mosq);
     assert(packet);
 
@@ -150,33 +207,19 @@ int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
         mosq->out_packet = packet;
     }
     mosq->out_packet_last = packet;
+    corked = mosq->out_corked;
     pthread_mutex_unlock(&mosq->out_packet_mutex);
-#ifdef WITH_BROKER
-#ifdef WITH_WEBSOCKETS
+#if defined(WITH_BROKER) && defined(WITH_WEBSOCKETS)
     if(mosq->wsi){
         libwebsocket_callback_on_writable(mosq->ws_context, mosq->wsi);
         return MOSQ_ERR_SUCCESS;
-    }else{
-        return packet__write(mosq);
     }
-#else
-    return packet__write(mosq);
 #endif
-#else
-
-    /* Write a single byte to sockpairW (connected to sockpairR) to break out
-     * of select() if in threaded mode. */
-    if(mosq->sockpairW != INVALID_SOCKET){
-        if(write(mosq->sockpairW, &sockpair_data, 1)){
-        }
-    }
-
-    if(mosq->in_callback == false && mosq->threaded == mosq_ts_none){
-        return packet__write(mosq);
-    }else{
+    if(corked){
+        /* Sent by packet__uncork() along with anything else queued. */
         return MOSQ_ERR_SUCCESS;
     }
-#endif
+    return packet__queue_flush(mosq);
 }
 
 
@@ -195,9 +238,52 @@ int packet__check_oversize(struct mosquitto *mosq, uint32_t remaining_length)
 }
 
 
+/* Fill iov with whatever is left to send of the current packet, followed by as
+ * many of the queued packets as will fit, so they can go in a single
+ * writev(). */
+static int packet__iov_fill(struct mosquitto *mosq, struct iovec *iov, int iov_max)
+{
+    struct mosquitto__packet *packet;
+    uint32_t head_length;
+    int count = 0;
+
+    pthread_mutex_lock(&mosq->out_packet_mutex);
+    packet = mosq->current_out_packet;
+    while(packet && count+2 <= iov_max){
+        head_length = packet->packet_length - packet->body_length;
+        if(packet->pos < head_length){
+            iov[count].iov_base = &(packet->payload[packet->pos]);
+            iov[count].iov_len = head_length - packet->pos;
+            count++;
+            if(packet->body_length){
+                iov[count].iov_base = (void *)packet->body;
+                iov[count].iov_len = packet->body_length;
+                count++;
+            }
+        }else{
+            iov[count].iov_base = (void *)&(packet->body[packet->pos - head_length]);
+            iov[count].iov_len = packet->to_process;
+            count++;
+        }
+
+        if(packet == mosq->current_out_packet){
+            packet = mosq->out_packet;
+        }else{
+            packet = packet->next;
+        }
+    }
+    pthread_mutex_unlock(&mosq->out_packet_mutex);
+
+    return count;
+}
+
+
 int packet__write(struct mosquitto *mosq)
 {
+    struct iovec iov[PACKET_IOV_MAX];
+    int iovcnt;
     ssize_t write_length;
+    uint32_t length;
     struct mosquitto__packet *packet;
     int state;
 
@@ -226,88 +312,232 @@ int packet__write(struct mosquitto *mosq)
     }
 
     while(mosq->current_out_packet){
-        packet = mosq->current_out_packet;
-
-        while(packet->to_process > 0){
-            write_length = net__write(mosq, &(packet->payload[packet->pos]), packet->to_process);
-            if(write_length > 0){
-                G_BYTES_SENT_INC(write_length);
-                packet->to_process -= write_length;
-                packet->pos += write_length;
+        iovcnt = packet__iov_fill(mosq, iov, PACKET_IOV_MAX);
+        write_length = net__writev(mosq, iov, iovcnt);
+        G_WRITE_CALLS_INC(1);
+        if(write_length <= 0){
+            if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK
+                    ){
+                pthread_mutex_unlock(&mosq->current_out_packet_mutex);
+                return MOSQ_ERR_SUCCESS;
             }else{
-                if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK
-                        ){
-                    pthread_mutex_unlock(&mosq->current_out_packet_mutex);
-                    return MOSQ_ERR_SUCCESS;
-                }else{
-                    pthread_mutex_unlock(&mosq->current_out_packet_mutex);
-                    switch(errno){
-                        case COMPAT_ECONNRESET:
-                            return MOSQ_ERR_CONN_LOST;
-                        default:
-                            return MOSQ_ERR_ERRNO;
-                    }
+                pthread_mutex_unlock(&mosq->current_out_packet_mutex);
+                switch(errno){
+                    case COMPAT_ECONNRESET:
+                        return MOSQ_ERR_CONN_LOST;
+                    default:
+                        return MOSQ_ERR_ERRNO;
                 }
             }
         }
+        G_BYTES_SENT_INC(mosq, write_length);
+
+        /* Share the bytes written out between the packets they came from, in
+         * order, finishing off each one that is now complete. */
+        while(write_length > 0 && mosq->current_out_packet){
+            packet = mosq->current_out_packet;
+
+            if((uint32_t)write_length < packet->to_process){
+                length = (uint32_t)write_length;
+            }else{
+                length = packet->to_process;
+            }
+            packet->to_process -= length;
+            packet->pos += length;
+            write_length -= length;
+            if(packet->to_process > 0){
+                break;
+            }
 
-        G_MSGS_SENT_INC(1);
-        if(((packet->command)&0xF6) == CMD_PUBLISH){
-            G_PUB_MSGS_SENT_INC(1);
+            G_MSGS_SENT_INC(1);
+            if(((packet->command)&0xF0) == CMD_PUBLISH){
+                G_PUB_MSGS_SENT_INC(mosq, 1);
+            }
 #ifndef WITH_BROKER
-            pthread_mutex_lock(&mosq->callback_mutex);
-            if(mosq->on_publish){
-                /* This is a QoS=0 message */
-                mosq->in_callback = true;
-                mosq->on_publish(mosq, mosq->userdata, packet->mid);
-                mosq->in_callback = false;
+            if(((packet->command)&0xF6) == CMD_PUBLISH){
+                pthread_mutex_lock(&mosq->callback_mutex);
+                if(mosq->on_publish){
+                    /* This is a QoS=0 message */
+                    mosq->in_callback = true;
+                    mosq->on_publish(mosq, mosq->userdata, packet->mid);
+                    mosq->in_callback = false;
+                }
+                if(mosq->on_publish_v5){
+                    /* This is a QoS=0 message */
+                    mosq->in_callback = true;
+                    mosq->on_publish_v5(mosq, mosq->userdata, packet->mid, 0, NULL);
+                    mosq->in_callback = false;
+                }
+                pthread_mutex_unlock(&mosq->callback_mutex);
+            }else if(((packet->command)&0xF0) == CMD_DISCONNECT){
+                do_client_disconnect(mosq, MOSQ_ERR_SUCCESS, NULL);
+                packet__cleanup(packet);
+                mosquitto__pool_free(&packet_pool, packet);
+                return MOSQ_ERR_SUCCESS;
             }
-            if(mosq->on_publish_v5){
-                /* This is a QoS=0 message */
-                mosq->in_callback = true;
-                mosq->on_publish_v5(mosq, mosq->userdata, packet->mid, 0, NULL);
-                mosq->in_callback = false;
+#endif
+
+            /* Free data and reset values */
+            pthread_mutex_lock(&mosq->out_packet_mutex);
+            mosq->current_out_packet = mosq->out_packet;
+            if(mosq->out_packet){
+                mosq->out_packet = mosq->out_packet->next;
+                if(!mosq->out_packet){
+                    mosq->out_packet_last = NULL;
+                }
             }
-            pthread_mutex_unlock(&mosq->callback_mutex);
-        }else if(((packet->command)&0xF0) == CMD_DISCONNECT){
-            do_client_disconnect(mosq, MOSQ_ERR_SUCCESS, NULL);
+            pthread_mutex_unlock(&mosq->out_packet_mutex);
+
             packet__cleanup(packet);
-            mosquitto__free(packet);
-            return MOSQ_ERR_SUCCESS;
+            mosquitto__pool_free(&packet_pool, packet);
+
+            pthread_mutex_lock(&mosq->msgtime_mutex);
+            mosq->next_msg_out = mosquitto_time() + mosq->keepalive;
+            pthread_mutex_unlock(&mosq->msgtime_mutex);
+        }
+    }
+    pthread_mutex_unlock(&mosq->current_out_packet_mutex);
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Hold back packets queued for mosq until packet__uncork(), so that a run of
+ * them goes out in one writev() rather than one write() each. In the client,
+ * the network thread is also only woken once, by packet__uncork(). */
+void packet__cork(struct mosquitto *mosq)
+{
+    pthread_mutex_lock(&mosq->out_packet_mutex);
+    mosq->out_corked = true;
+    pthread_mutex_unlock(&mosq->out_packet_mutex);
+}
+
+
+int packet__uncork(struct mosquitto *mosq)
+{
+    bool pending;
+
+    pthread_mutex_lock(&mosq->out_packet_mutex);
+    mosq->out_corked = false;
+    pending = mosq->out_packet || mosq->current_out_packet;
+    pthread_mutex_unlock(&mosq->out_packet_mutex);
+
+    if(!pending){
+        return MOSQ_ERR_SUCCESS;
+    }
+#ifdef WITH_BROKER
+#ifdef WITH_WEBSOCKETS
+    if(mosq->wsi){
+        return MOSQ_ERR_SUCCESS;
+    }
+#endif
+    return packet__write(mosq);
+#else
+    return packet__queue_flush(mosq);
+#endif
+}
+
+
+/* Parse the fixed header of the packet at the start of the unread part of the
+ * receive buffer, without consuming it. Sets *header_length to 0 if the
+ * header isn't complete yet. */
+#ifdef WITH_BROKER
+static int packet__header_parse(struct mosquitto_db *db, struct mosquitto *mosq, uint32_t *header_length)
+#else
+static int packet__header_parse(struct mosquitto *mosq, uint32_t *header_length)
+#endif
+{
+    uint8_t *buf = &mosq->in_buf[mosq->in_buf_pos];
+    uint32_t len = mosq->in_buf_len - mosq->in_buf_pos;
+    uint32_t remaining_length = 0;
+    uint32_t remaining_mult = 1;
+    uint32_t i;
+
+    *header_length = 0;
+
+#ifdef WITH_BROKER
+    /* Clients must send CONNECT as their first command. */
+    if(!(mosq->bridge) && mosq->state == mosq_cs_connected && (buf[0]&0xF0) != CMD_CONNECT){
+        return MOSQ_ERR_PROTOCOL;
+    }
 #endif
+
+    for(i=1; i<len; i++){
+        /* Max 4 bytes length for remaining length as defined by protocol.
+         * Anything more likely means a broken/malicious client.
+         */
+        if(i > 4){
+            return MOSQ_ERR_PROTOCOL;
+        }
+        remaining_length += (buf[i] & 127) * remaining_mult;
+        remaining_mult *= 128;
+        if((buf[i] & 128) == 0){
+            break;
         }
+    }
+    if(i == len){
+        return MOSQ_ERR_SUCCESS;
+    }
 
-        /* Free data and reset values */
-        pthread_mutex_lock(&mosq->out_packet_mutex);
-        mosq->current_out_packet = mosq->out_packet;
-        if(mosq->out_packet){
-            mosq->out_packet = mosq->out_packet->next;
-            if(!mosq->out_packet){
-                mosq->out_packet_last = NULL;
-            }
+#ifdef WITH_BROKER
+    if(db->config->max_packet_size > 0 && remaining_length+1 > db->config->max_packet_size){
+        log__printf(NULL, MOSQ_LOG_INFO, "Client %s sent too large packet %d, disconnecting.", mosq->id, remaining_length+1);
+        if(mosq->protocol == mosq_p_mqtt5){
+            send__disconnect(mosq, MQTT_RC_PACKET_TOO_LARGE, NULL);
         }
-        pthread_mutex_unlock(&mosq->out_packet_mutex);
+        return MOSQ_ERR_OVERSIZE_PACKET;
+    }
+#else
+    // FIXME - client case for incoming message received from broker too large
+#endif
 
-        packet__cleanup(packet);
-        mosquitto__free(packet);
+    mosq->in_packet.command = buf[0];
+    mosq->in_packet.remaining_length = remaining_length;
+    mosq->in_packet.remaining_count = (int8_t)i;
+    *header_length = i+1;
 
-        pthread_mutex_lock(&mosq->msgtime_mutex);
-        mosq->next_msg_out = mosquitto_time() + mosq->keepalive;
-        pthread_mutex_unlock(&mosq->msgtime_mutex);
-    }
-    pthread_mutex_unlock(&mosq->current_out_packet_mutex);
     return MOSQ_ERR_SUCCESS;
 }
 
 
+/* Pass a completely read in_packet on to be handled, then reset it. */
+#ifdef WITH_BROKER
+static int packet__handle_in(struct mosquitto_db *db, struct mosquitto *mosq)
+#else
+static int packet__handle_in(struct mosquitto *mosq)
+#endif
+{
+    int rc;
+
+    mosq->in_packet.pos = 0;
+#ifdef WITH_BROKER
+    G_MSGS_RECEIVED_INC(1);
+    if(((mosq->in_packet.command)&0xF5) == CMD_PUBLISH){
+        G_PUB_MSGS_RECEIVED_INC(mosq, 1);
+    }
+    rc = handle__packet(db, mosq);
+#else
+    rc = handle__packet(mosq);
+#endif
+
+    /* Free data and reset values */
+    packet__cleanup(&mosq->in_packet);
+
+    pthread_mutex_lock(&mosq->msgtime_mutex);
+    mosq->last_msg_in = mosquitto_time();
+    pthread_mutex_unlock(&mosq->msgtime_mutex);
+    return rc;
+}
+
+
 #ifdef WITH_BROKER
 int packet__read(struct mosquitto_db *db, struct mosquitto *mosq)
 #else
 int packet__read(struct mosquitto *mosq)
 #endif
 {
-    uint8_t byte;
     ssize_t read_length;
+    uint32_t header_length;
+    uint32_t available;
     int rc = 0;
     int state;
 
@@ -322,77 +552,54 @@ int packet__read(struct mosquitto *mosq)
     if(state == mosq_cs_connect_pending){
         return MOSQ_ERR_SUCCESS;
     }
+#ifdef WITH_BROKER
+    if(mosq->plugin_pending){
+        /* Nothing more is read until a plugin has the result for the last
+         * packet. */
+        return MOSQ_ERR_SUCCESS;
+    }
+#endif
 
     /* This gets called if pselect() indicates that there is network data
-     * available - ie. at least one byte.  What we do depends on what data we
-     * already have.
-     * If we've not got a command, attempt to read one and save it. This should
-     * always work because it's only a single byte.
-     * Then try to read the remaining length. This may fail because it is may
-     * be more than one byte - will need to save data pending next read if it
-     * does fail.
-     * Then try to read the remaining payload, where 'payload' here means the
-     * combined variable header and actual payload. This is the most likely to
-     * fail due to longer length, so save current data and current position.
-     * After all data is read, send to mosquitto__handle_packet() to deal with.
-     * Finally, free the memory and reset everything to starting conditions.
+     * available - ie. at least one byte.
+     * Normally as much as will fit is read in to the receive buffer in one go,
+     * then every complete packet in the buffer is handled in place. Whatever
+     * is left over is the start of a packet, and is kept for next time.
+     * A packet that is too big for the receive buffer has what has arrived so
+     * far moved to its own allocation, and the rest of it is read straight in
+     * to that, possibly over several calls.
      */
-    if(!mosq->in_packet.command){
-        read_length = net__read(mosq, &byte, 1);
-        if(read_length == 1){
-            mosq->in_packet.command = byte;
-#ifdef WITH_BROKER
-            G_BYTES_RECEIVED_INC(1);
-            /* Clients must send CONNECT as their first command. */
-            if(!(mosq->bridge) && mosq->state == mosq_cs_connected && (byte&0xF0) != CMD_CONNECT){
-                return MOSQ_ERR_PROTOCOL;
-            }
-#endif
-        }else{
-            if(read_length == 0){
-                return MOSQ_ERR_CONN_LOST; /* EOF */
-            }
-            if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
-                return MOSQ_ERR_SUCCESS;
-            }else{
-                switch(errno){
-                    case COMPAT_ECONNRESET:
-                        return MOSQ_ERR_CONN_LOST;
-                    default:
-                        return MOSQ_ERR_ERRNO;
-                }
-            }
+    if(!mosq->in_buf){
+        mosq->in_buf = mosquitto__malloc(PACKET_IN_BUF_SIZE);
+        if(!mosq->in_buf){
+            return MOSQ_ERR_NOMEM;
         }
+        mosq->in_buf_pos = 0;
+        mosq->in_buf_len = 0;
     }
-    /* remaining_count is the number of bytes that the remaining_length
-     * parameter occupied in this incoming packet. We don't use it here as such
-     * (it is used when allocating an outgoing packet), but we must be able to
-     * determine whether all of the remaining_length parameter has been read.
-     * remaining_count has three states here:
-     *   0 means that we haven't read any remaining_length bytes
-     *   <0 means we have read some remaining_length bytes but haven't finished
-     *   >0 means we have finished reading the remaining_length bytes.
-     */
-    if(mosq->in_packet.remaining_count <= 0){
-        do{
-            read_length = net__read(mosq, &byte, 1);
-            if(read_length == 1){
-                mosq->in_packet.remaining_count--;
-                /* Max 4 bytes length for remaining length as defined by protocol.
-                 * Anything more likely means a broken/malicious client.
-                 */
-                if(mosq->in_packet.remaining_count < -4){
-                    return MOSQ_ERR_PROTOCOL;
-                }
 
-                G_BYTES_RECEIVED_INC(1);
-                mosq->in_packet.remaining_length += (byte & 127) * mosq->in_packet.remaining_mult;
-                mosq->in_packet.remaining_mult *= 128;
+    if(mosq->in_packet.to_process > 0){
+        while(mosq->in_packet.to_process>0){
+            read_length = net__read(mosq, &(mosq->in_packet.payload[mosq->in_packet.pos]), mosq->in_packet.to_process);
+            if(read_length > 0){
+                G_BYTES_RECEIVED_INC(mosq, read_length);
+                mosq->in_packet.to_process -= read_length;
+                mosq->in_packet.pos += read_length;
             }else{
                 if(read_length == 0){
                     return MOSQ_ERR_CONN_LOST; /* EOF */
                 }
                 if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
+                    if(mosq->in_packet.to_process > 1000){
+                        /* Update last_msg_in time if more than 1000 bytes left to
+                         * receive. Helps when receiving large messages.
+                         * This is an arbitrary limit, but with some consideration.
+                         * If a client can't send 1000 bytes in a second it
+                         * probably shouldn't be using a 1 second keep alive. */
+                        pthread_mutex_lock(&mosq->msgtime_mutex);
+                        mosq->last_msg_in = mosquitto_time();
+                        pthread_mutex_unlock(&mosq->msgtime_mutex);
+                    }
                     return MOSQ_ERR_SUCCESS;
                 }else{
                     switch(errno){
@@ -403,77 +610,100 @@ int packet__read(struct mosquitto *mosq)
                     }
                 }
             }
-        }while((byte & 128) != 0);
-        /* We have finished reading remaining_length, so make remaining_count
-         * positive. */
-        mosq->in_packet.remaining_count *= -1;
+        }
 
+        /* All data for this packet is read. */
 #ifdef WITH_BROKER
-        if(db->config->max_packet_size > 0 && mosq->in_packet.remaining_length+1 > db->config->max_packet_size){
-            log__printf(NULL, MOSQ_LOG_INFO, "Client %s sent too large packet %d, disconnecting.", mosq->id, mosq->in_packet.remaining_length+1);
-            if(mosq->protocol == mosq_p_mqtt5){
-                send__disconnect(mosq, MQTT_RC_PACKET_TOO_LARGE, NULL);
-            }
-            return MOSQ_ERR_OVERSIZE_PACKET;
-        }
+        return packet__handle_in(db, mosq);
 #else
-        // FIXME - client case for incoming message received from broker too large
+        return packet__handle_in(mosq);
 #endif
-        if(mosq->in_packet.remaining_length > 0){
-            mosq->in_packet.payload = mosquitto__malloc(mosq->in_packet.remaining_length*sizeof(uint8_t));
-            if(!mosq->in_packet.payload){
-                return MOSQ_ERR_NOMEM;
-            }
-            mosq->in_packet.to_process = mosq->in_packet.remaining_length;
-        }
     }
-    while(mosq->in_packet.to_process>0){
-        read_length = net__read(mosq, &(mosq->in_packet.payload[mosq->in_packet.pos]), mosq->in_packet.to_process);
-        if(read_length > 0){
-            G_BYTES_RECEIVED_INC(read_length);
-            mosq->in_packet.to_process -= read_length;
-            mosq->in_packet.pos += read_length;
-        }else{
-            if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
-                if(mosq->in_packet.to_process > 1000){
-                    /* Update last_msg_in time if more than 1000 bytes left to
-                     * receive. Helps when receiving large messages.
-                     * This is an arbitrary limit, but with some consideration.
-                     * If a client can't send 1000 bytes in a second it
-                     * probably shouldn't be using a 1 second keep alive. */
-                    pthread_mutex_lock(&mosq->msgtime_mutex);
-                    mosq->last_msg_in = mosquitto_time();
-                    pthread_mutex_unlock(&mosq->msgtime_mutex);
-                }
+
+    if(mosq->in_buf_pos > 0){
+        memmove(mosq->in_buf, &mosq->in_buf[mosq->in_buf_pos], mosq->in_buf_len - mosq->in_buf_pos);
+        mosq->in_buf_len -= mosq->in_buf_pos;
+        mosq->in_buf_pos = 0;
+    }
+    read_length = net__read(mosq, &mosq->in_buf[mosq->in_buf_len], PACKET_IN_BUF_SIZE - mosq->in_buf_len);
+    if(read_length > 0){
+        G_BYTES_RECEIVED_INC(mosq, read_length);
+        mosq->in_buf_len += read_length;
+    }else{
+        if(read_length == 0){
+            return MOSQ_ERR_CONN_LOST; /* EOF */
+        }
+        if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
+#ifdef WITH_BROKER
+            /* Complete packets may have been left in the buffer while reads
+             * were paused for a plugin, so carry on with those. */
+            if(mosq->in_buf_len == 0){
                 return MOSQ_ERR_SUCCESS;
-            }else{
-                switch(errno){
-                    case COMPAT_ECONNRESET:
-                        return MOSQ_ERR_CONN_LOST;
-                    default:
-                        return MOSQ_ERR_ERRNO;
-                }
+            }
+#else
+            return MOSQ_ERR_SUCCESS;
+#endif
+        }else{
+            switch(errno){
+                case COMPAT_ECONNRESET:
+                    return MOSQ_ERR_CONN_LOST;
+                default:
+                    return MOSQ_ERR_ERRNO;
             }
         }
     }
 
-    /* All data for this packet is read. */
-    mosq->in_packet.pos = 0;
+    while(mosq->in_buf_pos < mosq->in_buf_len){
 #ifdef WITH_BROKER
-    G_MSGS_RECEIVED_INC(1);
-    if(((mosq->in_packet.command)&0xF5) == CMD_PUBLISH){
-        G_PUB_MSGS_RECEIVED_INC(1);
-    }
-    rc = handle__packet(db, mosq);
+        rc = packet__header_parse(db, mosq, &header_length);
 #else
-    rc = handle__packet(mosq);
+        rc = packet__header_parse(mosq, &header_length);
 #endif
+        if(rc || header_length == 0){
+            return rc;
+        }
 
-    /* Free data and reset values */
-    packet__cleanup(&mosq->in_packet);
+        available = mosq->in_buf_len - mosq->in_buf_pos - header_length;
+        if(mosq->in_packet.remaining_length <= available){
+            if(mosq->in_packet.remaining_length > 0){
+                mosq->in_packet.payload = &mosq->in_buf[mosq->in_buf_pos + header_length];
+                mosq->in_packet.payload_borrowed = true;
+            }
+            mosq->in_buf_pos += header_length + mosq->in_packet.remaining_length;
 
-    pthread_mutex_lock(&mosq->msgtime_mutex);
-    mosq->last_msg_in = mosquitto_time();
-    pthread_mutex_unlock(&mosq->msgtime_mutex);
-    return rc;
+#ifdef WITH_BROKER
+            rc = packet__handle_in(db, mosq);
+#else
+            rc = packet__handle_in(mosq);
+#endif
+            /* The handler may have closed the connection, which frees the
+             * receive buffer. */
+            if(rc || mosq->sock == INVALID_SOCKET || !mosq->in_buf){
+                return rc;
+            }
+#ifdef WITH_BROKER
+            if(mosq->plugin_pending){
+                return MOSQ_ERR_SUCCESS;
+            }
+#endif
+        }else if(header_length + mosq->in_packet.remaining_length > PACKET_IN_BUF_SIZE){
+            mosq->in_packet.payload = mosquitto__malloc(mosq->in_packet.remaining_length*sizeof(uint8_t));
+            if(!mosq->in_packet.payload){
+                return MOSQ_ERR_NOMEM;
+            }
+            memcpy(mosq->in_packet.payload, &mosq->in_buf[mosq->in_buf_pos + header_length], available);
+            mosq->in_packet.pos = available;
+            mosq->in_packet.to_process = mosq->in_packet.remaining_length - available;
+            mosq->in_buf_pos = 0;
+            mosq->in_buf_len = 0;
+            return MOSQ_ERR_SUCCESS;
+        }else{
+            /* Wait for the rest of the packet. */
+            mosq->in_packet.command = 0;
+            mosq->in_packet.remaining_length = 0;
+            mosq->in_packet.remaining_count = 0;
+            return MOSQ_ERR_SUCCESS;
+        }
+    }
+    return MOSQ_ERR_SUCCESS;
 }
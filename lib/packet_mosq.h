@@ -23,6 +23,8 @@ Contributors:
 struct mosquitto_db;
 #endif
 
+extern struct mosquitto__pool packet_pool;
+
 int packet__alloc(struct mosquitto__packet *packet);
 void packet__cleanup(struct mosquitto__packet *packet);
 void packet__cleanup_all(struct mosquitto *mosq);
@@ -48,6 +50,8 @@ int packet__write_varint(struct mosquitto__packet *packet, int32_t word);
 int packet__varint_bytes(int32_t word);
 
 int packet__write(struct mosquitto *mosq);
+void packet__cork(struct mosquitto *mosq);
+int packet__uncork(struct mosquitto *mosq);
 #ifdef WITH_BROKER
 int packet__read(struct mosquitto_db *db, struct mosquitto *mosq);
 #else
@@ -123,7 +123,7 @@ int send__command_with_mid(struct mosquitto *mosq, uint8_t command, uint16_t mid
     int proplen, varbytes;
 
     assert(mosq);
-    packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+    packet = mosquitto__pool_calloc(&packet_pool);
     if(!packet) return MOSQ_ERR_NOMEM;
 
     packet->command = command;
@@ -146,7 +146,7 @@ int send__command_with_mid(struct mosquitto *mosq, uint8_t command, uint16_t mid
 
     rc = packet__alloc(packet);
     if(rc){
-        mosquitto__free(packet);
+        mosquitto__pool_free(&packet_pool, packet);
         return rc;
     }
 
@@ -171,7 +171,7 @@ int send__simple_command(struct mosquitto *mosq, uint8_t command)
     int rc;
 
     assert(mosq);
-    packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+    packet = mosquitto__pool_calloc(&packet_pool);
     if(!packet) return MOSQ_ERR_NOMEM;
 
     packet->command = command;
@@ -179,7 +179,7 @@ int send__simple_command(struct mosquitto *mosq, uint8_t command)
 
     rc = packet__alloc(packet);
     if(rc){
-        mosquitto__free(packet);
+        mosquitto__pool_free(&packet_pool, packet);
         return rc;
     }
 
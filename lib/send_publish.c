@@ -37,7 +37,24 @@ Contributors:
 #include "send_mosq.h"
 
 
-int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
+#ifdef WITH_BROKER
+/* Can the payload of an outgoing PUBLISH be written straight from the message
+ * store, rather than copied in to the packet? TLS would turn each part in to
+ * its own record, and websockets needs the whole packet in one buffer. */
+static bool send__publish_can_share(struct mosquitto *mosq)
+{
+#ifdef WITH_TLS
+    if(mosq->ssl) return false;
+#endif
+#ifdef WITH_WEBSOCKETS
+    if(mosq->wsi) return false;
+#endif
+    return true;
+}
+#endif
+
+
+int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval, struct mosquitto_msg_store *store)
 {
 #ifdef WITH_BROKER
     size_t len;
@@ -58,6 +75,14 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
     if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 #endif
 
+#if defined(WITH_BROKER) && defined(WITH_SYS_TREE)
+    /* Time from the message arriving to it first being sent. Retained
+     * messages may have been stored for any length of time. */
+    if(store && !dup && !retain){
+        G_DELIVER_TIME_ADD(stats__now_us() - store->received_us);
+    }
+#endif
+
 #ifdef WITH_BROKER
     if(mosq->listener && mosq->listener->mount_point){
         len = strlen(mosq->listener->mount_point);
@@ -110,7 +135,7 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
                     }
                     log__printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, mapped_topic, (long)payloadlen);
                     G_PUB_BYTES_SENT_INC(payloadlen);
-                    rc =  send__real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval);
+                    rc =  send__real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval, store);
                     mosquitto__free(mapped_topic);
                     return rc;
                 }
@@ -124,11 +149,11 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
     log__printf(mosq, MOSQ_LOG_DEBUG, "Client %s sending PUBLISH (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", mosq->id, dup, qos, retain, mid, topic, (long)payloadlen);
 #endif
 
-    return send__real_publish(mosq, mid, topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval);
+    return send__real_publish(mosq, mid, topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval, store);
 }
 
 
-int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
+int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval, struct mosquitto_msg_store *store)
 {
     struct mosquitto__packet *packet = NULL;
     int packetlen;
@@ -176,15 +201,23 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
         return MOSQ_ERR_OVERSIZE_PACKET;
     }
 
-    packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+    packet = mosquitto__pool_calloc(&packet_pool);
     if(!packet) return MOSQ_ERR_NOMEM;
 
     packet->mid = mid;
     packet->command = CMD_PUBLISH | ((dup&0x1)<<3) | (qos<<1) | retain;
     packet->remaining_length = packetlen;
+#ifdef WITH_BROKER
+    if(store && payloadlen && send__publish_can_share(mosq)){
+        /* The payload is shared by every subscriber this message goes to, so
+         * only the headers are built per client and the payload is written
+         * from the store with writev(). */
+        packet->body_length = payloadlen;
+    }
+#endif
     rc = packet__alloc(packet);
     if(rc){
-        mosquitto__free(packet);
+        mosquitto__pool_free(&packet_pool, packet);
         return rc;
     }
     /* Variable header (topic string) */
@@ -207,6 +240,13 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
     }
 
     /* Payload */
+#ifdef WITH_BROKER
+    if(packet->body_length){
+        packet->body = payload;
+        packet->store = store;
+        db__msg_store_ref_inc(store);
+    }else
+#endif
     if(payloadlen){
         packet__write_bytes(packet, payload, payloadlen);
     }
@@ -45,7 +45,7 @@ int send__subscribe(struct mosquitto *mosq, int *mid, int topic_count, const cha
     assert(mosq);
     assert(topic);
 
-    packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+    packet = mosquitto__pool_calloc(&packet_pool);
     if(!packet) return MOSQ_ERR_NOMEM;
 
     packetlen = 2;
@@ -62,7 +62,7 @@ int send__subscribe(struct mosquitto *mosq, int *mid, int topic_count, const cha
     packet->remaining_length = packetlen;
     rc = packet__alloc(packet);
     if(rc){
-        mosquitto__free(packet);
+        mosquitto__pool_free(&packet_pool, packet);
         return rc;
     }
 
@@ -46,7 +46,7 @@ int send__unsubscribe(struct mosquitto *mosq, int *mid, int topic_count, char *c
     assert(mosq);
     assert(topic);
 
-    packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+    packet = mosquitto__pool_calloc(&packet_pool);
     if(!packet) return MOSQ_ERR_NOMEM;
 
     packetlen = 2;
@@ -64,7 +64,7 @@ int send__unsubscribe(struct mosquitto *mosq, int *mid, int topic_count, char *c
     packet->remaining_length = packetlen;
     rc = packet__alloc(packet);
     if(rc){
-        mosquitto__free(packet);
+        mosquitto__pool_free(&packet_pool, packet);
         return rc;
     }
 
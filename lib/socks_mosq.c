@@ -116,7 +116,7 @@ int socks5__send(struct mosquitto *mosq)
     state = mosquitto__get_state(mosq);
 
     if(state == mosq_cs_socks5_new){
-        packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+        packet = mosquitto__pool_calloc(&packet_pool);
         if(!packet) return MOSQ_ERR_NOMEM;
 
         if(mosq->socks5_username){
@@ -144,13 +144,13 @@ int socks5__send(struct mosquitto *mosq)
         mosq->in_packet.payload = mosquitto__malloc(sizeof(uint8_t)*2);
         if(!mosq->in_packet.payload){
             mosquitto__free(packet->payload);
-            mosquitto__free(packet);
+            mosquitto__pool_free(&packet_pool, packet);
             return MOSQ_ERR_NOMEM;
         }
 
         return packet__queue(mosq, packet);
     }else if(state == mosq_cs_socks5_auth_ok){
-        packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+        packet = mosquitto__pool_calloc(&packet_pool);
         if(!packet) return MOSQ_ERR_NOMEM;
 
         ipv4_pton_result = inet_pton(AF_INET, mosq->host, &addr_ipv4);
@@ -160,7 +160,7 @@ int socks5__send(struct mosquitto *mosq)
             packet->packet_length = 10;
             packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length);
             if(!packet->payload){
-                mosquitto__free(packet);
+                mosquitto__pool_free(&packet_pool, packet);
                 return MOSQ_ERR_NOMEM;
             }
             packet->payload[3] = SOCKS_ATYPE_IP_V4;
@@ -172,7 +172,7 @@ int socks5__send(struct mosquitto *mosq)
             packet->packet_length = 22;
             packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length);
             if(!packet->payload){
-                mosquitto__free(packet);
+                mosquitto__pool_free(&packet_pool, packet);
                 return MOSQ_ERR_NOMEM;
             }
             packet->payload[3] = SOCKS_ATYPE_IP_V6;
@@ -183,13 +183,13 @@ int socks5__send(struct mosquitto *mosq)
         }else{
             slen = strlen(mosq->host);
             if(slen > UCHAR_MAX){
-                mosquitto__free(packet);
+                mosquitto__pool_free(&packet_pool, packet);
                 return MOSQ_ERR_NOMEM;
             }
             packet->packet_length = 7 + slen;
             packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length);
             if(!packet->payload){
-                mosquitto__free(packet);
+                mosquitto__pool_free(&packet_pool, packet);
                 return MOSQ_ERR_NOMEM;
             }
             packet->payload[3] = SOCKS_ATYPE_DOMAINNAME;
@@ -210,13 +210,13 @@ int socks5__send(struct mosquitto *mosq)
         mosq->in_packet.payload = mosquitto__malloc(sizeof(uint8_t)*5);
         if(!mosq->in_packet.payload){
             mosquitto__free(packet->payload);
-            mosquitto__free(packet);
+            mosquitto__pool_free(&packet_pool, packet);
             return MOSQ_ERR_NOMEM;
         }
 
         return packet__queue(mosq, packet);
     }else if(state == mosq_cs_socks5_send_userpass){
-        packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+        packet = mosquitto__pool_calloc(&packet_pool);
         if(!packet) return MOSQ_ERR_NOMEM;
 
         ulen = strlen(mosq->socks5_username);
@@ -239,7 +239,7 @@ int socks5__send(struct mosquitto *mosq)
         mosq->in_packet.payload = mosquitto__malloc(sizeof(uint8_t)*2);
         if(!mosq->in_packet.payload){
             mosquitto__free(packet->payload);
-            mosquitto__free(packet);
+            mosquitto__pool_free(&packet_pool, packet);
             return MOSQ_ERR_NOMEM;
         }
 
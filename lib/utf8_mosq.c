@@ -16,22 +16,85 @@ Contributors:
 
 #include "config.h"
 
+#include <stdbool.h>
 #include <stdio.h>
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#  define UTF8_BLOCK 32
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#  define UTF8_BLOCK 16
+#else
+#  include <stdint.h>
+#  include <string.h>
+#  define UTF8_BLOCK 8
+#endif
+
 #include "mosquitto.h"
 
+/* Returns true if all UTF8_BLOCK bytes starting at ustr are printable ASCII,
+ * 0x20 to 0x7E. Each of these is a complete code point that is always valid,
+ * so the block needs no further checks. Without SSE2, this checks a 64-bit
+ * word at a time. */
+static bool utf8__block_printable(const unsigned char *ustr)
+{
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *)ustr);
+
+    /* Signed compares, so bytes 0x80 and above fail the first one. */
+    v = _mm256_and_si256(
+            _mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x1F)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7F), v));
+    return _mm256_movemask_epi8(v) == -1;
+#elif defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *)ustr);
+
+    /* Signed compares, so bytes 0x80 and above fail the first one. */
+    v = _mm_and_si128(
+            _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)),
+            _mm_cmpgt_epi8(_mm_set1_epi8(0x7F), v));
+    return _mm_movemask_epi8(v) == 0xFFFF;
+#else
+    uint64_t w;
+
+    memcpy(&w, ustr, sizeof(w));
+    /* The high bit of a byte is set in the first term if that byte is below
+     * 0x20, and in the second if it is above 0x7E. */
+    return ((((w - 0x2020202020202020ULL) & ~w) | (w + 0x0101010101010101ULL) | w)
+            & 0x8080808080808080ULL) == 0;
+#endif
+}
+
+
 int mosquitto_validate_utf8(const char *str, int len)
 {
     int i;
     int j;
     int codelen;
     int codepoint;
+    int scalar_end = 0;
     const unsigned char *ustr = (const unsigned char *)str;
 
     if(!str) return MOSQ_ERR_INVAL;
     if(len < 0 || len > 65536) return MOSQ_ERR_INVAL;
 
     for(i=0; i<len; i++){
-        if(ustr[i] == 0){
+        /* Skip runs of printable ASCII a block at a time. Once a block fails,
+         * decode at least that far a byte at a time before trying again, so
+         * text that isn't mostly ASCII doesn't pay for a failed block check
+         * on every character. */
+        if(i >= scalar_end){
+            while(len-i >= UTF8_BLOCK && utf8__block_printable(&ustr[i])){
+                i += UTF8_BLOCK;
+            }
+            if(i == len) break;
+            scalar_end = i + UTF8_BLOCK;
+        }
+
+        if(ustr[i] >= 0x20 && ustr[i] <= 0x7E){
+            /* Printable ASCII */
+            continue;
+        }else if(ustr[i] == 0){
             return MOSQ_ERR_MALFORMED_UTF8;
         }else if(ustr[i] <= 0x7f){
             codelen = 1;
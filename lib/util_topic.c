@@ -17,7 +17,15 @@ Contributors:
 #include "config.h"
 
 #include <assert.h>
+#include <stdbool.h>
 #include <string.h>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define TOPIC_BLOCK 16
+#else
+#  include <stdint.h>
+#  define TOPIC_BLOCK 8
+#endif
 
 #include <sys/stat.h>
 
@@ -34,6 +42,53 @@ Contributors:
 #include "tls_mosq.h"
 #include "util_mosq.h"
 
+/* Scan the TOPIC_BLOCK bytes starting at str. Returns true if any of them is
+ * '+', '#' or NUL, otherwise adds the number of '/' in the block to
+ * *hier_count and returns false. Without SSE2, this checks a 64-bit word at a
+ * time. */
+static bool topic__block_scan(const char *str, int *hier_count)
+{
+#if defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *)str);
+    __m128i special;
+
+    special = _mm_or_si128(
+            _mm_or_si128(
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('+')),
+                _mm_cmpeq_epi8(v, _mm_set1_epi8('#'))),
+            _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+    if(_mm_movemask_epi8(special)){
+        return true;
+    }
+    *hier_count += __builtin_popcount(
+            (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/'))));
+    return false;
+#else
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    uint64_t w, x;
+    int i;
+
+    memcpy(&w, str, sizeof(w));
+    /* The high bit of a byte in a term is set if that byte is zero, but
+     * possibly also in bytes above one that is. That is fine for an any/none
+     * test. */
+#define HAS_ZERO(v) (((v) - ones) & ~(v) & highs)
+    if(HAS_ZERO(w) || HAS_ZERO(w ^ (ones*'+')) || HAS_ZERO(w ^ (ones*'#'))){
+        return true;
+    }
+#undef HAS_ZERO
+    /* Exactly the bytes that are '/' have their high bit set in x. */
+    x = w ^ (ones*'/');
+    x = ~(((x & ~highs) + ~highs) | x | ~highs);
+    for(i=0; i<8; i++){
+        *hier_count += (int)((x >> (i*8+7)) & 1);
+    }
+    return false;
+#endif
+}
+
+
 /* Check that a topic used for publishing is valid.
    Search for + or # in a topic. Return MOSQ_ERR_INVAL if found.
    Also returns MOSQ_ERR_INVAL if the topic string is too long.
@@ -72,21 +127,23 @@ int mosquitto_pub_topic_check(const char *str)
 int mosquitto_pub_topic_check2(const char *str, size_t len)
 {
     size_t i;
-#ifdef WITH_BROKER
     int hier_count = 0;
-#endif
 
     if(len > 65535) return MOSQ_ERR_INVAL;
 
-    for(i=0; i<len; i++){
-        if(str[i] == '+' || str[i] == '#'){
+    /* Any '+', '#' or NUL makes the topic invalid, so a block only needs
+     * looking at more closely to count the '/'. */
+    for(i=0; len-i >= TOPIC_BLOCK; i+=TOPIC_BLOCK){
+        if(topic__block_scan(&str[i], &hier_count)){
             return MOSQ_ERR_INVAL;
         }
-#ifdef WITH_BROKER
-        else if(str[i] == '/'){
+    }
+    for(; i<len; i++){
+        if(str[i] == '+' || str[i] == '#' || str[i] == '\0'){
+            return MOSQ_ERR_INVAL;
+        }else if(str[i] == '/'){
             hier_count++;
         }
-#endif
     }
 #ifdef WITH_BROKER
     if(hier_count > TOPIC_HIERARCHY_LIMIT) return MOSQ_ERR_INVAL;
@@ -145,29 +202,42 @@ int mosquitto_sub_topic_check(const char *str)
 int mosquitto_sub_topic_check2(const char *str, size_t len)
 {
     char c = '\0';
-    size_t i;
-#ifdef WITH_BROKER
+    size_t i, end;
     int hier_count = 0;
-#endif
 
     if(len > 65535) return MOSQ_ERR_INVAL;
 
-    for(i=0; i<len; i++){
-        if(str[i] == '+'){
-            if((c != '\0' && c != '/') || (i<len-1 && str[i+1] != '/')){
-                return MOSQ_ERR_INVAL;
+    i = 0;
+    while(i<len){
+        /* Blocks without a wildcard or NUL only need their '/' counting.
+         * Any others are checked a byte at a time. */
+        if(len-i >= TOPIC_BLOCK){
+            if(!topic__block_scan(&str[i], &hier_count)){
+                i += TOPIC_BLOCK;
+                c = str[i-1];
+                continue;
             }
-        }else if(str[i] == '#'){
-            if((c != '\0' && c != '/')  || i<len-1){
+            end = i + TOPIC_BLOCK;
+        }else{
+            end = len;
+        }
+
+        for(; i<end; i++){
+            if(str[i] == '+'){
+                if((c != '\0' && c != '/') || (i<len-1 && str[i+1] != '/')){
+                    return MOSQ_ERR_INVAL;
+                }
+            }else if(str[i] == '#'){
+                if((c != '\0' && c != '/')  || i<len-1){
+                    return MOSQ_ERR_INVAL;
+                }
+            }else if(str[i] == '\0'){
                 return MOSQ_ERR_INVAL;
+            }else if(str[i] == '/'){
+                hier_count++;
             }
+            c = str[i];
         }
-#ifdef WITH_BROKER
-        else if(str[i] == '/'){
-            hier_count++;
-        }
-#endif
-        c = str[i];
     }
 #ifdef WITH_BROKER
     if(hier_count > TOPIC_HIERARCHY_LIMIT) return MOSQ_ERR_INVAL;
@@ -429,14 +429,14 @@ void bridge__packet_cleanup(struct mosquitto *context)
 
     if(context->current_out_packet){
         packet__cleanup(context->current_out_packet);
-        mosquitto__free(context->current_out_packet);
+        mosquitto__pool_free(&packet_pool, context->current_out_packet);
         context->current_out_packet = NULL;
     }
     while(context->out_packet){
         packet__cleanup(context->out_packet);
         packet = context->out_packet;
         context->out_packet = context->out_packet->next;
-        mosquitto__free(packet);
+        mosquitto__pool_free(&packet_pool, packet);
     }
     context->out_packet = NULL;
     context->out_packet_last = NULL;
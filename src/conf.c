@@ -133,8 +133,10 @@ static void config__init_reload(struct mosquitto_db *db, struct mosquitto__confi
     mosquitto__free(config->security_options.psk_file);
     config->security_options.psk_file = NULL;
 
+    config->acl_cache_size = 0;
     config->autosave_interval = 1800;
     config->autosave_on_changes = false;
+    config->autosave_background = false;
     mosquitto__free(config->clientid_prefixes);
     config->connection_messages = true;
     config->clientid_prefixes = NULL;
@@ -153,6 +155,7 @@ static void config__init_reload(struct mosquitto_db *db, struct mosquitto__confi
     }else{
         config->log_type = MOSQ_LOG_ERR | MOSQ_LOG_WARNING | MOSQ_LOG_NOTICE | MOSQ_LOG_INFO;
     }
+    config->log_rate_limit = 0;
     config->log_timestamp = true;
     mosquitto__free(config->log_timestamp_format);
     config->log_timestamp_format = NULL;
@@ -164,10 +167,12 @@ static void config__init_reload(struct mosquitto_db *db, struct mosquitto__confi
     config->persistence_location = NULL;
     mosquitto__free(config->persistence_file);
     config->persistence_file = NULL;
+    config->persistence_journal = false;
     config->persistent_client_expiration = 0;
     config->queue_qos0_messages = false;
     config->retain_available = true;
     config->set_tcp_nodelay = false;
+    config->subscription_cache_size = 0;
     config->sys_interval = 10;
     config->upgrade_outgoing_qos = false;
 
@@ -215,6 +220,9 @@ void config__init(struct mosquitto_db *db, struct mosquitto__config *config)
     config->default_listener.security_options.allow_zero_length_clientid = true;
     config->default_listener.maximum_qos = 2;
     config->default_listener.max_topic_alias = 10;
+    config->password_check_threads = 0;
+    config->log_queue_size = 0;
+    config->queue_spill_threshold = 0;
 }
 
 void config__cleanup(struct mosquitto__config *config)
@@ -228,10 +236,12 @@ void config__cleanup(struct mosquitto__config *config)
     mosquitto__free(config->persistence_location);
     mosquitto__free(config->persistence_file);
     mosquitto__free(config->persistence_filepath);
+    mosquitto__free(config->queue_spill_location);
     mosquitto__free(config->security_options.auto_id_prefix);
     mosquitto__free(config->security_options.acl_file);
     mosquitto__free(config->security_options.password_file);
     mosquitto__free(config->security_options.psk_file);
+    mosquitto__free(config->metrics_host);
     mosquitto__free(config->pid_file);
     mosquitto__free(config->user);
     mosquitto__free(config->log_timestamp_format);
@@ -516,6 +526,7 @@ void config__copy(struct mosquitto__config *src, struct mosquitto__config *dest)
 
     dest->autosave_interval = src->autosave_interval;
     dest->autosave_on_changes = src->autosave_on_changes;
+    dest->autosave_background = src->autosave_background;
 
     mosquitto__free(dest->clientid_prefixes);
     dest->clientid_prefixes = src->clientid_prefixes;
@@ -524,6 +535,7 @@ void config__copy(struct mosquitto__config *src, struct mosquitto__config *dest)
     dest->log_dest = src->log_dest;
     dest->log_facility = src->log_facility;
     dest->log_type = src->log_type;
+    dest->log_rate_limit = src->log_rate_limit;
     dest->log_timestamp = src->log_timestamp;
 
     mosquitto__free(dest->log_timestamp_format);
@@ -688,6 +700,12 @@ int config__read(struct mosquitto_db *db, struct mosquitto__config *config, bool
             if(!config->persistence_filepath) return MOSQ_ERR_NOMEM;
         }
     }
+    if(config->queue_spill_threshold > 0 && config->persistence_journal){
+        /* The journal refers to messages by store id, which spilled messages
+         * don't keep. */
+        log__printf(NULL, MOSQ_LOG_WARNING, "Warning: queue_spill_threshold can't be used with persistence_journal, messages will not be spilled.");
+        config->queue_spill_threshold = 0;
+    }
 #endif
     /* Default to drop to mosquitto user if no other user specified. This must
      * remain here even though it is covered in config__parse_args() because this
@@ -758,7 +776,13 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
             }
             token = strtok_r((*buf), " ", &saveptr);
             if(token){
-                if(!strcmp(token, "acl_file")){
+                if(!strcmp(token, "acl_cache_size")){
+                    if(conf__parse_int(&token, "acl_cache_size", &config->acl_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+                    if(config->acl_cache_size < 0){
+                        log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid acl_cache_size value (%d).", config->acl_cache_size);
+                        return MOSQ_ERR_INVAL;
+                    }
+                }else if(!strcmp(token, "acl_file")){
                     conf__set_cur_security_options(config, cur_listener, &cur_security_options);
                     if(reload){
                         mosquitto__free(cur_security_options->acl_file);
@@ -905,6 +929,8 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
                 }else if(!strcmp(token, "autosave_interval")){
                     if(conf__parse_int(&token, "autosave_interval", &config->autosave_interval, saveptr)) return MOSQ_ERR_INVAL;
                     if(config->autosave_interval < 0) config->autosave_interval = 0;
+                }else if(!strcmp(token, "autosave_background")){
+                    if(conf__parse_bool(&token, "autosave_background", &config->autosave_background, saveptr)) return MOSQ_ERR_INVAL;
                 }else if(!strcmp(token, "autosave_on_changes")){
                     if(conf__parse_bool(&token, "autosave_on_changes", &config->autosave_on_changes, saveptr)) return MOSQ_ERR_INVAL;
                 }else if(!strcmp(token, "bind_address")){
@@ -1466,6 +1492,19 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
                             log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid log_facility value (%d).", tmp_int);
                             return MOSQ_ERR_INVAL;
                     }
+                }else if(!strcmp(token, "log_queue_size")){
+                    if(reload) continue; // Log thread not valid for reloading.
+                    if(conf__parse_int(&token, "log_queue_size", &config->log_queue_size, saveptr)) return MOSQ_ERR_INVAL;
+                    if(config->log_queue_size < 0 || config->log_queue_size > 1048576){
+                        log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid log_queue_size value (%d).", config->log_queue_size);
+                        return MOSQ_ERR_INVAL;
+                    }
+                }else if(!strcmp(token, "log_rate_limit")){
+                    if(conf__parse_int(&token, "log_rate_limit", &config->log_rate_limit, saveptr)) return MOSQ_ERR_INVAL;
+                    if(config->log_rate_limit < 0){
+                        log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid log_rate_limit value (%d).", config->log_rate_limit);
+                        return MOSQ_ERR_INVAL;
+                    }
                 }else if(!strcmp(token, "log_timestamp")){
                     if(conf__parse_bool(&token, token, &config->log_timestamp, saveptr)) return MOSQ_ERR_INVAL;
                 }else if(!strcmp(token, "log_timestamp_format")){
@@ -1581,6 +1620,34 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
                         log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid message_size_limit value (%u).", config->message_size_limit);
                         return MOSQ_ERR_INVAL;
                     }
+                }else if(!strcmp(token, "metrics_listener")){
+#ifdef WITH_SYS_TREE
+                    if(reload) continue; // Metrics listener not valid for reloading.
+                    token = strtok_r(NULL, " ", &saveptr);
+                    if(token){
+                        tmp_int = atoi(token);
+                        if(tmp_int < 1 || tmp_int > 65535){
+                            log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid metrics_listener port value (%d).", tmp_int);
+                            return MOSQ_ERR_INVAL;
+                        }
+                        config->metrics_port = tmp_int;
+                        token = strtok_r(NULL, " ", &saveptr);
+                        if (token != NULL && token[0] == '#'){
+                            token = NULL;
+                        }
+                        mosquitto__free(config->metrics_host);
+                        if(token){
+                            config->metrics_host = mosquitto__strdup(token);
+                        }else{
+                            config->metrics_host = NULL;
+                        }
+                    }else{
+                        log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty metrics_listener value in configuration.");
+                        return MOSQ_ERR_INVAL;
+                    }
+#else
+                    log__printf(NULL, MOSQ_LOG_WARNING, "Warning: $SYS tree support not available, metrics_listener has no effect.");
+#endif
                 }else if(!strcmp(token, "mount_point")){
                     if(reload) continue; // Listeners not valid for reloading.
                     if(config->listener_count == 0){
@@ -1637,6 +1704,16 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
                     if(conf__parse_string(&token, "bridge remote_password", &cur_bridge->remote_password, saveptr)) return MOSQ_ERR_INVAL;
 #else
                     log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+                }else if(!strcmp(token, "password_check_threads")){
+                    if(reload) continue; // Password check threads not valid for reloading.
+                    if(conf__parse_int(&token, "password_check_threads", &config->password_check_threads, saveptr)) return MOSQ_ERR_INVAL;
+                    if(config->password_check_threads < 0 || config->password_check_threads > 1024){
+                        log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid password_check_threads value (%d).", config->password_check_threads);
+                        return MOSQ_ERR_INVAL;
+                    }
+#ifndef WITH_TLS
+                    log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available, password_check_threads has no effect.");
 #endif
                 }else if(!strcmp(token, "password_file")){
                     conf__set_cur_security_options(config, cur_listener, &cur_security_options);
@@ -1655,6 +1732,9 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
                     if(conf__parse_bool(&token, token, &config->persistence, saveptr)) return MOSQ_ERR_INVAL;
                 }else if(!strcmp(token, "persistence_file")){
                     if(conf__parse_string(&token, "persistence_file", &config->persistence_file, saveptr)) return MOSQ_ERR_INVAL;
+                }else if(!strcmp(token, "persistence_journal")){
+                    if(reload) continue; // Journal not valid for reloading.
+                    if(conf__parse_bool(&token, token, &config->persistence_journal, saveptr)) return MOSQ_ERR_INVAL;
                 }else if(!strcmp(token, "persistence_location")){
                     if(conf__parse_string(&token, "persistence_location", &config->persistence_location, saveptr)) return MOSQ_ERR_INVAL;
                 }else if(!strcmp(token, "persistent_client_expiration")){
@@ -1747,6 +1827,16 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
 #endif
                 }else if(!strcmp(token, "queue_qos0_messages")){
                     if(conf__parse_bool(&token, token, &config->queue_qos0_messages, saveptr)) return MOSQ_ERR_INVAL;
+                }else if(!strcmp(token, "queue_spill_location")){
+                    if(reload) continue; // Spill files not valid for reloading.
+                    if(conf__parse_string(&token, "queue_spill_location", &config->queue_spill_location, saveptr)) return MOSQ_ERR_INVAL;
+                }else if(!strcmp(token, "queue_spill_threshold")){
+                    if(reload) continue; // Spill files not valid for reloading.
+                    if(conf__parse_int(&token, "queue_spill_threshold", &config->queue_spill_threshold, saveptr)) return MOSQ_ERR_INVAL;
+                    if(config->queue_spill_threshold < 0){
+                        log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid queue_spill_threshold value (%d).", config->queue_spill_threshold);
+                        return MOSQ_ERR_INVAL;
+                    }
                 }else if(!strcmp(token, "require_certificate")){
 #ifdef WITH_TLS
                     if(reload) continue; // Listeners not valid for reloading.
@@ -1847,6 +1937,12 @@ int config__read_file_core(struct mosquitto__config *config, bool reload, struct
                     }
                 }else if(!strcmp(token, "store_clean_interval")){
                     log__printf(NULL, MOSQ_LOG_WARNING, "Warning: store_clean_interval is no longer needed.");
+                }else if(!strcmp(token, "subscription_cache_size")){
+                    if(conf__parse_int(&token, "subscription_cache_size", &config->subscription_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+                    if(config->subscription_cache_size < 0){
+                        log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid subscription_cache_size value (%d).", config->subscription_cache_size);
+                        return MOSQ_ERR_INVAL;
+                    }
                 }else if(!strcmp(token, "sys_interval")){
                     if(conf__parse_int(&token, "sys_interval", &config->sys_interval, saveptr)) return MOSQ_ERR_INVAL;
                     if(config->sys_interval < 0 || config->sys_interval > 65535){
@@ -86,6 +86,7 @@ struct mosquitto *context__init(struct mosquitto_db *db, mosq_sock_t sock)
 
     if((int)context->sock >= 0){
         HASH_ADD(hh_sock, db->contexts_by_sock, sock, sizeof(context->sock), context);
+        keepalive__add(context);
     }
     return context;
 }
@@ -143,12 +144,15 @@ void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool d
     mosquitto__free(context->auth_method);
     context->auth_method = NULL;
 
+    acl__cache_free(context);
+
     mosquitto__free(context->username);
     context->username = NULL;
 
     mosquitto__free(context->password);
     context->password = NULL;
 
+    keepalive__remove(context);
     net__socket_close(db, context);
     if(do_free || context->clean_start){
         sub__clean_session(db, context);
@@ -168,14 +172,14 @@ void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool d
     packet__cleanup(&(context->in_packet));
     if(context->current_out_packet){
         packet__cleanup(context->current_out_packet);
-        mosquitto__free(context->current_out_packet);
+        mosquitto__pool_free(&packet_pool, context->current_out_packet);
         context->current_out_packet = NULL;
     }
     while(context->out_packet){
         packet__cleanup(context->out_packet);
         packet = context->out_packet;
         context->out_packet = context->out_packet->next;
-        mosquitto__free(packet);
+        mosquitto__pool_free(&packet_pool, packet);
     }
     if(do_free || context->clean_start){
         db__messages_delete(db, context);
@@ -188,6 +192,7 @@ void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool d
     }
 #endif
     if(do_free){
+        plugin__pending_free(context->plugin_pending);
         mosquitto__free(context);
     }
 }
@@ -226,6 +231,7 @@ void context__send_will(struct mosquitto_db *db, struct mosquitto *ctxt)
 
 void context__disconnect(struct mosquitto_db *db, struct mosquitto *context)
 {
+    keepalive__remove(context);
     net__socket_close(db, context);
 
     context__send_will(db, context);
@@ -270,40 +276,44 @@ void context__add_to_disused(struct mosquitto_db *db, struct mosquitto *context)
 void context__free_disused(struct mosquitto_db *db)
 {
     struct mosquitto *context, *next;
-#ifdef WITH_WEBSOCKETS
-    struct mosquitto *last = NULL;
-#endif
+    struct mosquitto *keep = NULL;
     assert(db);
 
     context = db->ll_for_free;
+    db->ll_for_free = NULL;
     while(context){
+        next = context->for_free_next;
 #ifdef WITH_WEBSOCKETS
-        if(context->wsi){
-            /* Don't delete yet, lws hasn't finished with it */
-            if(last){
-                last->for_free_next = context;
-            }else{
-                db->ll_for_free = context;
-            }
-            next = context->for_free_next;
-            context->for_free_next = NULL;
-            last = context;
-            context = next;
-        }else
+        if(context->wsi || context->wake_pending
+                || (context->plugin_pending && !context->plugin_pending->done)){
+#else
+        if(context->wake_pending
+                || (context->plugin_pending && !context->plugin_pending->done)){
 #endif
-        {
-            next = context->for_free_next;
+            /* Don't delete yet, lws, the main loop's wake list or a plugin
+             * hasn't finished with it */
+            context->for_free_next = keep;
+            keep = context;
+        }else{
             context__cleanup(db, context, true);
-            context = next;
         }
+        context = next;
+    }
+    while(keep){
+        next = keep->for_free_next;
+        keep->for_free_next = db->ll_for_free;
+        db->ll_for_free = keep;
+        keep = next;
     }
-    db->ll_for_free = NULL;
 }
 
 
 void context__remove_from_by_id(struct mosquitto_db *db, struct mosquitto *context)
 {
     if(context->removed_from_by_id == false && context->id){
+#ifdef WITH_PERSISTENCE
+        persist__journal_client_delete(db, context);
+#endif
         HASH_DELETE(hh_id, db->contexts_by_id, context);
         context->removed_from_by_id = true;
     }
@@ -22,11 +22,17 @@ Contributors:
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
+#include "mid_index_mosq.h"
+#include "msg_queue.h"
+#include "packet_mosq.h"
 #include "send_mosq.h"
 #include "sys_tree.h"
 #include "time_mosq.h"
 #include "util_mosq.h"
 
+struct mosquitto__pool client_msg_pool = MOSQUITTO__POOL_INIT("client messages", struct mosquitto_client_msg);
+struct mosquitto__pool msg_store_pool = MOSQUITTO__POOL_INIT("stored messages", struct mosquitto_msg_store);
+
 static unsigned long max_inflight_bytes = 0;
 static int max_queued = 100;
 static unsigned long max_queued_bytes = 0;
@@ -153,14 +159,13 @@ static void subhier_clean(struct mosquitto_db *db, struct mosquitto__subhier **s
         leaf = peer->subs;
         while(leaf){
             nextleaf = leaf->next;
-            mosquitto__free(leaf);
+            mosquitto__pool_free(&subleaf_pool, leaf);
             leaf = nextleaf;
         }
         if(peer->retained){
             db__msg_store_ref_dec(db, &peer->retained);
         }
         subhier_clean(db, &peer->children);
-        mosquitto__free(peer->topic);
 
         HASH_DELETE(hh, *subhier, peer);
         mosquitto__free(peer);
@@ -169,8 +174,10 @@ static void subhier_clean(struct mosquitto_db *db, struct mosquitto__subhier **s
 
 int db__close(struct mosquitto_db *db)
 {
+    subs_cache__cleanup();
     subhier_clean(db, &db->subs);
     db__msg_store_clean(db);
+    spill__cleanup();
 
     return MOSQ_ERR_SUCCESS;
 }
@@ -189,8 +196,6 @@ void db__msg_store_add(struct mosquitto_db *db, struct mosquitto_msg_store *stor
 
 void db__msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *store)
 {
-    int i;
-
     if(store->prev){
         store->prev->next = store->next;
         if(store->next){
@@ -205,18 +210,16 @@ void db__msg_store_remove(struct mosquitto_db *db, struct mosquitto_msg_store *s
     db->msg_store_count--;
     db->msg_store_bytes -= store->payloadlen;
 
+#ifdef WITH_PERSISTENCE
+    persist__journal_msg_store_delete(db, store);
+#endif
+
     mosquitto__free(store->source_id);
     mosquitto__free(store->source_username);
-    if(store->dest_ids){
-        for(i=0; i<store->dest_id_count; i++){
-            mosquitto__free(store->dest_ids[i]);
-        }
-        mosquitto__free(store->dest_ids);
-    }
     mosquitto__free(store->topic);
     mosquitto_property_free_all(&store->properties);
     UHPA_FREE_PAYLOAD(store);
-    mosquitto__free(store);
+    mosquitto__pool_free(&msg_store_pool, store);
 }
 
 
@@ -262,12 +265,16 @@ void db__msg_store_compact(struct mosquitto_db *db)
 }
 
 
-static void db__message_remove(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
+static void db__message_remove(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
 {
     if(!msg_data || !item){
         return;
     }
 
+#ifdef WITH_PERSISTENCE
+    persist__journal_client_msg_delete(db, context, item);
+#endif
+    mid_index__remove(&msg_data->inflight_index, item->mid, item);
     DL_DELETE(msg_data->inflight, item);
     if(item->store){
         msg_data->msg_count--;
@@ -280,44 +287,45 @@ static void db__message_remove(struct mosquitto_db *db, struct mosquitto_msg_dat
     }
 
     mosquitto_property_free_all(&item->properties);
-    mosquitto__free(item);
+    mosquitto__pool_free(&client_msg_pool, item);
 }
 
 
-void db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data)
+int db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data)
 {
     struct mosquitto_client_msg *msg;
 
-    msg = msg_data->queued;
-    DL_DELETE(msg_data->queued, msg);
+    msg = msg_queue__first(&msg_data->queued);
+    if(mid_index__add(&msg_data->inflight_index, msg->mid, msg)){
+        return MOSQ_ERR_NOMEM;
+    }
+    msg_queue__pop(&msg_data->queued);
     DL_APPEND(msg_data->inflight, msg);
     if(msg_data->inflight_quota > 0){
         msg_data->inflight_quota--;
     }
+    return MOSQ_ERR_SUCCESS;
 }
 
 
 int db__message_delete_outgoing(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state expect_state, int qos)
 {
-    struct mosquitto_client_msg *tail, *tmp;
-    int msg_index = 0;
+    struct mosquitto_client_msg *tail;
+    int msg_index;
 
     if(!context) return MOSQ_ERR_INVAL;
 
-    DL_FOREACH_SAFE(context->msgs_out.inflight, tail, tmp){
-        msg_index++;
-        if(tail->mid == mid){
-            if(tail->qos != qos){
-                return MOSQ_ERR_PROTOCOL;
-            }else if(qos == 2 && tail->state != expect_state){
-                return MOSQ_ERR_PROTOCOL;
-            }
-            msg_index--;
-            db__message_remove(db, &context->msgs_out, tail);
+    while((tail = mid_index__find(&context->msgs_out.inflight_index, mid))){
+        if(tail->qos != qos){
+            return MOSQ_ERR_PROTOCOL;
+        }else if(qos == 2 && tail->state != expect_state){
+            return MOSQ_ERR_PROTOCOL;
         }
+        db__message_remove(db, context, &context->msgs_out, tail);
     }
+    msg_index = context->msgs_out.inflight_index.count;
 
-    DL_FOREACH_SAFE(context->msgs_out.queued, tail, tmp){
+    while((tail = msg_queue__first(&context->msgs_out.queued))){
         if(context->msgs_out.inflight_maximum != 0 && msg_index >= context->msgs_out.inflight_maximum){
             break;
         }
@@ -335,7 +343,9 @@ int db__message_delete_outgoing(struct mosquitto_db *db, struct mosquitto *conte
                 tail->state = mosq_ms_publish_qos2;
                 break;
         }
-        db__message_dequeue_first(context, &context->msgs_out);
+        if(db__message_dequeue_first(context, &context->msgs_out)){
+            return MOSQ_ERR_NOMEM;
+        }
     }
 
     return MOSQ_ERR_SUCCESS;
@@ -346,9 +356,9 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
     struct mosquitto_client_msg *msg;
     struct mosquitto_msg_data *msg_data;
     enum mosquitto_msg_state state = mosq_ms_invalid;
+    int msg_qos;
     int rc = 0;
-    int i;
-    char **dest_ids;
+    int rc2;
 
     assert(stored);
     if(!context) return MOSQ_ERR_INVAL;
@@ -369,15 +379,12 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
      */
     if(context->protocol != mosq_p_mqtt5
             && db->config->allow_duplicate_messages == false
-            && dir == mosq_md_out && retain == false && stored->dest_ids){
+            && dir == mosq_md_out && retain == false
+            && context->last_dest_db_id == stored->db_id){
 
-        for(i=0; i<stored->dest_id_count; i++){
-            if(!strcmp(stored->dest_ids[i], context->id)){
-                /* We have already sent this message to this client. */
-                mosquitto_property_free_all(&properties);
-                return MOSQ_ERR_SUCCESS;
-            }
-        }
+        /* We have already sent this message to this client. */
+        mosquitto_property_free_all(&properties);
+        return MOSQ_ERR_SUCCESS;
     }
     if(context->sock == INVALID_SOCKET){
         /* Client is not connected only queue messages with QoS>0. */
@@ -395,7 +402,7 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
     }
 
     if(context->sock != INVALID_SOCKET){
-        if(db__ready_for_flight(msg_data, qos)){
+        if(msg_data->spilled.count == 0 && db__ready_for_flight(msg_data, qos)){
             if(dir == mosq_md_out){
                 switch(qos){
                     case 0:
@@ -454,56 +461,73 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
     }
 #endif
 
-    msg = mosquitto__malloc(sizeof(struct mosquitto_client_msg));
-    if(!msg) return MOSQ_ERR_NOMEM;
-    msg->prev = NULL;
-    msg->next = NULL;
-    msg->store = stored;
-    db__msg_store_ref_inc(msg->store);
-    msg->mid = mid;
-    msg->timestamp = mosquitto_time();
-    msg->direction = dir;
-    msg->state = state;
-    msg->dup = false;
     if(qos > context->maximum_qos){
-        msg->qos = context->maximum_qos;
+        msg_qos = context->maximum_qos;
     }else{
-        msg->qos = qos;
+        msg_qos = qos;
     }
-    msg->retain = retain;
-    msg->properties = properties;
 
-    if(state == mosq_ms_queued){
-        DL_APPEND(msg_data->queued, msg);
+    if(state == mosq_ms_queued && spill__wanted(db, context, msg_data, stored)
+            && spill__push(db, msg_data, stored, mid, msg_qos, retain, properties) == MOSQ_ERR_SUCCESS){
+
+        /* Spilled to disk, only counted here. */
     }else{
-        DL_APPEND(msg_data->inflight, msg);
+        msg = mosquitto__pool_calloc(&client_msg_pool);
+        if(!msg) return MOSQ_ERR_NOMEM;
+        msg->prev = NULL;
+        msg->next = NULL;
+        msg->store = stored;
+        db__msg_store_ref_inc(msg->store);
+        msg->mid = mid;
+        msg->timestamp = mosquitto_time();
+        msg->direction = dir;
+        msg->state = state;
+        msg->dup = false;
+        msg->qos = msg_qos;
+        msg->retain = retain;
+        msg->properties = properties;
+
+        if(state == mosq_ms_queued){
+            rc2 = msg_queue__push(&msg_data->queued, msg);
+        }else{
+            rc2 = mid_index__add(&msg_data->inflight_index, mid, msg);
+            if(rc2 == MOSQ_ERR_SUCCESS){
+                DL_APPEND(msg_data->inflight, msg);
+            }
+        }
+        if(rc2){
+            db__msg_store_ref_dec(db, &msg->store);
+            mosquitto_property_free_all(&msg->properties);
+            mosquitto__pool_free(&client_msg_pool, msg);
+            return rc2;
+        }
+#ifdef WITH_PERSISTENCE
+        persist__journal_client_msg(db, context, msg);
+#endif
     }
     msg_data->msg_count++;
-    msg_data->msg_bytes+= msg->store->payloadlen;
+    msg_data->msg_bytes += stored->payloadlen;
     if(qos > 0){
         msg_data->msg_count12++;
-        msg_data->msg_bytes12 += msg->store->payloadlen;
+        msg_data->msg_bytes12 += stored->payloadlen;
+    }
+    if(dir == mosq_md_out){
+        G_QUEUE_DEPTH_ADD(msg_data->msg_count);
     }
 
     if(db->config->allow_duplicate_messages == false && dir == mosq_md_out && retain == false){
-        /* Record which client ids this message has been sent to so we can avoid duplicates.
-         * Outgoing messages only.
+        /* Record that this message has been sent to this client so we can
+         * avoid duplicates. A message is queued to all of its subscribers in
+         * a single pass of sub__messages_queue(), so it is enough for each
+         * client to remember the last message it was sent, and db_id is never
+         * reused. Outgoing messages only.
          * If retain==true then this is a stale retained message and so should be
          * sent regardless. FIXME - this does mean retained messages will received
          * multiple times for overlapping subscriptions, although this is only the
          * case for SUBSCRIPTION with multiple subs in so is a minor concern.
          */
-        dest_ids = mosquitto__realloc(stored->dest_ids, sizeof(char *)*(stored->dest_id_count+1));
-        if(dest_ids){
-            stored->dest_ids = dest_ids;
-            stored->dest_id_count++;
-            stored->dest_ids[stored->dest_id_count-1] = mosquitto__strdup(context->id);
-            if(!stored->dest_ids[stored->dest_id_count-1]){
-                return MOSQ_ERR_NOMEM;
-            }
-        }else{
-            return MOSQ_ERR_NOMEM;
-        }
+        context->last_dest_db_id = stored->db_id;
+        stored->dest_id_count++;
     }
 #ifdef WITH_BRIDGE
     if(context->bridge && context->bridge->start_type == bst_lazy
@@ -514,35 +538,37 @@ int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint1
     }
 #endif
 
-    if(dir == mosq_md_out && msg->qos > 0){
+    if(dir == mosq_md_out && msg_qos > 0){
         util__decrement_send_quota(context);
     }
 #ifdef WITH_WEBSOCKETS
     if(context->wsi && rc == 0){
         return db__message_write(db, context);
-    }else{
-        return rc;
     }
-#else
-    return rc;
 #endif
+    if(dir == mosq_md_out && rc == 0){
+        worker__wake(context);
+    }
+    return rc;
 }
 
-int db__message_update_outgoing(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state state, int qos)
+int db__message_update_outgoing(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state state, int qos)
 {
     struct mosquitto_client_msg *tail;
 
-    DL_FOREACH(context->msgs_out.inflight, tail){
-        if(tail->mid == mid){
-            if(tail->qos != qos){
-                return MOSQ_ERR_PROTOCOL;
-            }
-            tail->state = state;
-            tail->timestamp = mosquitto_time();
-            return MOSQ_ERR_SUCCESS;
-        }
+    tail = mid_index__find(&context->msgs_out.inflight_index, mid);
+    if(!tail){
+        return MOSQ_ERR_NOT_FOUND;
+    }
+    if(tail->qos != qos){
+        return MOSQ_ERR_PROTOCOL;
     }
-    return MOSQ_ERR_NOT_FOUND;
+    tail->state = state;
+    tail->timestamp = mosquitto_time();
+#ifdef WITH_PERSISTENCE
+    persist__journal_client_msg(db, context, tail);
+#endif
+    return MOSQ_ERR_SUCCESS;
 }
 
 
@@ -554,20 +580,38 @@ void db__messages_delete_list(struct mosquitto_db *db, struct mosquitto_client_m
         DL_DELETE(*head, tail);
         db__msg_store_ref_dec(db, &tail->store);
         mosquitto_property_free_all(&tail->properties);
-        mosquitto__free(tail);
+        mosquitto__pool_free(&client_msg_pool, tail);
     }
     *head = NULL;
 }
 
 
+static void db__messages_delete_queue(struct mosquitto_db *db, struct mosquitto__msg_queue *queue)
+{
+    struct mosquitto_client_msg *msg;
+    int i;
+
+    for(i=0; i<queue->count; i++){
+        msg = msg_queue__get(queue, i);
+        db__msg_store_ref_dec(db, &msg->store);
+        mosquitto_property_free_all(&msg->properties);
+        mosquitto__pool_free(&client_msg_pool, msg);
+    }
+    msg_queue__cleanup(queue);
+}
+
+
 int db__messages_delete(struct mosquitto_db *db, struct mosquitto *context)
 {
     if(!context) return MOSQ_ERR_INVAL;
 
     db__messages_delete_list(db, &context->msgs_in.inflight);
-    db__messages_delete_list(db, &context->msgs_in.queued);
+    db__messages_delete_queue(db, &context->msgs_in.queued);
     db__messages_delete_list(db, &context->msgs_out.inflight);
-    db__messages_delete_list(db, &context->msgs_out.queued);
+    db__messages_delete_queue(db, &context->msgs_out.queued);
+    spill__discard(db, &context->msgs_out);
+    mid_index__cleanup(&context->msgs_in.inflight_index);
+    mid_index__cleanup(&context->msgs_out.inflight_index);
 
     context->msgs_in.msg_bytes = 0;
     context->msgs_in.msg_bytes12 = 0;
@@ -638,7 +682,7 @@ int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, u
     assert(db);
     assert(stored);
 
-    temp = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store));
+    temp = mosquitto__pool_calloc(&msg_store_pool);
     if(!temp){
         log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
         rc = MOSQ_ERR_NOMEM;
@@ -679,6 +723,9 @@ int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, u
     temp->payloadlen = payloadlen;
     temp->properties = properties;
     temp->origin = origin;
+#ifdef WITH_SYS_TREE
+    temp->received_us = stats__now_us();
+#endif
     if(payloadlen){
         UHPA_MOVE(temp->payload, *payload, payloadlen);
     }else{
@@ -690,7 +737,6 @@ int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, u
         temp->message_expiry_time = 0;
     }
 
-    temp->dest_ids = NULL;
     temp->dest_id_count = 0;
     db->msg_store_count++;
     db->msg_store_bytes += payloadlen;
@@ -711,7 +757,7 @@ error:
         mosquitto__free(temp->source_id);
         mosquitto__free(temp->source_username);
         mosquitto__free(temp->topic);
-        mosquitto__free(temp);
+        mosquitto__pool_free(&msg_store_pool, temp);
     }
     mosquitto_property_free_all(&properties);
     UHPA_FREE(*payload, payloadlen);
@@ -721,18 +767,19 @@ error:
 int db__message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_msg_store **stored)
 {
     struct mosquitto_client_msg *tail;
+    int i;
 
     if(!context) return MOSQ_ERR_INVAL;
 
     *stored = NULL;
-    DL_FOREACH(context->msgs_in.inflight, tail){
-        if(tail->store->source_mid == mid){
-            *stored = tail->store;
-            return MOSQ_ERR_SUCCESS;
-        }
+    tail = mid_index__find(&context->msgs_in.inflight_index, mid);
+    if(tail && tail->store->source_mid == mid){
+        *stored = tail->store;
+        return MOSQ_ERR_SUCCESS;
     }
 
-    DL_FOREACH(context->msgs_in.queued, tail){
+    for(i=0; i<context->msgs_in.queued.count; i++){
+        tail = msg_queue__get(&context->msgs_in.queued, i);
         if(tail->store->source_mid == mid){
             *stored = tail->store;
             return MOSQ_ERR_SUCCESS;
@@ -747,6 +794,7 @@ int db__message_store_find(struct mosquitto *context, uint16_t mid, struct mosqu
 int db__message_reconnect_reset_outgoing(struct mosquitto_db *db, struct mosquitto *context)
 {
     struct mosquitto_client_msg *msg, *tmp;
+    int i;
 
     context->msgs_out.msg_bytes = 0;
     context->msgs_out.msg_bytes12 = 0;
@@ -783,16 +831,18 @@ int db__message_reconnect_reset_outgoing(struct mosquitto_db *db, struct mosquit
      * in the mosq_ms_queued state. If we don't change them to the
      * appropriate "publish" state, then the queued messages won't
      * get sent until the client next receives a message - and they
-     * will be sent out of order.
+     * will be sent out of order. Only the front of the queue can go in
+     * flight, so that order is kept.
      */
-    DL_FOREACH_SAFE(context->msgs_out.queued, msg, tmp){
+    i = 0;
+    while((msg = msg_queue__get(&context->msgs_out.queued, i))){
         context->msgs_out.msg_count++;
         context->msgs_out.msg_bytes += msg->store->payloadlen;
         if(msg->qos > 0){
             context->msgs_out.msg_count12++;
             context->msgs_out.msg_bytes12 += msg->store->payloadlen;
         }
-        if(db__ready_for_flight(&context->msgs_out, msg->qos)){
+        if(i == 0 && db__ready_for_flight(&context->msgs_out, msg->qos)){
             switch(msg->qos){
                 case 0:
                     msg->state = mosq_ms_publish_qos0;
@@ -804,9 +854,19 @@ int db__message_reconnect_reset_outgoing(struct mosquitto_db *db, struct mosquit
                     msg->state = mosq_ms_publish_qos2;
                     break;
             }
-            db__message_dequeue_first(context, &context->msgs_out);
+            if(db__message_dequeue_first(context, &context->msgs_out)){
+                return MOSQ_ERR_NOMEM;
+            }
+        }else{
+            i++;
         }
     }
+    /* Spilled messages are still queued, they are brought back in to the
+     * queue by db__message_write(). */
+    context->msgs_out.msg_count += context->msgs_out.spilled.count;
+    context->msgs_out.msg_bytes += context->msgs_out.spilled.bytes;
+    context->msgs_out.msg_count12 += context->msgs_out.spilled.count12;
+    context->msgs_out.msg_bytes12 += context->msgs_out.spilled.bytes12;
 
     return MOSQ_ERR_SUCCESS;
 }
@@ -816,6 +876,7 @@ int db__message_reconnect_reset_outgoing(struct mosquitto_db *db, struct mosquit
 int db__message_reconnect_reset_incoming(struct mosquitto_db *db, struct mosquitto *context)
 {
     struct mosquitto_client_msg *msg, *tmp;
+    int i;
 
     context->msgs_in.msg_bytes = 0;
     context->msgs_in.msg_bytes12 = 0;
@@ -835,7 +896,7 @@ int db__message_reconnect_reset_incoming(struct mosquitto_db *db, struct mosquit
         if(msg->qos != 2){
             /* Anything <QoS 2 can be completely retried by the client at
              * no harm. */
-            db__message_remove(db, &context->msgs_in, msg);
+            db__message_remove(db, context, &context->msgs_in, msg);
         }else{
             /* Message state can be preserved here because it should match
              * whatever the client has got. */
@@ -846,16 +907,18 @@ int db__message_reconnect_reset_incoming(struct mosquitto_db *db, struct mosquit
      * in the mosq_ms_queued state. If we don't change them to the
      * appropriate "publish" state, then the queued messages won't
      * get sent until the client next receives a message - and they
-     * will be sent out of order.
+     * will be sent out of order. Only the front of the queue can go in
+     * flight, so that order is kept.
      */
-    DL_FOREACH_SAFE(context->msgs_in.queued, msg, tmp){
+    i = 0;
+    while((msg = msg_queue__get(&context->msgs_in.queued, i))){
         context->msgs_in.msg_count++;
         context->msgs_in.msg_bytes += msg->store->payloadlen;
         if(msg->qos > 0){
             context->msgs_in.msg_count12++;
             context->msgs_in.msg_bytes12 += msg->store->payloadlen;
         }
-        if(db__ready_for_flight(&context->msgs_in, msg->qos)){
+        if(i == 0 && db__ready_for_flight(&context->msgs_in, msg->qos)){
             switch(msg->qos){
                 case 0:
                     msg->state = mosq_ms_publish_qos0;
@@ -867,7 +930,11 @@ int db__message_reconnect_reset_incoming(struct mosquitto_db *db, struct mosquit
                     msg->state = mosq_ms_publish_qos2;
                     break;
             }
-            db__message_dequeue_first(context, &context->msgs_in);
+            if(db__message_dequeue_first(context, &context->msgs_in)){
+                return MOSQ_ERR_NOMEM;
+            }
+        }else{
+            i++;
         }
     }
 
@@ -887,46 +954,45 @@ int db__message_reconnect_reset(struct mosquitto_db *db, struct mosquitto *conte
 
 int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid)
 {
-    struct mosquitto_client_msg *tail, *tmp;
+    struct mosquitto_client_msg *tail;
     int retain;
     char *topic;
     char *source_id;
-    int msg_index = 0;
+    int msg_index;
     bool deleted = false;
     int rc;
 
     if(!context) return MOSQ_ERR_INVAL;
 
-    DL_FOREACH_SAFE(context->msgs_in.inflight, tail, tmp){
-        msg_index++;
-        if(tail->mid == mid){
-            if(tail->store->qos != 2){
-                return MOSQ_ERR_PROTOCOL;
-            }
-            topic = tail->store->topic;
-            retain = tail->retain;
-            source_id = tail->store->source_id;
-
-            /* topic==NULL should be a QoS 2 message that was
-             * denied/dropped and is being processed so the client doesn't
-             * keep resending it. That means we don't send it to other
-             * clients. */
-            if(!topic){
-                db__message_remove(db, &context->msgs_in, tail);
+    while((tail = mid_index__find(&context->msgs_in.inflight_index, mid))){
+        if(tail->store->qos != 2){
+            return MOSQ_ERR_PROTOCOL;
+        }
+        topic = tail->store->topic;
+        retain = tail->retain;
+        source_id = tail->store->source_id;
+
+        /* topic==NULL should be a QoS 2 message that was
+         * denied/dropped and is being processed so the client doesn't
+         * keep resending it. That means we don't send it to other
+         * clients. */
+        if(!topic){
+            db__message_remove(db, context, &context->msgs_in, tail);
+            deleted = true;
+        }else{
+            rc = sub__messages_queue(db, source_id, topic, 2, retain, &tail->store);
+            if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_NO_SUBSCRIBERS){
+                db__message_remove(db, context, &context->msgs_in, tail);
                 deleted = true;
             }else{
-                rc = sub__messages_queue(db, source_id, topic, 2, retain, &tail->store);
-                if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_NO_SUBSCRIBERS){
-                    db__message_remove(db, &context->msgs_in, tail);
-                    deleted = true;
-                }else{
-                    return 1;
-                }
+                return 1;
             }
         }
     }
+    msg_index = context->msgs_in.inflight_index.count;
 
-    DL_FOREACH_SAFE(context->msgs_in.queued, tail, tmp){
+    /* Only QoS 2 messages are queued incoming. */
+    while((tail = msg_queue__first(&context->msgs_in.queued))){
         if(context->msgs_in.inflight_maximum != 0 && msg_index >= context->msgs_in.inflight_maximum){
             break;
         }
@@ -934,10 +1000,10 @@ int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *cont
         msg_index++;
         tail->timestamp = mosquitto_time();
 
-        if(tail->qos == 2){
-            send__pubrec(context, tail->mid, 0);
-            tail->state = mosq_ms_wait_for_pubrel;
-            db__message_dequeue_first(context, &context->msgs_in);
+        send__pubrec(context, tail->mid, 0);
+        tail->state = mosq_ms_wait_for_pubrel;
+        if(db__message_dequeue_first(context, &context->msgs_in)){
+            return MOSQ_ERR_NOMEM;
         }
     }
     if(deleted){
@@ -947,7 +1013,31 @@ int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *cont
     }
 }
 
-int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
+/* Bring spilled messages back in to the outgoing queue, up to
+ * queue_spill_threshold at a time. */
+static int db__messages_unspill(struct mosquitto_db *db, struct mosquitto *context)
+{
+    struct mosquitto_client_msg *msg;
+    int rc;
+
+    while(context->msgs_out.spilled.count > 0
+            && context->msgs_out.queued.count < db->config->queue_spill_threshold){
+
+        rc = spill__pop(db, context, &msg);
+        if(rc) return rc;
+        if(msg == NULL) continue; /* Expired, or no longer allowed by ACL */
+
+        if(msg_queue__push(&context->msgs_out.queued, msg)){
+            db__msg_store_ref_dec(db, &msg->store);
+            mosquitto_property_free_all(&msg->properties);
+            mosquitto__pool_free(&client_msg_pool, msg);
+            return MOSQ_ERR_NOMEM;
+        }
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+static int db__message_write_all(struct mosquitto_db *db, struct mosquitto *context)
 {
     int rc;
     struct mosquitto_client_msg *tail, *tmp;
@@ -963,15 +1053,6 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
     time_t now = 0;
     uint32_t expiry_interval;
 
-    if(!context || context->sock == INVALID_SOCKET
-            || (context->state == mosq_cs_active && !context->id)){
-        return MOSQ_ERR_INVAL;
-    }
-
-    if(context->state != mosq_cs_active){
-        return MOSQ_ERR_SUCCESS;
-    }
-
     DL_FOREACH_SAFE(context->msgs_in.inflight, tail, tmp){
         msg_count++;
         if(tail->store->message_expiry_time){
@@ -980,7 +1061,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
             }
             if(now > tail->store->message_expiry_time){
                 /* Message is expired, must not send. */
-                db__message_remove(db, &context->msgs_in, tail);
+                db__message_remove(db, context, &context->msgs_in, tail);
                 continue;
             }
         }
@@ -1027,7 +1108,7 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
             }
             if(now > tail->store->message_expiry_time){
                 /* Message is expired, must not send. */
-                db__message_remove(db, &context->msgs_out, tail);
+                db__message_remove(db, context, &context->msgs_out, tail);
                 continue;
             }else{
                 expiry_interval = tail->store->message_expiry_time - now;
@@ -1047,35 +1128,35 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
 
         switch(tail->state){
             case mosq_ms_publish_qos0:
-                rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
+                rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval, tail->store);
                 if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_OVERSIZE_PACKET){
-                    db__message_remove(db, &context->msgs_out, tail);
+                    db__message_remove(db, context, &context->msgs_out, tail);
                 }else{
                     return rc;
                 }
                 break;
 
             case mosq_ms_publish_qos1:
-                rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
+                rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval, tail->store);
                 if(rc == MOSQ_ERR_SUCCESS){
                     tail->timestamp = mosquitto_time();
                     tail->dup = 1; /* Any retry attempts are a duplicate. */
                     tail->state = mosq_ms_wait_for_puback;
                 }else if(rc == MOSQ_ERR_OVERSIZE_PACKET){
-                    db__message_remove(db, &context->msgs_out, tail);
+                    db__message_remove(db, context, &context->msgs_out, tail);
                 }else{
                     return rc;
                 }
                 break;
 
             case mosq_ms_publish_qos2:
-                rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
+                rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval, tail->store);
                 if(rc == MOSQ_ERR_SUCCESS){
                     tail->timestamp = mosquitto_time();
                     tail->dup = 1; /* Any retry attempts are a duplicate. */
                     tail->state = mosq_ms_wait_for_pubrec;
                 }else if(rc == MOSQ_ERR_OVERSIZE_PACKET){
-                    db__message_remove(db, &context->msgs_out, tail);
+                    db__message_remove(db, context, &context->msgs_out, tail);
                 }else{
                     return rc;
                 }
@@ -1102,26 +1183,35 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
         }
     }
 
-    DL_FOREACH_SAFE(context->msgs_in.queued, tail, tmp){
+    /* Only QoS 2 messages are queued incoming. */
+    while((tail = msg_queue__first(&context->msgs_in.queued))){
         if(context->msgs_out.inflight_maximum != 0 && context->msgs_in.inflight_quota == 0){
             break;
         }
 
         msg_count++;
 
-        if(tail->qos == 2){
-            tail->state = mosq_ms_send_pubrec;
-            db__message_dequeue_first(context, &context->msgs_in);
-            rc = send__pubrec(context, tail->mid, 0);
-            if(!rc){
-                tail->state = mosq_ms_wait_for_pubrel;
-            }else{
-                return rc;
-            }
+        tail->state = mosq_ms_send_pubrec;
+        if(db__message_dequeue_first(context, &context->msgs_in)){
+            return MOSQ_ERR_NOMEM;
+        }
+        rc = send__pubrec(context, tail->mid, 0);
+        if(!rc){
+            tail->state = mosq_ms_wait_for_pubrel;
+        }else{
+            return rc;
         }
     }
 
-    DL_FOREACH_SAFE(context->msgs_out.queued, tail, tmp){
+    while(1){
+        if(context->msgs_out.queued.count == 0 && context->msgs_out.spilled.count > 0){
+            rc = db__messages_unspill(db, context);
+            if(rc) return rc;
+        }
+        tail = msg_queue__first(&context->msgs_out.queued);
+        if(!tail){
+            break;
+        }
         if(context->msgs_out.inflight_maximum != 0 && context->msgs_out.inflight_quota == 0){
             break;
         }
@@ -1139,12 +1229,37 @@ int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
                 tail->state = mosq_ms_publish_qos2;
                 break;
         }
-        db__message_dequeue_first(context, &context->msgs_out);
+        if(db__message_dequeue_first(context, &context->msgs_out)){
+            return MOSQ_ERR_NOMEM;
+        }
     }
 
     return MOSQ_ERR_SUCCESS;
 }
 
+
+int db__message_write(struct mosquitto_db *db, struct mosquitto *context)
+{
+    int rc, rc2;
+
+    if(!context || context->sock == INVALID_SOCKET
+            || (context->state == mosq_cs_active && !context->id)){
+        return MOSQ_ERR_INVAL;
+    }
+
+    if(context->state != mosq_cs_active){
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    packet__cork(context);
+    rc = db__message_write_all(db, context);
+    rc2 = packet__uncork(context);
+    if(rc == MOSQ_ERR_SUCCESS){
+        rc = rc2;
+    }
+    return rc;
+}
+
 void db__limits_set(unsigned long inflight_bytes, int queued, unsigned long queued_bytes)
 {
     max_inflight_bytes = inflight_bytes;
@@ -66,6 +66,7 @@ static long client_msg_count = 0;
 static long msg_store_count = 0;
 static long retain_count = 0;
 static long sub_count = 0;
+static long delete_count = 0;
 /* ====== */
 
 
@@ -101,7 +102,50 @@ static void free__msg_store(struct P_msg_store *chunk)
 }
 
 
-static int dump__cfg_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint32_t length)
+/* Version 6 chunks are read whole and CRC checked by persist__chunk_read_v6(),
+ * then parsed from buf. The parsers leave client ids and topics pointing into
+ * buf, so they are copied to match what the stdio readers give. */
+static char *dump__strndup(const char *s, uint16_t len)
+{
+    char *str;
+
+    if(!s) return NULL;
+    str = malloc(len+1);
+    if(str){
+        memcpy(str, s, len);
+        str[len] = '\0';
+    }
+    return str;
+}
+
+
+static int dump__client_msg_parse(const uint8_t *buf, uint32_t length, struct P_client_msg *chunk)
+{
+    if(persist__chunk_client_msg_parse_v5(buf, length, chunk)) return 1;
+    chunk->client_id = dump__strndup(chunk->client_id, chunk->F.id_len);
+    if(!chunk->client_id){
+        mosquitto_property_free_all(&chunk->properties);
+        return 1;
+    }
+    return 0;
+}
+
+
+static int dump__sub_parse(const uint8_t *buf, uint32_t length, struct P_sub *chunk)
+{
+    if(persist__chunk_sub_parse_v5(buf, length, chunk)) return 1;
+    chunk->client_id = dump__strndup(chunk->client_id, chunk->F.id_len);
+    chunk->topic = dump__strndup(chunk->topic, chunk->F.topic_len);
+    if(!chunk->client_id || !chunk->topic){
+        free(chunk->client_id);
+        free(chunk->topic);
+        return 1;
+    }
+    return 0;
+}
+
+
+static int dump__cfg_chunk_process(struct mosquitto_db *db, FILE *db_fd, const uint8_t *buf, uint32_t length)
 {
     struct PF_cfg chunk;
     int rc;
@@ -110,7 +154,9 @@ static int dump__cfg_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint32_
 
     memset(&chunk, 0, sizeof(struct PF_cfg));
 
-    if(db_version == 5){
+    if(buf){
+        rc = persist__chunk_cfg_parse_v5(buf, length, &chunk);
+    }else if(db_version == 5){
         rc = persist__chunk_cfg_read_v5(db_fd, &chunk);
     }else{
         rc = persist__chunk_cfg_read_v234(db_fd, &chunk);
@@ -137,7 +183,7 @@ static int dump__cfg_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint32_
 }
 
 
-static int dump__client_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint32_t length)
+static int dump__client_chunk_process(struct mosquitto_db *db, FILE *db_fd, const uint8_t *buf, uint32_t length)
 {
     struct P_client chunk;
     int rc = 0;
@@ -147,7 +193,13 @@ static int dump__client_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint
 
     memset(&chunk, 0, sizeof(struct P_client));
 
-    if(db_version == 5){
+    if(buf){
+        rc = persist__chunk_client_parse_v5(buf, length, &chunk);
+        if(rc == 0){
+            chunk.client_id = dump__strndup(chunk.client_id, chunk.F.id_len);
+            if(!chunk.client_id) rc = 1;
+        }
+    }else if(db_version == 5){
         rc = persist__chunk_client_read_v5(db_fd, &chunk);
     }else{
         rc = persist__chunk_client_read_v234(db_fd, &chunk, db_version);
@@ -179,7 +231,7 @@ static int dump__client_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint
 }
 
 
-static int dump__client_msg_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint32_t length)
+static int dump__client_msg_chunk_process(struct mosquitto_db *db, FILE *db_fd, const uint8_t *buf, uint32_t length)
 {
     struct P_client_msg chunk;
     struct client_data *cc;
@@ -189,7 +241,9 @@ static int dump__client_msg_chunk_process(struct mosquitto_db *db, FILE *db_fd,
     client_msg_count++;
 
     memset(&chunk, 0, sizeof(struct P_client_msg));
-    if(db_version == 5){
+    if(buf){
+        rc = dump__client_msg_parse(buf, length, &chunk);
+    }else if(db_version == 5){
         rc = persist__chunk_client_msg_read_v5(db_fd, &chunk, length);
     }else{
         rc = persist__chunk_client_msg_read_v234(db_fd, &chunk);
@@ -221,7 +275,7 @@ static int dump__client_msg_chunk_process(struct mosquitto_db *db, FILE *db_fd,
 }
 
 
-static int dump__msg_store_chunk_process(struct mosquitto_db *db, FILE *db_fptr, uint32_t length)
+static int dump__msg_store_chunk_process(struct mosquitto_db *db, FILE *db_fptr, const uint8_t *buf, uint32_t length)
 {
     struct P_msg_store chunk;
     struct mosquitto_msg_store *stored = NULL;
@@ -234,7 +288,9 @@ static int dump__msg_store_chunk_process(struct mosquitto_db *db, FILE *db_fptr,
     msg_store_count++;
 
     memset(&chunk, 0, sizeof(struct P_msg_store));
-    if(db_version == 5){
+    if(buf){
+        rc = persist__chunk_msg_store_parse_v6(buf, length, &chunk);
+    }else if(db_version == 5){
         rc = persist__chunk_msg_store_read_v5(db_fptr, &chunk, length);
     }else{
         rc = persist__chunk_msg_store_read_v234(db_fptr, &chunk, db_version);
@@ -312,7 +368,7 @@ static int dump__msg_store_chunk_process(struct mosquitto_db *db, FILE *db_fptr,
 }
 
 
-static int dump__retain_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint32_t length)
+static int dump__retain_chunk_process(struct mosquitto_db *db, FILE *db_fd, const uint8_t *buf, uint32_t length)
 {
     struct P_retain chunk;
     int rc;
@@ -321,7 +377,9 @@ static int dump__retain_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint
     if(do_print) printf("DB_CHUNK_RETAIN:\n");
     if(do_print) printf("\tLength: %d\n", length);
 
-    if(db_version == 5){
+    if(buf){
+        rc = persist__chunk_retain_parse_v5(buf, length, &chunk);
+    }else if(db_version == 5){
         rc = persist__chunk_retain_read_v5(db_fd, &chunk);
     }else{
         rc = persist__chunk_retain_read_v234(db_fd, &chunk);
@@ -336,7 +394,7 @@ static int dump__retain_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint
 }
 
 
-static int dump__sub_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint32_t length)
+static int dump__sub_chunk_process(struct mosquitto_db *db, FILE *db_fd, const uint8_t *buf, uint32_t length)
 {
     int rc = 0;
     struct P_sub chunk;
@@ -345,7 +403,9 @@ static int dump__sub_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint32_
     sub_count++;
 
     memset(&chunk, 0, sizeof(struct P_sub));
-    if(db_version == 5){
+    if(buf){
+        rc = dump__sub_parse(buf, length, &chunk);
+    }else if(db_version == 5){
         rc = persist__chunk_sub_read_v5(db_fd, &chunk);
     }else{
         rc = persist__chunk_sub_read_v234(db_fd, &chunk);
@@ -373,6 +433,103 @@ static int dump__sub_chunk_process(struct mosquitto_db *db, FILE *db_fd, uint32_
 }
 
 
+/* Chunks that only appear in the persistence journal. */
+static int dump__delete_chunk_process(struct mosquitto_db *db, FILE *db_fd, const uint8_t *buf, int chunk_id, uint32_t length)
+{
+    struct P_client_msg client_msg_chunk;
+    struct P_retain retain_chunk;
+    struct P_sub sub_chunk;
+    char *str = NULL;
+    const char *sbuf;
+    uint16_t slen;
+    int rc = 0;
+
+    delete_count++;
+
+    switch(chunk_id){
+        case DB_CHUNK_CLIENT_DELETE:
+        case DB_CHUNK_RETAIN_DELETE:
+            if(buf){
+                rc = persist__chunk_string_parse_v5(buf, length, &sbuf, &slen);
+                if(rc == 0) str = dump__strndup(sbuf, slen);
+            }else{
+                rc = persist__read_string(db_fd, &str);
+            }
+            if(rc == 0 && str == NULL) rc = 1;
+            if(rc) break;
+            if(do_print){
+                if(chunk_id == DB_CHUNK_CLIENT_DELETE){
+                    printf("DB_CHUNK_CLIENT_DELETE:\n");
+                    printf("\tLength: %d\n", length);
+                    printf("\tClient ID: %s\n", str);
+                }else{
+                    printf("DB_CHUNK_RETAIN_DELETE:\n");
+                    printf("\tLength: %d\n", length);
+                    printf("\tTopic: %s\n", str);
+                }
+            }
+            free(str);
+            break;
+
+        case DB_CHUNK_CLIENT_MSG_DELETE:
+            memset(&client_msg_chunk, 0, sizeof(struct P_client_msg));
+            if(buf){
+                rc = dump__client_msg_parse(buf, length, &client_msg_chunk);
+            }else{
+                rc = persist__chunk_client_msg_read_v5(db_fd, &client_msg_chunk, length);
+            }
+            if(rc) break;
+            if(do_print){
+                printf("DB_CHUNK_CLIENT_MSG_DELETE:\n");
+                printf("\tLength: %d\n", length);
+                printf("\tClient ID: %s\n", client_msg_chunk.client_id);
+                printf("\tStore ID: %" PRIu64 "\n", client_msg_chunk.F.store_id);
+                printf("\tMID: %d\n", client_msg_chunk.F.mid);
+                printf("\tDirection: %d\n", client_msg_chunk.F.direction);
+            }
+            free__client_msg(&client_msg_chunk);
+            break;
+
+        case DB_CHUNK_MSG_STORE_DELETE:
+            if(buf){
+                rc = persist__chunk_retain_parse_v5(buf, length, &retain_chunk);
+            }else{
+                rc = persist__chunk_retain_read_v5(db_fd, &retain_chunk);
+            }
+            if(rc) break;
+            if(do_print){
+                printf("DB_CHUNK_MSG_STORE_DELETE:\n");
+                printf("\tLength: %d\n", length);
+                printf("\tStore ID: %" PRIu64 "\n", retain_chunk.F.store_id);
+            }
+            break;
+
+        case DB_CHUNK_SUB_DELETE:
+            memset(&sub_chunk, 0, sizeof(struct P_sub));
+            if(buf){
+                rc = dump__sub_parse(buf, length, &sub_chunk);
+            }else{
+                rc = persist__chunk_sub_read_v5(db_fd, &sub_chunk);
+            }
+            if(rc) break;
+            if(do_print){
+                printf("DB_CHUNK_SUB_DELETE:\n");
+                printf("\tLength: %d\n", length);
+                printf("\tClient ID: %s\n", sub_chunk.client_id);
+                printf("\tTopic: %s\n", sub_chunk.topic);
+            }
+            free__sub(&sub_chunk);
+            break;
+    }
+    if(rc){
+        fprintf(stderr, "Error: Corrupt persistent database.");
+        fclose(db_fd);
+        return 1;
+    }
+    return 0;
+}
+
+
 int main(int argc, char *argv[])
 {
     FILE *fd;
@@ -381,7 +538,11 @@ int main(int argc, char *argv[])
     uint32_t crc;
     uint32_t i32temp;
     int length;
+    uint32_t length6;
     int chunk;
+    uint8_t *buf = NULL;
+    const uint8_t *chunk_buf;
+    size_t buf_size = 0;
     struct mosquitto_db db;
     char *filename;
     struct client_data *cc, *cc_tmp;
@@ -417,38 +578,67 @@ int main(int argc, char *argv[])
             if(do_print) printf("Warning: mosquitto_db_dump does not support this DB version, continuing but expecting errors.\n");
         }
 
-        while(persist__chunk_header_read(fd, &chunk, &length) == MOSQ_ERR_SUCCESS){
+        while(1){
+            if(db_version >= 6){
+                rc = persist__chunk_read_v6(fd, &chunk, &length6, &buf, &buf_size);
+                if(rc == MOSQ_ERR_NOT_FOUND){
+                    rc = 0;
+                    break;
+                }else if(rc){
+                    fprintf(stderr, "Error: Persistent database is truncated or corrupt, a chunk failed its CRC check.\n");
+                    free(buf);
+                    fclose(fd);
+                    return 1;
+                }
+                length = length6;
+                chunk_buf = &buf[sizeof(struct PF_header)];
+            }else{
+                if(persist__chunk_header_read(fd, &chunk, &length) != MOSQ_ERR_SUCCESS) break;
+                chunk_buf = NULL;
+            }
+
             switch(chunk){
                 case DB_CHUNK_CFG:
-                    if(dump__cfg_chunk_process(&db, fd, length)) return 1;
+                    if(dump__cfg_chunk_process(&db, fd, chunk_buf, length)) return 1;
                     break;
 
                 case DB_CHUNK_MSG_STORE:
-                    if(dump__msg_store_chunk_process(&db, fd, length)) return 1;
+                    if(dump__msg_store_chunk_process(&db, fd, chunk_buf, length)) return 1;
                     break;
 
                 case DB_CHUNK_CLIENT_MSG:
-                    if(dump__client_msg_chunk_process(&db, fd, length)) return 1;
+                    if(dump__client_msg_chunk_process(&db, fd, chunk_buf, length)) return 1;
                     break;
 
                 case DB_CHUNK_RETAIN:
-                    if(dump__retain_chunk_process(&db, fd, length)) return 1;
+                    if(dump__retain_chunk_process(&db, fd, chunk_buf, length)) return 1;
                     break;
 
                 case DB_CHUNK_SUB:
-                    if(dump__sub_chunk_process(&db, fd, length)) return 1;
+                    if(dump__sub_chunk_process(&db, fd, chunk_buf, length)) return 1;
                     break;
 
                 case DB_CHUNK_CLIENT:
-                    if(dump__client_chunk_process(&db, fd, length)) return 1;
+                    if(dump__client_chunk_process(&db, fd, chunk_buf, length)) return 1;
+                    break;
+
+                case DB_CHUNK_CLIENT_DELETE:
+                case DB_CHUNK_CLIENT_MSG_DELETE:
+                case DB_CHUNK_MSG_STORE_DELETE:
+                case DB_CHUNK_RETAIN_DELETE:
+                case DB_CHUNK_SUB_DELETE:
+                    if(dump__delete_chunk_process(&db, fd, chunk_buf, chunk, length)) return 1;
                     break;
 
                 default:
                     fprintf(stderr, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.\n", chunk);
-                    fseek(fd, length, SEEK_CUR);
+                    if(!chunk_buf){
+                        fseek(fd, length, SEEK_CUR);
+                    }
                     break;
             }
         }
+        free(buf);
     }else{
         fprintf(stderr, "Error: Unrecognised file format.");
         rc = 1;
@@ -463,6 +653,7 @@ int main(int argc, char *argv[])
         printf("DB_CHUNK_RETAIN:     %ld\n", retain_count);
         printf("DB_CHUNK_SUB:        %ld\n", sub_count);
         printf("DB_CHUNK_CLIENT:     %ld\n", client_count);
+        printf("DB_CHUNK_*_DELETE:   %ld\n", delete_count);
     }
 
     if(client_stats){
@@ -3,6 +3,7 @@
 
 #include "mosquitto_broker_internal.h"
 #include "mosquitto_internal.h"
+#include "memory_mosq.h"
 
 struct mosquitto *context__init(struct mosquitto_db *db, mosq_sock_t sock)
 {
@@ -54,6 +55,11 @@ void *mosquitto__malloc(size_t len)
     return malloc(len);
 }
 
+void *mosquitto__realloc(void *ptr, size_t len)
+{
+    return realloc(ptr, len);
+}
+
 char *mosquitto__strdup(const char *s)
 {
     return strdup(s);
@@ -79,7 +85,60 @@ int sub__add(struct mosquitto_db *db, struct mosquitto *context, const char *sub
     return 0;
 }
 
+struct mosquitto__subhier *sub__add_hier(struct mosquitto_db *db, const char *sub)
+{
+    return NULL;
+}
+
+int sub__add_restored(struct mosquitto_db *db, struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier)
+{
+    return 0;
+}
+
 int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store **stored)
 {
     return 0;
 }
+
+void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool do_free)
+{
+}
+
+void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store)
+{
+}
+
+struct mosquitto_db *mosquitto__get_db(void)
+{
+    return NULL;
+}
+
+struct mosquitto__pool client_msg_pool = MOSQUITTO__POOL_INIT("client messages", struct mosquitto_client_msg);
+
+void *mosquitto__pool_calloc(struct mosquitto__pool *pool)
+{
+    return calloc(1, pool->size);
+}
+
+void mosquitto__pool_free(struct mosquitto__pool *pool, void *mem)
+{
+    free(mem);
+}
+
+ssize_t net__writev(struct mosquitto *mosq, struct iovec *iov, int iovcnt)
+{
+    return 0;
+}
+
+int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct mosquitto__subhier *root, uint8_t *reason)
+{
+    return 0;
+}
+
+void sub__retain_clear(struct mosquitto_db *db, const char *topic)
+{
+}
+
+void worker__wake(struct mosquitto *context)
+{
+}
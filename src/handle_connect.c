@@ -23,6 +23,8 @@ Contributors:
 #include "mosquitto_broker_internal.h"
 #include "mqtt_protocol.h"
 #include "memory_mosq.h"
+#include "mid_index_mosq.h"
+#include "msg_queue.h"
 #include "packet_mosq.h"
 #include "property_mosq.h"
 #include "send_mosq.h"
@@ -82,23 +84,52 @@ static char *client_id_gen(int *idlen, const char *auto_id_prefix, int auto_id_p
     return client_id;
 }
 
+static bool connection_msg_allowed(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+    if(msg->direction != mosq_md_out){
+        return true;
+    }
+    return mosquitto_acl_check(db, context, msg->store->topic,
+            msg->store->payloadlen, UHPA_ACCESS(msg->store->payload, msg->store->payloadlen),
+            msg->store->qos, msg->store->retain, MOSQ_ACL_READ) == MOSQ_ERR_SUCCESS;
+}
+
+
+static void connection_msg_free(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+#ifdef WITH_PERSISTENCE
+    persist__journal_client_msg_delete(db, context, msg);
+#endif
+    db__msg_store_ref_dec(db, &msg->store);
+    mosquitto_property_free_all(&msg->properties);
+    mosquitto__pool_free(&client_msg_pool, msg);
+}
+
+
 /* Remove any queued messages that are no longer allowed through ACL,
  * assuming a possible change of username. */
-void connection_check_acl(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg **head)
+void connection_check_acl(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_data *msg_data)
 {
     struct mosquitto_client_msg *msg_tail, *tmp;
+    int i, count;
 
-    DL_FOREACH_SAFE((*head), msg_tail, tmp){
-        if(msg_tail->direction == mosq_md_out){
-            if(mosquitto_acl_check(db, context, msg_tail->store->topic,
-                                   msg_tail->store->payloadlen, UHPA_ACCESS(msg_tail->store->payload, msg_tail->store->payloadlen),
-                                   msg_tail->store->qos, msg_tail->store->retain, MOSQ_ACL_READ) != MOSQ_ERR_SUCCESS){
+    DL_FOREACH_SAFE(msg_data->inflight, msg_tail, tmp){
+        if(!connection_msg_allowed(db, context, msg_tail)){
+            mid_index__remove(&msg_data->inflight_index, msg_tail->mid, msg_tail);
+            DL_DELETE(msg_data->inflight, msg_tail);
+            connection_msg_free(db, context, msg_tail);
+        }
+    }
 
-                DL_DELETE((*head), msg_tail);
-                db__msg_store_ref_dec(db, &msg_tail->store);
-                mosquitto_property_free_all(&msg_tail->properties);
-                mosquitto__free(msg_tail);
-            }
+    /* Go once round the queue, putting back the messages that are kept, so
+     * the order is unchanged. Pushing can't fail straight after a pop. */
+    count = msg_data->queued.count;
+    for(i=0; i<count; i++){
+        msg_tail = msg_queue__pop(&msg_data->queued);
+        if(connection_msg_allowed(db, context, msg_tail)){
+            msg_queue__push(&msg_data->queued, msg_tail);
+        }else{
+            connection_msg_free(db, context, msg_tail);
         }
     }
 }
@@ -133,8 +164,9 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
                 connect_ack |= 0x01;
             }
 
-            if(found_context->msgs_in.inflight || found_context->msgs_in.queued
-                    || found_context->msgs_out.inflight || found_context->msgs_out.queued){
+            if(found_context->msgs_in.inflight || found_context->msgs_in.queued.count
+                    || found_context->msgs_out.inflight || found_context->msgs_out.queued.count
+                    || found_context->msgs_out.spilled.count){
 
                 memcpy(&context->msgs_in, &found_context->msgs_in, sizeof(struct mosquitto_msg_data));
                 memcpy(&context->msgs_out, &found_context->msgs_out, sizeof(struct mosquitto_msg_data));
@@ -166,6 +198,12 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
         if(context->clean_start == true){
             sub__clean_session(db, found_context);
         }
+#ifdef WITH_PERSISTENCE
+        if(context->clean_start == true || found_context->session_expiry_interval == 0){
+            /* The old session is not being taken over. */
+            persist__journal_client_delete(db, found_context);
+        }
+#endif
         session_expiry__remove(found_context);
         will_delay__remove(found_context);
         will__clear(found_context);
@@ -181,6 +219,7 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
         free(auth_data_out);
         return rc;
     }
+    acl__cache_init(db, context);
 
     if(db->config->connection_messages == true){
         if(context->is_bridge){
@@ -216,16 +255,15 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
     context->ping_t = 0;
     context->is_dropping = false;
 
-    connection_check_acl(db, context, &context->msgs_in.inflight);
-    connection_check_acl(db, context, &context->msgs_in.queued);
-    connection_check_acl(db, context, &context->msgs_out.inflight);
-    connection_check_acl(db, context, &context->msgs_out.queued);
+    connection_check_acl(db, context, &context->msgs_in);
+    connection_check_acl(db, context, &context->msgs_out);
 
     HASH_ADD_KEYPTR(hh_id, db->contexts_by_id, context->id, strlen(context->id), context);
 
 #ifdef WITH_PERSISTENCE
     if(!context->clean_start){
         db->persistence_changes++;
+        persist__journal_client(db, context);
     }
 #endif
     context->maximum_qos = context->listener->maximum_qos;
@@ -245,6 +283,7 @@ int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, v
         }
         if(context->keepalive > db->config->max_keepalive){
             context->keepalive = db->config->max_keepalive;
+            keepalive__add(context);
             if(mosquitto_property_add_int16(&connack_props, MQTT_PROP_SERVER_KEEP_ALIVE, context->keepalive)){
                 rc = MOSQ_ERR_NOMEM;
                 goto error;
@@ -363,6 +402,137 @@ error_cleanup:
 
 
 
+static void connect__will_free(struct mosquitto_message_all *will_struct)
+{
+    if(will_struct){
+        mosquitto_property_free_all(&will_struct->properties);
+        mosquitto__free(will_struct->msg.payload);
+        mosquitto__free(will_struct->msg.topic);
+        mosquitto__free(will_struct);
+    }
+}
+
+
+static int connect__unpwd_failed(struct mosquitto_db *db, struct mosquitto *context, int rc)
+{
+    if(rc == MOSQ_ERR_AUTH){
+        if(context->protocol == mosq_p_mqtt5){
+            send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
+        }else{
+            send__connack(db, context, 0, CONNACK_REFUSED_NOT_AUTHORIZED, NULL);
+        }
+    }
+    context__disconnect(db, context);
+    return 1;
+}
+
+
+/* The rest of handling CONNECT once the client has passed the username and
+ * password check. Takes ownership of client_id, will_struct and auth_data. */
+static int connect__finish(struct mosquitto_db *db, struct mosquitto *context, char *client_id, uint8_t clean_start, struct mosquitto_message_all *will_struct, void *auth_data, uint16_t auth_data_len)
+{
+    void *auth_data_out = NULL;
+    uint16_t auth_data_out_len = 0;
+    int rc;
+
+    if(context->listener->use_username_as_clientid){
+        if(context->username){
+            mosquitto__free(client_id);
+            client_id = mosquitto__strdup(context->username);
+            if(!client_id){
+                rc = MOSQ_ERR_NOMEM;
+                goto error;
+            }
+        }else{
+            if(context->protocol == mosq_p_mqtt5){
+                send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
+            }else{
+                send__connack(db, context, 0, CONNACK_REFUSED_NOT_AUTHORIZED, NULL);
+            }
+            rc = 1;
+            goto error;
+        }
+    }
+    context->clean_start = clean_start;
+    context->id = client_id;
+    context->will = will_struct;
+
+    if(context->auth_method){
+        /* 如果有扩展认证，则开始扩展认证过程 */
+        rc = mosquitto_security_auth_start(db, context, false, auth_data, auth_data_len, &auth_data_out, &auth_data_out_len);
+        mosquitto__free(auth_data);
+        if(rc == MOSQ_ERR_SUCCESS){
+            /* 认证成功，则回复CONNACK报文 */
+            return connect__on_authorised(db, context, auth_data_out, auth_data_out_len);
+        }else if(rc == MOSQ_ERR_AUTH_CONTINUE){
+            /* 设置状态为“认证中”，并回复AUTH报文 */
+            mosquitto__set_state(context, mosq_cs_authenticating);
+            rc = send__auth(db, context, MQTT_RC_CONTINUE_AUTHENTICATION, auth_data_out, auth_data_out_len);
+            free(auth_data_out);
+            return rc;
+        }else{
+            /* 认证失败 */
+            free(auth_data_out);
+            will__clear(context);
+            if(rc == MOSQ_ERR_AUTH){
+                send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
+                mosquitto__free(context->id);
+                context->id = NULL;
+                return MOSQ_ERR_PROTOCOL;
+            }else if(rc == MOSQ_ERR_NOT_SUPPORTED){
+                /* Client has requested extended authentication, but we don't support it. */
+                send__connack(db, context, 0, MQTT_RC_BAD_AUTHENTICATION_METHOD, NULL);
+                mosquitto__free(context->id);
+                context->id = NULL;
+                return MOSQ_ERR_PROTOCOL;
+            }else{
+                mosquitto__free(context->id);
+                context->id = NULL;
+                return rc;
+            }
+        }
+    }else{
+        /* 没有扩展认证时，直接回复CONNACK报文 */
+        return connect__on_authorised(db, context, NULL, 0);
+    }
+
+error:
+    mosquitto__free(auth_data);
+    mosquitto__free(client_id);
+    connect__will_free(will_struct);
+    return rc;
+}
+
+
+/* Carry on with a CONNECT that was held for a plugin's username and password
+ * check. */
+int connect__pending(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__plugin_pending *pending)
+{
+    char *client_id;
+    struct mosquitto_message_all *will_struct;
+    void *auth_data;
+
+    if(pending->result != MOSQ_ERR_SUCCESS){
+        return connect__unpwd_failed(db, context, pending->result);
+    }
+
+    context->username = pending->username;
+    context->password = pending->password;
+    client_id = pending->client_id;
+    will_struct = pending->will;
+    auth_data = pending->auth_data;
+
+    /* All now belong to the context or connect__finish() */
+    pending->username = NULL;
+    pending->password = NULL;
+    pending->client_id = NULL;
+    pending->will = NULL;
+    pending->auth_data = NULL;
+
+    return connect__finish(db, context, client_id, pending->clean_start, will_struct, auth_data, pending->auth_data_len);
+}
+
+
 int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
 {
     char protocol_name[7];
@@ -379,8 +549,7 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
     mosquitto_property *properties = NULL;
     void *auth_data = NULL;
     uint16_t auth_data_len = 0;
-    void *auth_data_out = NULL;
-    uint16_t auth_data_out_len = 0;
+    struct mosquitto__plugin_pending *pending;
 #ifdef WITH_TLS
     int i;
     X509 *client_cert = NULL;
@@ -389,7 +558,7 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
     ASN1_STRING *name_asn1 = NULL;
 #endif
 
-    G_CONNECTION_COUNT_INC();
+    G_CONNECTION_COUNT_INC(context);
 
     if(!context->listener){
         return MOSQ_ERR_INVAL;
@@ -518,6 +687,7 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
         rc = 1;
         goto handle_connect_error;
     }
+    keepalive__add(context);
 
     if(protocol_version == PROTOCOL_VERSION_v5){
         /* 读取CONNECT报文中的所有属性 */
@@ -791,19 +961,30 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
             switch(rc){
                 case MOSQ_ERR_SUCCESS:
                     break;
-                case MOSQ_ERR_AUTH:
-                    if(context->protocol == mosq_p_mqtt5){
-                        send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
-                    }else{
-                        send__connack(db, context, 0, CONNACK_REFUSED_NOT_AUTHORIZED, NULL);
+                case MOSQ_ERR_PLUGIN_PENDING:
+#ifdef WITH_WEBSOCKETS
+                    if(context->wsi){
+                        /* Websockets clients can't have their reads paused. */
+                        log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Auth plugin returned pending for a password check on a websockets client, denying access.");
+                        rc = connect__unpwd_failed(db, context, MOSQ_ERR_AUTH);
+                        goto handle_connect_error;
                     }
-                    context__disconnect(db, context);
-                    rc = 1;
-                    goto handle_connect_error;
-                    break;
+#endif
+                    pending = plugin__pending_new(context, plugin_pending_unpwd);
+                    if(!pending){
+                        rc = MOSQ_ERR_NOMEM;
+                        goto handle_connect_error;
+                    }
+                    pending->client_id = client_id;
+                    pending->username = username;
+                    pending->password = password;
+                    pending->will = will_struct;
+                    pending->auth_data = auth_data;
+                    pending->auth_data_len = auth_data_len;
+                    pending->clean_start = clean_start;
+                    return MOSQ_ERR_SUCCESS;
                 default:
-                    context__disconnect(db, context);
-                    rc = 1;
+                    rc = connect__unpwd_failed(db, context, rc);
                     goto handle_connect_error;
                     break;
             }
@@ -828,79 +1009,14 @@ int handle__connect(struct mosquitto_db *db, struct mosquitto *context)
     }
 #endif
 
-    if(context->listener->use_username_as_clientid){
-        if(context->username){
-            mosquitto__free(client_id);
-            client_id = mosquitto__strdup(context->username);
-            if(!client_id){
-                rc = MOSQ_ERR_NOMEM;
-                goto handle_connect_error;
-            }
-        }else{
-            if(context->protocol == mosq_p_mqtt5){
-                send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
-            }else{
-                send__connack(db, context, 0, CONNACK_REFUSED_NOT_AUTHORIZED, NULL);
-            }
-            rc = 1;
-            goto handle_connect_error;
-        }
-    }
-    context->clean_start = clean_start;
-    context->id = client_id;
-    context->will = will_struct;
-
-    if(context->auth_method){
-        /* 如果有扩展认证，则开始扩展认证过程 */
-        rc = mosquitto_security_auth_start(db, context, false, auth_data, auth_data_len, &auth_data_out, &auth_data_out_len);
-        mosquitto__free(auth_data);
-        if(rc == MOSQ_ERR_SUCCESS){
-            /* 认证成功，则回复CONNACK报文 */
-            return connect__on_authorised(db, context, auth_data_out, auth_data_out_len);
-        }else if(rc == MOSQ_ERR_AUTH_CONTINUE){
-            /* 设置状态为“认证中”，并回复AUTH报文 */
-            mosquitto__set_state(context, mosq_cs_authenticating);
-            rc = send__auth(db, context, MQTT_RC_CONTINUE_AUTHENTICATION, auth_data_out, auth_data_out_len);
-            free(auth_data_out);
-            return rc;
-        }else{
-            /* 认证失败 */
-            free(auth_data_out);
-            will__clear(context);
-            if(rc == MOSQ_ERR_AUTH){
-                send__connack(db, context, 0, MQTT_RC_NOT_AUTHORIZED, NULL);
-                mosquitto__free(context->id);
-                context->id = NULL;
-                return MOSQ_ERR_PROTOCOL;
-            }else if(rc == MOSQ_ERR_NOT_SUPPORTED){
-                /* Client has requested extended authentication, but we don't support it. */
-                send__connack(db, context, 0, MQTT_RC_BAD_AUTHENTICATION_METHOD, NULL);
-                mosquitto__free(context->id);
-                context->id = NULL;
-                return MOSQ_ERR_PROTOCOL;
-            }else{
-                mosquitto__free(context->id);
-                context->id = NULL;
-                return rc;
-            }
-        }
-    }else{
-        /* 没有扩展认证时，直接回复CONNACK报文 */
-        return connect__on_authorised(db, context, NULL, 0);
-    }
-
+    return connect__finish(db, context, client_id, clean_start, will_struct, auth_data, auth_data_len);
 
 handle_connect_error:
     mosquitto__free(auth_data);
     mosquitto__free(client_id);
     mosquitto__free(username);
     mosquitto__free(password);
-    if(will_struct){
-        mosquitto_property_free_all(&will_struct->properties);
-        mosquitto__free(will_struct->msg.payload);
-        mosquitto__free(will_struct->msg.topic);
-        mosquitto__free(will_struct);
-    }
+    connect__will_free(will_struct);
 #ifdef WITH_TLS
     if(client_cert) X509_free(client_cert);
 #endif
@@ -32,6 +32,104 @@ Contributors:
 #include "util_mosq.h"
 
 
+static int publish__bad_message(struct mosquitto *context, uint8_t qos, uint16_t mid, uint8_t reason_code)
+{
+    switch(qos){
+        case 0:
+            return MOSQ_ERR_SUCCESS;
+        case 1:
+            return send__puback(context, mid, reason_code);
+        case 2:
+            if(context->protocol == mosq_p_mqtt5){
+                return send__pubrec(context, mid, reason_code);
+            }else{
+                return send__pubrec(context, mid, 0);
+            }
+    }
+    return 1;
+}
+
+
+/* Everything after the ACL check, rc is its result. Takes ownership of topic,
+ * payload and msg_properties. */
+static int publish__process(struct mosquitto_db *db, struct mosquitto *context, int rc, char *topic, mosquitto__payload_uhpa *payload, uint32_t payloadlen, uint8_t dup, uint8_t qos, uint8_t retain, uint16_t mid, uint32_t message_expiry_interval, mosquitto_property *msg_properties)
+{
+    struct mosquitto_msg_store *stored = NULL;
+    uint8_t reason_code = 0;
+    int rc2;
+    int res = 0;
+
+    if(rc == MOSQ_ERR_ACL_DENIED){
+        log__printf(NULL, MOSQ_LOG_DEBUG, "Denied PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+        reason_code = MQTT_RC_NOT_AUTHORIZED;
+        goto process_bad_message;
+    }else if(rc != MOSQ_ERR_SUCCESS){
+        mosquitto__free(topic);
+        UHPA_FREE(*payload, payloadlen);
+        mosquitto_property_free_all(&msg_properties);
+        return rc;
+    }
+
+    log__printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
+    if(qos > 0){
+        db__message_store_find(context, mid, &stored);
+    }
+    if(!stored){
+        dup = 0;
+        if(db__message_store(db, context, mid, topic, qos, payloadlen, payload, retain, &stored, message_expiry_interval, msg_properties, 0, mosq_mo_client)){
+            mosquitto_property_free_all(&msg_properties);
+            return 1;
+        }
+        msg_properties = NULL; /* Now belongs to db__message_store() */
+    }else{
+        mosquitto__free(topic);
+        topic = stored->topic;
+        dup = 1;
+        mosquitto_property_free_all(&msg_properties);
+        UHPA_FREE(*payload, payloadlen);
+    }
+
+    switch(qos){
+        case 0:
+            rc2 = sub__messages_queue(db, context->id, topic, qos, retain, &stored);
+            if(rc2 > 0) rc = 1;
+            break;
+        case 1:
+            util__decrement_receive_quota(context);
+            rc2 = sub__messages_queue(db, context->id, topic, qos, retain, &stored);
+            if(rc2 == MOSQ_ERR_SUCCESS || context->protocol != mosq_p_mqtt5){
+                if(send__puback(context, mid, 0)) rc = 1;
+            }else if(rc2 == MOSQ_ERR_NO_SUBSCRIBERS){
+                if(send__puback(context, mid, MQTT_RC_NO_MATCHING_SUBSCRIBERS)) rc = 1;
+            }else{
+                rc = rc2;
+            }
+            break;
+        case 2:
+            if(dup == 0){
+                res = db__message_insert(db, context, mid, mosq_md_in, qos, retain, stored, NULL);
+            }else{
+                res = 0;
+            }
+            /* db__message_insert() returns 2 to indicate dropped message
+             * due to queue. This isn't an error so don't disconnect them. */
+            if(!res){
+                if(send__pubrec(context, mid, 0)) rc = 1;
+            }else if(res == 1){
+                rc = 1;
+            }
+            break;
+    }
+
+    return rc;
+process_bad_message:
+    mosquitto__free(topic);
+    UHPA_FREE(*payload, payloadlen);
+    mosquitto_property_free_all(&msg_properties);
+    return publish__bad_message(context, qos, mid, reason_code);
+}
+
+
 int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 {
     char *topic;
@@ -40,10 +138,7 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
     uint8_t dup, qos, retain;
     uint16_t mid = 0;
     int rc = 0;
-    int rc2;
     uint8_t header = context->in_packet.command;
-    int res = 0;
-    struct mosquitto_msg_store *stored = NULL;
     int len;
     int slen;
     char *topic_mount;
@@ -52,7 +147,7 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
     mosquitto_property *msg_properties = NULL, *msg_properties_last;
     uint32_t message_expiry_interval = 0;
     int topic_alias = -1;
-    uint8_t reason_code = 0;
+    struct mosquitto__plugin_pending *pending;
 
 #ifdef WITH_BRIDGE
     char *topic_temp;
@@ -182,6 +277,7 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
                 mosquitto__free(topic);
                 return rc;
             }
+            slen = strlen(topic);
         }
     }
     if(mosquitto_validate_utf8(topic, slen) != MOSQ_ERR_SUCCESS){
@@ -215,6 +311,7 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
                             }
                             mosquitto__free(topic);
                             topic = topic_temp;
+                            slen = strlen(topic);
                         }
                     }
 
@@ -231,6 +328,7 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
 
                         mosquitto__free(topic);
                         topic = topic_temp;
+                        slen = strlen(topic);
                     }
                     break;
                 }
@@ -238,7 +336,7 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
         }
     }
 #endif
-    if(mosquitto_pub_topic_check(topic) != MOSQ_ERR_SUCCESS){
+    if(mosquitto_pub_topic_check2(topic, slen) != MOSQ_ERR_SUCCESS){
         /* Invalid publish topic, just swallow it. */
         mosquitto__free(topic);
         return 1;
@@ -264,8 +362,9 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
     if(payloadlen){
         if(db->config->message_size_limit && payloadlen > db->config->message_size_limit){
             log__printf(NULL, MOSQ_LOG_DEBUG, "Dropped too large PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
-            reason_code = MQTT_RC_IMPLEMENTATION_SPECIFIC;
-            goto process_bad_message;
+            mosquitto__free(topic);
+            mosquitto_property_free_all(&msg_properties);
+            return publish__bad_message(context, qos, mid, MQTT_RC_IMPLEMENTATION_SPECIFIC);
         }
         if(UHPA_ALLOC(payload, payloadlen) == 0){
             mosquitto__free(topic);
@@ -282,85 +381,43 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context)
     }
 
     /* Check for topic access */
-    rc = mosquitto_acl_check(db, context, topic, payloadlen, UHPA_ACCESS(payload, payloadlen), qos, retain, MOSQ_ACL_WRITE);
-    if(rc == MOSQ_ERR_ACL_DENIED){
-        log__printf(NULL, MOSQ_LOG_DEBUG, "Denied PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
-            reason_code = MQTT_RC_NOT_AUTHORIZED;
-        goto process_bad_message;
-    }else if(rc != MOSQ_ERR_SUCCESS){
-        mosquitto__free(topic);
-        UHPA_FREE(payload, payloadlen);
-        mosquitto_property_free_all(&msg_properties);
-        return rc;
-    }
-
-    log__printf(NULL, MOSQ_LOG_DEBUG, "Received PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, qos, retain, mid, topic, (long)payloadlen);
-    if(qos > 0){
-        db__message_store_find(context, mid, &stored);
-    }
-    if(!stored){
-        dup = 0;
-        if(db__message_store(db, context, mid, topic, qos, payloadlen, &payload, retain, &stored, message_expiry_interval, msg_properties, 0, mosq_mo_client)){
+    rc = mosquitto_acl_check_publish(db, context, topic, payloadlen, UHPA_ACCESS(payload, payloadlen), qos, retain);
+    if(rc == MOSQ_ERR_PLUGIN_PENDING){
+        pending = plugin__pending_new(context, plugin_pending_acl);
+        if(!pending){
+            mosquitto__free(topic);
+            UHPA_FREE(payload, payloadlen);
             mosquitto_property_free_all(&msg_properties);
-            return 1;
+            return MOSQ_ERR_NOMEM;
         }
-        msg_properties = NULL; /* Now belongs to db__message_store() */
-    }else{
-        mosquitto__free(topic);
-        topic = stored->topic;
-        dup = 1;
-        mosquitto_property_free_all(&msg_properties);
-        UHPA_FREE(payload, payloadlen);
+        pending->topic = topic;
+        UHPA_MOVE(pending->payload, payload, payloadlen);
+        pending->payloadlen = payloadlen;
+        pending->properties = msg_properties;
+        pending->message_expiry_interval = message_expiry_interval;
+        pending->mid = mid;
+        pending->dup = dup;
+        pending->qos = qos;
+        pending->retain = retain;
+        return MOSQ_ERR_SUCCESS;
     }
+    return publish__process(db, context, rc, topic, &payload, payloadlen, dup, qos, retain, mid, message_expiry_interval, msg_properties);
+}
 
-    switch(qos){
-        case 0:
-            rc2 = sub__messages_queue(db, context->id, topic, qos, retain, &stored);
-            if(rc2 > 0) rc = 1;
-            break;
-        case 1:
-            util__decrement_receive_quota(context);
-            rc2 = sub__messages_queue(db, context->id, topic, qos, retain, &stored);
-            if(rc2 == MOSQ_ERR_SUCCESS || context->protocol != mosq_p_mqtt5){
-                if(send__puback(context, mid, 0)) rc = 1;
-            }else if(rc2 == MOSQ_ERR_NO_SUBSCRIBERS){
-                if(send__puback(context, mid, MQTT_RC_NO_MATCHING_SUBSCRIBERS)) rc = 1;
-            }else{
-                rc = rc2;
-            }
-            break;
-        case 2:
-            if(dup == 0){
-                res = db__message_insert(db, context, mid, mosq_md_in, qos, retain, stored, NULL);
-            }else{
-                res = 0;
-            }
-            /* db__message_insert() returns 2 to indicate dropped message
-             * due to queue. This isn't an error so don't disconnect them. */
-            if(!res){
-                if(send__pubrec(context, mid, 0)) rc = 1;
-            }else if(res == 1){
-                rc = 1;
-            }
-            break;
-    }
 
+/* Carry on with a PUBLISH that was held for a plugin's ACL check. */
+int handle__publish_pending(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__plugin_pending *pending)
+{
+    int rc;
+
+    rc = publish__process(db, context, pending->result, pending->topic, &pending->payload, pending->payloadlen,
+            pending->dup, pending->qos, pending->retain, pending->mid,
+            pending->message_expiry_interval, pending->properties);
+
+    /* All now belong to publish__process() */
+    pending->topic = NULL;
+    pending->payloadlen = 0;
+    pending->properties = NULL;
     return rc;
-process_bad_message:
-    mosquitto__free(topic);
-    UHPA_FREE(payload, payloadlen);
-    switch(qos){
-        case 0:
-            return MOSQ_ERR_SUCCESS;
-        case 1:
-            return send__puback(context, mid, reason_code);
-        case 2:
-            if(context->protocol == mosq_p_mqtt5){
-                return send__pubrec(context, mid, reason_code);
-            }else{
-                return send__pubrec(context, mid, 0);
-            }
-    }
-    return 1;
 }
 
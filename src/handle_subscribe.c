@@ -94,7 +94,7 @@ int handle__subscribe(struct mosquitto_db *db, struct mosquitto *context)
                 mosquitto__free(payload);
                 return 1;
             }
-            if(mosquitto_sub_topic_check(sub)){
+            if(mosquitto_sub_topic_check2(sub, slen)){
                 log__printf(NULL, MOSQ_LOG_INFO,
                         "Invalid subscription string from %s, disconnecting.",
                         context->address);
@@ -87,7 +87,7 @@ int handle__unsubscribe(struct mosquitto_db *db, struct mosquitto *context)
             mosquitto__free(reason_codes);
             return 1;
         }
-        if(mosquitto_sub_topic_check(sub)){
+        if(mosquitto_sub_topic_check2(sub, slen)){
             log__printf(NULL, MOSQ_LOG_INFO,
                     "Invalid unsubscription string from %s, disconnecting.",
                     context->id);
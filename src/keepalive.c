@@ -0,0 +1,65 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <time.h>
+
+#include "mosquitto_broker_internal.h"
+#include "time_mosq.h"
+
+/* Receiving a packet only updates last_msg_in, so the keepalive timer gives
+ * the earliest time the client could have expired. When it fires the real
+ * expiry time is checked and the client either disconnected or the timer moved
+ * on. */
+
+static time_t keepalive__expiry(struct mosquitto *context)
+{
+    return context->last_msg_in + (time_t)(context->keepalive)*3/2;
+}
+
+
+static void keepalive__expire(struct mosquitto_db *db, struct mosquitto__timer *timer)
+{
+    struct mosquitto *context = timer->data;
+
+    if(context->sock == INVALID_SOCKET || context->keepalive == 0){
+        return;
+    }
+    if(mosquitto_time() > keepalive__expiry(context)){
+        /* Client has exceeded keepalive*1.5 */
+        do_disconnect(db, context, MOSQ_ERR_KEEPALIVE);
+    }else{
+        timer__add(&context->keepalive_timer, keepalive__expiry(context)+1, keepalive__expire, context);
+    }
+}
+
+
+void keepalive__add(struct mosquitto *context)
+{
+    /* Local bridges never time out in this fashion. */
+    if(context->sock == INVALID_SOCKET || context->keepalive == 0 || context->bridge){
+        timer__remove(&context->keepalive_timer);
+        return;
+    }
+    timer__add(&context->keepalive_timer, keepalive__expiry(context)+1, keepalive__expire, context);
+}
+
+
+void keepalive__remove(struct mosquitto *context)
+{
+    timer__remove(&context->keepalive_timer);
+}
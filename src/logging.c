@@ -15,9 +15,14 @@ Contributors:
 */
 #include "config.h"
 
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include <syslog.h>
 
@@ -34,6 +39,10 @@ Contributors:
 
 extern struct mosquitto_db int_db;
 
+/* See worker.c */
+#undef pthread_create
+#undef pthread_join
+
 /* Options for logging should be:
  *
  * A combination of:
@@ -46,30 +55,101 @@ extern struct mosquitto_db int_db;
 /* Give option of logging timestamp.
  * Logging pid.
  */
+
+/* With log_queue_size set, log__printf() only formats the message in to a
+ * free entry of a ring buffer and returns. A log thread empties the ring and
+ * does the writing to stdout, stderr, the log file and syslog, so none of it
+ * holds up the thread that logged the message. Reserving an entry is a single
+ * compare and swap, so any thread can log without taking a lock, including
+ * plugin threads. If the ring is full the message is dropped and counted, the
+ * log thread reports how many were dropped.
+ *
+ * Publishing to $SYS/broker/log/# needs db_mutex, so the log thread passes
+ * those messages on through a second ring that the main loop empties.
+ *
+ * Without log_queue_size, and in the child of a background save, messages are
+ * written straight away as before.
+ */
+
+#define LOG_MSG_MAX 1024
+#define LOG_TYPE_COUNT 32
+
+/* Where a message to be written should go for log_dest topic. */
+#define LOG_TOPIC_PUBLISH 0
+#define LOG_TOPIC_QUEUE 1
+#define LOG_TOPIC_NONE 2
+
+struct log__entry{
+    uint64_t seq;
+    time_t time;
+    int priority;
+    char msg[LOG_MSG_MAX];
+};
+
+/* A bounded queue for any number of writers and one reader. The seq of each
+ * entry says whether it is free for the writer at that position, or ready for
+ * the reader. */
+struct log__ring{
+    struct log__entry *entries;
+    uint64_t mask;
+    uint64_t head;
+    uint64_t tail;
+};
+
+/* Messages allowed for one log type in the current second. */
+struct log__limit{
+    time_t window;
+    unsigned int count;
+    unsigned int suppressed;
+};
+
 static int log_destinations = MQTT3_LOG_STDERR;
 static int log_priorities = MOSQ_LOG_ERR | MOSQ_LOG_WARNING | MOSQ_LOG_NOTICE | MOSQ_LOG_INFO;
+static unsigned int log_rate_limit = 0;
+
+static struct log__ring log_ring;
+static struct log__ring topic_ring;
+static pthread_t log_thread;
+static bool log_async = false;
+static bool log_stop = false;
+static bool log_sleeping = false;
+static int log_wakefd = -1;
+static bool atfork_set = false;
+
+static struct log__limit log_limits[LOG_TYPE_COUNT];
+static unsigned long dropped_queue_full = 0;
+static unsigned long dropped_rate_limit = 0;
 
 #ifdef WITH_DLT
 static DltContext dltContext;
 #endif
 
-static int get_time(struct tm **ti)
+#ifdef WITH_DLT
+DltLogLevelType get_dlt_level(int priority)
 {
-#if defined(__APPLE__)
-    struct timeval tv;
-#else
-    struct timespec ts;
+    switch (priority) {
+        case MOSQ_LOG_ERR:
+            return DLT_LOG_ERROR;
+        case MOSQ_LOG_WARNING:
+            return DLT_LOG_WARN;
+        case MOSQ_LOG_INFO:
+            return DLT_LOG_INFO;
+        case MOSQ_LOG_DEBUG:
+            return DLT_LOG_DEBUG;
+        case MOSQ_LOG_NOTICE:
+        case MOSQ_LOG_SUBSCRIBE:
+        case MOSQ_LOG_UNSUBSCRIBE:
+            return DLT_LOG_VERBOSE;
+        default:
+            return DLT_LOG_DEFAULT;
+    }
+}
 #endif
-    time_t s;
 
-    if(clock_gettime(CLOCK_REALTIME, &ts) != 0){
-        fprintf(stderr, "Error obtaining system time.\n");
-        return 1;
-    }
-    s = ts.tv_sec;
 
-    *ti = localtime(&s);
-    if(!(*ti)){
+static int get_time(time_t now, struct tm *ti)
+{
+    if(!localtime_r(&now, ti)){
         fprintf(stderr, "Error obtaining system time.\n");
         return 1;
     }
@@ -78,12 +158,474 @@ static int get_time(struct tm **ti)
 }
 
 
+static int ring__init(struct log__ring *ring, int size)
+{
+    uint64_t count = 1;
+    uint64_t i;
+
+    while(count < (uint64_t)size){
+        count <<= 1;
+    }
+    ring->entries = mosquitto__calloc(count, sizeof(struct log__entry));
+    if(!ring->entries) return MOSQ_ERR_NOMEM;
+
+    for(i=0; i<count; i++){
+        ring->entries[i].seq = i;
+    }
+    ring->mask = count-1;
+    ring->head = 0;
+    ring->tail = 0;
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static void ring__cleanup(struct log__ring *ring)
+{
+    mosquitto__free(ring->entries);
+    memset(ring, 0, sizeof(struct log__ring));
+}
+
+
+/* Can be called from any thread. Returns an entry to fill in and hand over
+ * with ring__commit(), or NULL if the ring is full. */
+static struct log__entry *ring__reserve(struct log__ring *ring, uint64_t *pos)
+{
+    struct log__entry *entry;
+    uint64_t seq;
+    int64_t diff;
+
+    *pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    while(1){
+        entry = &ring->entries[(*pos) & ring->mask];
+        seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t)(seq - *pos);
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&ring->head, pos, (*pos)+1,
+                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+
+                return entry;
+            }
+        }else if(diff < 0){
+            return NULL;
+        }else{
+            *pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+static void ring__commit(struct log__entry *entry, uint64_t pos)
+{
+    /* Sequentially consistent to pair with log_sleeping, see log__wake(). */
+    __atomic_store_n(&entry->seq, pos+1, __ATOMIC_SEQ_CST);
+}
+
+
+/* Reader only. Returns the oldest entry, or NULL if there is none. */
+static struct log__entry *ring__peek(struct log__ring *ring)
+{
+    struct log__entry *entry;
+
+    if(!ring->entries) return NULL;
+
+    entry = &ring->entries[ring->tail & ring->mask];
+    if(__atomic_load_n(&entry->seq, __ATOMIC_SEQ_CST) != ring->tail+1){
+        return NULL;
+    }
+    return entry;
+}
+
+
+static void ring__pop(struct log__ring *ring, struct log__entry *entry)
+{
+    __atomic_store_n(&entry->seq, ring->tail + ring->mask + 1, __ATOMIC_RELEASE);
+    ring->tail++;
+}
+
+
+static const char *log__topic(int priority, int *syslog_priority)
+{
+    switch(priority){
+        case MOSQ_LOG_SUBSCRIBE:
+            *syslog_priority = LOG_NOTICE;
+            return "$SYS/broker/log/M/subscribe";
+        case MOSQ_LOG_UNSUBSCRIBE:
+            *syslog_priority = LOG_NOTICE;
+            return "$SYS/broker/log/M/unsubscribe";
+        case MOSQ_LOG_DEBUG:
+            *syslog_priority = LOG_DEBUG;
+            return "$SYS/broker/log/D";
+        case MOSQ_LOG_ERR:
+            *syslog_priority = LOG_ERR;
+            return "$SYS/broker/log/E";
+        case MOSQ_LOG_WARNING:
+            *syslog_priority = LOG_WARNING;
+            return "$SYS/broker/log/W";
+        case MOSQ_LOG_NOTICE:
+            *syslog_priority = LOG_NOTICE;
+            return "$SYS/broker/log/N";
+        case MOSQ_LOG_INFO:
+            *syslog_priority = LOG_INFO;
+            return "$SYS/broker/log/I";
+#ifdef WITH_WEBSOCKETS
+        case MOSQ_LOG_WEBSOCKETS:
+            *syslog_priority = LOG_DEBUG;
+            return "$SYS/broker/log/WS";
+#endif
+        default:
+            *syslog_priority = LOG_ERR;
+            return "$SYS/broker/log/E";
+    }
+}
+
+
+/* Must be called with db_mutex held. */
+static void log__topic_send(int priority, time_t now, const char *s)
+{
+    char st[LOG_MSG_MAX+30];
+    const char *topic;
+    int syslog_priority;
+    bool log_timestamp = true;
+
+    if(int_db.config){
+        log_timestamp = int_db.config->log_timestamp;
+    }
+    topic = log__topic(priority, &syslog_priority);
+
+    if(log_timestamp){
+        snprintf(st, sizeof(st), "%d: %s", (int)now, s);
+        db__messages_easy_queue(&int_db, NULL, topic, 2, strlen(st), st, 0, 20, NULL);
+    }else{
+        db__messages_easy_queue(&int_db, NULL, topic, 2, strlen(s), s, 0, 20, NULL);
+    }
+}
+
+
+static void log__topic_queue(int priority, time_t now, const char *s)
+{
+    struct log__entry *entry;
+    uint64_t pos;
+
+    entry = ring__reserve(&topic_ring, &pos);
+    if(!entry){
+        __atomic_fetch_add(&dropped_queue_full, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    entry->priority = priority;
+    entry->time = now;
+    snprintf(entry->msg, LOG_MSG_MAX, "%s", s);
+    ring__commit(entry, pos);
+}
+
+
+/* Write a message to each destination. With flush false, stdout and stderr
+ * are left to be flushed by log__flush(). */
+static void log__output(int priority, time_t now, const char *s, int topic_mode, bool flush)
+{
+    int syslog_priority;
+    static time_t last_flush = 0;
+    char time_buf[50];
+    bool log_timestamp = true;
+    char *log_timestamp_format = NULL;
+    FILE *log_fptr = NULL;
+
+    if(int_db.config){
+        log_timestamp = int_db.config->log_timestamp;
+        log_timestamp_format = int_db.config->log_timestamp_format;
+        log_fptr = int_db.config->log_fptr;
+    }
+
+    log__topic(priority, &syslog_priority);
+
+    if(log_timestamp && log_timestamp_format){
+        struct tm ti;
+        if(get_time(now, &ti) || strftime(time_buf, 50, log_timestamp_format, &ti) == 0){
+            snprintf(time_buf, 50, "Time error");
+        }
+    }
+    if(log_destinations & MQTT3_LOG_STDOUT){
+        if(log_timestamp){
+            if(log_timestamp_format){
+                fprintf(stdout, "%s: %s\n", time_buf, s);
+            }else{
+                fprintf(stdout, "%d: %s\n", (int)now, s);
+            }
+        }else{
+            fprintf(stdout, "%s\n", s);
+        }
+        if(flush) fflush(stdout);
+    }
+    if(log_destinations & MQTT3_LOG_STDERR){
+        if(log_timestamp){
+            if(log_timestamp_format){
+                fprintf(stderr, "%s: %s\n", time_buf, s);
+            }else{
+                fprintf(stderr, "%d: %s\n", (int)now, s);
+            }
+        }else{
+            fprintf(stderr, "%s\n", s);
+        }
+        if(flush) fflush(stderr);
+    }
+    if(log_destinations & MQTT3_LOG_FILE && log_fptr){
+        if(log_timestamp){
+            if(log_timestamp_format){
+                fprintf(log_fptr, "%s: %s\n", time_buf, s);
+            }else{
+                fprintf(log_fptr, "%d: %s\n", (int)now, s);
+            }
+        }else{
+            fprintf(log_fptr, "%s\n", s);
+        }
+        if(now - last_flush > 1){
+            fflush(log_fptr);
+            last_flush = now;
+        }
+    }
+    if(log_destinations & MQTT3_LOG_SYSLOG){
+        syslog(syslog_priority, "%s", s);
+    }
+    if(log_destinations & MQTT3_LOG_TOPIC && priority != MOSQ_LOG_DEBUG && priority != MOSQ_LOG_INTERNAL){
+        if(topic_mode == LOG_TOPIC_PUBLISH){
+            log__topic_send(priority, now, s);
+        }else if(topic_mode == LOG_TOPIC_QUEUE){
+            log__topic_queue(priority, now, s);
+        }
+    }
+#ifdef WITH_DLT
+    if(priority != MOSQ_LOG_INTERNAL){
+        DLT_LOG_STRING(dltContext, get_dlt_level(priority), s);
+    }
+#endif
+}
+
+
+static void log__flush(void)
+{
+    if(log_destinations & MQTT3_LOG_STDOUT){
+        fflush(stdout);
+    }
+    if(log_destinations & MQTT3_LOG_STDERR){
+        fflush(stderr);
+    }
+    if(log_destinations & MQTT3_LOG_FILE && int_db.config && int_db.config->log_fptr){
+        fflush(int_db.config->log_fptr);
+    }
+}
+
+
+static void log__drain(int topic_mode)
+{
+    struct log__entry *entry;
+
+    while((entry = ring__peek(&log_ring))){
+        log__output(entry->priority, entry->time, entry->msg, topic_mode, false);
+        ring__pop(&log_ring, entry);
+    }
+}
+
+
+static void log__wake(void)
+{
+    uint64_t u = 1;
+
+    /* Either the log thread sees the entry just committed before it sleeps,
+     * or we see that it is sleeping. */
+    if(__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST)
+            && __atomic_exchange_n(&log_sleeping, false, __ATOMIC_SEQ_CST)){
+
+        if(write(log_wakefd, &u, sizeof(u))){
+        }
+    }
+}
+
+
+static void *log__thread_main(void *arg)
+{
+    struct pollfd pfd;
+    uint64_t u;
+    unsigned long dropped;
+    unsigned long reported = 0;
+    time_t now, last_report = 0;
+    char buf[100];
+
+    UNUSED(arg);
+
+    memset(&pfd, 0, sizeof(struct pollfd));
+    pfd.fd = log_wakefd;
+    pfd.events = POLLIN;
+
+    while(1){
+        log__drain(LOG_TOPIC_QUEUE);
+
+        /* Drops are reported at most once a second. */
+        dropped = __atomic_load_n(&dropped_queue_full, __ATOMIC_RELAXED);
+        now = time(NULL);
+        if(dropped != reported && now != last_report){
+            if(log_priorities & MOSQ_LOG_WARNING){
+                snprintf(buf, sizeof(buf), "Warning: %lu log messages dropped because the log queue was full.", dropped - reported);
+                log__output(MOSQ_LOG_WARNING, now, buf, LOG_TOPIC_QUEUE, false);
+            }
+            reported = dropped;
+            last_report = now;
+        }
+        log__flush();
+
+        if(__atomic_load_n(&log_stop, __ATOMIC_ACQUIRE)){
+            break;
+        }
+
+        __atomic_store_n(&log_sleeping, true, __ATOMIC_SEQ_CST);
+        if(ring__peek(&log_ring) == NULL){
+            /* Wake at least once a second to report drops. */
+            poll(&pfd, 1, 1000);
+        }
+        __atomic_store_n(&log_sleeping, false, __ATOMIC_SEQ_CST);
+        if(read(log_wakefd, &u, sizeof(u))){
+        }
+    }
+
+    return NULL;
+}
+
+
+/* The child of a background save only has the thread that forked, so must
+ * write its messages itself. */
+static void log__atfork_child(void)
+{
+    log_async = false;
+}
+
+
+static int log__thread_start(int queue_size)
+{
+    sigset_t sigblock, origsig;
+    int rc;
+
+    if(ring__init(&log_ring, queue_size) || ring__init(&topic_ring, queue_size)){
+        ring__cleanup(&log_ring);
+        return MOSQ_ERR_NOMEM;
+    }
+    log_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(log_wakefd == -1){
+        ring__cleanup(&log_ring);
+        ring__cleanup(&topic_ring);
+        return MOSQ_ERR_ERRNO;
+    }
+    if(!atfork_set){
+        pthread_atfork(NULL, NULL, log__atfork_child);
+        atfork_set = true;
+    }
+    log_stop = false;
+    log_sleeping = false;
+
+    /* Signals are only ever handled by the main thread. */
+    sigfillset(&sigblock);
+    pthread_sigmask(SIG_BLOCK, &sigblock, &origsig);
+    rc = pthread_create(&log_thread, NULL, log__thread_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+
+    if(rc){
+        close(log_wakefd);
+        log_wakefd = -1;
+        ring__cleanup(&log_ring);
+        ring__cleanup(&topic_ring);
+        return MOSQ_ERR_UNKNOWN;
+    }
+    __atomic_store_n(&log_async, true, __ATOMIC_RELEASE);
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Messages logged while the thread stops are written straight away, anything
+ * still queued is written here. $SYS/broker/log messages not yet published
+ * are dropped, because the database may already have been closed. */
+static void log__thread_stop(void)
+{
+    uint64_t u = 1;
+
+    if(!log_async) return;
+
+    __atomic_store_n(&log_async, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&log_stop, true, __ATOMIC_RELEASE);
+    if(write(log_wakefd, &u, sizeof(u))){
+    }
+    pthread_join(log_thread, NULL);
+
+    log__drain(LOG_TOPIC_NONE);
+    log__flush();
+
+    close(log_wakefd);
+    log_wakefd = -1;
+    ring__cleanup(&log_ring);
+    ring__cleanup(&topic_ring);
+}
+
+
+static const char *log__type_name(int priority)
+{
+    switch(priority){
+        case MOSQ_LOG_INFO:
+            return "information";
+        case MOSQ_LOG_NOTICE:
+            return "notice";
+        case MOSQ_LOG_WARNING:
+            return "warning";
+        case MOSQ_LOG_ERR:
+            return "error";
+        case MOSQ_LOG_DEBUG:
+            return "debug";
+        case MOSQ_LOG_SUBSCRIBE:
+            return "subscribe";
+        case MOSQ_LOG_UNSUBSCRIBE:
+            return "unsubscribe";
+        case MOSQ_LOG_WEBSOCKETS:
+            return "websockets";
+        default:
+            return "internal";
+    }
+}
+
+
+/* Returns true if the message should be dropped because too many of its type
+ * have already been logged this second. */
+static bool log__limited(int priority, time_t now)
+{
+    struct log__limit *limit;
+    time_t window;
+    unsigned int suppressed;
+
+    limit = &log_limits[__builtin_ctz((unsigned int)priority) % LOG_TYPE_COUNT];
+
+    window = __atomic_load_n(&limit->window, __ATOMIC_RELAXED);
+    if(window != now && __atomic_compare_exchange_n(&limit->window, &window, now,
+                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+
+        __atomic_store_n(&limit->count, 0, __ATOMIC_RELAXED);
+        suppressed = __atomic_exchange_n(&limit->suppressed, 0, __ATOMIC_RELAXED);
+        if(suppressed){
+            log__printf(NULL, priority, "%u %s log messages suppressed by log_rate_limit.", suppressed, log__type_name(priority));
+        }
+    }
+
+    if(__atomic_fetch_add(&limit->count, 1, __ATOMIC_RELAXED) < log_rate_limit){
+        return false;
+    }
+    __atomic_fetch_add(&limit->suppressed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dropped_rate_limit, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+
 int log__init(struct mosquitto__config *config)
 {
     int rc = 0;
 
     log_priorities = config->log_type;
     log_destinations = config->log_dest;
+    log_rate_limit = (unsigned int)config->log_rate_limit;
 
     if(log_destinations & MQTT3_LOG_SYSLOG){
         openlog("mosquitto", LOG_PID|LOG_CONS, config->log_facility);
@@ -106,11 +648,19 @@ int log__init(struct mosquitto__config *config)
     DLT_REGISTER_APP("MQTT","mosquitto log");
     dlt_register_context(&dltContext, "MQTT", "mosquitto DLT context");
 #endif
+    if(config->log_queue_size > 0 && log_destinations != MQTT3_LOG_NONE){
+        rc = log__thread_start(config->log_queue_size);
+        if(rc){
+            log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start log thread.");
+        }
+    }
     return rc;
 }
 
 int log__close(struct mosquitto__config *config)
 {
+    log__thread_stop();
+
     if(log_destinations & MQTT3_LOG_SYSLOG){
         closelog();
     }
@@ -129,170 +679,64 @@ int log__close(struct mosquitto__config *config)
     return MOSQ_ERR_SUCCESS;
 }
 
-#ifdef WITH_DLT
-DltLogLevelType get_dlt_level(int priority)
-{
-    switch (priority) {
-        case MOSQ_LOG_ERR:
-            return DLT_LOG_ERROR;
-        case MOSQ_LOG_WARNING:
-            return DLT_LOG_WARN;
-        case MOSQ_LOG_INFO:
-            return DLT_LOG_INFO;
-        case MOSQ_LOG_DEBUG:
-            return DLT_LOG_DEBUG;
-        case MOSQ_LOG_NOTICE:
-        case MOSQ_LOG_SUBSCRIBE:
-        case MOSQ_LOG_UNSUBSCRIBE:
-            return DLT_LOG_VERBOSE;
-        default:
-            return DLT_LOG_DEFAULT;
-    }
-}
-#endif
 
 int log__vprintf(int priority, const char *fmt, va_list va)
 {
-    char *s;
-    char *st;
-    int len;
-    const char *topic;
-    int syslog_priority;
-    time_t now = time(NULL);
-    static time_t last_flush = 0;
-    char time_buf[50];
-    bool log_timestamp = true;
-    char *log_timestamp_format = NULL;
-    FILE *log_fptr = NULL;
+    char s[LOG_MSG_MAX];
+    struct log__entry *entry;
+    uint64_t pos;
+    time_t now;
 
-    if(int_db.config){
-        log_timestamp = int_db.config->log_timestamp;
-        log_timestamp_format = int_db.config->log_timestamp_format;
-        log_fptr = int_db.config->log_fptr;
+    if((log_priorities & priority) == 0 || log_destinations == MQTT3_LOG_NONE){
+        return MOSQ_ERR_SUCCESS;
     }
 
-    if((log_priorities & priority) && log_destinations != MQTT3_LOG_NONE){
-        switch(priority){
-            case MOSQ_LOG_SUBSCRIBE:
-                topic = "$SYS/broker/log/M/subscribe";
-                syslog_priority = LOG_NOTICE;
-                break;
-            case MOSQ_LOG_UNSUBSCRIBE:
-                topic = "$SYS/broker/log/M/unsubscribe";
-                syslog_priority = LOG_NOTICE;
-                break;
-            case MOSQ_LOG_DEBUG:
-                topic = "$SYS/broker/log/D";
-                syslog_priority = LOG_DEBUG;
-                break;
-            case MOSQ_LOG_ERR:
-                topic = "$SYS/broker/log/E";
-                syslog_priority = LOG_ERR;
-                break;
-            case MOSQ_LOG_WARNING:
-                topic = "$SYS/broker/log/W";
-                syslog_priority = LOG_WARNING;
-                break;
-            case MOSQ_LOG_NOTICE:
-                topic = "$SYS/broker/log/N";
-                syslog_priority = LOG_NOTICE;
-                break;
-            case MOSQ_LOG_INFO:
-                topic = "$SYS/broker/log/I";
-                syslog_priority = LOG_INFO;
-                break;
-#ifdef WITH_WEBSOCKETS
-            case MOSQ_LOG_WEBSOCKETS:
-                topic = "$SYS/broker/log/WS";
-                syslog_priority = LOG_DEBUG;
-                break;
-#endif
-            default:
-                topic = "$SYS/broker/log/E";
-                syslog_priority = LOG_ERR;
-        }
-        len = strlen(fmt) + 500;
-        s = mosquitto__malloc(len*sizeof(char));
-        if(!s) return MOSQ_ERR_NOMEM;
-
-        vsnprintf(s, len, fmt, va);
-        s[len-1] = '\0'; /* Ensure string is null terminated. */
-
-        if(log_timestamp && log_timestamp_format){
-            struct tm *ti = NULL;
-            get_time(&ti);
-            if(strftime(time_buf, 50, log_timestamp_format, ti) == 0){
-                snprintf(time_buf, 50, "Time error");
-            }
-        }
-        if(log_destinations & MQTT3_LOG_STDOUT){
-            if(log_timestamp){
-                if(log_timestamp_format){
-                    fprintf(stdout, "%s: %s\n", time_buf, s);
-                }else{
-                    fprintf(stdout, "%d: %s\n", (int)now, s);
-                }
-            }else{
-                fprintf(stdout, "%s\n", s);
-            }
-            fflush(stdout);
-        }
-        if(log_destinations & MQTT3_LOG_STDERR){
-            if(log_timestamp){
-                if(log_timestamp_format){
-                    fprintf(stderr, "%s: %s\n", time_buf, s);
-                }else{
-                    fprintf(stderr, "%d: %s\n", (int)now, s);
-                }
-            }else{
-                fprintf(stderr, "%s\n", s);
-            }
-            fflush(stderr);
-        }
-        if(log_destinations & MQTT3_LOG_FILE && log_fptr){
-            if(log_timestamp){
-                if(log_timestamp_format){
-                    fprintf(log_fptr, "%s: %s\n", time_buf, s);
-                }else{
-                    fprintf(log_fptr, "%d: %s\n", (int)now, s);
-                }
-            }else{
-                fprintf(log_fptr, "%s\n", s);
-            }
-            if(now - last_flush > 1){
-                fflush(log_fptr);
-                last_flush = now;
-            }
-        }
-        if(log_destinations & MQTT3_LOG_SYSLOG){
-            syslog(syslog_priority, "%s", s);
-        }
-        if(log_destinations & MQTT3_LOG_TOPIC && priority != MOSQ_LOG_DEBUG && priority != MOSQ_LOG_INTERNAL){
-            if(log_timestamp){
-                len += 30;
-                st = mosquitto__malloc(len*sizeof(char));
-                if(!st){
-                    mosquitto__free(s);
-                    return MOSQ_ERR_NOMEM;
-                }
-                snprintf(st, len, "%d: %s", (int)now, s);
-                db__messages_easy_queue(&int_db, NULL, topic, 2, strlen(st), st, 0, 20, NULL);
-                mosquitto__free(st);
-            }else{
-                db__messages_easy_queue(&int_db, NULL, topic, 2, strlen(s), s, 0, 20, NULL);
-            }
-        }
-#ifdef WITH_DLT
-        if(priority != MOSQ_LOG_INTERNAL){
-            DLT_LOG_STRING(dltContext, get_dlt_level(priority), s);
+    now = time(NULL);
+    if(log_rate_limit && log__limited(priority, now)){
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    if(__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)){
+        entry = ring__reserve(&log_ring, &pos);
+        if(!entry){
+            __atomic_fetch_add(&dropped_queue_full, 1, __ATOMIC_RELAXED);
+            return MOSQ_ERR_SUCCESS;
         }
-#endif
-        mosquitto__free(s);
+        entry->priority = priority;
+        entry->time = now;
+        vsnprintf(entry->msg, LOG_MSG_MAX, fmt, va);
+        ring__commit(entry, pos);
+        log__wake();
+    }else{
+        vsnprintf(s, LOG_MSG_MAX, fmt, va);
+        log__output(priority, now, s, LOG_TOPIC_PUBLISH, true);
     }
 
     return MOSQ_ERR_SUCCESS;
 }
 
+
+/* Publish the $SYS/broker/log messages passed on by the log thread. Called
+ * from the main loop with db_mutex held. */
+void log__topic_publish(struct mosquitto_db *db)
+{
+    struct log__entry *entry;
+
+    UNUSED(db);
+
+    while((entry = ring__peek(&topic_ring))){
+        log__topic_send(entry->priority, entry->time, entry->msg);
+        ring__pop(&topic_ring, entry);
+    }
+}
+
+
+void log__dropped(unsigned long *queue_full, unsigned long *rate_limited)
+{
+    *queue_full = __atomic_load_n(&dropped_queue_full, __ATOMIC_RELAXED);
+    *rate_limited = __atomic_load_n(&dropped_rate_limit, __ATOMIC_RELAXED);
+}
+
 int log__printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
 {
     va_list va;
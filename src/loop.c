@@ -55,6 +55,43 @@ extern int run;
 
 static void loop_handle_reads_writes(struct mosquitto_db *db, mosq_sock_t sock, uint32_t events);
 
+
+int loop__write_context(struct mosquitto_db *db, struct mosquitto *context)
+{
+    struct epoll_event ev;
+    uint32_t events;
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+
+    if(db__message_write(db, context) == MOSQ_ERR_SUCCESS){
+        /* Reads are paused while a plugin decides what to do with the last
+         * packet, see plugin__pending_new(). */
+        if(context->plugin_pending){
+            events = 0;
+        }else{
+            events = EPOLLIN;
+        }
+        if(context->current_out_packet || context->state == mosq_cs_connect_pending || context->ws_want_write){
+            events |= EPOLLOUT;
+            context->ws_want_write = false;
+        }
+        if(events != context->events){
+            ev.data.fd = context->sock;
+            ev.events = events;
+            if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1) {
+                if((errno != EEXIST)||(epoll_ctl(db->epollfd, EPOLL_CTL_MOD, context->sock, &ev) == -1)) {
+                        log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll re-registering client events: %s", strerror(errno));
+                }
+            }
+            context->events = events;
+        }
+        return MOSQ_ERR_SUCCESS;
+    }else{
+        do_disconnect(db, context, MOSQ_ERR_CONN_LOST);
+        return MOSQ_ERR_CONN_LOST;
+    }
+}
+
 #ifdef WITH_WEBSOCKETS
 static void temp__expire_websockets_clients(struct mosquitto_db *db)
 {
@@ -99,6 +136,7 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 {
 #ifdef WITH_SYS_TREE
     time_t start_time = mosquitto_time();
+    uint64_t loop_start = 0;
 #endif
 #ifdef WITH_PERSISTENCE
     time_t last_backup = mosquitto_time();
@@ -107,15 +145,16 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
     int time_count;
     int fdcount;
     struct mosquitto *context, *ctxt_tmp;
+    struct mosquitto__worker *main_worker;
     sigset_t sigblock, origsig;
     int i;
 
     int j;
+    int err;
     struct epoll_event ev, events[MAX_EVENTS];
 
 #ifdef WITH_BRIDGE
     int rc;
-    int err;
     socklen_t len;
 #endif
 
@@ -165,6 +204,37 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
     }
 #endif
 
+    worker__lock();
+    if(worker__start(db)){
+        worker__unlock();
+        worker__stop(db);
+        (void)close(db->epollfd);
+        db->epollfd = 0;
+        return MOSQ_ERR_UNKNOWN;
+    }
+    main_worker = worker__main();
+#ifdef WITH_TLS
+    if(pw__pool_start(db)){
+        worker__unlock();
+        worker__stop(db);
+        (void)close(db->epollfd);
+        db->epollfd = 0;
+        return MOSQ_ERR_UNKNOWN;
+    }
+#endif
+#ifdef WITH_SYS_TREE
+    if(metrics__init(db)){
+        worker__unlock();
+#ifdef WITH_TLS
+        pw__pool_stop();
+#endif
+        worker__stop(db);
+        (void)close(db->epollfd);
+        db->epollfd = 0;
+        return MOSQ_ERR_UNKNOWN;
+    }
+#endif
+
     while(run){
         context__free_disused(db);
 #ifdef WITH_SYS_TREE
@@ -174,99 +244,68 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 #endif
 
 
-        time_count = 0;
-        HASH_ITER(hh_sock, db->contexts_by_sock, context, ctxt_tmp){
-            if(time_count > 0){
-                time_count--;
-            }else{
-                time_count = 1000;
-                now = mosquitto_time();
-            }
-            context->pollfd_index = -1;
+        now = mosquitto_time();
+#ifdef WITH_SYS_TREE
+        metrics__check_timeouts(db, now);
+#endif
+#ifdef WITH_BRIDGE
+        for(i=0; i<db->bridge_count; i++){
+            if(!db->bridges[i]) continue;
 
+            context = db->bridges[i];
             if(context->sock != INVALID_SOCKET){
-#ifdef WITH_BRIDGE
-                if(context->bridge){
-                    mosquitto__check_keepalive(db, context);
-                    if(context->bridge->round_robin == false
-                            && context->bridge->cur_address != 0
-                            && context->bridge->primary_retry
-                            && now > context->bridge->primary_retry){
-
-                        if(context->bridge->primary_retry_sock == INVALID_SOCKET){
-                            rc = net__try_connect(context->bridge->addresses[0].address,
-                                    context->bridge->addresses[0].port,
-                                    &context->bridge->primary_retry_sock, NULL, false);
-
-                            if(rc == 0){
+                mosquitto__check_keepalive(db, context);
+                if(context->bridge->round_robin == false
+                        && context->bridge->cur_address != 0
+                        && context->bridge->primary_retry
+                        && now > context->bridge->primary_retry){
+                    if(context->bridge->primary_retry_sock == INVALID_SOCKET){
+                        rc = net__try_connect(context->bridge->addresses[0].address,
+                                context->bridge->addresses[0].port,
+                                &context->bridge->primary_retry_sock, NULL, false);
+
+                        if(rc == 0){
+                            COMPAT_CLOSE(context->bridge->primary_retry_sock);
+                            context->bridge->primary_retry_sock = INVALID_SOCKET;
+                            context->bridge->primary_retry = 0;
+                            net__socket_close(db, context);
+                            context->bridge->cur_address = 0;
+                        }
+                    }else{
+                        len = sizeof(int);
+                        if(!getsockopt(context->bridge->primary_retry_sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len)){
+                            if(err == 0){
                                 COMPAT_CLOSE(context->bridge->primary_retry_sock);
                                 context->bridge->primary_retry_sock = INVALID_SOCKET;
                                 context->bridge->primary_retry = 0;
                                 net__socket_close(db, context);
-                                context->bridge->cur_address = 0;
-                            }
-                        }else{
-                            len = sizeof(int);
-                            if(!getsockopt(context->bridge->primary_retry_sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len)){
-                                if(err == 0){
-                                    COMPAT_CLOSE(context->bridge->primary_retry_sock);
-                                    context->bridge->primary_retry_sock = INVALID_SOCKET;
-                                    context->bridge->primary_retry = 0;
-                                    net__socket_close(db, context);
-                                    context->bridge->cur_address = context->bridge->address_count-1;
-                                }else{
-                                    COMPAT_CLOSE(context->bridge->primary_retry_sock);
-                                    context->bridge->primary_retry_sock = INVALID_SOCKET;
-                                    context->bridge->primary_retry = now+5;
-                                }
+                                context->bridge->cur_address = context->bridge->address_count-1;
                             }else{
                                 COMPAT_CLOSE(context->bridge->primary_retry_sock);
                                 context->bridge->primary_retry_sock = INVALID_SOCKET;
                                 context->bridge->primary_retry = now+5;
                             }
+                        }else{
+                            COMPAT_CLOSE(context->bridge->primary_retry_sock);
+                            context->bridge->primary_retry_sock = INVALID_SOCKET;
+                            context->bridge->primary_retry = now+5;
                         }
                     }
                 }
+            }
+        }
 #endif
 
-                /* Local bridges never time out in this fashion. */
-                if(!(context->keepalive)
-                        || context->bridge
-                        || now - context->last_msg_in <= (time_t)(context->keepalive)*3/2){
-
-                    if(db__message_write(db, context) == MOSQ_ERR_SUCCESS){
-                        if(context->current_out_packet || context->state == mosq_cs_connect_pending || context->ws_want_write){
-                            if(!(context->events & EPOLLOUT)) {
-                                ev.data.fd = context->sock;
-                                ev.events = EPOLLIN | EPOLLOUT;
-                                if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1) {
-                                    if((errno != EEXIST)||(epoll_ctl(db->epollfd, EPOLL_CTL_MOD, context->sock, &ev) == -1)) {
-                                            log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll re-registering to EPOLLOUT: %s", strerror(errno));
-                                    }
-                                }
-                                context->events = EPOLLIN | EPOLLOUT;
-                            }
-                            context->ws_want_write = false;
-                        }
-                        else{
-                            if(context->events & EPOLLOUT) {
-                                ev.data.fd = context->sock;
-                                ev.events = EPOLLIN;
-                                if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, context->sock, &ev) == -1) {
-                                    if((errno != EEXIST)||(epoll_ctl(db->epollfd, EPOLL_CTL_MOD, context->sock, &ev) == -1)) {
-                                            log__printf(NULL, MOSQ_LOG_DEBUG, "Error in epoll re-registering to EPOLLIN: %s", strerror(errno));
-                                    }
-                                }
-                                context->events = EPOLLIN;
-                            }
-                        }
-                    }else{
-                        do_disconnect(db, context, MOSQ_ERR_CONN_LOST);
-                    }
-                }else{
-                    /* Client has exceeded keepalive*1.5 */
-                    do_disconnect(db, context, MOSQ_ERR_KEEPALIVE);
+        /* Only clients that have had something queued for them since the last
+         * time around need to be written to. */
+        worker__wake_take(main_worker);
+        while((context = worker__wake_pop(main_worker))){
+            if(context->sock != INVALID_SOCKET){
+                if(context->plugin_pending && context->plugin_pending->done){
+                    plugin__pending_resume(db, context);
+                    if(context->sock == INVALID_SOCKET) continue;
                 }
+                loop__write_context(db, context);
             }
         }
 
@@ -384,7 +423,20 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 
         sigprocmask(SIG_SETMASK, &sigblock, &origsig);
 
-        fdcount = epoll_wait(db->epollfd, events, MAX_EVENTS, 100);
+#ifdef WITH_SYS_TREE
+        if(loop_start){
+            G_LOOP_TIME_ADD(stats__now_us() - loop_start);
+        }
+#endif
+        worker__unlock();
+        fdcount = epoll_wait(db->epollfd, events, MAX_EVENTS,
+                worker__wake_waiting(main_worker)?0:100);
+        err = errno;
+        worker__lock();
+        errno = err;
+#ifdef WITH_SYS_TREE
+        loop_start = stats__now_us();
+#endif
 
         sigprocmask(SIG_SETMASK, &origsig, NULL);
 
@@ -398,18 +450,27 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
             break;
         default:
             for(i=0; i<fdcount; i++){
+                if(worker__is_main_wakefd(events[i].data.fd)){
+                    worker__wake_drain(events[i].data.fd);
+                    continue;
+                }
+#ifdef WITH_SYS_TREE
+                if(metrics__handle(db, events[i].data.fd, events[i].events)){
+                    continue;
+                }
+#endif
                 for(j=0; j<listensock_count; j++){
                     if (events[i].data.fd == listensock[j]) {
                         if (events[i].events & (EPOLLIN | EPOLLPRI)){
                             while((ev.data.fd = net__socket_accept(db, listensock[j])) != -1){
-                                ev.events = EPOLLIN;
-                                if (epoll_ctl(db->epollfd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
-                                    log__printf(NULL, MOSQ_LOG_ERR, "Error in epoll accepting: %s", strerror(errno));
-                                }
                                 context = NULL;
                                 HASH_FIND(hh_sock, db->contexts_by_sock, &(ev.data.fd), sizeof(mosq_sock_t), context);
                                 if(context){
                                     context->events = EPOLLIN;
+                                    ev.events = EPOLLIN;
+                                    if (epoll_ctl(db->epollfd, EPOLL_CTL_ADD, ev.data.fd, &ev) == -1) {
+                                        log__printf(NULL, MOSQ_LOG_ERR, "Error in epoll accepting: %s", strerror(errno));
+                                    }
                                 }else{
                                     log__printf(NULL, MOSQ_LOG_ERR, "Error in epoll accepting: no context");
                                 }
@@ -424,19 +485,20 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
             }
         }
 
-        now = time(NULL);
-        session_expiry__check(db, now);
-        will_delay__check(db, now);
+        /* Keepalive, session expiry and will delay. */
+        timer__check(db, mosquitto_time());
+        log__topic_publish(db);
 #ifdef WITH_PERSISTENCE
+        persist__background_check(db, false);
         if(db->config->persistence && db->config->autosave_interval){
             if(db->config->autosave_on_changes){
                 if(db->persistence_changes >= db->config->autosave_interval){
-                    persist__backup(db, false);
+                    persist__autosave(db);
                     db->persistence_changes = 0;
                 }
             }else{
                 if(last_backup + db->config->autosave_interval < mosquitto_time()){
-                    persist__backup(db, false);
+                    persist__autosave(db);
                     last_backup = mosquitto_time();
                 }
             }
@@ -487,12 +549,22 @@ int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int li
 #endif
     }
 
+#ifdef WITH_SYS_TREE
+    metrics__cleanup(db);
+#endif
+    worker__unlock();
+#ifdef WITH_TLS
+    pw__pool_stop();
+#endif
+    worker__stop(db);
+
     (void) close(db->epollfd);
     db->epollfd = 0;
 
     return MOSQ_ERR_SUCCESS;
 }
 
+
 void do_disconnect(struct mosquitto_db *db, struct mosquitto *context, int reason)
 {
     char *id;
@@ -666,7 +738,7 @@ static void loop_handle_reads_writes(struct mosquitto_db *db, mosq_sock_t sock,
                     do_disconnect(db, context, rc);
                     continue;
                 }
-            }while(SSL_DATA_PENDING(context));
+            }while(SSL_DATA_PENDING(context) && !context->plugin_pending);
         }else{
             if(events & (EPOLLERR | EPOLLHUP)){
                 do_disconnect(db, context, MOSQ_ERR_CONN_LOST);
@@ -674,6 +746,10 @@ static void loop_handle_reads_writes(struct mosquitto_db *db, mosq_sock_t sock,
             }
         }
     }
+
+    /* Anything this client sent may have freed up space in its inflight
+     * queue, so give it a chance to send. */
+    worker__wake(context);
 }
 
 
@@ -0,0 +1,481 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_SYS_TREE
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "net_mosq.h"
+#include "time_mosq.h"
+
+/* Broker statistics in the Prometheus text exposition format.
+ *
+ * With metrics_listener set, the main thread accepts plain HTTP connections
+ * on a port of its own and answers any GET with the current statistics, then
+ * closes the connection. Nothing goes through the subscription tree, so this
+ * costs nothing between scrapes, unlike the $SYS tree, which can be turned
+ * off with sys_interval 0 when this is used instead.
+ *
+ * Listener counters are labelled with the listener. Everything is read with
+ * db_mutex held, like the rest of the main loop.
+ */
+
+#define METRICS_MAX_CONNS 8
+#define METRICS_REQUEST_MAX 2048
+#define METRICS_TIMEOUT 5
+
+struct metrics__conn{
+    mosq_sock_t sock;
+    time_t accepted;
+    char *out;
+    size_t out_len;
+    size_t out_pos;
+    size_t in_len;
+    char in[METRICS_REQUEST_MAX];
+};
+
+struct metrics__buf{
+    char *data;
+    size_t len;
+    size_t size;
+    bool error;
+};
+
+struct metrics__counter{
+    const char *name;
+    const char *help;
+    size_t offset;
+};
+
+static const struct metrics__counter broker_counters[] = {
+    {"mosquitto_bytes_received_total", "Bytes received from the network.", offsetof(struct mosquitto__stats, bytes_received)},
+    {"mosquitto_bytes_sent_total", "Bytes sent over the network.", offsetof(struct mosquitto__stats, bytes_sent)},
+    {"mosquitto_publish_bytes_received_total", "PUBLISH payload bytes received.", offsetof(struct mosquitto__stats, pub_bytes_received)},
+    {"mosquitto_publish_bytes_sent_total", "PUBLISH payload bytes sent.", offsetof(struct mosquitto__stats, pub_bytes_sent)},
+    {"mosquitto_messages_received_total", "MQTT packets received.", offsetof(struct mosquitto__stats, msgs_received)},
+    {"mosquitto_messages_sent_total", "MQTT packets sent.", offsetof(struct mosquitto__stats, msgs_sent)},
+    {"mosquitto_publish_messages_received_total", "PUBLISH packets received.", offsetof(struct mosquitto__stats, pub_msgs_received)},
+    {"mosquitto_publish_messages_sent_total", "PUBLISH packets sent.", offsetof(struct mosquitto__stats, pub_msgs_sent)},
+    {"mosquitto_publish_messages_dropped_total", "PUBLISH messages dropped because a queue was full.", offsetof(struct mosquitto__stats, msgs_dropped)},
+    {"mosquitto_write_calls_total", "Calls made to write to a socket.", offsetof(struct mosquitto__stats, write_calls)},
+    {"mosquitto_clients_expired_total", "Sessions removed because they expired.", offsetof(struct mosquitto__stats, clients_expired)},
+    {"mosquitto_socket_connections_total", "Network connections accepted.", offsetof(struct mosquitto__stats, socket_connections)},
+    {"mosquitto_connections_total", "CONNECT packets accepted.", offsetof(struct mosquitto__stats, connection_count)},
+};
+
+static const struct metrics__counter listener_counters[] = {
+    {"mosquitto_listener_bytes_received_total", "Bytes received from the network, by listener.", offsetof(struct mosquitto__listener_stats, bytes_received)},
+    {"mosquitto_listener_bytes_sent_total", "Bytes sent over the network, by listener.", offsetof(struct mosquitto__listener_stats, bytes_sent)},
+    {"mosquitto_listener_publish_messages_received_total", "PUBLISH packets received, by listener.", offsetof(struct mosquitto__listener_stats, pub_msgs_received)},
+    {"mosquitto_listener_publish_messages_sent_total", "PUBLISH packets sent, by listener.", offsetof(struct mosquitto__listener_stats, pub_msgs_sent)},
+    {"mosquitto_listener_connections_total", "CONNECT packets accepted, by listener.", offsetof(struct mosquitto__listener_stats, connection_count)},
+};
+
+static mosq_sock_t metrics_sock = INVALID_SOCKET;
+static struct metrics__conn *conns[METRICS_MAX_CONNS];
+static time_t start_time = 0;
+
+
+static void metrics__printf(struct metrics__buf *buf, const char *fmt, ...)
+{
+    va_list va;
+    int len;
+    char *data;
+
+    if(buf->error) return;
+
+    while(1){
+        va_start(va, fmt);
+        len = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, va);
+        va_end(va);
+        if(len < 0){
+            buf->error = true;
+            return;
+        }
+        if(buf->len + (size_t)len < buf->size){
+            buf->len += (size_t)len;
+            return;
+        }
+        data = mosquitto__realloc(buf->data, buf->size*2 + (size_t)len);
+        if(!data){
+            buf->error = true;
+            return;
+        }
+        buf->data = data;
+        buf->size = buf->size*2 + (size_t)len;
+    }
+}
+
+
+static uint64_t metrics__field(const void *stats, size_t offset)
+{
+    return *(const uint64_t *)((const char *)stats + offset);
+}
+
+
+static void metrics__write_counters(struct metrics__buf *buf)
+{
+    size_t i;
+
+    for(i=0; i<sizeof(broker_counters)/sizeof(struct metrics__counter); i++){
+        metrics__printf(buf, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                broker_counters[i].name, broker_counters[i].help, broker_counters[i].name,
+                broker_counters[i].name, (unsigned long long)metrics__field(&g_stats, broker_counters[i].offset));
+    }
+}
+
+
+static void metrics__write_listeners(struct mosquitto_db *db, struct metrics__buf *buf)
+{
+    size_t i;
+    int l;
+    struct mosquitto__listener *listener;
+
+    for(i=0; i<sizeof(listener_counters)/sizeof(struct metrics__counter); i++){
+        metrics__printf(buf, "# HELP %s %s\n# TYPE %s counter\n",
+                listener_counters[i].name, listener_counters[i].help, listener_counters[i].name);
+
+        for(l=0; l<db->config->listener_count; l++){
+            listener = &db->config->listeners[l];
+            metrics__printf(buf, "%s{listener=\"%d\",port=\"%d\"} %llu\n", listener_counters[i].name, l, listener->port,
+                    (unsigned long long)metrics__field(&listener->stats, listener_counters[i].offset));
+        }
+    }
+
+    metrics__printf(buf, "# HELP mosquitto_listener_clients Clients connected, by listener.\n"
+            "# TYPE mosquitto_listener_clients gauge\n");
+    for(l=0; l<db->config->listener_count; l++){
+        listener = &db->config->listeners[l];
+        metrics__printf(buf, "mosquitto_listener_clients{listener=\"%d\",port=\"%d\"} %d\n", l, listener->port, listener->client_count);
+    }
+}
+
+
+/* Buckets are powers of two of the recorded unit, scale converts that unit to
+ * the one given in the output. */
+static void metrics__write_hist(struct metrics__buf *buf, const char *name, const char *help, const struct mosquitto__stats_hist *hist, double scale)
+{
+    int i;
+    uint64_t cumulative = 0;
+
+    metrics__printf(buf, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for(i=0; i<STATS_HIST_BUCKETS-1; i++){
+        cumulative += hist->buckets[i];
+        metrics__printf(buf, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ULL<<i)*scale, (unsigned long long)cumulative);
+    }
+    metrics__printf(buf, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)hist->count);
+    metrics__printf(buf, "%s_sum %g\n", name, (double)hist->sum*scale);
+    metrics__printf(buf, "%s_count %llu\n", name, (unsigned long long)hist->count);
+}
+
+
+static void metrics__write_gauge(struct metrics__buf *buf, const char *name, const char *help, unsigned long long value)
+{
+    metrics__printf(buf, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n", name, help, name, name, value);
+}
+
+
+static void metrics__write(struct mosquitto_db *db, struct metrics__buf *buf)
+{
+    int count_by_sock;
+    unsigned long log_queue_full, log_rate_limited;
+
+    metrics__write_counters(buf);
+    metrics__write_listeners(db, buf);
+
+    metrics__write_hist(buf, "mosquitto_loop_duration_seconds",
+            "Time spent handling network events in each loop iteration.",
+            &g_stats.loop_time, 1e-6);
+    metrics__write_hist(buf, "mosquitto_publish_delivery_latency_seconds",
+            "Time from a PUBLISH being received to it being sent to a subscriber.",
+            &g_stats.deliver_time, 1e-6);
+    metrics__write_hist(buf, "mosquitto_client_queue_depth_messages",
+            "Outgoing messages queued for a client when another is added.",
+            &g_stats.queue_depth, 1.0);
+
+    count_by_sock = HASH_CNT(hh_sock, db->contexts_by_sock);
+    metrics__write_gauge(buf, "mosquitto_clients_connected", "Clients with a network connection.", (unsigned long long)count_by_sock);
+    metrics__write_gauge(buf, "mosquitto_clients_total", "Clients connected or with a session.", (unsigned long long)HASH_CNT(hh_id, db->contexts_by_id));
+    metrics__write_gauge(buf, "mosquitto_store_messages", "Messages held in the message store.", (unsigned long long)db->msg_store_count);
+    metrics__write_gauge(buf, "mosquitto_store_messages_bytes", "Payload bytes held in the message store.", (unsigned long long)db->msg_store_bytes);
+    metrics__write_gauge(buf, "mosquitto_subscriptions", "Subscriptions.", (unsigned long long)db->subscription_count);
+    metrics__write_gauge(buf, "mosquitto_shared_subscriptions", "Shared subscriptions.", (unsigned long long)db->shared_subscription_count);
+    metrics__write_gauge(buf, "mosquitto_retained_messages", "Retained messages.", (unsigned long long)db->retained_count);
+#ifdef REAL_WITH_MEMORY_TRACKING
+    metrics__write_gauge(buf, "mosquitto_heap_bytes", "Heap memory in use.", (unsigned long long)mosquitto__memory_used());
+#endif
+    log__dropped(&log_queue_full, &log_rate_limited);
+    metrics__printf(buf, "# HELP mosquitto_log_messages_dropped_total Log messages dropped.\n"
+            "# TYPE mosquitto_log_messages_dropped_total counter\n"
+            "mosquitto_log_messages_dropped_total{reason=\"queue_full\"} %lu\n"
+            "mosquitto_log_messages_dropped_total{reason=\"rate_limit\"} %lu\n",
+            log_queue_full, log_rate_limited);
+    metrics__write_gauge(buf, "mosquitto_uptime_seconds", "Time since the broker started.", (unsigned long long)(mosquitto_time() - start_time));
+}
+
+
+static void metrics__conn_close(struct mosquitto_db *db, int index)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    epoll_ctl(db->epollfd, EPOLL_CTL_DEL, conns[index]->sock, &ev);
+    COMPAT_CLOSE(conns[index]->sock);
+    mosquitto__free(conns[index]->out);
+    mosquitto__free(conns[index]);
+    conns[index] = NULL;
+}
+
+
+static void metrics__accept(struct mosquitto_db *db)
+{
+    struct epoll_event ev;
+    mosq_sock_t sock;
+    int i;
+
+    while((sock = accept(metrics_sock, NULL, 0)) != INVALID_SOCKET){
+        for(i=0; i<METRICS_MAX_CONNS; i++){
+            if(!conns[i]) break;
+        }
+        if(i == METRICS_MAX_CONNS){
+            COMPAT_CLOSE(sock);
+            continue;
+        }
+        if(net__socket_nonblock(&sock)){
+            continue;
+        }
+        conns[i] = mosquitto__calloc(1, sizeof(struct metrics__conn));
+        if(!conns[i]){
+            COMPAT_CLOSE(sock);
+            continue;
+        }
+        conns[i]->sock = sock;
+        conns[i]->accepted = mosquitto_time();
+
+        memset(&ev, 0, sizeof(struct epoll_event));
+        ev.data.fd = sock;
+        ev.events = EPOLLIN;
+        if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, sock, &ev) == -1){
+            log__printf(NULL, MOSQ_LOG_ERR, "Error in epoll accepting: %s", strerror(errno));
+            metrics__conn_close(db, i);
+        }
+    }
+}
+
+
+static void metrics__respond(struct mosquitto_db *db, struct metrics__conn *conn)
+{
+    struct metrics__buf buf;
+
+    memset(&buf, 0, sizeof(struct metrics__buf));
+    buf.size = 16384;
+    buf.data = mosquitto__malloc(buf.size);
+    if(!buf.data) return;
+
+    if(!strncmp(conn->in, "GET ", 4)){
+        metrics__printf(&buf, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+        metrics__write(db, &buf);
+    }else{
+        metrics__printf(&buf, "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\nConnection: close\r\n\r\n");
+    }
+    if(buf.error){
+        mosquitto__free(buf.data);
+        return;
+    }
+    conn->out = buf.data;
+    conn->out_len = buf.len;
+}
+
+
+/* Returns true once the connection should be closed. */
+static bool metrics__conn_handle(struct mosquitto_db *db, struct metrics__conn *conn, uint32_t events)
+{
+    struct epoll_event ev;
+    ssize_t len;
+
+    if(events & (EPOLLERR | EPOLLHUP)){
+        return true;
+    }
+
+    if(!conn->out){
+        len = recv(conn->sock, conn->in + conn->in_len, METRICS_REQUEST_MAX-1 - conn->in_len, 0);
+        if(len <= 0){
+            return len == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+        conn->in_len += (size_t)len;
+        conn->in[conn->in_len] = '\0';
+
+        /* Only the request line matters, but the whole header is read before
+         * answering so that closing the socket doesn't reset the connection. */
+        if(!strstr(conn->in, "\r\n\r\n") && !strstr(conn->in, "\n\n")){
+            return conn->in_len == METRICS_REQUEST_MAX-1;
+        }
+        metrics__respond(db, conn);
+        if(!conn->out){
+            return true;
+        }
+    }
+
+    while(conn->out_pos < conn->out_len){
+        len = send(conn->sock, conn->out + conn->out_pos, conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+        if(len < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                memset(&ev, 0, sizeof(struct epoll_event));
+                ev.data.fd = conn->sock;
+                ev.events = EPOLLOUT;
+                return epoll_ctl(db->epollfd, EPOLL_CTL_MOD, conn->sock, &ev) == -1;
+            }
+            return true;
+        }
+        conn->out_pos += (size_t)len;
+    }
+    return true;
+}
+
+
+/* Returns true if fd belongs to the metrics listener, in which case the event
+ * has been handled. */
+bool metrics__handle(struct mosquitto_db *db, int fd, uint32_t events)
+{
+    int i;
+
+    if(metrics_sock == INVALID_SOCKET){
+        return false;
+    }
+    if(fd == metrics_sock){
+        metrics__accept(db);
+        return true;
+    }
+    for(i=0; i<METRICS_MAX_CONNS; i++){
+        if(conns[i] && conns[i]->sock == fd){
+            if(metrics__conn_handle(db, conns[i], events)){
+                metrics__conn_close(db, i);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/* Close connections that haven't been dealt with in METRICS_TIMEOUT seconds,
+ * so that clients which never finish their request can't hold on to every
+ * connection slot. */
+void metrics__check_timeouts(struct mosquitto_db *db, time_t now)
+{
+    int i;
+
+    for(i=0; i<METRICS_MAX_CONNS; i++){
+        if(conns[i] && now - conns[i]->accepted > METRICS_TIMEOUT){
+            metrics__conn_close(db, i);
+        }
+    }
+}
+
+
+int metrics__init(struct mosquitto_db *db)
+{
+    struct addrinfo hints;
+    struct addrinfo *ainfo, *rp;
+    struct epoll_event ev;
+    char service[10];
+    const char *host;
+    int ss_opt = 1;
+    int rc;
+
+    start_time = mosquitto_time();
+    if(db->config->metrics_port == 0){
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    host = db->config->metrics_host?db->config->metrics_host:"127.0.0.1";
+    snprintf(service, 10, "%d", db->config->metrics_port);
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_flags = AI_PASSIVE;
+    hints.ai_socktype = SOCK_STREAM;
+
+    rc = getaddrinfo(host, service, &hints, &ainfo);
+    if(rc){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error creating metrics listener: %s.", gai_strerror(rc));
+        return MOSQ_ERR_INVAL;
+    }
+
+    for(rp = ainfo; rp; rp = rp->ai_next){
+        metrics_sock = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if(metrics_sock == INVALID_SOCKET) continue;
+
+        setsockopt(metrics_sock, SOL_SOCKET, SO_REUSEADDR, (char *)&ss_opt, sizeof(ss_opt));
+        if(net__socket_nonblock(&metrics_sock)){
+            continue;
+        }
+        if(bind(metrics_sock, rp->ai_addr, rp->ai_addrlen) == 0 && listen(metrics_sock, 16) == 0){
+            break;
+        }
+        COMPAT_CLOSE(metrics_sock);
+        metrics_sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(ainfo);
+
+    if(metrics_sock == INVALID_SOCKET){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error creating metrics listener on %s port %d: %s.",
+                host, db->config->metrics_port, strerror(errno));
+        return MOSQ_ERR_UNKNOWN;
+    }
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = metrics_sock;
+    ev.events = EPOLLIN;
+    if(epoll_ctl(db->epollfd, EPOLL_CTL_ADD, metrics_sock, &ev) == -1){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error in epoll initial registering: %s", strerror(errno));
+        COMPAT_CLOSE(metrics_sock);
+        metrics_sock = INVALID_SOCKET;
+        return MOSQ_ERR_UNKNOWN;
+    }
+    log__printf(NULL, MOSQ_LOG_INFO, "Opening metrics listener on %s port %d.", host, db->config->metrics_port);
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+void metrics__cleanup(struct mosquitto_db *db)
+{
+    int i;
+
+    for(i=0; i<METRICS_MAX_CONNS; i++){
+        if(conns[i]){
+            metrics__conn_close(db, i);
+        }
+    }
+    if(metrics_sock != INVALID_SOCKET){
+        COMPAT_CLOSE(metrics_sock);
+        metrics_sock = INVALID_SOCKET;
+    }
+}
+
+#endif
@@ -293,6 +293,13 @@ int main(int argc, char *argv[])
     rc = drop_privileges(&config, false);
     if(rc != MOSQ_ERR_SUCCESS) return rc;
 
+#ifdef WITH_PERSISTENCE
+    /* Opened after dropping privileges so the journal can be replaced when
+     * it is compacted. Without a journal, autosaves write the full database
+     * as usual. */
+    persist__journal_open(&int_db);
+#endif
+
     signal(SIGINT, handle_sigint);
     signal(SIGTERM, handle_sigint);
 #ifdef SIGHUP
@@ -384,6 +391,7 @@ int main(int argc, char *argv[])
     log__close(&config);
     config__cleanup(int_db.config);
     net__broker_cleanup();
+    memory__pools_cleanup();
 
     return rc;
 }
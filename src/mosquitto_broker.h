@@ -165,6 +165,70 @@ const char *mosquitto_client_username(const struct mosquitto *client);
  */
 int mosquitto_set_username(struct mosquitto *client, const char *username);
 
+
+/* Function: mosquitto_acl_cache_clear
+ *
+ * Forget the ACL check results cached for a client, see the acl_cache_size
+ * option. A plugin whose ACL decisions have changed should call this, so the
+ * new decisions are used for topics that have already been checked.
+ *
+ * client can be NULL, in which case the results for every client are
+ * forgotten.
+ *
+ * May be called from any thread.
+ *
+ * Returns:
+ *   MOSQ_ERR_SUCCESS - on success
+ */
+int mosquitto_acl_cache_clear(struct mosquitto *client);
+
+
+/* Function: mosquitto_unpwd_check_complete
+ *
+ * Give the result of a username and password check that a version 5 plugin
+ * answered with MOSQ_ERR_PLUGIN_PENDING. The client's CONNECT is held until
+ * this is called, other clients are served as normal in the meantime.
+ *
+ * May be called from any thread, but not from within the
+ * mosquitto_auth_unpwd_check() call that returned MOSQ_ERR_PLUGIN_PENDING.
+ *
+ * Parameters:
+ *   client - the client passed to mosquitto_auth_unpwd_check()
+ *   result - MOSQ_ERR_SUCCESS if the client is authenticated, MOSQ_ERR_AUTH
+ *            if authentication failed, or another MOSQ_ERR_* code for an
+ *            error, which disconnects the client.
+ *
+ * Returns:
+ *   MOSQ_ERR_SUCCESS - on success
+ *   MOSQ_ERR_INVAL - if client is NULL, or has no username and password
+ *                    check waiting for a result
+ */
+int mosquitto_unpwd_check_complete(struct mosquitto *client, int result);
+
+
+/* Function: mosquitto_acl_check_complete
+ *
+ * Give the result of a MOSQ_ACL_WRITE check that a version 5 plugin answered
+ * with MOSQ_ERR_PLUGIN_PENDING. The client's PUBLISH, and anything it sends
+ * after it, is held until this is called, other clients are served as normal
+ * in the meantime.
+ *
+ * May be called from any thread, but not from within the
+ * mosquitto_auth_acl_check() call that returned MOSQ_ERR_PLUGIN_PENDING.
+ *
+ * Parameters:
+ *   client - the client passed to mosquitto_auth_acl_check()
+ *   result - MOSQ_ERR_SUCCESS if access is granted, MOSQ_ERR_ACL_DENIED if it
+ *            is not, or another MOSQ_ERR_* code for an error, which
+ *            disconnects the client.
+ *
+ * Returns:
+ *   MOSQ_ERR_SUCCESS - on success
+ *   MOSQ_ERR_INVAL - if client is NULL, or has no ACL check waiting for a
+ *                    result
+ */
+int mosquitto_acl_check_complete(struct mosquitto *client, int result);
+
 #ifdef __cplusplus
 }
 #endif
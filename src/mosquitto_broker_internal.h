@@ -48,6 +48,7 @@ Contributors:
 #include "mosquitto_broker.h"
 #include "mosquitto_plugin.h"
 #include "mosquitto.h"
+#include "sys_tree.h"
 #include "tls_mosq.h"
 #include "uthash.h"
 
@@ -215,7 +216,7 @@ struct mosquitto__security_options {
      * should be disabled when these options are set.
      */
     struct mosquitto__acl_user *acl_list;
-    struct mosquitto__acl *acl_patterns;
+    struct mosquitto__aclhier *acl_patterns;
     char *password_file;
     char *psk_file;
     char *acl_file;
@@ -268,12 +269,16 @@ struct mosquitto__listener {
     struct mosquitto__security_options security_options;
     struct mosquitto__unpwd *unpwd;
     struct mosquitto__unpwd *psk_id;
+#ifdef WITH_SYS_TREE
+    struct mosquitto__listener_stats stats;
+#endif
 };
 
 struct mosquitto__config {
     bool allow_duplicate_messages;
     int autosave_interval;
     bool autosave_on_changes;
+    bool autosave_background;
     bool check_retain_source;
     char *clientid_prefixes;
     bool connection_messages;
@@ -288,23 +293,33 @@ struct mosquitto__config {
     char *log_timestamp_format;
     char *log_file;
     FILE *log_fptr;
+    int log_queue_size;
+    int log_rate_limit;
     uint16_t max_inflight_messages;
     uint16_t max_keepalive;
     uint32_t max_packet_size;
     uint32_t message_size_limit;
+    char *metrics_host;
+    int metrics_port;
     bool persistence;
     char *persistence_location;
     char *persistence_file;
     char *persistence_filepath;
+    bool persistence_journal;
     time_t persistent_client_expiration;
     char *pid_file;
     bool queue_qos0_messages;
+    char *queue_spill_location;
+    int queue_spill_threshold;
     bool per_listener_settings;
     bool retain_available;
     bool set_tcp_nodelay;
+    int subscription_cache_size;
+    int acl_cache_size;
     int sys_interval;
     bool upgrade_outgoing_qos;
     char *user;
+    int password_check_threads;
 #ifdef WITH_WEBSOCKETS
     int websockets_log_level;
     int websockets_headers_size;
@@ -344,6 +359,8 @@ struct mosquitto__subhier {
     UT_hash_handle hh;
     struct mosquitto__subhier *parent;
     struct mosquitto__subhier *children;
+    struct mosquitto__subhier *child_plus; /* The "+" entry in children */
+    struct mosquitto__subhier *child_hash; /* The "#" entry in children */
     struct mosquitto__subleaf *subs;
     struct mosquitto__subshared *shared;
     struct mosquitto_msg_store *retained;
@@ -351,6 +368,17 @@ struct mosquitto__subhier {
     uint16_t topic_len;
 };
 
+struct subs_cache_entry {
+    UT_hash_handle hh;
+    struct subs_cache_entry *prev;
+    struct subs_cache_entry *next;
+    char *topic;
+    struct mosquitto__subhier **hiers;
+    int hier_count;
+    int hier_max;
+    uint64_t generation;
+};
+
 struct mosquitto_msg_store_load{
     UT_hash_handle hh;
     dbid_t db_id;
@@ -364,7 +392,6 @@ struct mosquitto_msg_store{
     char *source_id;
     char *source_username;
     struct mosquitto__listener *source_listener;
-    char **dest_ids;
     int dest_id_count;
     int ref_count;
     char* topic;
@@ -377,6 +404,10 @@ struct mosquitto_msg_store{
     uint8_t qos;
     bool retain;
     uint8_t origin;
+    bool journalled;
+#ifdef WITH_SYS_TREE
+    uint64_t received_us;
+#endif
 };
 
 struct mosquitto_client_msg{
@@ -393,6 +424,12 @@ struct mosquitto_client_msg{
     bool dup;
 };
 
+/* The number is the id used in the password file, e.g. $7$. */
+enum mosquitto_pwhash_type{
+    pw_sha512 = 6,
+    pw_sha512_pbkdf2 = 7,
+};
+
 struct mosquitto__unpwd{
     char *username;
     char *password;
@@ -400,22 +437,73 @@ struct mosquitto__unpwd{
     unsigned int password_len;
     unsigned int salt_len;
     unsigned char *salt;
+    enum mosquitto_pwhash_type hashtype;
+    int iterations;
 #endif
     UT_hash_handle hh;
 };
 
-struct mosquitto__acl{
-    struct mosquitto__acl *next;
+/* ACL topics are compiled in to a tree, one level per node like the
+ * subscription tree. access is the union of the access of every rule that
+ * ends at a node. Levels of a pattern that contain %c or %u are kept in the
+ * patterns list rather than children, and are substituted while matching. */
+struct mosquitto__aclhier{
+    UT_hash_handle hh;
+    struct mosquitto__aclhier *children;
+    struct mosquitto__aclhier *child_plus; /* The "+" entry in children */
+    struct mosquitto__aclhier *child_hash; /* The "#" entry in children */
+    struct mosquitto__aclhier *patterns;
+    struct mosquitto__aclhier *next; /* Next entry in the parent's patterns */
+    char *topic;
+    uint16_t topic_len;
+    uint8_t access;
+};
+
+struct mosquitto__acl_cache{
     char *topic;
+    uint32_t hash;
     int access;
-    int ucount;
-    int ccount;
+    int rc;
+    uint8_t qos;
+    bool retain;
+};
+
+enum mosquitto__plugin_pending_type{
+    plugin_pending_unpwd = 1,
+    plugin_pending_acl = 2,
+};
+
+/* A CONNECT or PUBLISH held while a plugin works out the result of its check.
+ * Which fields are used depends on type, anything still set when it is freed
+ * is freed with it. */
+struct mosquitto__plugin_pending{
+    enum mosquitto__plugin_pending_type type;
+    int result;
+    bool done;
+    /* CONNECT */
+    char *client_id;
+    char *username;
+    char *password;
+    struct mosquitto_message_all *will;
+    void *auth_data;
+    uint16_t auth_data_len;
+    uint8_t clean_start;
+    /* PUBLISH */
+    char *topic;
+    mosquitto__payload_uhpa payload;
+    uint32_t payloadlen;
+    mosquitto_property *properties;
+    uint32_t message_expiry_interval;
+    uint16_t mid;
+    uint8_t dup;
+    uint8_t qos;
+    uint8_t retain;
 };
 
 struct mosquitto__acl_user{
     struct mosquitto__acl_user *next;
     char *username;
-    struct mosquitto__acl *acl;
+    struct mosquitto__aclhier *acl;
 };
 
 struct mosquitto_db{
@@ -437,6 +525,8 @@ struct mosquitto_db{
 #endif
     int msg_store_count;
     unsigned long msg_store_bytes;
+    int msg_spilled_count;
+    unsigned long msg_spilled_bytes;
     char *config_file;
     struct mosquitto__config *config;
     int auth_plugin_count;
@@ -447,10 +537,21 @@ struct mosquitto_db{
     int retained_count;
 #endif
     int persistence_changes;
+    unsigned long persistence_saves;
+    double persistence_save_time;
+    long persistence_save_bytes;
     struct mosquitto *ll_for_free;
     int epollfd;
 };
 
+/* Clients that have new outgoing data are put on the main loop's wake_list, a
+ * lock free stack, so only those clients are written to on the next pass of
+ * the loop. Other threads can add to it too. */
+struct mosquitto__worker {
+    struct mosquitto *wake_list;
+    struct mosquitto *wake_batch;
+};
+
 enum mosquitto__bridge_direction{
     bd_out = 0,
     bd_in = 1,
@@ -547,6 +648,7 @@ struct libws_mqtt_data {
  * ============================================================ */
 int mosquitto_main_loop(struct mosquitto_db *db, mosq_sock_t *listensock, int listensock_count);
 struct mosquitto_db *mosquitto__get_db(void);
+int loop__write_context(struct mosquitto_db *db, struct mosquitto *context);
 
 /* ============================================================
  * Config functions
@@ -597,15 +699,31 @@ int handle__publish(struct mosquitto_db *db, struct mosquitto *context);
 int handle__subscribe(struct mosquitto_db *db, struct mosquitto *context);
 int handle__unsubscribe(struct mosquitto_db *db, struct mosquitto *context);
 int handle__auth(struct mosquitto_db *db, struct mosquitto *context);
+int handle__publish_pending(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__plugin_pending *pending);
 
 /* ============================================================
  * Database handling
  * ============================================================ */
+extern struct mosquitto__pool client_msg_pool;
+extern struct mosquitto__pool msg_store_pool;
 int db__open(struct mosquitto__config *config, struct mosquitto_db *db);
 int db__close(struct mosquitto_db *db);
 #ifdef WITH_PERSISTENCE
 int persist__backup(struct mosquitto_db *db, bool shutdown);
 int persist__restore(struct mosquitto_db *db);
+int persist__autosave(struct mosquitto_db *db);
+int persist__backup_background(struct mosquitto_db *db);
+void persist__background_check(struct mosquitto_db *db, bool wait);
+int persist__journal_open(struct mosquitto_db *db);
+void persist__journal_reset(struct mosquitto_db *db, bool shutdown);
+void persist__journal_client(struct mosquitto_db *db, struct mosquitto *context);
+void persist__journal_client_delete(struct mosquitto_db *db, struct mosquitto *context);
+void persist__journal_client_msg(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void persist__journal_client_msg_delete(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
+void persist__journal_msg_store_delete(struct mosquitto_db *db, struct mosquitto_msg_store *stored);
+void persist__journal_retain(struct mosquitto_db *db, const char *topic, struct mosquitto_msg_store *stored);
+void persist__journal_sub(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, uint32_t identifier, int options);
+void persist__journal_sub_delete(struct mosquitto_db *db, struct mosquitto *context, const char *sub);
 #endif
 void db__limits_set(unsigned long inflight_bytes, int queued, unsigned long queued_bytes);
 /* Return the number of in-flight messages in count. */
@@ -613,9 +731,9 @@ int db__message_count(int *count);
 int db__message_delete_outgoing(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state expect_state, int qos);
 int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, mosquitto_property *properties);
 int db__message_release_incoming(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid);
-int db__message_update_outgoing(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state state, int qos);
+int db__message_update_outgoing(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state state, int qos);
 int db__message_write(struct mosquitto_db *db, struct mosquitto *context);
-void db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data);
+int db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data);
 int db__messages_delete(struct mosquitto_db *db, struct mosquitto *context);
 int db__messages_easy_queue(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int qos, uint32_t payloadlen, const void *payload, int retain, uint32_t message_expiry_interval, mosquitto_property **properties);
 int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, uint16_t source_mid, char *topic, int qos, uint32_t payloadlen, mosquitto__payload_uhpa *payload, int retain, struct mosquitto_msg_store **stored, uint32_t message_expiry_interval, mosquitto_property *properties, dbid_t store_id, enum mosquitto_msg_origin origin);
@@ -626,21 +744,49 @@ void db__msg_store_ref_inc(struct mosquitto_msg_store *store);
 void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store);
 void db__msg_store_clean(struct mosquitto_db *db);
 void db__msg_store_compact(struct mosquitto_db *db);
+bool spill__wanted(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_data *msg_data, struct mosquitto_msg_store *stored);
+int spill__push(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data, struct mosquitto_msg_store *stored, uint16_t mid, int qos, bool retain, mosquitto_property *properties);
+int spill__pop(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg **msg);
+void spill__discard(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data);
+void spill__cleanup(void);
+#ifdef WITH_PERSISTENCE
+int spill__persist(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context);
+#endif
 int db__message_reconnect_reset(struct mosquitto_db *db, struct mosquitto *context);
 void sys_tree__init(struct mosquitto_db *db);
 void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time);
+#ifdef WITH_SYS_TREE
+int metrics__init(struct mosquitto_db *db);
+void metrics__cleanup(struct mosquitto_db *db);
+bool metrics__handle(struct mosquitto_db *db, int fd, uint32_t events);
+void metrics__check_timeouts(struct mosquitto_db *db, time_t now);
+#endif
 
 /* ============================================================
  * Subscription functions
  * ============================================================ */
+extern struct mosquitto__pool subleaf_pool;
 int sub__add(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, uint32_t identifier, int options, struct mosquitto__subhier **root);
 struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent, struct mosquitto__subhier **sibling, const char *topic, size_t len);
+struct mosquitto__subhier *sub__add_hier(struct mosquitto_db *db, const char *sub);
+int sub__add_restored(struct mosquitto_db *db, struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier);
 int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct mosquitto__subhier *root, uint8_t *reason);
 void sub__tree_print(struct mosquitto__subhier *root, int level);
 int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context);
 int sub__retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos, uint32_t subscription_identifier);
+void sub__retain_clear(struct mosquitto_db *db, const char *topic);
 int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store **stored);
 
+/* ============================================================
+ * Subscription match cache functions
+ * ============================================================ */
+struct subs_cache_entry *subs_cache__find(const char *topic);
+struct subs_cache_entry *subs_cache__add(struct mosquitto_db *db, const char *topic);
+void subs_cache__append(struct subs_cache_entry *entry, struct mosquitto__subhier *hier);
+void subs_cache__discard(struct subs_cache_entry *entry);
+void subs_cache__invalidate(void);
+void subs_cache__cleanup(void);
+
 /* ============================================================
  * Context functions
  * ============================================================ */
@@ -653,12 +799,15 @@ void context__send_will(struct mosquitto_db *db, struct mosquitto *context);
 void context__remove_from_by_id(struct mosquitto_db *db, struct mosquitto *context);
 
 int connect__on_authorised(struct mosquitto_db *db, struct mosquitto *context, void *auth_data_out, uint16_t auth_data_out_len);
+int connect__pending(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__plugin_pending *pending);
 
 /* ============================================================
  * Logging functions
  * ============================================================ */
 int log__init(struct mosquitto__config *config);
 int log__close(struct mosquitto__config *config);
+void log__topic_publish(struct mosquitto_db *db);
+void log__dropped(unsigned long *queue_full, unsigned long *rate_limited);
 int log__printf(struct mosquitto *mosq, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 void log__internal(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
@@ -685,6 +834,9 @@ int property__process_disconnect(struct mosquitto *context, mosquitto_property *
  * Security related functions
  * ============================================================ */
 int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context);
+void acl__cache_init(struct mosquitto_db *db, struct mosquitto *context);
+void acl__cache_clear(struct mosquitto *context);
+void acl__cache_free(struct mosquitto *context);
 int mosquitto_security_module_init(struct mosquitto_db *db);
 int mosquitto_security_module_cleanup(struct mosquitto_db *db);
 
@@ -692,6 +844,7 @@ int mosquitto_security_init(struct mosquitto_db *db, bool reload);
 int mosquitto_security_apply(struct mosquitto_db *db);
 int mosquitto_security_cleanup(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access);
+int mosquitto_acl_check_publish(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain);
 int mosquitto_unpwd_check(struct mosquitto_db *db, struct mosquitto *context, const char *username, const char *password);
 int mosquitto_psk_key_get(struct mosquitto_db *db, struct mosquitto *context, const char *hint, const char *identity, char *key, int max_key_len);
 
@@ -701,17 +854,38 @@ int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload);
 int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access);
 int mosquitto_unpwd_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *username, const char *password);
 int mosquitto_psk_key_get_default(struct mosquitto_db *db, struct mosquitto *context, const char *hint, const char *identity, char *key, int max_key_len);
+#ifdef WITH_TLS
+int pw__verify(const char *password, const struct mosquitto__unpwd *u);
+#endif
 
 int mosquitto_security_auth_start(struct mosquitto_db *db, struct mosquitto *context, bool reauth, const void *data_in, uint16_t data_in_len, void **data_out, uint16_t *data_out_len);
 int mosquitto_security_auth_continue(struct mosquitto_db *db, struct mosquitto *context, const void *data_in, uint16_t data_len, void **data_out, uint16_t *data_out_len);
 
+struct mosquitto__plugin_pending *plugin__pending_new(struct mosquitto *context, enum mosquitto__plugin_pending_type type);
+void plugin__pending_free(struct mosquitto__plugin_pending *pending);
+void plugin__pending_resume(struct mosquitto_db *db, struct mosquitto *context);
+int plugin__pending_result(struct mosquitto *client, enum mosquitto__plugin_pending_type type, int result);
+
+/* ============================================================
+ * Timers
+ * ============================================================ */
+void timer__add(struct mosquitto__timer *timer, time_t expiry, void (*callback)(struct mosquitto_db *, struct mosquitto__timer *), void *data);
+void timer__remove(struct mosquitto__timer *timer);
+bool timer__pending(struct mosquitto__timer *timer);
+void timer__check(struct mosquitto_db *db, time_t now);
+
+/* ============================================================
+ * Keepalive
+ * ============================================================ */
+void keepalive__add(struct mosquitto *context);
+void keepalive__remove(struct mosquitto *context);
+
 /* ============================================================
  * Session expiry
  * ============================================================ */
 int session_expiry__add(struct mosquitto_db *db, struct mosquitto *context);
 void session_expiry__remove(struct mosquitto *context);
 void session_expiry__remove_all(struct mosquitto_db *db);
-void session_expiry__check(struct mosquitto_db *db, time_t now);
 void session_expiry__send_all(struct mosquitto_db *db);
 
 /* ============================================================
@@ -730,9 +904,33 @@ void do_disconnect(struct mosquitto_db *db, struct mosquitto *context, int reaso
  * Will delay
  * ============================================================ */
 int will_delay__add(struct mosquitto *context);
-void will_delay__check(struct mosquitto_db *db, time_t now);
 void will_delay__send_all(struct mosquitto_db *db);
 void will_delay__remove(struct mosquitto *mosq);
 
+/* ============================================================
+ * Main loop wake list and broker lock
+ * ============================================================ */
+int worker__start(struct mosquitto_db *db);
+void worker__stop(struct mosquitto_db *db);
+void worker__lock(void);
+void worker__unlock(void);
+struct mosquitto__worker *worker__main(void);
+void worker__wake(struct mosquitto *context);
+bool worker__wake_waiting(struct mosquitto__worker *worker);
+void worker__wake_take(struct mosquitto__worker *worker);
+struct mosquitto *worker__wake_pop(struct mosquitto__worker *worker);
+void worker__wake_drain(int wakefd);
+bool worker__is_main_wakefd(int fd);
+bool worker__is_broker_thread(void);
+
+/* ============================================================
+ * Password check threads
+ * ============================================================ */
+#ifdef WITH_TLS
+int pw__pool_start(struct mosquitto_db *db);
+void pw__pool_stop(void);
+int pw__pool_submit(struct mosquitto *context, const struct mosquitto__unpwd *u, const char *password);
+#endif
+
 #endif
 
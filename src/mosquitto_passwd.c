@@ -34,6 +34,7 @@ Contributors:
 
 #define MAX_BUFFER_LEN 65536
 #define SALT_LEN 12
+#define PW_DEFAULT_ITERATIONS 101
 
 #include "misc_mosq.h"
 
@@ -44,6 +45,14 @@ struct cb_helper {
     bool found;
 };
 
+enum pwhash_type{
+    HASH_SHA512 = 6,
+    HASH_SHA512_PBKDF2 = 7,
+};
+
+static enum pwhash_type hashtype = HASH_SHA512_PBKDF2;
+static int iterations = PW_DEFAULT_ITERATIONS;
+
 static char alphanum[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
 
 static unsigned char tmpfile_path[36];
@@ -107,12 +116,14 @@ int base64_encode(unsigned char *in, unsigned int in_len, char **encoded)
 void print_usage(void)
 {
     printf("mosquitto_passwd is a tool for managing password files for mosquitto.\n\n");
-    printf("Usage: mosquitto_passwd [-c | -D] passwordfile username\n");
-    printf("       mosquitto_passwd -b passwordfile username password\n");
-    printf("       mosquitto_passwd -U passwordfile\n");
+    printf("Usage: mosquitto_passwd [-H hash] [-I iterations] [-c | -D] passwordfile username\n");
+    printf("       mosquitto_passwd [-H hash] [-I iterations] -b passwordfile username password\n");
+    printf("       mosquitto_passwd [-H hash] [-I iterations] -U passwordfile\n");
     printf(" -b : run in batch mode to allow passing passwords on the command line.\n");
     printf(" -c : create a new password file. This will overwrite existing files.\n");
     printf(" -D : delete the username rather than adding/updating its password.\n");
+    printf(" -H : specify the hashing algorithm, sha512 or sha512-pbkdf2. Defaults to sha512-pbkdf2.\n");
+    printf(" -I : specify the number of PBKDF2 iterations. Defaults to %d.\n", PW_DEFAULT_ITERATIONS);
     printf(" -U : update a plain text password file to use hashed passwords.\n");
     printf("\nSee https://mosquitto.org/ for more information.\n\n");
 }
@@ -152,21 +163,30 @@ int output_new_password(FILE *fptr, const char *username, const char *password)
         return 1;
     }
 
+    if(hashtype == HASH_SHA512_PBKDF2){
+        hash_len = EVP_MD_size(digest);
+        if(!PKCS5_PBKDF2_HMAC(password, strlen(password), salt, SALT_LEN, iterations, digest, hash_len, hash)){
+            free(salt64);
+            fprintf(stderr, "Error: Unable to hash password.\n");
+            return 1;
+        }
+    }else{
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
-    EVP_MD_CTX_init(&context);
-    EVP_DigestInit_ex(&context, digest, NULL);
-    EVP_DigestUpdate(&context, password, strlen(password));
-    EVP_DigestUpdate(&context, salt, SALT_LEN);
-    EVP_DigestFinal_ex(&context, hash, &hash_len);
-    EVP_MD_CTX_cleanup(&context);
+        EVP_MD_CTX_init(&context);
+        EVP_DigestInit_ex(&context, digest, NULL);
+        EVP_DigestUpdate(&context, password, strlen(password));
+        EVP_DigestUpdate(&context, salt, SALT_LEN);
+        EVP_DigestFinal_ex(&context, hash, &hash_len);
+        EVP_MD_CTX_cleanup(&context);
 #else
-    context = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(context, digest, NULL);
-    EVP_DigestUpdate(context, password, strlen(password));
-    EVP_DigestUpdate(context, salt, SALT_LEN);
-    EVP_DigestFinal_ex(context, hash, &hash_len);
-    EVP_MD_CTX_free(context);
+        context = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(context, digest, NULL);
+        EVP_DigestUpdate(context, password, strlen(password));
+        EVP_DigestUpdate(context, salt, SALT_LEN);
+        EVP_DigestFinal_ex(context, hash, &hash_len);
+        EVP_MD_CTX_free(context);
 #endif
+    }
 
     rc = base64_encode(hash, hash_len, &hash64);
     if(rc){
@@ -176,7 +196,11 @@ int output_new_password(FILE *fptr, const char *username, const char *password)
         return 1;
     }
 
-    fprintf(fptr, "%s:$6$%s$%s\n", username, salt64, hash64);
+    if(hashtype == HASH_SHA512_PBKDF2){
+        fprintf(fptr, "%s:$7$%d$%s$%s\n", username, iterations, salt64, hash64);
+    }else{
+        fprintf(fptr, "%s:$6$%s$%s\n", username, salt64, hash64);
+    }
     free(salt64);
     free(hash64);
 
@@ -474,6 +498,31 @@ int main(int argc, char *argv[])
             | OPENSSL_INIT_LOAD_CONFIG, NULL);
 #endif
 
+    while(argc > 1 && (!strcmp(argv[1], "-H") || !strcmp(argv[1], "-I"))){
+        if(argc < 3){
+            fprintf(stderr, "Error: %s argument given but no value specified.\n", argv[1]);
+            return 1;
+        }
+        if(!strcmp(argv[1], "-H")){
+            if(!strcmp(argv[2], "sha512")){
+                hashtype = HASH_SHA512;
+            }else if(!strcmp(argv[2], "sha512-pbkdf2")){
+                hashtype = HASH_SHA512_PBKDF2;
+            }else{
+                fprintf(stderr, "Error: Unknown hash type '%s'.\n", argv[2]);
+                return 1;
+            }
+        }else{
+            iterations = atoi(argv[2]);
+            if(iterations < 1){
+                fprintf(stderr, "Error: Number of iterations must be > 0.\n");
+                return 1;
+            }
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
     if(argc == 1){
         print_usage();
         return 1;
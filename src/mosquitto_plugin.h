@@ -21,7 +21,7 @@ Contributors:
 extern "C" {
 #endif
 
-#define MOSQ_AUTH_PLUGIN_VERSION 4
+#define MOSQ_AUTH_PLUGIN_VERSION 5
 
 #define MOSQ_ACL_NONE 0x00
 #define MOSQ_ACL_READ 0x01
@@ -80,6 +80,26 @@ struct mosquitto_acl_msg {
  *   returns MOSQ_ERR_PLUGIN_DEFER then the next plugin runs its check.
  * * If the final plugin returns MOSQ_ERR_PLUGIN_DEFER, then access will be
  *   denied.
+ *
+ * Version 5 plugins have the same functions as version 4 plugins, and may also
+ * answer some checks with MOSQ_ERR_PLUGIN_PENDING if they can't give a result
+ * straight away, for example because they need to ask another server. The
+ * broker holds the client's packet, and stops reading from that client, until
+ * the plugin gives the result by calling mosquitto_unpwd_check_complete() or
+ * mosquitto_acl_check_complete() from mosquitto_broker.h. All other clients
+ * are served as normal in the meantime. This is possible for:
+ *
+ * * mosquitto_auth_unpwd_check(), when a client connects.
+ * * mosquitto_auth_acl_check() with MOSQ_ACL_WRITE, when a client publishes.
+ *
+ * A plugin that returns MOSQ_ERR_PLUGIN_PENDING must complete the check
+ * later, even if the client has disconnected in the meantime, because the
+ * broker keeps the client around until it does. The client and msg arguments
+ * may only be used for the duration of the call, apart from the client being
+ * passed back to the complete function, so copy anything else that is needed
+ * to answer the check. A MOSQ_ERR_PLUGIN_PENDING returned for any other
+ * check, or for a MOSQ_ACL_WRITE check on a client's will message or on a
+ * websockets client, is treated as a denial and must not be completed.
  */
 
 /* =========================================================================
@@ -234,6 +254,8 @@ int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_opt *opts,
  *    MOSQ_ERR_ACL_DENIED if access was not granted.
  *    MOSQ_ERR_UNKNOWN for an application specific error.
  *    MOSQ_ERR_PLUGIN_DEFER if your plugin does not wish to handle this check.
+ *    MOSQ_ERR_PLUGIN_PENDING if the result of a MOSQ_ACL_WRITE check will be
+ *    given later with mosquitto_acl_check_complete(). Version 5 plugins only.
  */
 int mosquitto_auth_acl_check(void *user_data, int access, struct mosquitto *client, const struct mosquitto_acl_msg *msg);
 
@@ -251,6 +273,8 @@ int mosquitto_auth_acl_check(void *user_data, int access, struct mosquitto *clie
  *    MOSQ_ERR_AUTH if authentication failed.
  *    MOSQ_ERR_UNKNOWN for an application specific error.
  *    MOSQ_ERR_PLUGIN_DEFER if your plugin does not wish to handle this check.
+ *    MOSQ_ERR_PLUGIN_PENDING if the result will be given later with
+ *    mosquitto_unpwd_check_complete(). Version 5 plugins only.
  */
 int mosquitto_auth_unpwd_check(void *user_data, struct mosquitto *client, const char *username, const char *password);
 
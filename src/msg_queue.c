@@ -0,0 +1,102 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "mosquitto.h"
+#include "memory_mosq.h"
+#include "msg_queue.h"
+
+/* The queued messages of a client, waiting for space in flight, as a ring of
+ * pointers.
+ *
+ * Messages only ever join at the back and leave from the front, so a ring
+ * gives O(1) push and pop and keeps a large backlog for a persistent session
+ * in one block rather than threaded through every message. The messages
+ * themselves still come from client_msg_pool, because the inflight list and
+ * the persistence journal keep pointers to them.
+ *
+ * The ring starts small and is doubled when full, so a client with nothing
+ * queued costs nothing and one at max_queued_messages has a ring at most
+ * twice that size. It is halved again once an eighth full. The rare removals
+ * from the middle, for an ACL change or journal replay, are made by popping
+ * every message and pushing back those that are kept.
+ */
+
+#define MSG_QUEUE_MIN_SIZE 16
+
+
+static int msg_queue__resize(struct mosquitto__msg_queue *queue, int size)
+{
+    struct mosquitto_client_msg **msgs;
+    int i;
+
+    msgs = mosquitto__malloc(size*sizeof(struct mosquitto_client_msg *));
+    if(!msgs) return MOSQ_ERR_NOMEM;
+
+    for(i=0; i<queue->count; i++){
+        msgs[i] = queue->msgs[(queue->head + i) & (queue->size-1)];
+    }
+    mosquitto__free(queue->msgs);
+    queue->msgs = msgs;
+    queue->size = size;
+    queue->head = 0;
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+int msg_queue__push(struct mosquitto__msg_queue *queue, struct mosquitto_client_msg *msg)
+{
+    int size;
+
+    if(queue->count == queue->size){
+        size = queue->size ? queue->size*2 : MSG_QUEUE_MIN_SIZE;
+        if(msg_queue__resize(queue, size)) return MOSQ_ERR_NOMEM;
+    }
+
+    queue->msgs[(queue->head + queue->count) & (queue->size-1)] = msg;
+    queue->count++;
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+struct mosquitto_client_msg *msg_queue__pop(struct mosquitto__msg_queue *queue)
+{
+    struct mosquitto_client_msg *msg;
+
+    if(queue->count == 0) return NULL;
+
+    msg = queue->msgs[queue->head];
+    queue->head = (queue->head + 1) & (queue->size-1);
+    queue->count--;
+
+    if(queue->size > MSG_QUEUE_MIN_SIZE && queue->count*8 < queue->size){
+        /* Failing to shrink isn't a problem. */
+        msg_queue__resize(queue, queue->size/2);
+    }
+    return msg;
+}
+
+
+void msg_queue__cleanup(struct mosquitto__msg_queue *queue)
+{
+    mosquitto__free(queue->msgs);
+    memset(queue, 0, sizeof(struct mosquitto__msg_queue));
+}
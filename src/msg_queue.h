@@ -0,0 +1,40 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#ifndef MSG_QUEUE_H
+#define MSG_QUEUE_H
+
+#include "mosquitto_internal.h"
+
+struct mosquitto_client_msg;
+
+int msg_queue__push(struct mosquitto__msg_queue *queue, struct mosquitto_client_msg *msg);
+struct mosquitto_client_msg *msg_queue__pop(struct mosquitto__msg_queue *queue);
+void msg_queue__cleanup(struct mosquitto__msg_queue *queue);
+
+/* The i'th message from the front of the queue, or NULL. */
+static inline struct mosquitto_client_msg *msg_queue__get(const struct mosquitto__msg_queue *queue, int i)
+{
+    if(i < 0 || i >= queue->count) return NULL;
+    return queue->msgs[(queue->head + i) & (queue->size-1)];
+}
+
+static inline struct mosquitto_client_msg *msg_queue__first(const struct mosquitto__msg_queue *queue)
+{
+    return msg_queue__get(queue, 0);
+}
+
+#endif
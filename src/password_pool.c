@@ -0,0 +1,237 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_TLS
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+
+/* Threads for checking passwords against the password_file.
+ *
+ * Hashing a password, and PBKDF2 in particular, is slow enough that doing it
+ * on the main loop holds up every other client. With password_check_threads
+ * set, mosquitto_unpwd_check_default() copies what is needed for the check in
+ * to a job and answers MOSQ_ERR_PLUGIN_PENDING, so the CONNECT is parked in
+ * the same way as for a version 5 auth plugin. The result is handed back with
+ * plugin__pending_result(), which wakes the main loop.
+ *
+ * Jobs are allocated and freed with db_mutex held, like all other broker
+ * memory, only the hashing itself is done without it.
+ */
+
+/* See worker.c */
+#undef pthread_create
+#undef pthread_join
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+
+struct pw__job{
+    struct pw__job *next;
+    struct mosquitto *context;
+    char *password;
+    struct mosquitto__unpwd u;
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t *threads = NULL;
+static int thread_count = 0;
+static bool stop = false;
+static struct pw__job *queue_head = NULL;
+static struct pw__job *queue_tail = NULL;
+
+
+static void pw__job_free(struct pw__job *job)
+{
+    mosquitto__free(job->password);
+    mosquitto__free(job->u.password);
+    mosquitto__free(job->u.salt);
+    mosquitto__free(job);
+}
+
+
+static void *pw__thread_main(void *arg)
+{
+    struct pw__job *job;
+    int rc;
+
+    UNUSED(arg);
+
+    pthread_mutex_lock(&pool_mutex);
+    while(1){
+        while(!queue_head && !stop){
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+        }
+        if(stop) break;
+
+        job = queue_head;
+        queue_head = job->next;
+        if(!queue_head){
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+
+        rc = pw__verify(job->password, &job->u);
+
+        worker__lock();
+        plugin__pending_result(job->context, plugin_pending_unpwd, rc);
+        pw__job_free(job);
+        worker__unlock();
+
+        pthread_mutex_lock(&pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    return NULL;
+}
+
+
+static void pw__threads_join(void)
+{
+    int i;
+
+    pthread_mutex_lock(&pool_mutex);
+    stop = true;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    for(i=0; i<thread_count; i++){
+        pthread_join(threads[i], NULL);
+    }
+    thread_count = 0;
+}
+
+
+/* Must be called with db_mutex held. */
+int pw__pool_start(struct mosquitto_db *db)
+{
+    sigset_t sigblock, origsig;
+    int i;
+
+    if(db->config->password_check_threads < 1){
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    threads = mosquitto__calloc(db->config->password_check_threads, sizeof(pthread_t));
+    if(!threads){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+        return MOSQ_ERR_NOMEM;
+    }
+    stop = false;
+
+    /* Signals are only ever handled by the main thread. */
+    sigfillset(&sigblock);
+    pthread_sigmask(SIG_BLOCK, &sigblock, &origsig);
+
+    for(i=0; i<db->config->password_check_threads; i++){
+        if(pthread_create(&threads[i], NULL, pw__thread_main, NULL)){
+            log__printf(NULL, MOSQ_LOG_ERR, "Error creating password check thread.");
+            break;
+        }
+        thread_count++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &origsig, NULL);
+
+    if(thread_count != db->config->password_check_threads){
+        pw__threads_join();
+        mosquitto__free(threads);
+        threads = NULL;
+        return MOSQ_ERR_UNKNOWN;
+    }
+    log__printf(NULL, MOSQ_LOG_INFO, "Started %d password check threads.", thread_count);
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Must be called without db_mutex held. Checks still queued are dropped, the
+ * clients waiting for them are only freed on exit. */
+void pw__pool_stop(void)
+{
+    struct pw__job *job;
+
+    pw__threads_join();
+
+    worker__lock();
+    while(queue_head){
+        job = queue_head;
+        queue_head = job->next;
+        pw__job_free(job);
+    }
+    queue_tail = NULL;
+    mosquitto__free(threads);
+    threads = NULL;
+    worker__unlock();
+}
+
+
+/* Queue a check of password against u for context. Returns
+ * MOSQ_ERR_PLUGIN_PENDING if the check has been queued, or
+ * MOSQ_ERR_NOT_SUPPORTED if it should be made straight away instead. Must be
+ * called with db_mutex held. */
+int pw__pool_submit(struct mosquitto *context, const struct mosquitto__unpwd *u, const char *password)
+{
+    struct pw__job *job;
+
+    if(thread_count == 0){
+        return MOSQ_ERR_NOT_SUPPORTED;
+    }
+#ifdef WITH_WEBSOCKETS
+    if(context->wsi){
+        /* Websockets clients can't have their reads paused. */
+        return MOSQ_ERR_NOT_SUPPORTED;
+    }
+#endif
+
+    job = mosquitto__calloc(1, sizeof(struct pw__job));
+    if(!job) return MOSQ_ERR_NOMEM;
+
+    job->context = context;
+    job->u.hashtype = u->hashtype;
+    job->u.iterations = u->iterations;
+    job->u.password_len = u->password_len;
+    job->u.salt_len = u->salt_len;
+    job->password = mosquitto__strdup(password);
+    job->u.password = mosquitto__malloc(u->password_len);
+    job->u.salt = mosquitto__malloc(u->salt_len);
+    if(!job->password || !job->u.password || !job->u.salt){
+        pw__job_free(job);
+        return MOSQ_ERR_NOMEM;
+    }
+    memcpy(job->u.password, u->password, u->password_len);
+    memcpy(job->u.salt, u->salt, u->salt_len);
+
+    pthread_mutex_lock(&pool_mutex);
+    if(queue_tail){
+        queue_tail->next = job;
+    }else{
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    return MOSQ_ERR_PLUGIN_PENDING;
+}
+
+#endif
@@ -17,7 +17,7 @@ Contributors:
 #ifndef PERSIST_H
 #define PERSIST_H
 
-#define MOSQ_DB_VERSION 5
+#define MOSQ_DB_VERSION 6
 
 /* DB read/write */
 extern const unsigned char magic[15];
@@ -27,8 +27,18 @@ extern const unsigned char magic[15];
 #define DB_CHUNK_RETAIN 4
 #define DB_CHUNK_SUB 5
 #define DB_CHUNK_CLIENT 6
+/* Journal only, see persist_journal.c */
+#define DB_CHUNK_CLIENT_DELETE 7
+#define DB_CHUNK_CLIENT_MSG_DELETE 8
+#define DB_CHUNK_MSG_STORE_DELETE 9
+#define DB_CHUNK_RETAIN_DELETE 10
+#define DB_CHUNK_SUB_DELETE 11
 /* End DB read/write */
 
+/* Payload encodings, see struct PF_payload. */
+#define DB_PAYLOAD_RAW 0
+#define DB_PAYLOAD_LZ4 1
+
 #define read_e(f, b, c) if(fread(b, 1, c, f) != c){ goto error; }
 #define write_e(f, b, c) if(fwrite(b, 1, c, f) != c){ goto error; }
 
@@ -43,6 +53,11 @@ extern const unsigned char magic[15];
  * rearranged without updating the db format version. When adding new members,
  * always use explicit sized datatypes ("uint32_t", not "long"), and check
  * whether what is being added can go in an existing hole in the struct.
+ *
+ * Version 6 uses the version 5 chunks, with two changes. Every chunk is
+ * followed by a uint32_t CRC-32 of its header and contents, which is not
+ * counted in the header length. Message store chunks have a PF_payload after
+ * their PF_msg_store, and the payload is stored in that encoding.
  */
 
 struct PF_header{
@@ -97,6 +112,13 @@ struct PF_msg_store{
     uint8_t qos;
     uint8_t retain;
 };
+/* Version 6 and later. stored_len is the length of the payload as stored,
+ * payloadlen in PF_msg_store is the length once decoded. */
+struct PF_payload{
+    uint32_t stored_len;
+    uint8_t encoding;
+    uint8_t padding[3];
+};
 struct P_msg_store{
     struct PF_msg_store F;
     mosquitto__payload_uhpa payload;
@@ -128,6 +150,8 @@ struct P_retain{
 };
 
 
+char *persist__journal_path(struct mosquitto_db *db);
+
 int persist__read_string_len(FILE *db_fptr, char **str, uint16_t len);
 int persist__read_string(FILE *db_fptr, char **str);
 
@@ -149,11 +173,36 @@ int persist__chunk_msg_store_read_v5(FILE *db_fptr, struct P_msg_store *chunk, u
 int persist__chunk_retain_read_v5(FILE *db_fptr, struct P_retain *chunk);
 int persist__chunk_sub_read_v5(FILE *db_fptr, struct P_sub *chunk);
 
+int persist__chunk_header_parse_v5(const uint8_t *buf, int *chunk, int *length);
+int persist__chunk_cfg_parse_v5(const uint8_t *buf, uint32_t length, struct PF_cfg *chunk);
+int persist__chunk_client_parse_v5(const uint8_t *buf, uint32_t length, struct P_client *chunk);
+int persist__chunk_client_msg_parse_v5(const uint8_t *buf, uint32_t length, struct P_client_msg *chunk);
+int persist__chunk_msg_store_parse_v5(const uint8_t *buf, uint32_t length, struct P_msg_store *chunk);
+int persist__chunk_retain_parse_v5(const uint8_t *buf, uint32_t length, struct P_retain *chunk);
+int persist__chunk_sub_parse_v5(const uint8_t *buf, uint32_t length, struct P_sub *chunk);
+
+int persist__chunk_read_v6(FILE *db_fptr, int *chunk, uint32_t *length, uint8_t **buf, size_t *buf_size);
+int persist__chunk_crc_check_v6(const uint8_t *buf, uint32_t length);
+int persist__chunk_msg_store_parse_v6(const uint8_t *buf, uint32_t length, struct P_msg_store *chunk);
+int persist__chunk_string_parse_v5(const uint8_t *buf, uint32_t length, const char **str, uint16_t *len);
+
 int persist__chunk_cfg_write_v5(FILE *db_fptr, struct PF_cfg *chunk);
 int persist__chunk_client_write_v5(FILE *db_fptr, struct P_client *chunk);
 int persist__chunk_client_msg_write_v5(FILE *db_fptr, struct P_client_msg *chunk);
 int persist__chunk_message_store_write_v5(FILE *db_fptr, struct P_msg_store *chunk);
 int persist__chunk_retain_write_v5(FILE *db_fptr, struct P_retain *chunk);
 int persist__chunk_sub_write_v5(FILE *db_fptr, struct P_sub *chunk);
+int persist__chunk_string_write_v5(FILE *db_fptr, int chunk_id, const char *str);
+int persist__chunk_client_msg_delete_write_v5(FILE *db_fptr, struct P_client_msg *chunk);
+int persist__chunk_msg_store_delete_write_v5(FILE *db_fptr, struct P_retain *chunk);
+int persist__chunk_sub_delete_write_v5(FILE *db_fptr, struct P_sub *chunk);
+
+uint32_t persist__crc32(uint32_t crc, const void *buf, size_t len);
+uint32_t persist__compress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len);
+int persist__decompress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len);
+
+int persist__header_write(FILE *db_fptr);
+int persist__message_store_write(FILE *db_fptr, struct mosquitto_msg_store *stored);
+int persist__client_message_write(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *cmsg);
 
 #endif
@@ -0,0 +1,287 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_PERSISTENCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mosquitto_broker_internal.h"
+#include "persist.h"
+
+/* Checksums and payload compression for version 6 of the persistence format.
+ *
+ * persist__crc32() is the usual CRC-32 (as used by zlib and gzip), worked
+ * four bytes at a time.
+ *
+ * Payloads are compressed in the LZ4 block format, so they can be checked
+ * with other tools if need be. The compressor is a simple greedy one with a
+ * single hash table, which is enough to catch the repetition in the JSON and
+ * similar text that makes up most large payloads, and is cheap enough to run
+ * for every message written to the journal. The decompressor checks every
+ * length and offset against its input and output, so a damaged payload is
+ * reported rather than read or written out of bounds.
+ */
+
+#define CRC_POLY 0xEDB88320UL
+
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5
+#define LZ4_MFLIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS_MIN 8
+#define LZ4_HASH_BITS_MAX 12
+
+static uint32_t crc_table[4][256];
+static bool crc_init = false;
+
+
+static void crc__init(void)
+{
+    uint32_t c;
+    int i, j;
+
+    for(i=0; i<256; i++){
+        c = (uint32_t)i;
+        for(j=0; j<8; j++){
+            c = (c & 1) ? (c >> 1) ^ CRC_POLY : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for(i=0; i<256; i++){
+        c = crc_table[0][i];
+        for(j=1; j<4; j++){
+            c = crc_table[0][c & 0xFF] ^ (c >> 8);
+            crc_table[j][i] = c;
+        }
+    }
+    crc_init = true;
+}
+
+
+/* Start with crc=0, and pass the result back in to continue over more data. */
+uint32_t persist__crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    if(!crc_init) crc__init();
+
+    crc = ~crc;
+    while(len >= 4){
+        crc ^= (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+        crc = crc_table[3][crc & 0xFF]
+            ^ crc_table[2][(crc >> 8) & 0xFF]
+            ^ crc_table[1][(crc >> 16) & 0xFF]
+            ^ crc_table[0][crc >> 24];
+        p += 4;
+        len -= 4;
+    }
+    while(len--){
+        crc = crc_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+static uint32_t lz4__read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(uint32_t));
+    return v;
+}
+
+
+/* Bytes needed for the extra length bytes of a literal or match length that
+ * doesn't fit in its half of the token. */
+static uint32_t lz4__length_bytes(uint32_t len)
+{
+    if(len < 15) return 0;
+    return (len - 15)/255 + 1;
+}
+
+
+static uint32_t lz4__length_write(uint8_t *dst, uint32_t len)
+{
+    uint32_t n = 0;
+
+    len -= 15;
+    while(len >= 255){
+        dst[n++] = 255;
+        len -= 255;
+    }
+    dst[n++] = (uint8_t)len;
+    return n;
+}
+
+
+/* Write one sequence, the literals src[0..lit_len) followed by a match of
+ * match_len bytes at offset, or with match_len == 0 just the final literals.
+ * Returns the number of bytes written, or 0 if they don't fit in dst_len. */
+static uint32_t lz4__sequence_write(uint8_t *dst, uint32_t dst_len, const uint8_t *src, uint32_t lit_len, uint32_t offset, uint32_t match_len)
+{
+    uint32_t needed;
+    uint32_t n = 0;
+    uint8_t *token;
+
+    needed = 1 + lz4__length_bytes(lit_len) + lit_len;
+    if(match_len){
+        needed += 2 + lz4__length_bytes(match_len - LZ4_MINMATCH);
+    }
+    if(needed > dst_len) return 0;
+
+    token = &dst[n++];
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4);
+    if(lit_len >= 15){
+        n += lz4__length_write(&dst[n], lit_len);
+    }
+    memcpy(&dst[n], src, lit_len);
+    n += lit_len;
+
+    if(match_len){
+        dst[n++] = (uint8_t)(offset & 0xFF);
+        dst[n++] = (uint8_t)(offset >> 8);
+        match_len -= LZ4_MINMATCH;
+        *token |= (uint8_t)(match_len < 15 ? match_len : 15);
+        if(match_len >= 15){
+            n += lz4__length_write(&dst[n], match_len);
+        }
+    }
+    return n;
+}
+
+
+/* Compress src into dst. Returns the compressed length, or 0 if it doesn't
+ * fit in dst_len, in which case the data should be stored as it is. */
+uint32_t persist__compress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len)
+{
+    uint32_t table[1<<LZ4_HASH_BITS_MAX];
+    int bits = LZ4_HASH_BITS_MIN;
+    uint32_t ip = 0, anchor = 0, op = 0;
+    uint32_t ref, v, h, match_len, n;
+
+    if(src_len <= LZ4_MFLIMIT) return 0;
+
+    /* Small inputs don't need, or want to clear, the whole table. */
+    while(bits < LZ4_HASH_BITS_MAX && (1U<<bits) < src_len){
+        bits++;
+    }
+    memset(table, 0, sizeof(uint32_t)<<bits);
+
+    while(ip + LZ4_MFLIMIT < src_len){
+        v = lz4__read32(&src[ip]);
+        h = (v * 2654435761U) >> (32 - bits);
+        ref = table[h];
+        table[h] = ip;
+
+        /* Table entries may be stale or unset, the comparison sorts that
+         * out. */
+        if(ref < ip && ip - ref <= LZ4_MAX_OFFSET && lz4__read32(&src[ref]) == v){
+            match_len = LZ4_MINMATCH;
+            while(ip + match_len < src_len - LZ4_LASTLITERALS
+                    && src[ref + match_len] == src[ip + match_len]){
+
+                match_len++;
+            }
+
+            n = lz4__sequence_write(&dst[op], dst_len - op, &src[anchor], ip - anchor, ip - ref, match_len);
+            if(n == 0) return 0;
+            op += n;
+            ip += match_len;
+            anchor = ip;
+        }else{
+            /* Skip ahead faster through data that isn't compressing. */
+            ip += 1 + ((ip - anchor) >> 6);
+        }
+    }
+
+    n = lz4__sequence_write(&dst[op], dst_len - op, &src[anchor], src_len - anchor, 0, 0);
+    if(n == 0) return 0;
+    return op + n;
+}
+
+
+static int lz4__length_read(const uint8_t *src, uint32_t src_len, uint32_t *ip, uint32_t *len, uint32_t max)
+{
+    uint8_t b;
+
+    do{
+        if(*ip >= src_len) return 1;
+        b = src[(*ip)++];
+        *len += b;
+        if(*len > max) return 1;
+    }while(b == 255);
+
+    return 0;
+}
+
+
+/* Decompress src, which must give exactly dst_len bytes. Returns 0 on
+ * success, or 1 if src is corrupt. */
+int persist__decompress(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_len)
+{
+    uint32_t ip = 0, op = 0;
+    uint32_t lit_len, match_len, offset, i;
+    uint8_t token;
+
+    while(1){
+        if(ip >= src_len) return 1;
+        token = src[ip++];
+
+        lit_len = token >> 4;
+        if(lit_len == 15 && lz4__length_read(src, src_len, &ip, &lit_len, dst_len)){
+            return 1;
+        }
+        if(lit_len > src_len - ip || lit_len > dst_len - op) return 1;
+        memcpy(&dst[op], &src[ip], lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if(ip == src_len){
+            /* The last sequence has literals only. */
+            break;
+        }
+
+        if(src_len - ip < 2) return 1;
+        offset = (uint32_t)src[ip] | (uint32_t)src[ip+1]<<8;
+        ip += 2;
+        if(offset == 0 || offset > op) return 1;
+
+        match_len = token & 0x0F;
+        if(match_len == 15 && lz4__length_read(src, src_len, &ip, &match_len, dst_len)){
+            return 1;
+        }
+        match_len += LZ4_MINMATCH;
+        if(match_len > dst_len - op) return 1;
+
+        if(offset >= match_len){
+            memcpy(&dst[op], &dst[op - offset], match_len);
+        }else{
+            /* Overlapping match, repeating the last offset bytes. */
+            for(i=0; i<match_len; i++){
+                dst[op + i] = dst[op - offset + i];
+            }
+        }
+        op += match_len;
+    }
+
+    return op == dst_len ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,330 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_PERSISTENCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "misc_mosq.h"
+#include "persist.h"
+
+/* Append only journal of changes made since the database was last written.
+ *
+ * With persistence_journal enabled, each change to a persistent session or
+ * retained message is appended to <persistence_file>.journal as it happens,
+ * using the same chunks as the database plus the *_DELETE chunks. Every chunk
+ * sets or deletes one keyed item, so the journal can be replayed over the
+ * database it follows in persist__restore() and gives the same result however
+ * much of it had already been applied.
+ *
+ * Message store chunks are only written when a message is first queued for a
+ * persistent client or retained, so messages nobody needs to keep cost
+ * nothing. Autosaves flush and sync the journal instead of rewriting the
+ * database, until the journal grows larger than the database, at which point
+ * the database is rewritten and the journal started again.
+ */
+
+#define JOURNAL_COMPACT_MIN (1024*1024)
+
+static FILE *journal = NULL;
+static long db_size = 0;
+
+
+static bool journal__persistent(struct mosquitto *context)
+{
+    return journal && context && context->id && context->clean_start == false;
+}
+
+
+static void journal__error(void)
+{
+    log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to write persistence journal, the database will be saved in full instead.");
+    fclose(journal);
+    journal = NULL;
+}
+
+
+/* Whether the journal at path was written in an older version of the
+ * format, which can be restored but not appended to. */
+static bool journal__outdated(const char *path)
+{
+    FILE *fptr;
+    char header[15];
+    uint32_t crc;
+    uint32_t i32temp;
+    bool outdated = false;
+
+    fptr = mosquitto__fopen(path, "rb", false);
+    if(!fptr) return false;
+
+    if(fread(&header, 1, 15, fptr) == 15
+            && fread(&crc, 1, sizeof(uint32_t), fptr) == sizeof(uint32_t)
+            && fread(&i32temp, 1, sizeof(uint32_t), fptr) == sizeof(uint32_t)){
+
+        outdated = ntohl(i32temp) != MOSQ_DB_VERSION;
+    }
+    fclose(fptr);
+    return outdated;
+}
+
+
+int persist__journal_open(struct mosquitto_db *db)
+{
+    char *path;
+    struct stat buf;
+
+    if(!db->config->persistence || !db->config->persistence_filepath || !db->config->persistence_journal){
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    path = persist__journal_path(db);
+    if(!path) return MOSQ_ERR_NOMEM;
+
+    if(journal__outdated(path)){
+        /* It has already been restored, writing the database in full
+         * removes it and starts a new one. */
+        log__printf(NULL, MOSQ_LOG_NOTICE, "Persistence journal %s uses an older format, saving the database in full.", path);
+        mosquitto__free(path);
+        return persist__backup(db, false);
+    }
+
+    journal = mosquitto__fopen(path, "ab", false);
+    if(!journal){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open persistence journal %s: %s.", path, strerror(errno));
+        mosquitto__free(path);
+        return 1;
+    }
+    mosquitto__free(path);
+
+    fseek(journal, 0, SEEK_END);
+    if(ftell(journal) == 0){
+        if(persist__header_write(journal)){
+            journal__error();
+            return 1;
+        }
+    }
+
+    if(stat(db->config->persistence_filepath, &buf) == 0){
+        db_size = buf.st_size;
+    }else{
+        db_size = 0;
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Called once the database has been written, everything in the journal is now
+ * in the database. */
+void persist__journal_reset(struct mosquitto_db *db, bool shutdown)
+{
+    char *path;
+
+    if(journal){
+        fclose(journal);
+        journal = NULL;
+    }
+    path = persist__journal_path(db);
+    if(!path) return;
+
+    if(unlink(path) && errno != ENOENT){
+        log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to remove persistence journal %s: %s.", path, strerror(errno));
+    }
+    mosquitto__free(path);
+
+    if(!shutdown){
+        persist__journal_open(db);
+    }
+}
+
+
+int persist__autosave(struct mosquitto_db *db)
+{
+    if(!journal){
+        /* Writes made after the fork would be in neither the database nor
+         * the journal, so background saves are only used without one. */
+        if(db->config->autosave_background && !db->config->persistence_journal){
+            return persist__backup_background(db);
+        }
+        return persist__backup(db, false);
+    }
+
+    if(fflush(journal) || fsync(fileno(journal))){
+        journal__error();
+        return persist__backup(db, false);
+    }
+    if(ftell(journal) > db_size && ftell(journal) > JOURNAL_COMPACT_MIN){
+        return persist__backup(db, false);
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static void journal__msg_store(struct mosquitto_msg_store *stored)
+{
+    if(stored->journalled){
+        return;
+    }
+    if(persist__message_store_write(journal, stored)){
+        journal__error();
+        return;
+    }
+    stored->journalled = true;
+}
+
+
+void persist__journal_client(struct mosquitto_db *db, struct mosquitto *context)
+{
+    struct P_client chunk;
+
+    if(!journal__persistent(context)) return;
+
+    memset(&chunk, 0, sizeof(struct P_client));
+    chunk.F.session_expiry_time = context->session_expiry_time;
+    chunk.F.session_expiry_interval = context->session_expiry_interval;
+    chunk.F.last_mid = context->last_mid;
+    chunk.F.id_len = strlen(context->id);
+    chunk.client_id = context->id;
+
+    if(persist__chunk_client_write_v5(journal, &chunk)){
+        journal__error();
+    }
+}
+
+
+void persist__journal_client_delete(struct mosquitto_db *db, struct mosquitto *context)
+{
+    if(!journal__persistent(context)) return;
+
+    if(persist__chunk_string_write_v5(journal, DB_CHUNK_CLIENT_DELETE, context->id)){
+        journal__error();
+    }
+}
+
+
+void persist__journal_client_msg(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+    if(!journal__persistent(context) || !cmsg->store || !cmsg->store->topic) return;
+
+    journal__msg_store(cmsg->store);
+    if(journal && persist__client_message_write(journal, context, cmsg)){
+        journal__error();
+    }
+}
+
+
+void persist__journal_client_msg_delete(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+    struct P_client_msg chunk;
+
+    if(!journal__persistent(context) || !cmsg->store) return;
+
+    memset(&chunk, 0, sizeof(struct P_client_msg));
+    chunk.F.store_id = cmsg->store->db_id;
+    chunk.F.mid = cmsg->mid;
+    chunk.F.id_len = strlen(context->id);
+    chunk.F.direction = cmsg->direction;
+    chunk.client_id = context->id;
+
+    if(persist__chunk_client_msg_delete_write_v5(journal, &chunk)){
+        journal__error();
+    }
+}
+
+
+void persist__journal_msg_store_delete(struct mosquitto_db *db, struct mosquitto_msg_store *stored)
+{
+    struct P_retain chunk;
+
+    if(!journal || !stored->journalled) return;
+
+    chunk.F.store_id = stored->db_id;
+    if(persist__chunk_msg_store_delete_write_v5(journal, &chunk)){
+        journal__error();
+    }
+}
+
+
+/* A NULL or empty message clears the retained message for topic. */
+void persist__journal_retain(struct mosquitto_db *db, const char *topic, struct mosquitto_msg_store *stored)
+{
+    struct P_retain chunk;
+
+    if(!journal) return;
+
+    if(stored && stored->payloadlen){
+        journal__msg_store(stored);
+        if(!journal) return;
+
+        chunk.F.store_id = stored->db_id;
+        if(persist__chunk_retain_write_v5(journal, &chunk)){
+            journal__error();
+        }
+    }else{
+        if(persist__chunk_string_write_v5(journal, DB_CHUNK_RETAIN_DELETE, topic)){
+            journal__error();
+        }
+    }
+}
+
+
+void persist__journal_sub(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int qos, uint32_t identifier, int options)
+{
+    struct P_sub chunk;
+
+    if(!journal__persistent(context)) return;
+
+    memset(&chunk, 0, sizeof(struct P_sub));
+    chunk.F.identifier = identifier;
+    chunk.F.id_len = strlen(context->id);
+    chunk.F.topic_len = strlen(sub);
+    chunk.F.qos = (uint8_t)qos;
+    chunk.F.options = (uint8_t)options;
+    chunk.client_id = context->id;
+    chunk.topic = (char *)sub;
+
+    if(persist__chunk_sub_write_v5(journal, &chunk)){
+        journal__error();
+    }
+}
+
+
+void persist__journal_sub_delete(struct mosquitto_db *db, struct mosquitto *context, const char *sub)
+{
+    struct P_sub chunk;
+
+    if(!journal__persistent(context)) return;
+
+    memset(&chunk, 0, sizeof(struct P_sub));
+    chunk.F.id_len = strlen(context->id);
+    chunk.F.topic_len = strlen(sub);
+    chunk.client_id = context->id;
+    chunk.topic = (char *)sub;
+
+    if(persist__chunk_sub_delete_write_v5(journal, &chunk)){
+        journal__error();
+    }
+}
+
+#endif
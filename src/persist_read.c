@@ -25,11 +25,17 @@ Contributors:
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
 #include <time.h>
+#include <unistd.h>
 #include <utlist.h>
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
+#include "mid_index_mosq.h"
+#include "msg_queue.h"
 #include "persist.h"
 #include "time_mosq.h"
 #include "misc_mosq.h"
@@ -39,29 +45,54 @@ uint32_t db_version;
 
 const unsigned char magic[15] = {0x00, 0xB5, 0x00, 'm','o','s','q','u','i','t','t','o',' ','d','b'};
 
-static int persist__restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos, uint32_t identifier, int options);
-
-static struct mosquitto *persist__find_or_add_context(struct mosquitto_db *db, const char *client_id, uint16_t last_mid)
+/* State that makes restoring a large database cheaper, only valid during
+ * persist__restore(). */
+static struct {
+    const uint8_t *map;                         /* The database, if mapped */
+    size_t map_len;
+    struct mosquitto *context;                  /* Client of the previous chunk */
+    struct mosquitto_msg_store_load **index;    /* Loaded messages by db_id */
+    dbid_t index_base;
+    size_t index_len;
+    bool index_tried;
+    char *sub_topic;                            /* Topic and node of the */
+    struct mosquitto__subhier *sub_hier;        /* previous subscription */
+    unsigned long msg_count;
+    unsigned long client_msg_count;
+    unsigned long sub_count;
+    long bytes;
+} restore;
+
+static int persist__restore_sub(struct mosquitto_db *db, const char *client_id, uint16_t id_len, const char *sub, uint16_t sub_len, int qos, uint32_t identifier, int options, bool journal);
+
+/* client_id need not be terminated. */
+static struct mosquitto *persist__find_or_add_context(struct mosquitto_db *db, const char *client_id, uint16_t id_len, uint16_t last_mid)
 {
     struct mosquitto *context;
 
-    if(!client_id) return NULL;
+    if(!client_id || !id_len) return NULL;
 
-    context = NULL;
-    HASH_FIND(hh_id, db->contexts_by_id, client_id, strlen(client_id), context);
+    /* Chunks for the same client are usually next to each other. */
+    context = restore.context;
+    if(!context || strncmp(context->id, client_id, id_len) || context->id[id_len] != '\0'){
+        HASH_FIND(hh_id, db->contexts_by_id, client_id, id_len, context);
+    }
     if(!context){
         context = context__init(db, -1);
         if(!context) return NULL;
-        context->id = mosquitto__strdup(client_id);
+        context->id = mosquitto__malloc(id_len+1);
         if(!context->id){
             mosquitto__free(context);
             return NULL;
         }
+        memcpy(context->id, client_id, id_len);
+        context->id[id_len] = '\0';
 
         context->clean_start = false;
 
-        HASH_ADD_KEYPTR(hh_id, db->contexts_by_id, context->id, strlen(context->id), context);
+        HASH_ADD_KEYPTR(hh_id, db->contexts_by_id, context->id, id_len, context);
     }
+    restore.context = context;
     if(last_mid){
         context->last_mid = last_mid;
     }
@@ -106,21 +137,162 @@ int persist__read_string(FILE *db_fptr, char **str)
 }
 
 
-static int persist__client_msg_restore(struct mosquitto_db *db, struct P_client_msg *chunk)
+static bool persist__client_msg_match(struct mosquitto_client_msg *cmsg, dbid_t store_id, uint16_t mid)
+{
+    return cmsg->store->db_id == store_id && cmsg->mid == mid;
+}
+
+
+/* Take the message matching store_id and mid out of the queue, keeping the
+ * order of the rest. */
+static struct mosquitto_client_msg *persist__client_msg_dequeue(struct mosquitto__msg_queue *queue, dbid_t store_id, uint16_t mid)
+{
+    struct mosquitto_client_msg *cmsg, *found = NULL;
+    int i, count;
+
+    count = queue->count;
+    for(i=0; i<count; i++){
+        cmsg = msg_queue__pop(queue);
+        if(!found && persist__client_msg_match(cmsg, store_id, mid)){
+            found = cmsg;
+        }else{
+            msg_queue__push(queue, cmsg);
+        }
+    }
+    return found;
+}
+
+
+/* Remove a message restored from an earlier chunk. Only used when replaying
+ * the journal. */
+static bool persist__client_msg_remove(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data, dbid_t store_id, uint16_t mid)
+{
+    struct mosquitto_client_msg *cmsg;
+
+    DL_FOREACH(msg_data->inflight, cmsg){
+        if(persist__client_msg_match(cmsg, store_id, mid)){
+            break;
+        }
+    }
+    if(cmsg){
+        mid_index__remove(&msg_data->inflight_index, cmsg->mid, cmsg);
+        DL_DELETE(msg_data->inflight, cmsg);
+        if(cmsg->qos > 0 && msg_data->inflight_quota < msg_data->inflight_maximum){
+            msg_data->inflight_quota++;
+        }
+    }else{
+        cmsg = persist__client_msg_dequeue(&msg_data->queued, store_id, mid);
+        if(!cmsg) return false;
+    }
+
+    msg_data->msg_count--;
+    msg_data->msg_bytes -= cmsg->store->payloadlen;
+    if(cmsg->qos > 0){
+        msg_data->msg_count12--;
+        msg_data->msg_bytes12 -= cmsg->store->payloadlen;
+    }
+    db__msg_store_ref_dec(db, &cmsg->store);
+    mosquitto_property_free_all(&cmsg->properties);
+    mosquitto__pool_free(&client_msg_pool, cmsg);
+    return true;
+}
+
+
+/* A database holds all of its messages before the client messages that refer
+ * to them, and their ids are close to consecutive, so once the first client
+ * message is reached the messages are put in an array indexed by id. This is
+ * much cheaper to look up than the hash, which is still used for anything not
+ * in the array. */
+static void persist__load_index_build(struct mosquitto_db *db)
+{
+    struct mosquitto_msg_store_load *load, *load_tmp;
+    dbid_t min_id = 0, max_id = 0;
+    unsigned int count;
+
+    restore.index_tried = true;
+
+    count = HASH_COUNT(db->msg_store_load);
+    if(count < 1024) return;
+
+    HASH_ITER(hh, db->msg_store_load, load, load_tmp){
+        if(min_id == 0 || load->db_id < min_id) min_id = load->db_id;
+        if(load->db_id > max_id) max_id = load->db_id;
+    }
+    if(max_id - min_id >= (dbid_t)count*4){
+        /* Too sparse to be worth it. */
+        return;
+    }
+
+    restore.index = mosquitto__calloc(max_id - min_id + 1, sizeof(struct mosquitto_msg_store_load *));
+    if(!restore.index) return;
+    restore.index_base = min_id;
+    restore.index_len = max_id - min_id + 1;
+
+    HASH_ITER(hh, db->msg_store_load, load, load_tmp){
+        restore.index[load->db_id - min_id] = load;
+    }
+}
+
+
+static struct mosquitto_msg_store_load *persist__load_find(struct mosquitto_db *db, dbid_t store_id)
+{
+    struct mosquitto_msg_store_load *load;
+
+    if(store_id >= restore.index_base && store_id - restore.index_base < restore.index_len){
+        load = restore.index[store_id - restore.index_base];
+        if(load) return load;
+    }
+    HASH_FIND(hh, db->msg_store_load, &store_id, sizeof(dbid_t), load);
+    return load;
+}
+
+
+static int persist__client_msg_restore(struct mosquitto_db *db, struct P_client_msg *chunk, uint16_t id_len, bool journal)
 {
     struct mosquitto_client_msg *cmsg;
     struct mosquitto_msg_store_load *load;
     struct mosquitto *context;
     struct mosquitto_msg_data *msg_data;
+    int rc;
+
+    if(!journal && restore.index_tried == false){
+        persist__load_index_build(db);
+    }
 
-    HASH_FIND(hh, db->msg_store_load, &chunk->F.store_id, sizeof(dbid_t), load);
+    load = persist__load_find(db, chunk->F.store_id);
     if(!load){
         /* Can't find message - probably expired */
+        mosquitto_property_free_all(&chunk->properties);
         return MOSQ_ERR_SUCCESS;
     }
 
-    cmsg = mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+    context = persist__find_or_add_context(db, chunk->client_id, id_len, 0);
+    if(!context){
+        mosquitto_property_free_all(&chunk->properties);
+        log__printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
+        return 1;
+    }
+
+    if(chunk->F.direction == mosq_md_out){
+        msg_data = &context->msgs_out;
+    }else{
+        msg_data = &context->msgs_in;
+    }
+
+    if(journal){
+        /* The journal holds every change to a message, the last one wins. */
+        if(persist__client_msg_remove(db, msg_data, chunk->F.store_id, chunk->F.mid) == false
+                && chunk->F.direction == mosq_md_out && chunk->F.mid){
+
+            /* New messages are journalled in the order their mids were
+             * generated. */
+            context->last_mid = chunk->F.mid;
+        }
+    }
+
+    cmsg = mosquitto__pool_calloc(&client_msg_pool);
     if(!cmsg){
+        mosquitto_property_free_all(&chunk->properties);
         log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
         return MOSQ_ERR_NOMEM;
     }
@@ -139,42 +311,67 @@ static int persist__client_msg_restore(struct mosquitto_db *db, struct P_client_
     cmsg->store = load->store;
     db__msg_store_ref_inc(cmsg->store);
 
-    context = persist__find_or_add_context(db, chunk->client_id, 0);
-    if(!context){
-        mosquitto__free(cmsg);
-        log__printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, message store corrupt.");
-        return 1;
-    }
-
-    if(cmsg->direction == mosq_md_out){
-        msg_data = &context->msgs_out;
-    }else{
-        msg_data = &context->msgs_in;
-    }
-
     if(chunk->F.state == mosq_ms_queued || (chunk->F.qos > 0 && msg_data->inflight_quota == 0)){
-        DL_APPEND(msg_data->queued, cmsg);
+        if(spill__wanted(db, context, msg_data, cmsg->store)
+                && spill__push(db, msg_data, cmsg->store, cmsg->mid, cmsg->qos, cmsg->retain, cmsg->properties) == MOSQ_ERR_SUCCESS){
+
+            /* The spill has the properties, the store is still held by the
+             * restore. */
+            cmsg->properties = NULL;
+            db__msg_store_ref_dec(db, &cmsg->store);
+            mosquitto__pool_free(&client_msg_pool, cmsg);
+            cmsg = NULL;
+            rc = MOSQ_ERR_SUCCESS;
+        }else{
+            rc = msg_queue__push(&msg_data->queued, cmsg);
+        }
     }else{
-        DL_APPEND(msg_data->inflight, cmsg);
-        if(chunk->F.qos > 0 && msg_data->inflight_quota > 0){
-            msg_data->inflight_quota--;
+        rc = mid_index__add(&msg_data->inflight_index, cmsg->mid, cmsg);
+        if(rc == MOSQ_ERR_SUCCESS){
+            DL_APPEND(msg_data->inflight, cmsg);
+            if(chunk->F.qos > 0 && msg_data->inflight_quota > 0){
+                msg_data->inflight_quota--;
+            }
         }
     }
+    if(rc){
+        db__msg_store_ref_dec(db, &cmsg->store);
+        mosquitto_property_free_all(&cmsg->properties);
+        mosquitto__pool_free(&client_msg_pool, cmsg);
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+        return MOSQ_ERR_NOMEM;
+    }
     msg_data->msg_count++;
-    msg_data->msg_bytes += cmsg->store->payloadlen;
+    msg_data->msg_bytes += load->store->payloadlen;
     if(chunk->F.qos > 0){
         msg_data->msg_count12++;
-        msg_data->msg_bytes12 += cmsg->store->payloadlen;
+        msg_data->msg_bytes12 += load->store->payloadlen;
     }
+    restore.client_msg_count++;
 
     return MOSQ_ERR_SUCCESS;
 }
 
 
+static int persist__client_restore(struct mosquitto_db *db, struct P_client *chunk, uint16_t id_len)
+{
+    struct mosquitto *context;
+
+    context = persist__find_or_add_context(db, chunk->client_id, id_len, chunk->F.last_mid);
+    if(context){
+        context->session_expiry_time = chunk->F.session_expiry_time;
+        context->session_expiry_interval = chunk->F.session_expiry_interval;
+        /* FIXME - we should expire clients here if they have exceeded their time */
+        return MOSQ_ERR_SUCCESS;
+    }else{
+        return 1;
+    }
+}
+
+
 static int persist__client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 {
     int rc = 0;
-    struct mosquitto *context;
     struct P_client chunk;
 
     memset(&chunk, 0, sizeof(struct P_client));
@@ -189,22 +386,14 @@ static int persist__client_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
         return rc;
     }
 
-    context = persist__find_or_add_context(db, chunk.client_id, chunk.F.last_mid);
-    if(context){
-        context->session_expiry_time = chunk.F.session_expiry_time;
-        context->session_expiry_interval = chunk.F.session_expiry_interval;
-        /* FIXME - we should expire clients here if they have exceeded their time */
-    }else{
-        rc = 1;
-    }
-
+    rc = persist__client_restore(db, &chunk, chunk.client_id?strlen(chunk.client_id):0);
     mosquitto__free(chunk.client_id);
 
     return rc;
 }
 
 
-static int persist__client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, uint32_t length)
+static int persist__client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, uint32_t length, bool journal)
 {
     struct P_client_msg chunk;
     int rc;
@@ -221,16 +410,16 @@ static int persist__client_msg_chunk_restore(struct mosquitto_db *db, FILE *db_f
         return rc;
     }
 
-    rc = persist__client_msg_restore(db, &chunk);
+    rc = persist__client_msg_restore(db, &chunk, chunk.client_id?strlen(chunk.client_id):0, journal);
     mosquitto__free(chunk.client_id);
 
     return rc;
 }
 
 
-static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, uint32_t length)
+/* Takes ownership of everything in chunk. */
+static int persist__msg_store_restore(struct mosquitto_db *db, struct P_msg_store *chunk)
 {
-    struct P_msg_store chunk;
     struct mosquitto_msg_store *stored = NULL;
     struct mosquitto_msg_store_load *load;
     int64_t message_expiry_interval64;
@@ -238,45 +427,44 @@ static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fp
     int rc = 0;
     int i;
 
-    memset(&chunk, 0, sizeof(struct P_msg_store));
-
-    if(db_version == 5){
-        rc = persist__chunk_msg_store_read_v5(db_fptr, &chunk, length);
-    }else{
-        rc = persist__chunk_msg_store_read_v234(db_fptr, &chunk, db_version);
-    }
-    if(rc){
-        fclose(db_fptr);
-        return rc;
+    load = persist__load_find(db, chunk->F.store_id);
+    if(load){
+        /* Already restored, the journal can repeat messages from the
+         * database. */
+        mosquitto__free(chunk->source.id);
+        mosquitto__free(chunk->source.username);
+        mosquitto__free(chunk->topic);
+        UHPA_FREE(chunk->payload, chunk->F.payloadlen);
+        mosquitto_property_free_all(&chunk->properties);
+        return MOSQ_ERR_SUCCESS;
     }
 
-    if(chunk.F.source_port){
+    if(chunk->F.source_port){
         for(i=0; i<db->config->listener_count; i++){
-            if(db->config->listeners[i].port == chunk.F.source_port){
-                chunk.source.listener = &db->config->listeners[i];
+            if(db->config->listeners[i].port == chunk->F.source_port){
+                chunk->source.listener = &db->config->listeners[i];
                 break;
             }
         }
     }
     load = mosquitto__calloc(1, sizeof(struct mosquitto_msg_store_load));
     if(!load){
-        fclose(db_fptr);
-        mosquitto__free(chunk.source.id);
-        mosquitto__free(chunk.source.username);
-        mosquitto__free(chunk.topic);
-        UHPA_FREE(chunk.payload, chunk.F.payloadlen);
+        mosquitto__free(chunk->source.id);
+        mosquitto__free(chunk->source.username);
+        mosquitto__free(chunk->topic);
+        UHPA_FREE(chunk->payload, chunk->F.payloadlen);
         log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
         return MOSQ_ERR_NOMEM;
     }
 
-    if(chunk.F.expiry_time > 0){
-        message_expiry_interval64 = chunk.F.expiry_time - time(NULL);
+    if(chunk->F.expiry_time > 0){
+        message_expiry_interval64 = chunk->F.expiry_time - time(NULL);
         if(message_expiry_interval64 < 0 || message_expiry_interval64 > UINT32_MAX){
             /* Expired message */
-            mosquitto__free(chunk.source.id);
-            mosquitto__free(chunk.source.username);
-            mosquitto__free(chunk.topic);
-            UHPA_FREE(chunk.payload, chunk.F.payloadlen);
+            mosquitto__free(chunk->source.id);
+            mosquitto__free(chunk->source.username);
+            mosquitto__free(chunk->topic);
+            UHPA_FREE(chunk->payload, chunk->F.payloadlen);
             mosquitto__free(load);
             return MOSQ_ERR_SUCCESS;
         }else{
@@ -286,33 +474,78 @@ static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fp
         message_expiry_interval = 0;
     }
 
-    rc = db__message_store(db, &chunk.source, chunk.F.source_mid,
-            chunk.topic, chunk.F.qos, chunk.F.payloadlen,
-            &chunk.payload, chunk.F.retain, &stored, message_expiry_interval,
-            chunk.properties, chunk.F.store_id, mosq_mo_client);
+    rc = db__message_store(db, &chunk->source, chunk->F.source_mid,
+            chunk->topic, chunk->F.qos, chunk->F.payloadlen,
+            &chunk->payload, chunk->F.retain, &stored, message_expiry_interval,
+            chunk->properties, chunk->F.store_id, mosq_mo_client);
 
-    mosquitto__free(chunk.source.id);
-    mosquitto__free(chunk.source.username);
-    chunk.source.id = NULL;
-    chunk.source.username = NULL;
+    mosquitto__free(chunk->source.id);
+    mosquitto__free(chunk->source.username);
+    chunk->source.id = NULL;
+    chunk->source.username = NULL;
 
     if(rc == MOSQ_ERR_SUCCESS){
-        stored->source_listener = chunk.source.listener;
+        stored->source_listener = chunk->source.listener;
+        stored->journalled = true;
         load->db_id = stored->db_id;
         load->store = stored;
+        /* Held until the end of the restore, so the message can't be freed
+         * while chunks may still refer to it. */
+        db__msg_store_ref_inc(stored);
+        if(stored->db_id > db->last_db_id){
+            db->last_db_id = stored->db_id;
+        }
 
         HASH_ADD(hh, db->msg_store_load, db_id, sizeof(dbid_t), load);
+        restore.msg_count++;
         return MOSQ_ERR_SUCCESS;
     }else{
         mosquitto__free(load);
+        return rc;
+    }
+}
+
+
+static int persist__msg_store_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, uint32_t length)
+{
+    struct P_msg_store chunk;
+    int rc = 0;
+
+    memset(&chunk, 0, sizeof(struct P_msg_store));
+
+    if(db_version == 5){
+        rc = persist__chunk_msg_store_read_v5(db_fptr, &chunk, length);
+    }else{
+        rc = persist__chunk_msg_store_read_v234(db_fptr, &chunk, db_version);
+    }
+    if(rc){
         fclose(db_fptr);
         return rc;
     }
+
+    rc = persist__msg_store_restore(db, &chunk);
+    if(rc){
+        fclose(db_fptr);
+    }
+    return rc;
 }
 
-static int persist__retain_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+
+static void persist__retain_restore(struct mosquitto_db *db, struct P_retain *chunk)
 {
     struct mosquitto_msg_store_load *load;
+
+    load = persist__load_find(db, chunk->F.store_id);
+    if(load){
+        sub__messages_queue(db, NULL, load->store->topic, load->store->qos, load->store->retain, &load->store);
+    }else{
+        /* Can't find the message - probably expired */
+    }
+}
+
+
+static int persist__retain_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+{
     struct P_retain chunk;
     int rc;
 
@@ -328,16 +561,11 @@ static int persist__retain_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
         return rc;
     }
 
-    HASH_FIND(hh, db->msg_store_load, &chunk.F.store_id, sizeof(dbid_t), load);
-    if(load){
-        sub__messages_queue(db, NULL, load->store->topic, load->store->qos, load->store->retain, &load->store);
-    }else{
-        /* Can't find the message - probably expired */
-    }
+    persist__retain_restore(db, &chunk);
     return MOSQ_ERR_SUCCESS;
 }
 
-static int persist__sub_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+static int persist__sub_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, bool journal)
 {
     struct P_sub chunk;
     int rc;
@@ -354,7 +582,9 @@ static int persist__sub_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
         return rc;
     }
 
-    rc = persist__restore_sub(db, chunk.client_id, chunk.topic, chunk.F.qos, chunk.F.identifier, chunk.F.options);
+    rc = persist__restore_sub(db, chunk.client_id, chunk.client_id?strlen(chunk.client_id):0,
+            chunk.topic, chunk.topic?strlen(chunk.topic):0,
+            chunk.F.qos, chunk.F.identifier, chunk.F.options, journal);
 
     mosquitto__free(chunk.client_id);
     mosquitto__free(chunk.topic);
@@ -363,149 +593,792 @@ static int persist__sub_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
 }
 
 
-int persist__chunk_header_read(FILE *db_fptr, int *chunk, int *length)
+/* The chunks below only appear in the journal. Client ids and topics are
+ * passed with their lengths, as they may point into a chunk buffer. */
+
+static void persist__client_delete(struct mosquitto_db *db, const char *client_id, uint16_t id_len)
 {
-    if(db_version == 5){
-        return persist__chunk_header_read_v5(db_fptr, chunk, length);
-    }else{
-        return persist__chunk_header_read_v234(db_fptr, chunk, length);
+    struct mosquitto *context;
+
+    HASH_FIND(hh_id, db->contexts_by_id, client_id, id_len, context);
+    if(context){
+        if(context == restore.context){
+            restore.context = NULL;
+        }
+        context__cleanup(db, context, true);
     }
 }
 
 
-int persist__restore(struct mosquitto_db *db)
+static void persist__client_msg_delete(struct mosquitto_db *db, struct P_client_msg *chunk, uint16_t id_len)
 {
-    FILE *fptr;
-    char header[15];
-    int rc = 0;
-    uint32_t crc;
-    uint32_t i32temp;
-    int chunk, length;
-    ssize_t rlen;
-    char *err;
-    struct mosquitto_msg_store_load *load, *load_tmp;
-    struct PF_cfg cfg_chunk;
-
-    assert(db);
-    assert(db->config);
-
-    if(!db->config->persistence || db->config->persistence_filepath == NULL){
-        return MOSQ_ERR_SUCCESS;
-    }
-
-    db->msg_store_load = NULL;
+    struct mosquitto *context;
 
-    fptr = mosquitto__fopen(db->config->persistence_filepath, "rb", false);
-    if(fptr == NULL) return MOSQ_ERR_SUCCESS;
-    rlen = fread(&header, 1, 15, fptr);
-    if(rlen == 0){
-        fclose(fptr);
-        log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistence file is empty.");
-        return 0;
-    }else if(rlen != 15){
-        goto error;
-    }
-    if(!memcmp(header, magic, 15)){
-        // Restore DB as normal
-        read_e(fptr, &crc, sizeof(uint32_t));
-        read_e(fptr, &i32temp, sizeof(uint32_t));
-        db_version = ntohl(i32temp);
-        /* IMPORTANT - this is where compatibility checks are made.
-         * Is your DB change still compatible with previous versions?
-         */
-        if(db_version > MOSQ_DB_VERSION && db_version != 0){
-            if(db_version == 4){
-            }else if(db_version == 3){
-                /* Addition of source_username and source_port to msg_store chunk in v4, v1.5.6 */
-            }else if(db_version == 2){
-                /* Addition of disconnect_t to client chunk in v3. */
+    if(chunk->client_id){
+        HASH_FIND(hh_id, db->contexts_by_id, chunk->client_id, id_len, context);
+        if(context){
+            if(chunk->F.direction == mosq_md_out){
+                persist__client_msg_remove(db, &context->msgs_out, chunk->F.store_id, chunk->F.mid);
             }else{
-                fclose(fptr);
-                log__printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version %d (need version %d).", db_version, MOSQ_DB_VERSION);
-                return 1;
+                persist__client_msg_remove(db, &context->msgs_in, chunk->F.store_id, chunk->F.mid);
             }
         }
+    }
+    mosquitto_property_free_all(&chunk->properties);
+}
 
-        while(persist__chunk_header_read(fptr, &chunk, &length) == MOSQ_ERR_SUCCESS){
-            switch(chunk){
-                case DB_CHUNK_CFG:
-                    if(db_version == 5){
-                        if(persist__chunk_cfg_read_v5(fptr, &cfg_chunk)){
-                            fclose(fptr);
-                            return 1;
-                        }
-                    }else{
-                        if(persist__chunk_cfg_read_v234(fptr, &cfg_chunk)){
-                            fclose(fptr);
-                            return 1;
-                        }
-                    }
-                    if(cfg_chunk.dbid_size != sizeof(dbid_t)){
-                        log__printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
-                                cfg_chunk.dbid_size, (unsigned long)sizeof(dbid_t));
-                        fclose(fptr);
-                        return 1;
-                    }
-                    db->last_db_id = cfg_chunk.last_db_id;
-                    break;
-
-                case DB_CHUNK_MSG_STORE:
-                    if(persist__msg_store_chunk_restore(db, fptr, length)) return 1;
-                    break;
-
-                case DB_CHUNK_CLIENT_MSG:
-                    if(persist__client_msg_chunk_restore(db, fptr, length)) return 1;
-                    break;
-
-                case DB_CHUNK_RETAIN:
-                    if(persist__retain_chunk_restore(db, fptr)) return 1;
-                    break;
-
-                case DB_CHUNK_SUB:
-                    if(persist__sub_chunk_restore(db, fptr)) return 1;
-                    break;
 
-                case DB_CHUNK_CLIENT:
-                    if(persist__client_chunk_restore(db, fptr)) return 1;
-                    break;
+static void persist__msg_store_delete(struct mosquitto_db *db, dbid_t store_id)
+{
+    struct mosquitto_msg_store_load *load;
 
-                default:
-                    log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
-                    fseek(fptr, length, SEEK_CUR);
-                    break;
-            }
+    load = persist__load_find(db, store_id);
+    if(load){
+        if(load->db_id >= restore.index_base && load->db_id - restore.index_base < restore.index_len){
+            restore.index[load->db_id - restore.index_base] = NULL;
         }
-        if(rlen < 0) goto error;
-    }else{
-        log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database. Unrecognised file format.");
-        rc = 1;
+        HASH_DELETE(hh, db->msg_store_load, load);
+        db__msg_store_ref_dec(db, &load->store);
+        mosquitto__free(load);
     }
+}
 
-    fclose(fptr);
 
-    HASH_ITER(hh, db->msg_store_load, load, load_tmp){
-        HASH_DELETE(hh, db->msg_store_load, load);
-        mosquitto__free(load);
+static char *persist__strndup(const char *s, uint16_t len)
+{
+    char *str;
+
+    str = mosquitto__malloc(len+1);
+    if(str){
+        memcpy(str, s, len);
+        str[len] = '\0';
+    }else{
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
     }
-    return rc;
-error:
-    err = strerror(errno);
-    log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
-    if(fptr) fclose(fptr);
-    return 1;
+    return str;
 }
 
-static int persist__restore_sub(struct mosquitto_db *db, const char *client_id, const char *sub, int qos, uint32_t identifier, int options)
+
+static int persist__retain_delete(struct mosquitto_db *db, const char *topic, uint16_t topic_len)
 {
-    struct mosquitto *context;
+    char *str;
 
-    assert(db);
-    assert(client_id);
-    assert(sub);
+    str = persist__strndup(topic, topic_len);
+    if(!str) return MOSQ_ERR_NOMEM;
 
-    context = persist__find_or_add_context(db, client_id, 0);
-    if(!context) return 1;
-    return sub__add(db, context, sub, qos, identifier, options, &db->subs);
+    sub__retain_clear(db, str);
+    mosquitto__free(str);
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__sub_delete(struct mosquitto_db *db, const char *client_id, uint16_t id_len, const char *topic, uint16_t topic_len)
+{
+    struct mosquitto *context;
+    uint8_t reason;
+    char *str;
+
+    if(!client_id || !topic) return 1;
+
+    HASH_FIND(hh_id, db->contexts_by_id, client_id, id_len, context);
+    if(context){
+        str = persist__strndup(topic, topic_len);
+        if(!str) return MOSQ_ERR_NOMEM;
+
+        sub__remove(db, context, str, db->subs, &reason);
+        mosquitto__free(str);
+    }
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__client_delete_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+{
+    char *client_id = NULL;
+
+    if(persist__read_string(db_fptr, &client_id) || !client_id){
+        fclose(db_fptr);
+        return 1;
+    }
+
+    persist__client_delete(db, client_id, strlen(client_id));
+    mosquitto__free(client_id);
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__client_msg_delete_chunk_restore(struct mosquitto_db *db, FILE *db_fptr, uint32_t length)
+{
+    struct P_client_msg chunk;
+    int rc;
+
+    memset(&chunk, 0, sizeof(struct P_client_msg));
+
+    rc = persist__chunk_client_msg_read_v5(db_fptr, &chunk, length);
+    if(rc){
+        fclose(db_fptr);
+        return rc;
+    }
+
+    persist__client_msg_delete(db, &chunk, chunk.client_id?strlen(chunk.client_id):0);
+    mosquitto__free(chunk.client_id);
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__msg_store_delete_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+{
+    struct P_retain chunk;
+
+    memset(&chunk, 0, sizeof(struct P_retain));
+
+    if(persist__chunk_retain_read_v5(db_fptr, &chunk)){
+        fclose(db_fptr);
+        return 1;
+    }
+
+    persist__msg_store_delete(db, chunk.F.store_id);
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__retain_delete_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+{
+    char *topic = NULL;
+
+    if(persist__read_string(db_fptr, &topic) || !topic){
+        fclose(db_fptr);
+        return 1;
+    }
+
+    sub__retain_clear(db, topic);
+    mosquitto__free(topic);
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static int persist__sub_delete_chunk_restore(struct mosquitto_db *db, FILE *db_fptr)
+{
+    struct P_sub chunk;
+    int rc;
+
+    memset(&chunk, 0, sizeof(struct P_sub));
+
+    rc = persist__chunk_sub_read_v5(db_fptr, &chunk);
+    if(rc){
+        fclose(db_fptr);
+        return rc;
+    }
+
+    rc = persist__sub_delete(db, chunk.client_id, chunk.client_id?strlen(chunk.client_id):0,
+            chunk.topic, chunk.topic?strlen(chunk.topic):0);
+    mosquitto__free(chunk.client_id);
+    mosquitto__free(chunk.topic);
+    if(rc){
+        fclose(db_fptr);
+    }
+    return rc;
+}
+
+
+int persist__chunk_header_read(FILE *db_fptr, int *chunk, int *length)
+{
+    if(db_version >= 5){
+        return persist__chunk_header_read_v5(db_fptr, chunk, length);
+    }else{
+        return persist__chunk_header_read_v234(db_fptr, chunk, length);
+    }
+}
+
+
+static int persist__cfg_restore(struct mosquitto_db *db, struct PF_cfg *chunk)
+{
+    if(chunk->dbid_size != sizeof(dbid_t)){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Incompatible database configuration (dbid size is %d bytes, expected %lu)",
+                chunk->dbid_size, (unsigned long)sizeof(dbid_t));
+        return 1;
+    }
+    db->last_db_id = chunk->last_db_id;
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Restore a version 5 or later chunk that has been read or mapped into
+ * memory, buf is the chunk following its header. Every chunk is parsed in
+ * place, so client ids and topics aren't copied, which is most of the work for
+ * the client message and subscription chunks that make up the bulk of a large
+ * database. */
+static int persist__chunk_restore(struct mosquitto_db *db, int chunk, const uint8_t *buf, uint32_t length, bool journal)
+{
+    struct PF_cfg cfg_chunk;
+    struct P_client client_chunk;
+    struct P_client_msg client_msg_chunk;
+    struct P_msg_store msg_store_chunk;
+    struct P_retain retain_chunk;
+    struct P_sub sub_chunk;
+    const char *str;
+    uint16_t slen;
+    int rc = 0;
+
+    switch(chunk){
+        case DB_CHUNK_CFG:
+            rc = persist__chunk_cfg_parse_v5(buf, length, &cfg_chunk);
+            if(rc == MOSQ_ERR_SUCCESS){
+                rc = persist__cfg_restore(db, &cfg_chunk);
+            }
+            break;
+
+        case DB_CHUNK_MSG_STORE:
+            memset(&msg_store_chunk, 0, sizeof(struct P_msg_store));
+            if(db_version >= 6){
+                rc = persist__chunk_msg_store_parse_v6(buf, length, &msg_store_chunk);
+            }else{
+                rc = persist__chunk_msg_store_parse_v5(buf, length, &msg_store_chunk);
+            }
+            if(rc == MOSQ_ERR_SUCCESS){
+                rc = persist__msg_store_restore(db, &msg_store_chunk);
+            }
+            break;
+
+        case DB_CHUNK_CLIENT_MSG:
+            memset(&client_msg_chunk, 0, sizeof(struct P_client_msg));
+            rc = persist__chunk_client_msg_parse_v5(buf, length, &client_msg_chunk);
+            if(rc == MOSQ_ERR_SUCCESS){
+                rc = persist__client_msg_restore(db, &client_msg_chunk, client_msg_chunk.F.id_len, journal);
+            }
+            break;
+
+        case DB_CHUNK_RETAIN:
+            rc = persist__chunk_retain_parse_v5(buf, length, &retain_chunk);
+            if(rc == MOSQ_ERR_SUCCESS){
+                persist__retain_restore(db, &retain_chunk);
+            }
+            break;
+
+        case DB_CHUNK_SUB:
+            memset(&sub_chunk, 0, sizeof(struct P_sub));
+            rc = persist__chunk_sub_parse_v5(buf, length, &sub_chunk);
+            if(rc == MOSQ_ERR_SUCCESS){
+                rc = persist__restore_sub(db, sub_chunk.client_id, sub_chunk.F.id_len,
+                        sub_chunk.topic, sub_chunk.F.topic_len,
+                        sub_chunk.F.qos, sub_chunk.F.identifier, sub_chunk.F.options, journal);
+            }
+            break;
+
+        case DB_CHUNK_CLIENT:
+            memset(&client_chunk, 0, sizeof(struct P_client));
+            rc = persist__chunk_client_parse_v5(buf, length, &client_chunk);
+            if(rc == MOSQ_ERR_SUCCESS){
+                rc = persist__client_restore(db, &client_chunk, client_chunk.F.id_len);
+            }
+            break;
+
+        case DB_CHUNK_CLIENT_DELETE:
+            rc = persist__chunk_string_parse_v5(buf, length, &str, &slen);
+            if(rc == MOSQ_ERR_SUCCESS){
+                persist__client_delete(db, str, slen);
+            }
+            break;
+
+        case DB_CHUNK_CLIENT_MSG_DELETE:
+            memset(&client_msg_chunk, 0, sizeof(struct P_client_msg));
+            rc = persist__chunk_client_msg_parse_v5(buf, length, &client_msg_chunk);
+            if(rc == MOSQ_ERR_SUCCESS){
+                persist__client_msg_delete(db, &client_msg_chunk, client_msg_chunk.F.id_len);
+            }
+            break;
+
+        case DB_CHUNK_MSG_STORE_DELETE:
+            rc = persist__chunk_retain_parse_v5(buf, length, &retain_chunk);
+            if(rc == MOSQ_ERR_SUCCESS){
+                persist__msg_store_delete(db, retain_chunk.F.store_id);
+            }
+            break;
+
+        case DB_CHUNK_RETAIN_DELETE:
+            rc = persist__chunk_string_parse_v5(buf, length, &str, &slen);
+            if(rc == MOSQ_ERR_SUCCESS){
+                rc = persist__retain_delete(db, str, slen);
+            }
+            break;
+
+        case DB_CHUNK_SUB_DELETE:
+            memset(&sub_chunk, 0, sizeof(struct P_sub));
+            rc = persist__chunk_sub_parse_v5(buf, length, &sub_chunk);
+            if(rc == MOSQ_ERR_SUCCESS){
+                rc = persist__sub_delete(db, sub_chunk.client_id, sub_chunk.F.id_len,
+                        sub_chunk.topic, sub_chunk.F.topic_len);
+            }
+            break;
+
+        default:
+            log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
+            break;
+    }
+    if(rc){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error restoring persistent database, chunk %d is corrupt.", chunk);
+        return 1;
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* As persist__chunks_restore(), for version 6 and later. Each chunk is read
+ * whole and its CRC checked before anything in it is used. */
+static int persist__chunks_restore_v6(struct mosquitto_db *db, FILE *fptr, bool journal, long *valid_length)
+{
+    int chunk;
+    uint32_t length;
+    uint8_t *buf = NULL;
+    size_t buf_size = 0;
+    int rc;
+
+    while(1){
+        rc = persist__chunk_read_v6(fptr, &chunk, &length, &buf, &buf_size);
+        if(rc == MOSQ_ERR_NOT_FOUND){
+            rc = MOSQ_ERR_SUCCESS;
+            break;
+        }else if(rc == MOSQ_ERR_MALFORMED_PACKET){
+            if(journal){
+                /* Left for persist__journal_restore() to report. */
+                rc = MOSQ_ERR_SUCCESS;
+            }else{
+                log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated or corrupt, a chunk failed its CRC check.");
+            }
+            break;
+        }else if(rc){
+            break;
+        }
+
+        rc = persist__chunk_restore(db, chunk, &buf[sizeof(struct PF_header)], length, journal);
+        if(rc) break;
+
+        if(valid_length){
+            *valid_length = ftell(fptr);
+        }
+    }
+    mosquitto__free(buf);
+    if(rc){
+        fclose(fptr);
+    }
+    return rc;
+}
+
+
+/* Restore all of the chunks following the header of fptr. When replaying the
+ * journal, a chunk that runs past file_size is what remains of a write that
+ * was cut short, so it is ignored and valid_length gives the end of the last
+ * complete chunk. On error fptr has been closed. */
+static int persist__chunks_restore(struct mosquitto_db *db, FILE *fptr, bool journal, long file_size, long *valid_length)
+{
+    int chunk, length;
+    struct PF_cfg cfg_chunk;
+
+    if(db_version >= 6){
+        return persist__chunks_restore_v6(db, fptr, journal, valid_length);
+    }
+
+    while(persist__chunk_header_read(fptr, &chunk, &length) == MOSQ_ERR_SUCCESS){
+        if(journal && (length < 0 || ftell(fptr) + length > file_size)){
+            break;
+        }
+        switch(chunk){
+            case DB_CHUNK_CFG:
+                if(db_version == 5){
+                    if(persist__chunk_cfg_read_v5(fptr, &cfg_chunk)){
+                        fclose(fptr);
+                        return 1;
+                    }
+                }else{
+                    if(persist__chunk_cfg_read_v234(fptr, &cfg_chunk)){
+                        fclose(fptr);
+                        return 1;
+                    }
+                }
+                if(persist__cfg_restore(db, &cfg_chunk)){
+                    fclose(fptr);
+                    return 1;
+                }
+                break;
+
+            case DB_CHUNK_MSG_STORE:
+                if(persist__msg_store_chunk_restore(db, fptr, length)) return 1;
+                break;
+
+            case DB_CHUNK_CLIENT_MSG:
+                if(persist__client_msg_chunk_restore(db, fptr, length, journal)) return 1;
+                break;
+
+            case DB_CHUNK_RETAIN:
+                if(persist__retain_chunk_restore(db, fptr)) return 1;
+                break;
+
+            case DB_CHUNK_SUB:
+                if(persist__sub_chunk_restore(db, fptr, journal)) return 1;
+                break;
+
+            case DB_CHUNK_CLIENT:
+                if(persist__client_chunk_restore(db, fptr)) return 1;
+                break;
+
+            case DB_CHUNK_CLIENT_DELETE:
+                if(persist__client_delete_chunk_restore(db, fptr)) return 1;
+                break;
+
+            case DB_CHUNK_CLIENT_MSG_DELETE:
+                if(persist__client_msg_delete_chunk_restore(db, fptr, length)) return 1;
+                break;
+
+            case DB_CHUNK_MSG_STORE_DELETE:
+                if(persist__msg_store_delete_chunk_restore(db, fptr)) return 1;
+                break;
+
+            case DB_CHUNK_RETAIN_DELETE:
+                if(persist__retain_delete_chunk_restore(db, fptr)) return 1;
+                break;
+
+            case DB_CHUNK_SUB_DELETE:
+                if(persist__sub_delete_chunk_restore(db, fptr)) return 1;
+                break;
+
+            default:
+                log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unsupported chunk \"%d\" in persistent database file. Ignoring.", chunk);
+                fseek(fptr, length, SEEK_CUR);
+                break;
+        }
+        if(valid_length){
+            *valid_length = ftell(fptr);
+        }
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+#ifndef WIN32
+/* As persist__chunks_restore(), for a version 5 or later database that has
+ * been mapped into memory, starting at pos. There is no per chunk I/O, or for
+ * version 6 copying of the chunk before its CRC is checked. */
+static int persist__chunks_restore_mapped(struct mosquitto_db *db, const uint8_t *map, size_t len, size_t pos)
+{
+    int chunk, length;
+    size_t crc_len = 0;
+
+    if(db_version >= 6){
+        crc_len = sizeof(uint32_t);
+    }
+
+    while(len - pos >= sizeof(struct PF_header)){
+        persist__chunk_header_parse_v5(&map[pos], &chunk, &length);
+        if(db_version == 5 && chunk == DB_CHUNK_RETAIN && length == 0){
+            /* Some databases have retain chunks with no length set, the
+             * stdio reader has never looked at it. */
+            length = sizeof(struct PF_retain);
+        }
+        if(length < 0 || (size_t)length + crc_len > len - pos - sizeof(struct PF_header)){
+            log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is truncated.");
+            return 1;
+        }
+        if(crc_len && persist__chunk_crc_check_v6(&map[pos], length)){
+            log__printf(NULL, MOSQ_LOG_ERR, "Error: Persistent database is corrupt, the chunk at offset %lu failed its CRC check.", (unsigned long)pos);
+            return 1;
+        }
+        if(persist__chunk_restore(db, chunk, &map[pos + sizeof(struct PF_header)], length, false)){
+            return 1;
+        }
+        pos += sizeof(struct PF_header) + length + crc_len;
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+#endif
+
+
+/* Reads and closes fptr. */
+static int persist__db_read(struct mosquitto_db *db, FILE *fptr)
+{
+    char header[15];
+    int rc = 0;
+    uint32_t crc;
+    uint32_t i32temp;
+    ssize_t rlen;
+    char *err;
+
+    rlen = fread(&header, 1, 15, fptr);
+    if(rlen == 0){
+        fclose(fptr);
+        log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Persistence file is empty.");
+        return 0;
+    }else if(rlen != 15){
+        goto error;
+    }
+    if(!memcmp(header, magic, 15)){
+        // Restore DB as normal
+        read_e(fptr, &crc, sizeof(uint32_t));
+        read_e(fptr, &i32temp, sizeof(uint32_t));
+        db_version = ntohl(i32temp);
+        /* IMPORTANT - this is where compatibility checks are made.
+         * Is your DB change still compatible with previous versions?
+         */
+        if(db_version > MOSQ_DB_VERSION && db_version != 0){
+            if(db_version == 4){
+            }else if(db_version == 3){
+                /* Addition of source_username and source_port to msg_store chunk in v4, v1.5.6 */
+            }else if(db_version == 2){
+                /* Addition of disconnect_t to client chunk in v3. */
+            }else{
+                fclose(fptr);
+                log__printf(NULL, MOSQ_LOG_ERR, "Error: Unsupported persistent database format version %d (need version %d).", db_version, MOSQ_DB_VERSION);
+                return 1;
+            }
+        }
+
+#ifndef WIN32
+        if(restore.map && db_version >= 5){
+            rc = persist__chunks_restore_mapped(db, restore.map, restore.map_len, ftell(fptr));
+            fclose(fptr);
+            return rc;
+        }
+#endif
+        if(persist__chunks_restore(db, fptr, false, 0, NULL)) return 1;
+        if(rlen < 0) goto error;
+    }else{
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistent database. Unrecognised file format.");
+        rc = 1;
+    }
+
+    fclose(fptr);
+    return rc;
+error:
+    err = strerror(errno);
+    log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
+    if(fptr) fclose(fptr);
+    return 1;
+}
+
+
+#ifndef WIN32
+/* Map the database into memory, for persist__chunks_restore_mapped(). If this
+ * fails the database is read through fptr as usual. */
+static void persist__db_map(FILE *fptr, size_t len)
+{
+    void *map;
+
+    if(len == 0) return;
+
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(fptr), 0);
+    if(map == MAP_FAILED) return;
+    madvise(map, len, MADV_SEQUENTIAL);
+    madvise(map, len, MADV_WILLNEED);
+
+    restore.map = map;
+    restore.map_len = len;
+}
+#endif
+
+
+static int persist__db_restore(struct mosquitto_db *db)
+{
+    FILE *fptr;
+    struct stat buf;
+    int rc;
+
+    fptr = mosquitto__fopen(db->config->persistence_filepath, "rb", false);
+    if(fptr == NULL) return MOSQ_ERR_SUCCESS;
+
+    if(fstat(fileno(fptr), &buf) == 0){
+        restore.bytes += buf.st_size;
+#ifndef WIN32
+        persist__db_map(fptr, buf.st_size);
+#endif
+    }
+
+    rc = persist__db_read(db, fptr);
+
+#ifndef WIN32
+    if(restore.map){
+        munmap((void *)restore.map, restore.map_len);
+        restore.map = NULL;
+        restore.map_len = 0;
+    }
+#endif
+    return rc;
+}
+
+
+char *persist__journal_path(struct mosquitto_db *db)
+{
+    char *path;
+    size_t len;
+
+    len = strlen(db->config->persistence_filepath) + strlen(".journal") + 1;
+    path = mosquitto__malloc(len);
+    if(path){
+        snprintf(path, len, "%s.journal", db->config->persistence_filepath);
+    }
+    return path;
+}
+
+
+/* Replay the journal, if there is one, over what was restored from the
+ * database. See persist_journal.c. */
+static int persist__journal_restore(struct mosquitto_db *db)
+{
+    FILE *fptr;
+    char *path;
+    char header[15];
+    uint32_t crc;
+    uint32_t i32temp;
+    struct stat buf;
+    long valid_length = 0;
+
+    path = persist__journal_path(db);
+    if(!path) return MOSQ_ERR_NOMEM;
+
+    fptr = mosquitto__fopen(path, "rb", false);
+    if(fptr == NULL){
+        mosquitto__free(path);
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    if(fstat(fileno(fptr), &buf) == 0
+            && fread(&header, 1, 15, fptr) == 15
+            && fread(&crc, 1, sizeof(uint32_t), fptr) == sizeof(uint32_t)
+            && fread(&i32temp, 1, sizeof(uint32_t), fptr) == sizeof(uint32_t)){
+
+        /* A version 5 journal is left by an older broker, and is replaced
+         * by persist__journal_open() once it has been restored. */
+        if(memcmp(header, magic, 15) || (ntohl(i32temp) != MOSQ_DB_VERSION && ntohl(i32temp) != 5)){
+            log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to restore persistence journal %s. Unrecognised file format.", path);
+            fclose(fptr);
+            mosquitto__free(path);
+            return 1;
+        }
+        db_version = ntohl(i32temp);
+        valid_length = ftell(fptr);
+        restore.bytes += buf.st_size;
+
+        if(persist__chunks_restore(db, fptr, true, buf.st_size, &valid_length)){
+            mosquitto__free(path);
+            return 1;
+        }
+        if(valid_length < buf.st_size){
+            log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Ignoring incomplete or corrupt chunk at the end of persistence journal %s.", path);
+        }
+    }
+    fclose(fptr);
+
+    /* Anything appended must follow on from the last complete chunk, or an
+     * incomplete header means the journal must be started again. */
+    if(truncate(path, valid_length)){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to truncate persistence journal %s: %s.", path, strerror(errno));
+        mosquitto__free(path);
+        return 1;
+    }
+    mosquitto__free(path);
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static double persist__elapsed(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
+
+int persist__restore(struct mosquitto_db *db)
+{
+    int rc;
+    struct mosquitto_msg_store_load *load, *load_tmp;
+    struct timespec start;
+    double t;
+
+    assert(db);
+    assert(db->config);
+
+    if(!db->config->persistence || db->config->persistence_filepath == NULL){
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    db->msg_store_load = NULL;
+    memset(&restore, 0, sizeof(restore));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    rc = persist__db_restore(db);
+    if(rc == MOSQ_ERR_SUCCESS){
+        rc = persist__journal_restore(db);
+    }
+
+    HASH_ITER(hh, db->msg_store_load, load, load_tmp){
+        HASH_DELETE(hh, db->msg_store_load, load);
+        /* Messages that nothing refers to any more are freed here. */
+        db__msg_store_ref_dec(db, &load->store);
+        mosquitto__free(load);
+    }
+    mosquitto__free(restore.index);
+    mosquitto__free(restore.sub_topic);
+
+    if(rc == MOSQ_ERR_SUCCESS && restore.bytes > 0){
+        t = persist__elapsed(&start);
+        log__printf(NULL, MOSQ_LOG_INFO, "Restored %u clients, %lu messages, %lu client messages and %lu subscriptions in %.3f seconds (%.1f MB/s, %.0f client messages/s).",
+                HASH_CNT(hh_id, db->contexts_by_id), restore.msg_count, restore.client_msg_count, restore.sub_count,
+                t, restore.bytes/t/1e6, restore.client_msg_count/t);
+    }
+    memset(&restore, 0, sizeof(restore));
+    return rc;
+}
+
+static int persist__restore_sub(struct mosquitto_db *db, const char *client_id, uint16_t id_len, const char *sub, uint16_t sub_len, int qos, uint32_t identifier, int options, bool journal)
+{
+    struct mosquitto *context;
+    char *topic;
+    int rc;
+
+    assert(db);
+
+    if(!sub || !sub_len) return 1;
+
+    context = persist__find_or_add_context(db, client_id, id_len, 0);
+    if(!context) return 1;
+
+    if(journal){
+        /* The journal can repeat subscriptions, so they must go through the
+         * usual duplicate check. */
+        topic = persist__strndup(sub, sub_len);
+        if(!topic) return MOSQ_ERR_NOMEM;
+        rc = sub__add(db, context, topic, qos, identifier, options, &db->subs);
+        mosquitto__free(topic);
+        return rc;
+    }
+
+    /* Subscriptions to the same topic are saved next to each other. */
+    if(!restore.sub_topic || strncmp(restore.sub_topic, sub, sub_len) || restore.sub_topic[sub_len] != '\0'){
+        mosquitto__free(restore.sub_topic);
+        restore.sub_topic = mosquitto__malloc(sub_len+1);
+        if(!restore.sub_topic) return MOSQ_ERR_NOMEM;
+        memcpy(restore.sub_topic, sub, sub_len);
+        restore.sub_topic[sub_len] = '\0';
+
+        restore.sub_hier = sub__add_hier(db, restore.sub_topic);
+        if(!restore.sub_hier){
+            mosquitto__free(restore.sub_topic);
+            restore.sub_topic = NULL;
+            return 1;
+        }
+    }
+
+    rc = sub__add_restored(db, context, qos, identifier, options, restore.sub_hier);
+    if(rc == MOSQ_ERR_SUCCESS){
+        restore.sub_count++;
+    }
+    return rc;
 }
 
 #endif
@@ -249,4 +249,320 @@ error:
     return 1;
 }
 
+
+/* The functions below parse chunks in place, from a database that has been
+ * mapped into memory by persist__db_restore(). buf is the chunk following its
+ * header. The client ids and topics in client, client message and
+ * subscription chunks point into buf and are not terminated, so must only be
+ * used with their lengths. */
+
+static char *persist__string_parse(const uint8_t *buf, uint16_t len)
+{
+    char *s;
+
+    s = mosquitto__malloc(len+1);
+    if(s){
+        memcpy(s, buf, len);
+        s[len] = '\0';
+    }
+    return s;
+}
+
+
+int persist__chunk_header_parse_v5(const uint8_t *buf, int *chunk, int *length)
+{
+    struct PF_header header;
+
+    memcpy(&header, buf, sizeof(struct PF_header));
+    *chunk = ntohl(header.chunk);
+    *length = ntohl(header.length);
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__chunk_cfg_parse_v5(const uint8_t *buf, uint32_t length, struct PF_cfg *chunk)
+{
+    if(length < sizeof(struct PF_cfg)) return 1;
+    memcpy(chunk, buf, sizeof(struct PF_cfg));
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__chunk_client_parse_v5(const uint8_t *buf, uint32_t length, struct P_client *chunk)
+{
+    if(length < sizeof(struct PF_client)) return 1;
+    memcpy(&chunk->F, buf, sizeof(struct PF_client));
+    chunk->F.session_expiry_interval = ntohl(chunk->F.session_expiry_interval);
+    chunk->F.last_mid = ntohs(chunk->F.last_mid);
+    chunk->F.id_len = ntohs(chunk->F.id_len);
+
+    if(chunk->F.id_len == 0 || length < sizeof(struct PF_client) + chunk->F.id_len) return 1;
+    chunk->client_id = (char *)&buf[sizeof(struct PF_client)];
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__chunk_client_msg_parse_v5(const uint8_t *buf, uint32_t length, struct P_client_msg *chunk)
+{
+    mosquitto_property *properties = NULL;
+    struct mosquitto__packet prop_packet;
+    int rc;
+
+    if(length < sizeof(struct PF_client_msg)) return 1;
+    memcpy(&chunk->F, buf, sizeof(struct PF_client_msg));
+    chunk->F.mid = ntohs(chunk->F.mid);
+    chunk->F.id_len = ntohs(chunk->F.id_len);
+
+    length -= sizeof(struct PF_client_msg);
+    if(length < chunk->F.id_len) return 1;
+    if(chunk->F.id_len){
+        chunk->client_id = (char *)&buf[sizeof(struct PF_client_msg)];
+    }
+    length -= chunk->F.id_len;
+
+    if(length > 0){
+        memset(&prop_packet, 0, sizeof(struct mosquitto__packet));
+        prop_packet.remaining_length = length;
+        prop_packet.payload = (uint8_t *)&buf[sizeof(struct PF_client_msg) + chunk->F.id_len];
+        rc = property__read_all(CMD_PUBLISH, &prop_packet, &properties);
+        if(rc){
+            return rc;
+        }
+    }
+    chunk->properties = properties;
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Unlike the other chunks, everything in a message store chunk is copied.
+ * From version 6 the payload is preceded by a PF_payload and may be
+ * compressed. */
+static int persist__msg_store_parse(const uint8_t *buf, uint32_t length, struct P_msg_store *chunk, bool has_payload_header)
+{
+    mosquitto_property *properties = NULL;
+    struct mosquitto__packet prop_packet;
+    struct PF_payload payload_header;
+    uint32_t pos;
+    int rc = 1;
+
+    if(length < sizeof(struct PF_msg_store)) return 1;
+    memcpy(&chunk->F, buf, sizeof(struct PF_msg_store));
+    chunk->F.payloadlen = ntohl(chunk->F.payloadlen);
+    if(chunk->F.payloadlen > MQTT_MAX_PAYLOAD){
+        return MOSQ_ERR_INVAL;
+    }
+    chunk->F.source_mid = ntohs(chunk->F.source_mid);
+    chunk->F.source_id_len = ntohs(chunk->F.source_id_len);
+    chunk->F.source_username_len = ntohs(chunk->F.source_username_len);
+    chunk->F.topic_len = ntohs(chunk->F.topic_len);
+    chunk->F.source_port = ntohs(chunk->F.source_port);
+    pos = sizeof(struct PF_msg_store);
+
+    if(has_payload_header){
+        if(length - pos < sizeof(struct PF_payload)) return 1;
+        memcpy(&payload_header, &buf[pos], sizeof(struct PF_payload));
+        payload_header.stored_len = ntohl(payload_header.stored_len);
+        pos += sizeof(struct PF_payload);
+
+        if(payload_header.encoding == DB_PAYLOAD_RAW){
+            if(payload_header.stored_len != chunk->F.payloadlen) return 1;
+        }else if(payload_header.encoding != DB_PAYLOAD_LZ4){
+            log__printf(NULL, MOSQ_LOG_ERR, "Error: Unknown payload encoding %d in persistent database.", payload_header.encoding);
+            return 1;
+        }
+    }else{
+        payload_header.stored_len = chunk->F.payloadlen;
+        payload_header.encoding = DB_PAYLOAD_RAW;
+    }
+
+    if(length - pos < (uint32_t)chunk->F.source_id_len + chunk->F.source_username_len + chunk->F.topic_len
+            || length - pos - chunk->F.source_id_len - chunk->F.source_username_len - chunk->F.topic_len < payload_header.stored_len){
+
+        return 1;
+    }
+
+    if(chunk->F.source_id_len){
+        chunk->source.id = persist__string_parse(&buf[pos], chunk->F.source_id_len);
+        if(!chunk->source.id) goto nomem;
+        pos += chunk->F.source_id_len;
+    }
+    if(chunk->F.source_username_len){
+        chunk->source.username = persist__string_parse(&buf[pos], chunk->F.source_username_len);
+        if(!chunk->source.username) goto nomem;
+        pos += chunk->F.source_username_len;
+    }
+    if(chunk->F.topic_len){
+        chunk->topic = persist__string_parse(&buf[pos], chunk->F.topic_len);
+        if(!chunk->topic) goto nomem;
+        pos += chunk->F.topic_len;
+    }
+
+    if(chunk->F.payloadlen > 0){
+        if(UHPA_ALLOC(chunk->payload, chunk->F.payloadlen) == 0){
+            goto nomem;
+        }
+        if(payload_header.encoding == DB_PAYLOAD_LZ4){
+            if(persist__decompress(&buf[pos], payload_header.stored_len,
+                        UHPA_ACCESS(chunk->payload, chunk->F.payloadlen), chunk->F.payloadlen)){
+
+                log__printf(NULL, MOSQ_LOG_ERR, "Error: Corrupt compressed payload in persistent database.");
+                goto error;
+            }
+        }else{
+            memcpy(UHPA_ACCESS(chunk->payload, chunk->F.payloadlen), &buf[pos], chunk->F.payloadlen);
+        }
+    }
+    pos += payload_header.stored_len;
+
+    if(length > pos){
+        memset(&prop_packet, 0, sizeof(struct mosquitto__packet));
+        prop_packet.remaining_length = length - pos;
+        prop_packet.payload = (uint8_t *)&buf[pos];
+        rc = property__read_all(CMD_PUBLISH, &prop_packet, &properties);
+        if(rc){
+            goto error;
+        }
+    }
+    chunk->properties = properties;
+
+    return MOSQ_ERR_SUCCESS;
+nomem:
+    log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+    rc = MOSQ_ERR_NOMEM;
+error:
+    UHPA_FREE(chunk->payload, chunk->F.payloadlen);
+    mosquitto__free(chunk->source.id);
+    mosquitto__free(chunk->source.username);
+    mosquitto__free(chunk->topic);
+    chunk->source.id = NULL;
+    chunk->source.username = NULL;
+    chunk->topic = NULL;
+    return rc;
+}
+
+
+int persist__chunk_msg_store_parse_v5(const uint8_t *buf, uint32_t length, struct P_msg_store *chunk)
+{
+    return persist__msg_store_parse(buf, length, chunk, false);
+}
+
+
+int persist__chunk_msg_store_parse_v6(const uint8_t *buf, uint32_t length, struct P_msg_store *chunk)
+{
+    return persist__msg_store_parse(buf, length, chunk, true);
+}
+
+
+int persist__chunk_retain_parse_v5(const uint8_t *buf, uint32_t length, struct P_retain *chunk)
+{
+    if(length < sizeof(struct PF_retain)) return 1;
+    memcpy(&chunk->F, buf, sizeof(struct PF_retain));
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+int persist__chunk_sub_parse_v5(const uint8_t *buf, uint32_t length, struct P_sub *chunk)
+{
+    if(length < sizeof(struct PF_sub)) return 1;
+    memcpy(&chunk->F, buf, sizeof(struct PF_sub));
+    chunk->F.identifier = ntohl(chunk->F.identifier);
+    chunk->F.id_len = ntohs(chunk->F.id_len);
+    chunk->F.topic_len = ntohs(chunk->F.topic_len);
+
+    if(length - sizeof(struct PF_sub) < (uint32_t)chunk->F.id_len + chunk->F.topic_len) return 1;
+    if(chunk->F.id_len){
+        chunk->client_id = (char *)&buf[sizeof(struct PF_sub)];
+    }
+    if(chunk->F.topic_len){
+        chunk->topic = (char *)&buf[sizeof(struct PF_sub) + chunk->F.id_len];
+    }
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+/* A chunk holding only a length prefixed string, as written by
+ * persist__chunk_string_write_v5(). str points into buf and is not
+ * terminated. */
+int persist__chunk_string_parse_v5(const uint8_t *buf, uint32_t length, const char **str, uint16_t *len)
+{
+    uint16_t i16temp;
+
+    if(length < sizeof(uint16_t)) return 1;
+    memcpy(&i16temp, buf, sizeof(uint16_t));
+    *len = ntohs(i16temp);
+    if(*len == 0 || length - sizeof(uint16_t) < *len) return 1;
+    *str = (const char *)&buf[sizeof(uint16_t)];
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Check the CRC that follows a version 6 chunk. buf is the start of the
+ * chunk header, length the chunk length from the header. */
+int persist__chunk_crc_check_v6(const uint8_t *buf, uint32_t length)
+{
+    uint32_t crc;
+
+    memcpy(&crc, &buf[sizeof(struct PF_header) + length], sizeof(uint32_t));
+    if(ntohl(crc) != persist__crc32(0, buf, sizeof(struct PF_header) + length)){
+        return 1;
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Read a complete version 6 chunk, including its header and CRC, into *buf,
+ * which is grown as needed and must be freed by the caller. The chunk
+ * contents start at sizeof(struct PF_header) into *buf.
+ *
+ * Returns MOSQ_ERR_NOT_FOUND at the end of the file, and
+ * MOSQ_ERR_MALFORMED_PACKET if the chunk is incomplete or fails its CRC
+ * check. */
+int persist__chunk_read_v6(FILE *db_fptr, int *chunk, uint32_t *length, uint8_t **buf, size_t *buf_size)
+{
+    struct PF_header header;
+    size_t rlen, len;
+    uint8_t *newbuf;
+
+    rlen = fread(&header, 1, sizeof(struct PF_header), db_fptr);
+    if(rlen == 0){
+        return MOSQ_ERR_NOT_FOUND;
+    }else if(rlen != sizeof(struct PF_header)){
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+    *chunk = ntohl(header.chunk);
+    *length = ntohl(header.length);
+
+    len = sizeof(struct PF_header) + (size_t)*length + sizeof(uint32_t);
+    if(*length > MQTT_MAX_PAYLOAD*2){
+        /* No chunk holds more than a message and its topic and properties,
+         * so this is damage rather than something to try and allocate. */
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+    if(len > *buf_size){
+        newbuf = mosquitto__realloc(*buf, len);
+        if(!newbuf){
+            log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+            return MOSQ_ERR_NOMEM;
+        }
+        *buf = newbuf;
+        *buf_size = len;
+    }
+
+    memcpy(*buf, &header, sizeof(struct PF_header));
+    if(fread(&(*buf)[sizeof(struct PF_header)], 1, len - sizeof(struct PF_header), db_fptr) != len - sizeof(struct PF_header)){
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+    if(persist__chunk_crc_check_v6(*buf, *length)){
+        return MOSQ_ERR_MALFORMED_PACKET;
+    }
+
+    return MOSQ_ERR_SUCCESS;
+}
+
 #endif
@@ -26,71 +26,163 @@ Contributors:
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#ifndef WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include <utlist.h>
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
+#include "msg_queue.h"
 #include "persist.h"
 #include "time_mosq.h"
 #include "misc_mosq.h"
 #include "util_mosq.h"
 
-static int persist__client_messages_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *queue)
+#ifndef WIN32
+static pid_t background_pid = 0;
+static struct timespec background_start;
+#endif
+
+/* Write the header that starts both the database and the journal. */
+int persist__header_write(FILE *db_fptr)
+{
+    uint32_t db_version_w = htonl(MOSQ_DB_VERSION);
+    uint32_t crc = 0;
+
+    write_e(db_fptr, magic, 15);
+    write_e(db_fptr, &crc, sizeof(uint32_t));
+    write_e(db_fptr, &db_version_w, sizeof(uint32_t));
+
+    return MOSQ_ERR_SUCCESS;
+error:
+    log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+    return 1;
+}
+
+
+int persist__client_message_write(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
 {
     struct P_client_msg chunk;
+
+    memset(&chunk, 0, sizeof(struct P_client_msg));
+
+    chunk.F.store_id = cmsg->store->db_id;
+    chunk.F.mid = cmsg->mid;
+    chunk.F.id_len = strlen(context->id);
+    chunk.F.qos = cmsg->qos;
+    chunk.F.retain_dup = (cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F);
+    chunk.F.direction = cmsg->direction;
+    chunk.F.state = cmsg->state;
+    chunk.client_id = context->id;
+    chunk.properties = cmsg->properties;
+
+    return persist__chunk_client_msg_write_v5(db_fptr, &chunk);
+}
+
+
+static int persist__client_msg_save(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
+{
+    if(!strncmp(cmsg->store->topic, "$SYS", 4)
+            && cmsg->store->ref_count <= 1
+            && cmsg->store->dest_id_count == 0){
+
+        /* This $SYS message won't have been persisted, so we can't persist
+         * this client message. */
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    return persist__client_message_write(db_fptr, context, cmsg);
+}
+
+
+static int persist__client_messages_save(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context, struct mosquitto_msg_data *msg_data)
+{
     struct mosquitto_client_msg *cmsg;
+    int i;
     int rc;
 
     assert(db);
     assert(db_fptr);
     assert(context);
 
-    memset(&chunk, 0, sizeof(struct P_client_msg));
-
-    cmsg = queue;
-    while(cmsg){
-        if(!strncmp(cmsg->store->topic, "$SYS", 4)
-                && cmsg->store->ref_count <= 1
-                && cmsg->store->dest_id_count == 0){
-
-            /* This $SYS message won't have been persisted, so we can't persist
-             * this client message. */
-            cmsg = cmsg->next;
-            continue;
+    DL_FOREACH(msg_data->inflight, cmsg){
+        rc = persist__client_msg_save(db_fptr, context, cmsg);
+        if(rc){
+            return rc;
         }
-
-        chunk.F.store_id = cmsg->store->db_id;
-        chunk.F.mid = cmsg->mid;
-        chunk.F.id_len = strlen(context->id);
-        chunk.F.qos = cmsg->qos;
-        chunk.F.retain_dup = (cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F);
-        chunk.F.direction = cmsg->direction;
-        chunk.F.state = cmsg->state;
-        chunk.client_id = context->id;
-        chunk.properties = cmsg->properties;
-
-        rc = persist__chunk_client_msg_write_v5(db_fptr, &chunk);
+    }
+    for(i=0; i<msg_data->queued.count; i++){
+        rc = persist__client_msg_save(db_fptr, context, msg_queue__get(&msg_data->queued, i));
         if(rc){
             return rc;
         }
-
-        cmsg = cmsg->next;
     }
 
     return MOSQ_ERR_SUCCESS;
 }
 
 
-static int persist__message_store_save(struct mosquitto_db *db, FILE *db_fptr)
+int persist__message_store_write(FILE *db_fptr, struct mosquitto_msg_store *stored)
 {
     struct P_msg_store chunk;
+
+    memset(&chunk, 0, sizeof(struct P_msg_store));
+
+    if(!strncmp(stored->topic, "$SYS", 4)){
+        /* Don't save $SYS messages as retained otherwise they can give
+         * misleading information when reloaded. They should still be saved
+         * because a disconnected durable client may have them in their
+         * queue. */
+        chunk.F.retain = 0;
+    }else{
+        chunk.F.retain = (uint8_t)stored->retain;
+    }
+
+    chunk.F.store_id = stored->db_id;
+    chunk.F.expiry_time = stored->message_expiry_time;
+    chunk.F.payloadlen = stored->payloadlen;
+    chunk.F.source_mid = stored->source_mid;
+    if(stored->source_id){
+        chunk.F.source_id_len = strlen(stored->source_id);
+        chunk.source.id = stored->source_id;
+    }else{
+        chunk.F.source_id_len = 0;
+        chunk.source.id = NULL;
+    }
+    if(stored->source_username){
+        chunk.F.source_username_len = strlen(stored->source_username);
+        chunk.source.username = stored->source_username;
+    }else{
+        chunk.F.source_username_len = 0;
+        chunk.source.username = NULL;
+    }
+
+    chunk.F.topic_len = strlen(stored->topic);
+    chunk.topic = stored->topic;
+
+    if(stored->source_listener){
+        chunk.F.source_port = stored->source_listener->port;
+    }else{
+        chunk.F.source_port = 0;
+    }
+    chunk.F.qos = stored->qos;
+    chunk.payload = stored->payload;
+    chunk.properties = stored->properties;
+
+    return persist__chunk_message_store_write_v5(db_fptr, &chunk);
+}
+
+
+static int persist__message_store_save(struct mosquitto_db *db, FILE *db_fptr)
+{
     struct mosquitto_msg_store *stored;
     int rc;
 
     assert(db);
     assert(db_fptr);
 
-    memset(&chunk, 0, sizeof(struct P_msg_store));
-
     stored = db->msg_store;
     while(stored){
         if(stored->ref_count < 1 || stored->topic == NULL){
@@ -98,53 +190,15 @@ static int persist__message_store_save(struct mosquitto_db *db, FILE *db_fptr)
             continue;
         }
 
-        if(!strncmp(stored->topic, "$SYS", 4)){
-            if(stored->ref_count <= 1 && stored->dest_id_count == 0){
-                /* $SYS messages that are only retained shouldn't be persisted. */
-                stored = stored->next;
-                continue;
-            }
-            /* Don't save $SYS messages as retained otherwise they can give
-             * misleading information when reloaded. They should still be saved
-             * because a disconnected durable client may have them in their
-             * queue. */
-            chunk.F.retain = 0;
-        }else{
-            chunk.F.retain = (uint8_t)stored->retain;
-        }
-
-        chunk.F.store_id = stored->db_id;
-        chunk.F.expiry_time = stored->message_expiry_time;
-        chunk.F.payloadlen = stored->payloadlen;
-        chunk.F.source_mid = stored->source_mid;
-        if(stored->source_id){
-            chunk.F.source_id_len = strlen(stored->source_id);
-            chunk.source.id = stored->source_id;
-        }else{
-            chunk.F.source_id_len = 0;
-            chunk.source.id = NULL;
-        }
-        if(stored->source_username){
-            chunk.F.source_username_len = strlen(stored->source_username);
-            chunk.source.username = stored->source_username;
-        }else{
-            chunk.F.source_username_len = 0;
-            chunk.source.username = NULL;
-        }
-
-        chunk.F.topic_len = strlen(stored->topic);
-        chunk.topic = stored->topic;
+        if(!strncmp(stored->topic, "$SYS", 4)
+                && stored->ref_count <= 1 && stored->dest_id_count == 0){
 
-        if(stored->source_listener){
-            chunk.F.source_port = stored->source_listener->port;
-        }else{
-            chunk.F.source_port = 0;
+            /* $SYS messages that are only retained shouldn't be persisted. */
+            stored = stored->next;
+            continue;
         }
-        chunk.F.qos = stored->qos;
-        chunk.payload = stored->payload;
-        chunk.properties = stored->properties;
 
-        rc = persist__chunk_message_store_write_v5(db_fptr, &chunk);
+        rc = persist__message_store_write(db_fptr, stored);
         if(rc){
             return rc;
         }
@@ -178,10 +232,9 @@ static int persist__client_save(struct mosquitto_db *db, FILE *db_fptr)
                 return rc;
             }
 
-            if(persist__client_messages_save(db, db_fptr, context, context->msgs_in.inflight)) return 1;
-            if(persist__client_messages_save(db, db_fptr, context, context->msgs_in.queued)) return 1;
-            if(persist__client_messages_save(db, db_fptr, context, context->msgs_out.inflight)) return 1;
-            if(persist__client_messages_save(db, db_fptr, context, context->msgs_out.queued)) return 1;
+            if(persist__client_messages_save(db, db_fptr, context, &context->msgs_in)) return 1;
+            if(persist__client_messages_save(db, db_fptr, context, &context->msgs_out)) return 1;
+            if(spill__persist(db, db_fptr, context)) return 1;
         }
     }
 
@@ -262,27 +315,23 @@ static int persist__subs_retain_save_all(struct mosquitto_db *db, FILE *db_fptr)
     return MOSQ_ERR_SUCCESS;
 }
 
-int persist__backup(struct mosquitto_db *db, bool shutdown)
+/* Write the database to a new file and rename it over the old one. This is
+ * also run in the child process for background saves, so must not change
+ * anything in db. Returns the size of the file written, or -1 on error. */
+static long persist__db_write(struct mosquitto_db *db, bool shutdown)
 {
-    int rc = 0;
     FILE *db_fptr = NULL;
-    uint32_t db_version_w = htonl(MOSQ_DB_VERSION);
-    uint32_t crc = 0;
     char *err;
     char *outfile = NULL;
     int len;
+    long size;
     struct PF_cfg cfg_chunk;
 
-    if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
-    if(db->config->persistence == false) return MOSQ_ERR_SUCCESS;
-
-    log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
-
     len = strlen(db->config->persistence_filepath)+5;
     outfile = mosquitto__malloc(len+1);
     if(!outfile){
         log__printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, out of memory.");
-        return MOSQ_ERR_NOMEM;
+        return -1;
     }
     snprintf(outfile, len, "%s.new", db->config->persistence_filepath);
     outfile[len] = '\0';
@@ -306,10 +355,8 @@ int persist__backup(struct mosquitto_db *db, bool shutdown)
     * mosquitto.db.
     *
     */
-    rc = unlink(outfile);
-    if (rc != 0) {
-        rc = 0;
-        if (errno != ENOENT) {
+    if(unlink(outfile) != 0){
+        if(errno != ENOENT){
             log__printf(NULL, MOSQ_LOG_INFO, "Error saving in-memory database, unable to remove %s.", outfile);
             goto error;
         }
@@ -322,9 +369,9 @@ int persist__backup(struct mosquitto_db *db, bool shutdown)
     }
 
     /* Header */
-    write_e(db_fptr, magic, 15);
-    write_e(db_fptr, &crc, sizeof(uint32_t));
-    write_e(db_fptr, &db_version_w, sizeof(uint32_t));
+    if(persist__header_write(db_fptr)){
+        goto error;
+    }
 
     memset(&cfg_chunk, 0, sizeof(struct PF_cfg));
     cfg_chunk.last_db_id = db->last_db_id;
@@ -365,20 +412,134 @@ int persist__backup(struct mosquitto_db *db, bool shutdown)
 
     fflush(db_fptr);
     fsync(fileno(db_fptr));
+    size = ftell(db_fptr);
     fclose(db_fptr);
 
     if(rename(outfile, db->config->persistence_filepath) != 0){
         goto error;
     }
     mosquitto__free(outfile);
-    outfile = NULL;
-    return rc;
+    return size;
 error:
     mosquitto__free(outfile);
     err = strerror(errno);
     log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", err);
     if(db_fptr) fclose(db_fptr);
-    return 1;
+    return -1;
+}
+
+
+static double persist__elapsed(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
+
+static void persist__saved(struct mosquitto_db *db, struct timespec *start, long size, bool shutdown)
+{
+    db->persistence_saves++;
+    db->persistence_save_time = persist__elapsed(start);
+    db->persistence_save_bytes = size;
+
+    /* Everything in the journal is now in the database. */
+    persist__journal_reset(db, shutdown);
+}
+
+
+/* Wait for a background save to finish, or with wait==false just check
+ * whether it has. Called from the main loop. */
+void persist__background_check(struct mosquitto_db *db, bool wait)
+{
+#ifndef WIN32
+    int status;
+    pid_t rc;
+    struct stat buf;
+
+    if(background_pid <= 0) return;
+
+    rc = waitpid(background_pid, &status, wait?0:WNOHANG);
+    if(rc == 0 || (rc == -1 && errno == EINTR)){
+        return;
+    }
+    background_pid = 0;
+
+    if(rc == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error saving in-memory database in the background.");
+        return;
+    }
+    if(stat(db->config->persistence_filepath, &buf) == 0){
+        persist__saved(db, &background_start, buf.st_size, false);
+    }else{
+        persist__saved(db, &background_start, 0, false);
+    }
+#else
+    UNUSED(db);
+    UNUSED(wait);
+#endif
+}
+
+
+/* Save the database from a forked child, which has a copy on write image of
+ * the broker as it was at the fork, so clients carry on being serviced while
+ * the file is written and synced. Only one background save runs at once, if
+ * one is still running this does nothing. */
+int persist__backup_background(struct mosquitto_db *db)
+{
+#ifndef WIN32
+    pid_t pid;
+
+    if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+    if(db->config->persistence == false) return MOSQ_ERR_SUCCESS;
+
+    persist__background_check(db, false);
+    if(background_pid > 0){
+        return MOSQ_ERR_SUCCESS;
+    }
+
+    log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s in the background.", db->config->persistence_filepath);
+
+    clock_gettime(CLOCK_MONOTONIC, &background_start);
+    pid = fork();
+    if(pid == 0){
+        /* Child. The broker lock is held by the thread that forked, so
+         * nothing else was part way through changing the database. */
+        _exit(persist__db_write(db, false) < 0 ? 1 : 0);
+    }else if(pid == -1){
+        log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to start background save: %s.", strerror(errno));
+        return persist__backup(db, false);
+    }
+    background_pid = pid;
+    return MOSQ_ERR_SUCCESS;
+#else
+    return persist__backup(db, false);
+#endif
+}
+
+
+int persist__backup(struct mosquitto_db *db, bool shutdown)
+{
+    struct timespec start;
+    long size;
+
+    if(!db || !db->config || !db->config->persistence_filepath) return MOSQ_ERR_INVAL;
+    if(db->config->persistence == false) return MOSQ_ERR_SUCCESS;
+
+    /* A background save finishing after this one would replace it with
+     * older data. */
+    persist__background_check(db, true);
+
+    log__printf(NULL, MOSQ_LOG_INFO, "Saving in-memory database to %s.", db->config->persistence_filepath);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size = persist__db_write(db, shutdown);
+    if(size < 0){
+        return 1;
+    }
+    persist__saved(db, &start, size, shutdown);
+    return MOSQ_ERR_SUCCESS;
 }
 
 
@@ -35,14 +35,73 @@ Contributors:
 #include "time_mosq.h"
 #include "util_mosq.h"
 
+/* The chunks are written in version 6 form, which is the version 5 form with
+ * a CRC-32 after every chunk and message payloads that may be compressed. See
+ * persist.h. */
+
+#define write_crc_e(f, crc, b, c) if(persist__chunk_write(f, &crc, b, c)){ goto error; }
+
+/* Payloads shorter than this are always stored as they are, and longer ones
+ * only compressed if that saves at least an eighth of their length. */
+#define PERSIST_COMPRESS_MIN 128
+
+static uint8_t *compress_buf = NULL;
+static uint32_t compress_buf_len = 0;
+
+
+static int persist__chunk_write(FILE *db_fptr, uint32_t *crc, const void *buf, size_t len)
+{
+    if(fwrite(buf, 1, len, db_fptr) != len){
+        return 1;
+    }
+    *crc = persist__crc32(*crc, buf, len);
+    return 0;
+}
+
+
+static int persist__chunk_crc_write(FILE *db_fptr, uint32_t crc)
+{
+    uint32_t i32temp = htonl(crc);
+
+    if(fwrite(&i32temp, 1, sizeof(uint32_t), db_fptr) != sizeof(uint32_t)){
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Compress payload into compress_buf if it is worth it. Returns the
+ * compressed length, or 0 to store the payload as it is. */
+static uint32_t persist__payload_compress(const uint8_t *payload, uint32_t payloadlen)
+{
+    uint32_t limit;
+    uint8_t *newbuf;
+
+    if(payloadlen < PERSIST_COMPRESS_MIN) return 0;
+
+    limit = payloadlen - payloadlen/8;
+    if(compress_buf_len < limit){
+        newbuf = mosquitto__realloc(compress_buf, limit);
+        if(!newbuf) return 0;
+        compress_buf = newbuf;
+        compress_buf_len = limit;
+    }
+    return persist__compress(payload, payloadlen, compress_buf, limit);
+}
+
 int persist__chunk_cfg_write_v5(FILE *db_fptr, struct PF_cfg *chunk)
 {
     struct PF_header header;
+    uint32_t crc = 0;
 
     header.chunk = htonl(DB_CHUNK_CFG);
     header.length = htonl(sizeof(struct PF_cfg));
-    write_e(db_fptr, &header, sizeof(struct PF_header));
-    write_e(db_fptr, chunk, sizeof(struct PF_cfg));
+    write_crc_e(db_fptr, crc, &header, sizeof(struct PF_header));
+    write_crc_e(db_fptr, crc, chunk, sizeof(struct PF_cfg));
+
+    if(persist__chunk_crc_write(db_fptr, crc)){
+        goto error;
+    }
 
     return MOSQ_ERR_SUCCESS;
 error:
@@ -54,6 +113,7 @@ error:
 int persist__chunk_client_write_v5(FILE *db_fptr, struct P_client *chunk)
 {
     struct PF_header header;
+    uint32_t crc = 0;
     uint16_t id_len = chunk->F.id_len;
 
     chunk->F.session_expiry_interval = htonl(chunk->F.session_expiry_interval);
@@ -63,10 +123,14 @@ int persist__chunk_client_write_v5(FILE *db_fptr, struct P_client *chunk)
     header.chunk = htonl(DB_CHUNK_CLIENT);
     header.length = htonl(sizeof(struct PF_client)+id_len);
 
-    write_e(db_fptr, &header, sizeof(struct PF_header));
-    write_e(db_fptr, &chunk->F, sizeof(struct PF_client));
+    write_crc_e(db_fptr, crc, &header, sizeof(struct PF_header));
+    write_crc_e(db_fptr, crc, &chunk->F, sizeof(struct PF_client));
 
-    write_e(db_fptr, chunk->client_id, id_len);
+    write_crc_e(db_fptr, crc, chunk->client_id, id_len);
+
+    if(persist__chunk_crc_write(db_fptr, crc)){
+        goto error;
+    }
 
     return MOSQ_ERR_SUCCESS;
 error:
@@ -75,9 +139,10 @@ error:
 }
 
 
-int persist__chunk_client_msg_write_v5(FILE *db_fptr, struct P_client_msg *chunk)
+static int persist__chunk_client_msg_write_id(FILE *db_fptr, struct P_client_msg *chunk, int chunk_id)
 {
     struct PF_header header;
+    uint32_t crc = 0;
     struct mosquitto__packet prop_packet;
     uint16_t id_len = chunk->F.id_len;
     uint32_t proplen = 0;
@@ -92,12 +157,12 @@ int persist__chunk_client_msg_write_v5(FILE *db_fptr, struct P_client_msg *chunk
     chunk->F.mid = htons(chunk->F.mid);
     chunk->F.id_len = htons(chunk->F.id_len);
 
-    header.chunk = htonl(DB_CHUNK_CLIENT_MSG);
+    header.chunk = htonl(chunk_id);
     header.length = htonl(sizeof(struct PF_client_msg) + id_len + proplen);
 
-    write_e(db_fptr, &header, sizeof(struct PF_header));
-    write_e(db_fptr, &chunk->F, sizeof(struct PF_client_msg));
-    write_e(db_fptr, chunk->client_id, id_len);
+    write_crc_e(db_fptr, crc, &header, sizeof(struct PF_header));
+    write_crc_e(db_fptr, crc, &chunk->F, sizeof(struct PF_client_msg));
+    write_crc_e(db_fptr, crc, chunk->client_id, id_len);
     if(chunk->properties){
         if(proplen > 0){
             prop_packet.remaining_length = proplen;
@@ -109,11 +174,15 @@ int persist__chunk_client_msg_write_v5(FILE *db_fptr, struct P_client_msg *chunk
             rc = property__write_all(&prop_packet, chunk->properties, true);
             if(rc) return rc;
 
-            write_e(db_fptr, prop_packet.payload, proplen);
+            write_crc_e(db_fptr, crc, prop_packet.payload, proplen);
             mosquitto__free(prop_packet.payload);
         }
     }
 
+    if(persist__chunk_crc_write(db_fptr, crc)){
+        goto error;
+    }
+
     return MOSQ_ERR_SUCCESS;
 error:
     log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
@@ -121,15 +190,34 @@ error:
 }
 
 
+int persist__chunk_client_msg_write_v5(FILE *db_fptr, struct P_client_msg *chunk)
+{
+    return persist__chunk_client_msg_write_id(db_fptr, chunk, DB_CHUNK_CLIENT_MSG);
+}
+
+
+/* Only the store id, mid, direction and client id identify the message to be
+ * deleted, properties are not written. */
+int persist__chunk_client_msg_delete_write_v5(FILE *db_fptr, struct P_client_msg *chunk)
+{
+    chunk->properties = NULL;
+    return persist__chunk_client_msg_write_id(db_fptr, chunk, DB_CHUNK_CLIENT_MSG_DELETE);
+}
+
+
 int persist__chunk_message_store_write_v5(FILE *db_fptr, struct P_msg_store *chunk)
 {
     struct PF_header header;
+    uint32_t crc = 0;
     uint32_t payloadlen = chunk->F.payloadlen;
     uint16_t source_id_len = chunk->F.source_id_len;
     uint16_t source_username_len = chunk->F.source_username_len;
     uint16_t topic_len = chunk->F.topic_len;
     uint32_t proplen = 0;
     struct mosquitto__packet prop_packet;
+    struct PF_payload payload_header;
+    const uint8_t *payload = NULL;
+    uint32_t stored_len = payloadlen;
     int rc;
 
     memset(&prop_packet, 0, sizeof(struct mosquitto__packet));
@@ -138,6 +226,20 @@ int persist__chunk_message_store_write_v5(FILE *db_fptr, struct P_msg_store *chu
         proplen += packet__varint_bytes(proplen);
     }
 
+    memset(&payload_header, 0, sizeof(struct PF_payload));
+    payload_header.encoding = DB_PAYLOAD_RAW;
+    if(payloadlen){
+        payload = UHPA_ACCESS(chunk->payload, payloadlen);
+        stored_len = persist__payload_compress(payload, payloadlen);
+        if(stored_len){
+            payload = compress_buf;
+            payload_header.encoding = DB_PAYLOAD_LZ4;
+        }else{
+            stored_len = payloadlen;
+        }
+    }
+    payload_header.stored_len = htonl(stored_len);
+
     chunk->F.payloadlen = htonl(chunk->F.payloadlen);
     chunk->F.source_mid = htons(chunk->F.source_mid);
     chunk->F.source_id_len = htons(chunk->F.source_id_len);
@@ -146,21 +248,22 @@ int persist__chunk_message_store_write_v5(FILE *db_fptr, struct P_msg_store *chu
     chunk->F.source_port = htons(chunk->F.source_port);
 
     header.chunk = htonl(DB_CHUNK_MSG_STORE);
-    header.length = htonl(sizeof(struct PF_msg_store) +
-            topic_len + payloadlen +
+    header.length = htonl(sizeof(struct PF_msg_store) + sizeof(struct PF_payload) +
+            topic_len + stored_len +
             source_id_len + source_username_len + proplen);
 
-    write_e(db_fptr, &header, sizeof(struct PF_header));
-    write_e(db_fptr, &chunk->F, sizeof(struct PF_msg_store));
+    write_crc_e(db_fptr, crc, &header, sizeof(struct PF_header));
+    write_crc_e(db_fptr, crc, &chunk->F, sizeof(struct PF_msg_store));
+    write_crc_e(db_fptr, crc, &payload_header, sizeof(struct PF_payload));
     if(source_id_len){
-        write_e(db_fptr, chunk->source.id, source_id_len);
+        write_crc_e(db_fptr, crc, chunk->source.id, source_id_len);
     }
     if(source_username_len){
-        write_e(db_fptr, chunk->source.username, source_username_len);
+        write_crc_e(db_fptr, crc, chunk->source.username, source_username_len);
     }
-    write_e(db_fptr, chunk->topic, topic_len);
-    if(payloadlen){
-        write_e(db_fptr, UHPA_ACCESS(chunk->payload, payloadlen), (unsigned int)payloadlen);
+    write_crc_e(db_fptr, crc, chunk->topic, topic_len);
+    if(stored_len){
+        write_crc_e(db_fptr, crc, payload, stored_len);
     }
     if(chunk->properties){
         if(proplen > 0){
@@ -173,11 +276,16 @@ int persist__chunk_message_store_write_v5(FILE *db_fptr, struct P_msg_store *chu
             rc = property__write_all(&prop_packet, chunk->properties, true);
             if(rc) return rc;
 
-            write_e(db_fptr, prop_packet.payload, proplen);
+            write_crc_e(db_fptr, crc, prop_packet.payload, proplen);
             mosquitto__free(prop_packet.payload);
+            prop_packet.payload = NULL;
         }
     }
 
+    if(persist__chunk_crc_write(db_fptr, crc)){
+        goto error;
+    }
+
     return MOSQ_ERR_SUCCESS;
 error:
     log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
@@ -186,15 +294,20 @@ error:
 }
 
 
-int persist__chunk_retain_write_v5(FILE *db_fptr, struct P_retain *chunk)
+static int persist__chunk_retain_write_id(FILE *db_fptr, struct P_retain *chunk, int chunk_id)
 {
     struct PF_header header;
+    uint32_t crc = 0;
 
-    header.chunk = htonl(DB_CHUNK_RETAIN);
+    header.chunk = htonl(chunk_id);
     header.length = htonl(sizeof(struct PF_retain));
 
-    write_e(db_fptr, &header, sizeof(struct PF_header));
-    write_e(db_fptr, &chunk->F, sizeof(struct PF_retain));
+    write_crc_e(db_fptr, crc, &header, sizeof(struct PF_header));
+    write_crc_e(db_fptr, crc, &chunk->F, sizeof(struct PF_retain));
+
+    if(persist__chunk_crc_write(db_fptr, crc)){
+        goto error;
+    }
 
     return MOSQ_ERR_SUCCESS;
 error:
@@ -203,9 +316,22 @@ error:
 }
 
 
-int persist__chunk_sub_write_v5(FILE *db_fptr, struct P_sub *chunk)
+int persist__chunk_retain_write_v5(FILE *db_fptr, struct P_retain *chunk)
+{
+    return persist__chunk_retain_write_id(db_fptr, chunk, DB_CHUNK_RETAIN);
+}
+
+
+int persist__chunk_msg_store_delete_write_v5(FILE *db_fptr, struct P_retain *chunk)
+{
+    return persist__chunk_retain_write_id(db_fptr, chunk, DB_CHUNK_MSG_STORE_DELETE);
+}
+
+
+static int persist__chunk_sub_write_id(FILE *db_fptr, struct P_sub *chunk, int chunk_id)
 {
     struct PF_header header;
+    uint32_t crc = 0;
     uint16_t id_len = chunk->F.id_len;
     uint16_t topic_len = chunk->F.topic_len;
 
@@ -213,14 +339,57 @@ int persist__chunk_sub_write_v5(FILE *db_fptr, struct P_sub *chunk)
     chunk->F.id_len = htons(chunk->F.id_len);
     chunk->F.topic_len = htons(chunk->F.topic_len);
 
-    header.chunk = htonl(DB_CHUNK_SUB);
+    header.chunk = htonl(chunk_id);
     header.length = htonl(sizeof(struct PF_sub) +
             id_len + topic_len);
 
-    write_e(db_fptr, &header, sizeof(struct PF_header));
-    write_e(db_fptr, &chunk->F, sizeof(struct PF_sub));
-    write_e(db_fptr, chunk->client_id, id_len);
-    write_e(db_fptr, chunk->topic, topic_len);
+    write_crc_e(db_fptr, crc, &header, sizeof(struct PF_header));
+    write_crc_e(db_fptr, crc, &chunk->F, sizeof(struct PF_sub));
+    write_crc_e(db_fptr, crc, chunk->client_id, id_len);
+    write_crc_e(db_fptr, crc, chunk->topic, topic_len);
+
+    if(persist__chunk_crc_write(db_fptr, crc)){
+        goto error;
+    }
+
+    return MOSQ_ERR_SUCCESS;
+error:
+    log__printf(NULL, MOSQ_LOG_ERR, "Error: %s.", strerror(errno));
+    return 1;
+}
+
+
+int persist__chunk_sub_write_v5(FILE *db_fptr, struct P_sub *chunk)
+{
+    return persist__chunk_sub_write_id(db_fptr, chunk, DB_CHUNK_SUB);
+}
+
+
+int persist__chunk_sub_delete_write_v5(FILE *db_fptr, struct P_sub *chunk)
+{
+    return persist__chunk_sub_write_id(db_fptr, chunk, DB_CHUNK_SUB_DELETE);
+}
+
+
+/* A chunk holding only a length prefixed string, read with
+ * persist__read_string(). */
+int persist__chunk_string_write_v5(FILE *db_fptr, int chunk_id, const char *str)
+{
+    struct PF_header header;
+    uint32_t crc = 0;
+    uint16_t slen = strlen(str);
+    uint16_t i16temp = htons(slen);
+
+    header.chunk = htonl(chunk_id);
+    header.length = htonl(sizeof(uint16_t) + slen);
+
+    write_crc_e(db_fptr, crc, &header, sizeof(struct PF_header));
+    write_crc_e(db_fptr, crc, &i16temp, sizeof(uint16_t));
+    write_crc_e(db_fptr, crc, str, slen);
+
+    if(persist__chunk_crc_write(db_fptr, crc)){
+        goto error;
+    }
 
     return MOSQ_ERR_SUCCESS;
 error:
@@ -0,0 +1,147 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include "mosquitto_broker_internal.h"
+#include "mosquitto_broker.h"
+#include "memory_mosq.h"
+#include "packet_mosq.h"
+#include "tls_mosq.h"
+
+/* Checks that a version 5 plugin answers with MOSQ_ERR_PLUGIN_PENDING.
+ *
+ * The packet being checked is moved in to a struct mosquitto__plugin_pending
+ * on the client, and while that is set nothing more is read from the client,
+ * so its packets are still handled in order. The plugin gives the result from
+ * any thread it likes, which marks the check as done and wakes the main loop.
+ * The main loop picks up handling the packet where it left off, then carries
+ * on with anything that arrived in the meantime.
+ *
+ * A client that disconnects while a check is pending isn't freed until the
+ * plugin has given the result, see context__free_disused().
+ */
+
+struct mosquitto__plugin_pending *plugin__pending_new(struct mosquitto *context, enum mosquitto__plugin_pending_type type)
+{
+    struct mosquitto__plugin_pending *pending;
+
+    pending = mosquitto__calloc(1, sizeof(struct mosquitto__plugin_pending));
+    if(!pending) return NULL;
+
+    pending->type = type;
+    context->plugin_pending = pending;
+
+    return pending;
+}
+
+
+void plugin__pending_free(struct mosquitto__plugin_pending *pending)
+{
+    if(!pending) return;
+
+    mosquitto__free(pending->client_id);
+    mosquitto__free(pending->username);
+    mosquitto__free(pending->password);
+    if(pending->will){
+        mosquitto_property_free_all(&pending->will->properties);
+        mosquitto__free(pending->will->msg.payload);
+        mosquitto__free(pending->will->msg.topic);
+        mosquitto__free(pending->will);
+    }
+    mosquitto__free(pending->auth_data);
+    mosquitto__free(pending->topic);
+    UHPA_FREE(pending->payload, pending->payloadlen);
+    mosquitto_property_free_all(&pending->properties);
+    mosquitto__free(pending);
+}
+
+
+/* Called by the main loop once the plugin has given the result. */
+void plugin__pending_resume(struct mosquitto_db *db, struct mosquitto *context)
+{
+    struct mosquitto__plugin_pending *pending;
+    int rc;
+
+    pending = context->plugin_pending;
+    context->plugin_pending = NULL;
+
+    if(pending->type == plugin_pending_unpwd){
+        rc = connect__pending(db, context, pending);
+    }else{
+        rc = handle__publish_pending(db, context, pending);
+    }
+    plugin__pending_free(pending);
+    if(rc){
+        do_disconnect(db, context, rc);
+        return;
+    }
+
+    /* Anything already read from the client hasn't been handled yet. */
+    do{
+        rc = packet__read(db, context);
+        if(rc){
+            do_disconnect(db, context, rc);
+            return;
+        }
+    }while(SSL_DATA_PENDING(context) && !context->plugin_pending);
+}
+
+
+/* Must be called with db_mutex held. */
+int plugin__pending_result(struct mosquitto *client, enum mosquitto__plugin_pending_type type, int result)
+{
+    if(client->plugin_pending && client->plugin_pending->type == type && !client->plugin_pending->done){
+        client->plugin_pending->result = result;
+        client->plugin_pending->done = true;
+        worker__wake(client);
+        return MOSQ_ERR_SUCCESS;
+    }else{
+        return MOSQ_ERR_INVAL;
+    }
+}
+
+
+static int plugin__pending_complete(struct mosquitto *client, enum mosquitto__plugin_pending_type type, int result)
+{
+    int rc;
+
+    if(!client) return MOSQ_ERR_INVAL;
+
+    /* Plugin threads must take the broker lock, the broker's own threads
+     * already hold it. */
+    if(worker__is_broker_thread()){
+        return plugin__pending_result(client, type, result);
+    }
+
+    worker__lock();
+    rc = plugin__pending_result(client, type, result);
+    worker__unlock();
+
+    return rc;
+}
+
+
+int mosquitto_unpwd_check_complete(struct mosquitto *client, int result)
+{
+    return plugin__pending_complete(client, plugin_pending_unpwd, result);
+}
+
+
+int mosquitto_acl_check_complete(struct mosquitto *client, int result)
+{
+    return plugin__pending_complete(client, plugin_pending_acl, result);
+}
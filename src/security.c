@@ -311,7 +311,7 @@ static int security__module_init_single(struct mosquitto__security_options *opts
             }
             version = plugin_version();
             opts->auth_plugin_configs[i].plugin.version = version;
-            if(version == 4){
+            if(version == 5 || version == 4){
                 rc = security__load_v4(
                         &opts->auth_plugin_configs[i].plugin,
                         opts->auth_plugin_configs[i].options,
@@ -379,7 +379,7 @@ static void security__module_cleanup_single(struct mosquitto__security_options *
 
     for(i=0; i<opts->auth_plugin_config_count; i++){
         /* Run plugin cleanup function */
-        if(opts->auth_plugin_configs[i].plugin.version == 4){
+        if(opts->auth_plugin_configs[i].plugin.version >= 4){
             opts->auth_plugin_configs[i].plugin.plugin_cleanup_v4(
                     opts->auth_plugin_configs[i].plugin.user_data,
                     opts->auth_plugin_configs[i].options,
@@ -428,7 +428,7 @@ static int security__init_single(struct mosquitto__security_options *opts, bool
     int rc;
 
     for(i=0; i<opts->auth_plugin_config_count; i++){
-        if(opts->auth_plugin_configs[i].plugin.version == 4){
+        if(opts->auth_plugin_configs[i].plugin.version >= 4){
             rc = opts->auth_plugin_configs[i].plugin.security_init_v4(
                     opts->auth_plugin_configs[i].plugin.user_data,
                     opts->auth_plugin_configs[i].options,
@@ -494,7 +494,7 @@ static int security__cleanup_single(struct mosquitto__security_options *opts, bo
     int rc;
 
     for(i=0; i<opts->auth_plugin_config_count; i++){
-        if(opts->auth_plugin_configs[i].plugin.version == 4){
+        if(opts->auth_plugin_configs[i].plugin.version >= 4){
             rc = opts->auth_plugin_configs[i].plugin.security_cleanup_v4(
                     opts->auth_plugin_configs[i].plugin.user_data,
                     opts->auth_plugin_configs[i].options,
@@ -566,7 +566,7 @@ static int acl__check_single(struct mosquitto__auth_plugin_config *auth_plugin,
         }
     }
 
-    if(auth_plugin->plugin.version == 4){
+    if(auth_plugin->plugin.version >= 4){
         return auth_plugin->plugin.acl_check_v4(auth_plugin->plugin.user_data, access, context, msg);
     }else if(auth_plugin->plugin.version == 3){
         return auth_plugin->plugin.acl_check_v3(auth_plugin->plugin.user_data, access, context, msg);
@@ -615,17 +615,67 @@ static int acl__check_dollar(const char *topic, int access)
 }
 
 
-int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access)
+/* Each client has its own cache of ACL results, acl_cache_size entries long,
+ * so repeated checks of the same topic are a single lookup. An entry is found
+ * by the hash of its topic, access, QoS and retain flag, because plugins may
+ * grant access based on any of these, and replaces whatever was in its slot
+ * before. The payload is not part of the key. The whole cache is cleared whenever the client's ACLs may have
+ * changed, which is on a config reload, when its username changes, or when a
+ * plugin asks with mosquitto_acl_cache_clear(). */
+static uint32_t acl__cache_hash(const char *topic, int access, int qos, bool retain)
+{
+    uint32_t hash = 2166136261U;
+
+    while(*topic){
+        hash = (hash ^ (uint8_t)*topic) * 16777619U;
+        topic++;
+    }
+    hash = (hash ^ (uint32_t)access) * 16777619U;
+    hash = (hash ^ (uint32_t)qos) * 16777619U;
+    return (hash ^ (uint32_t)retain) * 16777619U;
+}
+
+
+void acl__cache_init(struct mosquitto_db *db, struct mosquitto *context)
+{
+    acl__cache_free(context);
+
+    if(db->config->acl_cache_size > 0){
+        context->acl_cache = mosquitto__calloc(db->config->acl_cache_size, sizeof(struct mosquitto__acl_cache));
+        if(context->acl_cache){
+            context->acl_cache_size = db->config->acl_cache_size;
+        }
+    }
+}
+
+
+void acl__cache_clear(struct mosquitto *context)
+{
+    int i;
+
+    for(i=0; i<context->acl_cache_size; i++){
+        mosquitto__free(context->acl_cache[i].topic);
+        context->acl_cache[i].topic = NULL;
+    }
+}
+
+
+void acl__cache_free(struct mosquitto *context)
+{
+    acl__cache_clear(context);
+    mosquitto__free(context->acl_cache);
+    context->acl_cache = NULL;
+    context->acl_cache_size = 0;
+}
+
+
+static int acl__check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access)
 {
     int rc;
     int i;
     struct mosquitto__security_options *opts;
     struct mosquitto_acl_msg msg;
 
-    if(!context->id){
-        return MOSQ_ERR_ACL_DENIED;
-    }
-
     rc = acl__check_dollar(topic, access);
     if(rc) return rc;
 
@@ -666,6 +716,103 @@ int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, cons
     return rc;
 }
 
+
+static int acl__check_cached(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access)
+{
+    struct mosquitto__acl_cache *entry;
+    uint32_t hash;
+    int rc;
+
+    if(!context->id){
+        return MOSQ_ERR_ACL_DENIED;
+    }
+
+    /* Subscription checks are not repeated often enough to be worth
+     * caching. */
+    if(!context->acl_cache || (access != MOSQ_ACL_READ && access != MOSQ_ACL_WRITE)){
+        return acl__check(db, context, topic, payloadlen, payload, qos, retain, access);
+    }
+
+    hash = acl__cache_hash(topic, access, qos, retain);
+    entry = &context->acl_cache[hash % (uint32_t)context->acl_cache_size];
+    if(entry->topic && entry->hash == hash && entry->access == access && entry->qos == qos && entry->retain == retain && !strcmp(entry->topic, topic)){
+        return entry->rc;
+    }
+
+    rc = acl__check(db, context, topic, payloadlen, payload, qos, retain, access);
+    if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_ACL_DENIED){
+        mosquitto__free(entry->topic);
+        entry->topic = mosquitto__strdup(topic);
+        entry->hash = hash;
+        entry->access = access;
+        entry->qos = (uint8_t)qos;
+        entry->retain = retain;
+        entry->rc = rc;
+    }
+    return rc;
+}
+
+
+int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access)
+{
+    int rc;
+
+    rc = acl__check_cached(db, context, topic, payloadlen, payload, qos, retain, access);
+    if(rc == MOSQ_ERR_PLUGIN_PENDING){
+        log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Auth plugin returned pending for an ACL check that must be answered straight away, denying access.");
+        return MOSQ_ERR_ACL_DENIED;
+    }
+    return rc;
+}
+
+
+/* As mosquitto_acl_check() for an incoming PUBLISH, except a plugin may answer
+ * MOSQ_ERR_PLUGIN_PENDING and give the result later with
+ * mosquitto_acl_check_complete(). */
+int mosquitto_acl_check_publish(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain)
+{
+    int rc;
+
+    rc = acl__check_cached(db, context, topic, payloadlen, payload, qos, retain, MOSQ_ACL_WRITE);
+#ifdef WITH_WEBSOCKETS
+    if(rc == MOSQ_ERR_PLUGIN_PENDING && context->wsi){
+        /* Websockets clients can't have their reads paused. */
+        log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Auth plugin returned pending for an ACL check on websockets client %s, denying access.", context->id);
+        return MOSQ_ERR_ACL_DENIED;
+    }
+#endif
+    return rc;
+}
+
+
+int mosquitto_acl_cache_clear(struct mosquitto *client)
+{
+    struct mosquitto_db *db;
+    struct mosquitto *context, *ctxt_tmp;
+    bool locked = false;
+
+    /* Plugin threads must take the broker lock, the broker's own threads
+     * already hold it. */
+    if(!worker__is_broker_thread()){
+        worker__lock();
+        locked = true;
+    }
+
+    if(client){
+        acl__cache_clear(client);
+    }else{
+        db = mosquitto__get_db();
+        HASH_ITER(hh_id, db->contexts_by_id, context, ctxt_tmp){
+            acl__cache_clear(context);
+        }
+    }
+
+    if(locked){
+        worker__unlock();
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
 int mosquitto_unpwd_check(struct mosquitto_db *db, struct mosquitto *context, const char *username, const char *password)
 {
     int rc;
@@ -687,7 +834,7 @@ int mosquitto_unpwd_check(struct mosquitto_db *db, struct mosquitto *context, co
 
     rc = MOSQ_ERR_SUCCESS;
     for(i=0; i<opts->auth_plugin_config_count; i++){
-        if(opts->auth_plugin_configs[i].plugin.version == 4 
+        if(opts->auth_plugin_configs[i].plugin.version >= 4 
                 && opts->auth_plugin_configs[i].plugin.unpwd_check_v4){
 
             rc = opts->auth_plugin_configs[i].plugin.unpwd_check_v4(
@@ -745,7 +892,7 @@ int mosquitto_psk_key_get(struct mosquitto_db *db, struct mosquitto *context, co
     }
 
     for(i=0; i<opts->auth_plugin_config_count; i++){
-        if(opts->auth_plugin_configs[i].plugin.version == 4
+        if(opts->auth_plugin_configs[i].plugin.version >= 4
                 && opts->auth_plugin_configs[i].plugin.psk_key_get_v4){
 
             rc = opts->auth_plugin_configs[i].plugin.psk_key_get_v4(
@@ -18,6 +18,7 @@ Contributors:
 
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "mosquitto_broker_internal.h"
@@ -27,13 +28,15 @@ Contributors:
 #include "misc_mosq.h"
 #include "util_mosq.h"
 
+#include "utlist.h"
+
 static int aclfile__parse(struct mosquitto_db *db, struct mosquitto__security_options *security_opts);
 static int unpwd__file_parse(struct mosquitto__unpwd **unpwd, const char *password_file);
 static int acl__cleanup(struct mosquitto_db *db, bool reload);
 static int unpwd__cleanup(struct mosquitto__unpwd **unpwd, bool reload);
 static int psk__file_parse(struct mosquitto_db *db, struct mosquitto__unpwd **psk_id, const char *psk_file);
 #ifdef WITH_TLS
-static int pw__digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len);
+static int pw__digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len, enum mosquitto_pwhash_type hashtype, int iterations);
 static int base64__decode(char *in, unsigned char **decoded, unsigned int *decoded_len);
 static int mosquitto__memcmp_const(const void *ptr1, const void *b, size_t len);
 #endif
@@ -153,20 +156,221 @@ int mosquitto_security_cleanup_default(struct mosquitto_db *db, bool reload)
 }
 
 
+/* Substitutions for %c and %u in pattern ACLs, worked out once per check. */
+struct acl__subst{
+    const char *id;
+    const char *username;
+    size_t id_len;
+    size_t username_len;
+};
+
+
+static bool acl__level_is_pattern(const char *topic, size_t len)
+{
+    size_t i;
+
+    for(i=0; i+1<len; i++){
+        if(topic[i] == '%' && (topic[i+1] == 'c' || topic[i+1] == 'u')){
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static struct mosquitto__aclhier *acl__hier_entry_add(struct mosquitto__aclhier *parent, const char *topic, size_t len, bool pattern)
+{
+    struct mosquitto__aclhier *child;
+
+    if(parent){
+        if(pattern){
+            for(child = parent->patterns; child; child = child->next){
+                if(child->topic_len == len && !memcmp(child->topic, topic, len)){
+                    return child;
+                }
+            }
+        }else{
+            HASH_FIND(hh, parent->children, topic, len, child);
+            if(child) return child;
+        }
+    }
+
+    child = mosquitto__calloc(1, sizeof(struct mosquitto__aclhier) + len + 1);
+    if(!child) return NULL;
+
+    child->topic_len = (uint16_t)len;
+    child->topic = (char *)&child[1];
+    memcpy(child->topic, topic, len);
+    child->topic[len] = '\0';
+
+    if(!parent) return child;
+
+    if(pattern){
+        /* Kept in order, so matching tries them in the order they were
+         * given. */
+        LL_APPEND(parent->patterns, child);
+    }else{
+        HASH_ADD_KEYPTR(hh, parent->children, child->topic, child->topic_len, child);
+        if(len == 1){
+            if(topic[0] == '+'){
+                parent->child_plus = child;
+            }else if(topic[0] == '#'){
+                parent->child_hash = child;
+            }
+        }
+    }
+    return child;
+}
+
+
+/* Add topic to the tree at *root, creating the root if needed. The levels of
+ * a pattern that include %c or %u are added as patterns. */
+static int acl__tree_add(struct mosquitto__aclhier **root, const char *topic, int access, bool pattern)
+{
+    struct mosquitto__aclhier *hier;
+    const char *start, *c;
+    size_t len;
+
+    if(!*root){
+        *root = acl__hier_entry_add(NULL, "", 0, false);
+        if(!*root) return MOSQ_ERR_NOMEM;
+    }
+
+    hier = *root;
+    start = topic;
+    for(c=topic; ; c++){
+        if(*c == '/' || *c == '\0'){
+            len = c - start;
+            if(len > UINT16_MAX) return MOSQ_ERR_INVAL;
+            hier = acl__hier_entry_add(hier, start, len, pattern && acl__level_is_pattern(start, len));
+            if(!hier) return MOSQ_ERR_NOMEM;
+            if(*c == '\0') break;
+            start = c+1;
+        }
+    }
+    hier->access |= (uint8_t)access;
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static void acl__tree_free(struct mosquitto__aclhier *hier)
+{
+    struct mosquitto__aclhier *child, *child_tmp;
+
+    if(!hier) return;
+
+    HASH_ITER(hh, hier->children, child, child_tmp){
+        HASH_DELETE(hh, hier->children, child);
+        acl__tree_free(child);
+    }
+    LL_FOREACH_SAFE(hier->patterns, child, child_tmp){
+        acl__tree_free(child);
+    }
+    mosquitto__free(hier);
+}
+
+
+/* Match a pattern level against the start of topic, substituting %c and %u as
+ * it goes. A substituted client id or username may contain '/', so this can
+ * cover more than one level of topic. On a match *next is set to the level
+ * after those matched, or NULL at the end of topic. */
+static bool acl__pattern_match(const struct mosquitto__aclhier *hier, const char *topic, const struct acl__subst *subst, const char **next)
+{
+    const char *t = topic;
+    uint16_t i;
+
+    for(i=0; i<hier->topic_len; i++){
+        if(hier->topic[i] == '%' && i+1 < hier->topic_len){
+            if(hier->topic[i+1] == 'c'){
+                if(strncmp(t, subst->id, subst->id_len)) return false;
+                t += subst->id_len;
+                i++;
+                continue;
+            }else if(hier->topic[i+1] == 'u'){
+                if(!subst->username) return false;
+                if(strncmp(t, subst->username, subst->username_len)) return false;
+                t += subst->username_len;
+                i++;
+                continue;
+            }
+        }
+        if(*t != hier->topic[i]) return false;
+        t++;
+    }
+
+    if(*t == '/'){
+        *next = t+1;
+        return true;
+    }else if(*t == '\0'){
+        *next = NULL;
+        return true;
+    }else{
+        return false;
+    }
+}
+
+
+/* Whether any rule below hier that grants access matches topic, which is the
+ * remainder of the topic being checked, or NULL if it has all been matched.
+ * This follows mosquitto_topic_matches_sub(), so "a/#" also matches "a", and
+ * wildcards in the first level don't match topics beginning with $. */
+static bool acl__tree_search(const struct mosquitto__aclhier *hier, const char *topic, int access, const struct acl__subst *subst, bool first)
+{
+    struct mosquitto__aclhier *branch;
+    const char *end, *next;
+    size_t len;
+
+    if(!topic){
+        if(hier->access & access) return true;
+        if(hier->child_hash && (hier->child_hash->access & access)) return true;
+        return false;
+    }
+
+    end = strchr(topic, '/');
+    if(end){
+        len = end - topic;
+        next = end+1;
+    }else{
+        len = strlen(topic);
+        next = NULL;
+    }
+
+    HASH_FIND(hh, hier->children, topic, len, branch);
+    if(branch && acl__tree_search(branch, next, access, subst, false)){
+        return true;
+    }
+
+    if(!first || topic[0] != '$'){
+        if(hier->child_plus && acl__tree_search(hier->child_plus, next, access, subst, false)){
+            return true;
+        }
+        if(hier->child_hash && (hier->child_hash->access & access)){
+            return true;
+        }
+    }
+
+    if(subst){
+        for(branch = hier->patterns; branch; branch = branch->next){
+            if(acl__pattern_match(branch, topic, subst, &next)
+                    && acl__tree_search(branch, next, access, subst, false)){
+
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
 int add__acl(struct mosquitto__security_options *security_opts, const char *user, const char *topic, int access)
 {
     struct mosquitto__acl_user *acl_user=NULL, *user_tail;
-    struct mosquitto__acl *acl, *acl_tail;
-    char *local_topic;
-    bool new_user = false;
+    int rc;
 
     if(!security_opts || !topic) return MOSQ_ERR_INVAL;
 
-    local_topic = mosquitto__strdup(topic);
-    if(!local_topic){
-        return MOSQ_ERR_NOMEM;
-    }
-
     if(security_opts->acl_list){
         user_tail = security_opts->acl_list;
         while(user_tail){
@@ -185,14 +389,11 @@ int add__acl(struct mosquitto__security_options *security_opts, const char *user
     if(!acl_user){
         acl_user = mosquitto__malloc(sizeof(struct mosquitto__acl_user));
         if(!acl_user){
-            mosquitto__free(local_topic);
             return MOSQ_ERR_NOMEM;
         }
-        new_user = true;
         if(user){
             acl_user->username = mosquitto__strdup(user);
             if(!acl_user->username){
-                mosquitto__free(local_topic);
                 mosquitto__free(acl_user);
                 return MOSQ_ERR_NOMEM;
             }
@@ -201,33 +402,7 @@ int add__acl(struct mosquitto__security_options *security_opts, const char *user
         }
         acl_user->next = NULL;
         acl_user->acl = NULL;
-    }
-
-    acl = mosquitto__malloc(sizeof(struct mosquitto__acl));
-    if(!acl){
-        mosquitto__free(local_topic);
-        mosquitto__free(acl_user->username);
-        mosquitto__free(acl_user);
-        return MOSQ_ERR_NOMEM;
-    }
-    acl->access = access;
-    acl->topic = local_topic;
-    acl->next = NULL;
-    acl->ccount = 0;
-    acl->ucount = 0;
-
-    /* Add acl to user acl list */
-    if(acl_user->acl){
-        acl_tail = acl_user->acl;
-        while(acl_tail->next){
-            acl_tail = acl_tail->next;
-        }
-        acl_tail->next = acl;
-    }else{
-        acl_user->acl = acl;
-    }
 
-    if(new_user){
         /* Add to end of list */
         if(security_opts->acl_list){
             user_tail = security_opts->acl_list;
@@ -240,78 +415,36 @@ int add__acl(struct mosquitto__security_options *security_opts, const char *user
         }
     }
 
-    return MOSQ_ERR_SUCCESS;
+    /* Plain topics are never substituted, so %c and %u are literal here. */
+    rc = acl__tree_add(&acl_user->acl, topic, access, false);
+    if(rc == MOSQ_ERR_NOMEM){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+    }
+    return rc;
 }
 
 int add__acl_pattern(struct mosquitto__security_options *security_opts, const char *topic, int access)
 {
-    struct mosquitto__acl *acl, *acl_tail;
-    char *local_topic;
-    char *s;
+    int rc;
 
     if(!security_opts| !topic) return MOSQ_ERR_INVAL;
 
-    local_topic = mosquitto__strdup(topic);
-    if(!local_topic){
-        return MOSQ_ERR_NOMEM;
-    }
-
-    acl = mosquitto__malloc(sizeof(struct mosquitto__acl));
-    if(!acl){
-        mosquitto__free(local_topic);
-        return MOSQ_ERR_NOMEM;
-    }
-    acl->access = access;
-    acl->topic = local_topic;
-    acl->next = NULL;
-
-    acl->ccount = 0;
-    s = local_topic;
-    while(s){
-        s = strstr(s, "%c");
-        if(s){
-            acl->ccount++;
-            s+=2;
-        }
-    }
-
-    acl->ucount = 0;
-    s = local_topic;
-    while(s){
-        s = strstr(s, "%u");
-        if(s){
-            acl->ucount++;
-            s+=2;
-        }
-    }
-
-    if(acl->ccount == 0 && acl->ucount == 0){
+    if(!strstr(topic, "%c") && !strstr(topic, "%u")){
         log__printf(NULL, MOSQ_LOG_WARNING,
                 "Warning: ACL pattern '%s' does not contain '%%c' or '%%u'.",
                 topic);
     }
 
-    if(security_opts->acl_patterns){
-        acl_tail = security_opts->acl_patterns;
-        while(acl_tail->next){
-            acl_tail = acl_tail->next;
-        }
-        acl_tail->next = acl;
-    }else{
-        security_opts->acl_patterns = acl;
+    rc = acl__tree_add(&security_opts->acl_patterns, topic, access, true);
+    if(rc == MOSQ_ERR_NOMEM){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
     }
-
-    return MOSQ_ERR_SUCCESS;
+    return rc;
 }
 
 int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *topic, int access)
 {
-    char *local_acl;
-    struct mosquitto__acl *acl_root;
-    bool result;
-    int i;
-    int len, tlen, clen, ulen;
-    char *s;
+    struct acl__subst subst;
     struct mosquitto__security_options *security_opts = NULL;
 
     if(!db || !context || !topic) return MOSQ_ERR_INVAL;
@@ -329,35 +462,16 @@ int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *conte
 
     if(access == MOSQ_ACL_SUBSCRIBE) return MOSQ_ERR_SUCCESS; /* FIXME - implement ACL subscription strings. */
     if(!context->acl_list && !security_opts->acl_patterns) return MOSQ_ERR_ACL_DENIED;
+    if(topic[0] == '\0') return MOSQ_ERR_ACL_DENIED;
 
-    if(context->acl_list){
-        acl_root = context->acl_list->acl;
-    }else{
-        acl_root = NULL;
-    }
-
-    /* Loop through all ACLs for this client. */
-    while(acl_root){
-        /* Loop through the topic looking for matches to this ACL. */
+    /* Check the ACLs for this client. */
+    if(context->acl_list && context->acl_list->acl
+            && acl__tree_search(context->acl_list->acl, topic, access, NULL, true)){
 
-        /* If subscription starts with $, acl_root->topic must also start with $. */
-        if(topic[0] == '$' && acl_root->topic[0] != '$'){
-            acl_root = acl_root->next;
-            continue;
-        }
-        mosquitto_topic_matches_sub(acl_root->topic, topic, &result);
-        if(result){
-            if(access & acl_root->access){
-                /* And access is allowed. */
-                return MOSQ_ERR_SUCCESS;
-            }
-        }
-        acl_root = acl_root->next;
+        return MOSQ_ERR_SUCCESS;
     }
 
-    acl_root = security_opts->acl_patterns;
-
-    if(acl_root){
+    if(security_opts->acl_patterns){
         /* We are using pattern based acls. Check whether the username or
          * client id contains a + or # and if so deny access.
          *
@@ -376,57 +490,18 @@ int mosquitto_acl_check_default(struct mosquitto_db *db, struct mosquitto *conte
         }
     }
 
-    /* Loop through all pattern ACLs. */
+    /* Check the pattern ACLs, substituting in place while matching. */
     if(!context->id) return MOSQ_ERR_ACL_DENIED;
-    clen = strlen(context->id);
 
-    while(acl_root){
-        tlen = strlen(acl_root->topic);
-
-        if(acl_root->ucount && !context->username){
-            acl_root = acl_root->next;
-            continue;
-        }
+    if(security_opts->acl_patterns){
+        subst.id = context->id;
+        subst.id_len = strlen(context->id);
+        subst.username = context->username;
+        subst.username_len = context->username ? strlen(context->username) : 0;
 
-        if(context->username){
-            ulen = strlen(context->username);
-            len = tlen + acl_root->ccount*(clen-2) + acl_root->ucount*(ulen-2);
-        }else{
-            ulen = 0;
-            len = tlen + acl_root->ccount*(clen-2);
-        }
-        local_acl = mosquitto__malloc(len+1);
-        if(!local_acl) return 1; // FIXME
-        s = local_acl;
-        for(i=0; i<tlen; i++){
-            if(i<tlen-1 && acl_root->topic[i] == '%'){
-                if(acl_root->topic[i+1] == 'c'){
-                    i++;
-                    strncpy(s, context->id, clen);
-                    s+=clen;
-                    continue;
-                }else if(context->username && acl_root->topic[i+1] == 'u'){
-                    i++;
-                    strncpy(s, context->username, ulen);
-                    s+=ulen;
-                    continue;
-                }
-            }
-            s[0] = acl_root->topic[i];
-            s++;
-        }
-        local_acl[len] = '\0';
-
-        mosquitto_topic_matches_sub(local_acl, topic, &result);
-        mosquitto__free(local_acl);
-        if(result){
-            if(access & acl_root->access){
-                /* And access is allowed. */
-                return MOSQ_ERR_SUCCESS;
-            }
+        if(acl__tree_search(security_opts->acl_patterns, topic, access, &subst, true)){
+            return MOSQ_ERR_SUCCESS;
         }
-
-        acl_root = acl_root->next;
     }
 
     return MOSQ_ERR_ACL_DENIED;
@@ -564,18 +639,6 @@ static int aclfile__parse(struct mosquitto_db *db, struct mosquitto__security_op
     return rc;
 }
 
-static void free__acl(struct mosquitto__acl *acl)
-{
-    if(!acl) return;
-
-    if(acl->next){
-        free__acl(acl->next);
-    }
-    mosquitto__free(acl->topic);
-    mosquitto__free(acl);
-}
-
-
 static void acl__cleanup_single(struct mosquitto__security_options *security_opts)
 {
     struct mosquitto__acl_user *user_tail;
@@ -583,17 +646,15 @@ static void acl__cleanup_single(struct mosquitto__security_options *security_opt
     while(security_opts->acl_list){
         user_tail = security_opts->acl_list->next;
 
-        free__acl(security_opts->acl_list->acl);
+        acl__tree_free(security_opts->acl_list->acl);
         mosquitto__free(security_opts->acl_list->username);
         mosquitto__free(security_opts->acl_list);
 
         security_opts->acl_list = user_tail;
     }
 
-    if(security_opts->acl_patterns){
-        free__acl(security_opts->acl_patterns);
-        security_opts->acl_patterns = NULL;
-    }
+    acl__tree_free(security_opts->acl_patterns);
+    security_opts->acl_patterns = NULL;
 }
 
 
@@ -633,6 +694,8 @@ int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context)
     struct mosquitto__acl_user *acl_tail;
     struct mosquitto__security_options *security_opts;
 
+    acl__cache_clear(context);
+
     /* Associate user with its ACL, assuming we have ACLs loaded. */
     if(db->config->per_listener_settings){
         if(!context->listener){
@@ -696,18 +759,25 @@ static int pwfile__parse(const char *file, struct mosquitto__unpwd **root)
 
             username = strtok_r(buf, ":", &saveptr);
             if(username){
+                username = misc__trimblanks(username);
+                if(strlen(username) > 65535){
+                    log__printf(NULL, MOSQ_LOG_NOTICE, "Warning: Invalid line in password file '%s', username too long.", file);
+                    continue;
+                }
+                HASH_FIND(hh, *root, username, strlen(username), unpwd);
+                if(unpwd){
+                    /* Users are looked up by hash, so only the first entry
+                     * for a username can be used. */
+                    log__printf(NULL, MOSQ_LOG_NOTICE, "Warning: Duplicate user '%s' in password file '%s', ignoring.", username, file);
+                    continue;
+                }
+
                 unpwd = mosquitto__calloc(1, sizeof(struct mosquitto__unpwd));
                 if(!unpwd){
                     fclose(pwfile);
                     mosquitto__free(buf);
                     return MOSQ_ERR_NOMEM;
                 }
-                username = misc__trimblanks(username);
-                if(strlen(username) > 65535){
-                    log__printf(NULL, MOSQ_LOG_NOTICE, "Warning: Invalid line in password file '%s', username too long.", file);
-                    mosquitto__free(unpwd);
-                    continue;
-                }
 
                 unpwd->username = mosquitto__strdup(username);
                 if(!unpwd->username){
@@ -779,33 +849,42 @@ static int unpwd__decode_passwords(struct mosquitto__unpwd **unpwd)
         if(u->password){
             token = strtok(u->password, "$");
             if(token && !strcmp(token, "6")){
+                u->hashtype = pw_sha512;
+                u->iterations = 0;
+                token = strtok(NULL, "$");
+            }else if(token && !strcmp(token, "7")){
+                /* $7$iterations$salt$hash */
+                u->hashtype = pw_sha512_pbkdf2;
                 token = strtok(NULL, "$");
                 if(token){
-                    rc = base64__decode(token, &salt, &salt_len);
-                    if(rc == MOSQ_ERR_SUCCESS && salt_len == 12){
-                        u->salt = salt;
-                        u->salt_len = salt_len;
-                        token = strtok(NULL, "$");
-                        if(token){
-                            rc = base64__decode(token, &password, &password_len);
-                            if(rc == MOSQ_ERR_SUCCESS && password_len == 64){
-                                mosquitto__free(u->password);
-                                u->password = (char *)password;
-                                u->password_len = password_len;
-                            }else{
-                                log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to decode password for user %s, removing entry.", u->username);
-                                unpwd__free_item(unpwd, u);
-                            }
+                    u->iterations = atoi(token);
+                    token = u->iterations > 0 ? strtok(NULL, "$") : NULL;
+                }
+            }else{
+                token = NULL;
+            }
+            if(token){
+                rc = base64__decode(token, &salt, &salt_len);
+                if(rc == MOSQ_ERR_SUCCESS && salt_len == 12){
+                    u->salt = salt;
+                    u->salt_len = salt_len;
+                    token = strtok(NULL, "$");
+                    if(token){
+                        rc = base64__decode(token, &password, &password_len);
+                        if(rc == MOSQ_ERR_SUCCESS && password_len == 64){
+                            mosquitto__free(u->password);
+                            u->password = (char *)password;
+                            u->password_len = password_len;
                         }else{
-                            log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid password hash for user %s, removing entry.", u->username);
+                            log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to decode password for user %s, removing entry.", u->username);
                             unpwd__free_item(unpwd, u);
                         }
                     }else{
-                        log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to decode password salt for user %s, removing entry.", u->username);
+                        log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid password hash for user %s, removing entry.", u->username);
                         unpwd__free_item(unpwd, u);
                     }
                 }else{
-                    log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid password hash for user %s, removing entry.", u->username);
+                    log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to decode password salt for user %s, removing entry.", u->username);
                     unpwd__free_item(unpwd, u);
                 }
             }else{
@@ -888,11 +967,9 @@ static int mosquitto__memcmp_const(const void *a, const void *b, size_t len)
 
 int mosquitto_unpwd_check_default(struct mosquitto_db *db, struct mosquitto *context, const char *username, const char *password)
 {
-    struct mosquitto__unpwd *u, *tmp;
+    struct mosquitto__unpwd *u;
     struct mosquitto__unpwd *unpwd_ref;
 #ifdef WITH_TLS
-    unsigned char hash[EVP_MAX_MD_SIZE];
-    unsigned int hash_len;
     int rc;
 #endif
 
@@ -914,36 +991,31 @@ int mosquitto_unpwd_check_default(struct mosquitto_db *db, struct mosquitto *con
         return MOSQ_ERR_AUTH;
     }
 
-    HASH_ITER(hh, unpwd_ref, u, tmp){
-        if(!strcmp(u->username, username)){
-            if(u->password){
-                if(password){
+    HASH_FIND(hh, unpwd_ref, username, strlen(username), u);
+    if(!u){
+        return MOSQ_ERR_AUTH;
+    }
+    if(!u->password){
+        return MOSQ_ERR_SUCCESS;
+    }
+    if(!password){
+        return MOSQ_ERR_AUTH;
+    }
+
 #ifdef WITH_TLS
-                    rc = pw__digest(password, u->salt, u->salt_len, hash, &hash_len);
-                    if(rc == MOSQ_ERR_SUCCESS){
-                        if(hash_len == u->password_len && !mosquitto__memcmp_const(u->password, hash, hash_len)){
-                            return MOSQ_ERR_SUCCESS;
-                        }else{
-                            return MOSQ_ERR_AUTH;
-                        }
-                    }else{
-                        return rc;
-                    }
+    /* Hashing may take a while, hand it to the password check threads if
+     * there are any. */
+    rc = pw__pool_submit(context, u, password);
+    if(rc != MOSQ_ERR_NOT_SUPPORTED){
+        return rc;
+    }
+    return pw__verify(password, u);
 #else
-                    if(!strcmp(u->password, password)){
-                        return MOSQ_ERR_SUCCESS;
-                    }
-#endif
-                }else{
-                    return MOSQ_ERR_AUTH;
-                }
-            }else{
-                return MOSQ_ERR_SUCCESS;
-            }
-        }
+    if(!strcmp(u->password, password)){
+        return MOSQ_ERR_SUCCESS;
     }
-
     return MOSQ_ERR_AUTH;
+#endif
 }
 
 static int unpwd__cleanup(struct mosquitto__unpwd **root, bool reload)
@@ -1020,6 +1092,13 @@ int mosquitto_security_apply_default(struct mosquitto_db *db)
 #endif
 
     HASH_ITER(hh_id, db->contexts_by_id, context, ctxt_tmp){
+        /* The ACLs or the cache size may have changed. */
+        if(context->sock != INVALID_SOCKET){
+            acl__cache_init(db, context);
+        }else{
+            acl__cache_free(context);
+        }
+
         /* Check for anonymous clients when allow_anonymous is false */
         if(db->config->per_listener_settings){
             if(context->listener){
@@ -1219,11 +1298,34 @@ int mosquitto_psk_key_get_default(struct mosquitto_db *db, struct mosquitto *con
 }
 
 #ifdef WITH_TLS
-int pw__digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len)
+/* Check password against the hash for user u. May be called from any thread,
+ * it uses nothing but u. */
+int pw__verify(const char *password, const struct mosquitto__unpwd *u)
+{
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    unsigned int hash_len;
+    int rc;
+
+    rc = pw__digest(password, u->salt, u->salt_len, hash, &hash_len, u->hashtype, u->iterations);
+    if(rc != MOSQ_ERR_SUCCESS){
+        return rc;
+    }
+    if(hash_len == u->password_len && !mosquitto__memcmp_const(u->password, hash, hash_len)){
+        return MOSQ_ERR_SUCCESS;
+    }else{
+        return MOSQ_ERR_AUTH;
+    }
+}
+
+
+int pw__digest(const char *password, const unsigned char *salt, unsigned int salt_len, unsigned char *hash, unsigned int *hash_len, enum mosquitto_pwhash_type hashtype, int iterations)
 {
     const EVP_MD *digest;
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
     EVP_MD_CTX context;
+#else
+    EVP_MD_CTX *context;
+#endif
 
     digest = EVP_get_digestbyname("sha512");
     if(!digest){
@@ -1231,6 +1333,17 @@ int pw__digest(const char *password, const unsigned char *salt, unsigned int sal
         return 1;
     }
 
+    if(hashtype == pw_sha512_pbkdf2){
+        /* hash is assumed to be EVP_MAX_MD_SIZE bytes long. */
+        *hash_len = EVP_MD_size(digest);
+        if(!PKCS5_PBKDF2_HMAC(password, strlen(password), salt, salt_len, iterations, digest, *hash_len, hash)){
+            return 1;
+        }
+        return MOSQ_ERR_SUCCESS;
+    }
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+
     EVP_MD_CTX_init(&context);
     EVP_DigestInit_ex(&context, digest, NULL);
     EVP_DigestUpdate(&context, password, strlen(password));
@@ -1239,14 +1352,6 @@ int pw__digest(const char *password, const unsigned char *salt, unsigned int sal
     EVP_DigestFinal_ex(&context, hash, hash_len);
     EVP_MD_CTX_cleanup(&context);
 #else
-    EVP_MD_CTX *context;
-
-    digest = EVP_get_digestbyname("sha512");
-    if(!digest){
-        // FIXME fprintf(stderr, "Error: Unable to create openssl digest.\n");
-        return 1;
-    }
-
     context = EVP_MD_CTX_new();
     EVP_DigestInit_ex(context, digest, NULL);
     EVP_DigestUpdate(context, password, strlen(password));
@@ -0,0 +1,720 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "mqtt_protocol.h"
+#include "packet_mosq.h"
+#include "property_mosq.h"
+#include "uthash.h"
+#ifdef WITH_PERSISTENCE
+#include "persist.h"
+#endif
+
+/* Spilling queued messages to disk.
+ *
+ * With queue_spill_threshold set, a disconnected client only keeps that many
+ * queued outgoing messages in memory. Anything queued after that is appended
+ * to a segment file shared by all clients, and the client only keeps the
+ * offsets of its first and last record. Each record holds the offset of the
+ * next record for the same client, which is filled in when that record is
+ * written. Once a client has spilled messages, everything queued for it is
+ * spilled until the spill is empty again, so the order is kept.
+ *
+ * When the client reconnects, db__message_write() brings records back in to
+ * the queue as it empties, turning each one back in to a stored message and
+ * client message.
+ *
+ * Every record is self contained, so a message queued for many clients is
+ * written once for each of them. A segment is closed when none of its records
+ * are still queued. Segment files are unlinked as soon as they are opened, so
+ * nothing is left behind if the broker stops, and a background save can go on
+ * reading the records it needs after they have been dropped here.
+ *
+ * An offset is the segment id in the top 32 bits and the position in the
+ * segment in the bottom 32 bits. Segment ids start at 1, so an offset of 0 is
+ * never valid.
+ */
+
+#define SPILL_SEGMENT_SIZE (64*1024*1024)
+
+struct spill__segment{
+    UT_hash_handle hh;
+    uint32_t id;
+    int fd;
+    uint32_t size;
+    int live;
+};
+
+/* Written in host byte order, the files are never read by anything else. */
+struct spill__record{
+    uint64_t next;
+    time_t expiry_time;
+    struct mosquitto__listener *source_listener;
+    uint32_t payloadlen;
+    uint32_t store_proplen;
+    uint32_t msg_proplen;
+    uint16_t mid;
+    uint16_t source_mid;
+    uint16_t topic_len;
+    uint16_t source_id_len;
+    uint16_t source_username_len;
+    uint8_t qos;
+    uint8_t retain;
+    uint8_t store_qos;
+    uint8_t store_retain;
+    uint8_t origin;
+};
+
+/* A record read back in to memory. */
+struct spill__message{
+    struct spill__record rec;
+    struct mosquitto source;
+    char *topic;
+    mosquitto__payload_uhpa payload;
+    mosquitto_property *store_properties;
+    mosquitto_property *msg_properties;
+};
+
+static struct spill__segment *segments = NULL;
+static struct spill__segment *active = NULL;
+static uint32_t last_segment_id = 0;
+
+
+static struct spill__segment *spill__segment_find(uint64_t offset)
+{
+    struct spill__segment *seg;
+    uint32_t id = (uint32_t)(offset >> 32);
+
+    HASH_FIND(hh, segments, &id, sizeof(uint32_t), seg);
+    return seg;
+}
+
+
+static struct spill__segment *spill__segment_new(struct mosquitto_db *db)
+{
+    struct spill__segment *seg;
+    const char *location;
+    char *path;
+    size_t len;
+
+    seg = mosquitto__calloc(1, sizeof(struct spill__segment));
+    if(!seg) return NULL;
+
+    last_segment_id++;
+    if(last_segment_id == 0) last_segment_id++;
+    seg->id = last_segment_id;
+
+    if(db->config->queue_spill_location){
+        location = db->config->queue_spill_location;
+    }else if(db->config->persistence_location){
+        location = db->config->persistence_location;
+    }else{
+        location = "";
+    }
+    len = strlen(location) + strlen("mosquitto.spill.") + 11;
+    path = mosquitto__malloc(len);
+    if(!path){
+        mosquitto__free(seg);
+        return NULL;
+    }
+    snprintf(path, len, "%smosquitto.spill.%u", location, seg->id);
+
+    seg->fd = open(path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if(seg->fd < 0 && errno == EEXIST){
+        /* Left over from a broker that stopped before it could unlink it. */
+        unlink(path);
+        seg->fd = open(path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    }
+    if(seg->fd < 0){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open queue spill file %s: %s.", path, strerror(errno));
+        mosquitto__free(path);
+        mosquitto__free(seg);
+        return NULL;
+    }
+    unlink(path);
+    mosquitto__free(path);
+
+    HASH_ADD(hh, segments, id, sizeof(uint32_t), seg);
+    return seg;
+}
+
+
+static void spill__segment_close(struct spill__segment *seg)
+{
+    if(seg == active){
+        active = NULL;
+    }
+    HASH_DELETE(hh, segments, seg);
+    close(seg->fd);
+    mosquitto__free(seg);
+}
+
+
+/* One fewer record in the segment is still queued. */
+static void spill__segment_release(struct spill__segment *seg)
+{
+    seg->live--;
+    if(seg->live == 0){
+        spill__segment_close(seg);
+    }
+}
+
+
+static int spill__pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+    ssize_t len;
+
+    while(count > 0){
+        len = pwrite(fd, buf, count, offset);
+        if(len < 0){
+            if(errno == EINTR) continue;
+            return MOSQ_ERR_ERRNO;
+        }
+        buf = (const uint8_t *)buf + len;
+        count -= (size_t)len;
+        offset += len;
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static int spill__pread(int fd, void *buf, size_t count, off_t offset)
+{
+    ssize_t len;
+
+    while(count > 0){
+        len = pread(fd, buf, count, offset);
+        if(len < 0){
+            if(errno == EINTR) continue;
+            return MOSQ_ERR_ERRNO;
+        }else if(len == 0){
+            errno = EIO;
+            return MOSQ_ERR_ERRNO;
+        }
+        buf = (uint8_t *)buf + len;
+        count -= (size_t)len;
+        offset += len;
+    }
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+static uint32_t spill__proplen(const mosquitto_property *properties)
+{
+    int proplen;
+
+    if(!properties) return 0;
+
+    proplen = property__get_length_all(properties);
+    return (uint32_t)(proplen + packet__varint_bytes(proplen));
+}
+
+
+static int spill__properties_write(uint8_t *buf, uint32_t proplen, const mosquitto_property *properties)
+{
+    struct mosquitto__packet packet;
+
+    if(proplen == 0) return MOSQ_ERR_SUCCESS;
+
+    memset(&packet, 0, sizeof(struct mosquitto__packet));
+    packet.payload = buf;
+    packet.packet_length = proplen;
+    packet.remaining_length = proplen;
+    return property__write_all(&packet, properties, true);
+}
+
+
+static int spill__properties_read(uint8_t *buf, uint32_t proplen, mosquitto_property **properties)
+{
+    struct mosquitto__packet packet;
+
+    if(proplen == 0) return MOSQ_ERR_SUCCESS;
+
+    memset(&packet, 0, sizeof(struct mosquitto__packet));
+    packet.payload = buf;
+    packet.packet_length = proplen;
+    packet.remaining_length = proplen;
+    return property__read_all(CMD_PUBLISH, &packet, properties);
+}
+
+
+static char *spill__strndup(const uint8_t *buf, uint16_t len)
+{
+    char *s;
+
+    s = mosquitto__malloc(len+1);
+    if(!s) return NULL;
+    memcpy(s, buf, len);
+    s[len] = '\0';
+    return s;
+}
+
+
+static void spill__message_free(struct spill__message *m)
+{
+    mosquitto__free(m->source.id);
+    mosquitto__free(m->source.username);
+    mosquitto__free(m->topic);
+    UHPA_FREE(m->payload, m->rec.payloadlen);
+    mosquitto_property_free_all(&m->store_properties);
+    mosquitto_property_free_all(&m->msg_properties);
+    memset(m, 0, sizeof(struct spill__message));
+}
+
+
+static int spill__record_read(uint64_t offset, struct spill__record *rec)
+{
+    struct spill__segment *seg;
+
+    seg = spill__segment_find(offset);
+    if(!seg){
+        errno = ENOENT;
+        return MOSQ_ERR_ERRNO;
+    }
+    return spill__pread(seg->fd, rec, sizeof(struct spill__record), (off_t)(offset & 0xFFFFFFFF));
+}
+
+
+static int spill__message_read(uint64_t offset, struct spill__message *m)
+{
+    struct spill__segment *seg;
+    uint8_t *buf, *ptr;
+    size_t len;
+    int rc;
+
+    memset(m, 0, sizeof(struct spill__message));
+
+    seg = spill__segment_find(offset);
+    if(!seg){
+        errno = ENOENT;
+        return MOSQ_ERR_ERRNO;
+    }
+    rc = spill__pread(seg->fd, &m->rec, sizeof(struct spill__record), (off_t)(offset & 0xFFFFFFFF));
+    if(rc) return rc;
+
+    len = (size_t)m->rec.source_id_len + m->rec.source_username_len + m->rec.topic_len
+        + m->rec.payloadlen + m->rec.store_proplen + m->rec.msg_proplen;
+    buf = mosquitto__malloc(len);
+    if(!buf) return MOSQ_ERR_NOMEM;
+
+    rc = spill__pread(seg->fd, buf, len, (off_t)(offset & 0xFFFFFFFF) + (off_t)sizeof(struct spill__record));
+    if(rc){
+        mosquitto__free(buf);
+        return rc;
+    }
+
+    ptr = buf;
+    m->source.id = spill__strndup(ptr, m->rec.source_id_len);
+    ptr += m->rec.source_id_len;
+    if(m->rec.source_username_len){
+        m->source.username = spill__strndup(ptr, m->rec.source_username_len);
+        ptr += m->rec.source_username_len;
+    }
+    m->source.listener = m->rec.source_listener;
+    m->topic = spill__strndup(ptr, m->rec.topic_len);
+    ptr += m->rec.topic_len;
+    if(!m->source.id || (m->rec.source_username_len && !m->source.username) || !m->topic){
+        mosquitto__free(buf);
+        spill__message_free(m);
+        return MOSQ_ERR_NOMEM;
+    }
+    if(m->rec.payloadlen){
+        if(UHPA_ALLOC(m->payload, m->rec.payloadlen) == 0){
+            mosquitto__free(buf);
+            spill__message_free(m);
+            return MOSQ_ERR_NOMEM;
+        }
+        memcpy(UHPA_ACCESS(m->payload, m->rec.payloadlen), ptr, m->rec.payloadlen);
+        ptr += m->rec.payloadlen;
+    }
+    rc = spill__properties_read(ptr, m->rec.store_proplen, &m->store_properties);
+    ptr += m->rec.store_proplen;
+    if(rc == MOSQ_ERR_SUCCESS){
+        rc = spill__properties_read(ptr, m->rec.msg_proplen, &m->msg_properties);
+    }
+    mosquitto__free(buf);
+    if(rc){
+        spill__message_free(m);
+    }
+    return rc;
+}
+
+
+/* Remove the first record from the client's spill, once it has been read. */
+static void spill__advance(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data, const struct spill__record *rec)
+{
+    struct spill__segment *seg;
+
+    seg = spill__segment_find(msg_data->spilled.head);
+    if(seg){
+        spill__segment_release(seg);
+    }
+
+    db->msg_spilled_count--;
+    db->msg_spilled_bytes -= rec->payloadlen;
+    msg_data->spilled.count--;
+    msg_data->spilled.bytes -= rec->payloadlen;
+    if(rec->qos > 0){
+        msg_data->spilled.count12--;
+        msg_data->spilled.bytes12 -= rec->payloadlen;
+    }
+    if(msg_data->spilled.count == 0){
+        msg_data->spilled.head = 0;
+        msg_data->spilled.tail = 0;
+    }else{
+        msg_data->spilled.head = rec->next;
+    }
+}
+
+
+/* Forget everything spilled for a client after a read error. The segments
+ * the records are in can't be released, so stay open until exit. */
+static void spill__lost(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data)
+{
+    db->msg_spilled_count -= msg_data->spilled.count;
+    db->msg_spilled_bytes -= msg_data->spilled.bytes;
+    msg_data->msg_count -= msg_data->spilled.count;
+    msg_data->msg_bytes -= msg_data->spilled.bytes;
+    msg_data->msg_count12 -= msg_data->spilled.count12;
+    msg_data->msg_bytes12 -= msg_data->spilled.bytes12;
+    memset(&msg_data->spilled, 0, sizeof(struct mosquitto__spill));
+}
+
+
+/* Should a message about to be queued be spilled rather than kept in memory?
+ * Only outgoing messages are spilled. $SYS messages are always kept in memory,
+ * they aren't persisted either. */
+bool spill__wanted(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_data *msg_data, struct mosquitto_msg_store *stored)
+{
+    if(db->config->queue_spill_threshold == 0 || msg_data != &context->msgs_out){
+        return false;
+    }
+    if(!strncmp(stored->topic, "$SYS", 4)){
+        return false;
+    }
+    if(msg_data->spilled.count > 0){
+        return true;
+    }
+    return context->sock == INVALID_SOCKET
+        && msg_data->queued.count >= db->config->queue_spill_threshold;
+}
+
+
+/* Append a message to the client's spill. On success the properties belong
+ * to the spill, on failure they still belong to the caller and the message
+ * should be kept in memory instead. The caller counts the message in
+ * msg_count and msg_bytes as for any other queued message. */
+int spill__push(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data, struct mosquitto_msg_store *stored, uint16_t mid, int qos, bool retain, mosquitto_property *properties)
+{
+    struct spill__record rec;
+    struct spill__segment *seg;
+    uint8_t *buf, *ptr;
+    size_t len;
+    uint64_t offset;
+    int rc;
+
+    memset(&rec, 0, sizeof(struct spill__record));
+    rec.expiry_time = stored->message_expiry_time;
+    rec.source_listener = stored->source_listener;
+    rec.payloadlen = stored->payloadlen;
+    rec.store_proplen = spill__proplen(stored->properties);
+    rec.msg_proplen = spill__proplen(properties);
+    rec.mid = mid;
+    rec.source_mid = stored->source_mid;
+    rec.topic_len = (uint16_t)strlen(stored->topic);
+    rec.source_id_len = stored->source_id?(uint16_t)strlen(stored->source_id):0;
+    rec.source_username_len = stored->source_username?(uint16_t)strlen(stored->source_username):0;
+    rec.qos = (uint8_t)qos;
+    rec.retain = retain;
+    rec.store_qos = stored->qos;
+    rec.store_retain = stored->retain;
+    rec.origin = stored->origin;
+
+    len = sizeof(struct spill__record) + rec.source_id_len + rec.source_username_len
+        + rec.topic_len + rec.payloadlen + rec.store_proplen + rec.msg_proplen;
+    buf = mosquitto__malloc(len);
+    if(!buf) return MOSQ_ERR_NOMEM;
+
+    memcpy(buf, &rec, sizeof(struct spill__record));
+    ptr = buf + sizeof(struct spill__record);
+    memcpy(ptr, stored->source_id, rec.source_id_len);
+    ptr += rec.source_id_len;
+    memcpy(ptr, stored->source_username, rec.source_username_len);
+    ptr += rec.source_username_len;
+    memcpy(ptr, stored->topic, rec.topic_len);
+    ptr += rec.topic_len;
+    if(rec.payloadlen){
+        memcpy(ptr, UHPA_ACCESS_PAYLOAD(stored), rec.payloadlen);
+        ptr += rec.payloadlen;
+    }
+    rc = spill__properties_write(ptr, rec.store_proplen, stored->properties);
+    ptr += rec.store_proplen;
+    if(rc == MOSQ_ERR_SUCCESS){
+        rc = spill__properties_write(ptr, rec.msg_proplen, properties);
+    }
+    if(rc){
+        mosquitto__free(buf);
+        return rc;
+    }
+
+    if(active && active->size > 0 && active->size + len > SPILL_SEGMENT_SIZE){
+        /* Full, it is closed once the last of its records has been read. */
+        active = NULL;
+    }
+    if(!active){
+        active = spill__segment_new(db);
+        if(!active){
+            mosquitto__free(buf);
+            return MOSQ_ERR_ERRNO;
+        }
+    }
+    seg = active;
+
+    rc = spill__pwrite(seg->fd, buf, len, seg->size);
+    mosquitto__free(buf);
+    if(rc){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to write to queue spill file: %s.", strerror(errno));
+        /* The record may be partly written, but nothing refers to it. */
+        if(seg->live == 0){
+            spill__segment_close(seg);
+        }
+        return rc;
+    }
+    offset = ((uint64_t)seg->id << 32) | seg->size;
+
+    if(msg_data->spilled.count > 0){
+        rc = MOSQ_ERR_ERRNO;
+        seg = spill__segment_find(msg_data->spilled.tail);
+        if(seg){
+            rc = spill__pwrite(seg->fd, &offset, sizeof(uint64_t),
+                    (off_t)(msg_data->spilled.tail & 0xFFFFFFFF) + (off_t)offsetof(struct spill__record, next));
+        }
+        if(rc){
+            log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to write to queue spill file: %s.", strerror(errno));
+            if(active->live == 0){
+                spill__segment_close(active);
+            }
+            return rc;
+        }
+    }else{
+        msg_data->spilled.head = offset;
+    }
+    msg_data->spilled.tail = offset;
+    active->size += (uint32_t)len;
+    active->live++;
+
+    db->msg_spilled_count++;
+    db->msg_spilled_bytes += rec.payloadlen;
+    msg_data->spilled.count++;
+    msg_data->spilled.bytes += rec.payloadlen;
+    if(rec.qos > 0){
+        msg_data->spilled.count12++;
+        msg_data->spilled.bytes12 += rec.payloadlen;
+    }
+
+    mosquitto_property_free_all(&properties);
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Take the first spilled message for a client, as a queued client message.
+ * If the message has expired or the client may no longer read it, it is
+ * dropped and *msg is set to NULL. */
+int spill__pop(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_client_msg **msg)
+{
+    struct mosquitto_msg_data *msg_data = &context->msgs_out;
+    struct mosquitto_msg_store *stored;
+    struct mosquitto_client_msg *cmsg;
+    struct spill__message m;
+    uint32_t message_expiry_interval = 0;
+    time_t now;
+    int rc;
+
+    *msg = NULL;
+    if(msg_data->spilled.count == 0) return MOSQ_ERR_SUCCESS;
+
+    rc = spill__message_read(msg_data->spilled.head, &m);
+    if(rc == MOSQ_ERR_NOMEM){
+        return rc;
+    }else if(rc){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read queue spill file, %d messages for client %s lost: %s.",
+                msg_data->spilled.count, context->id, strerror(errno));
+        spill__lost(db, msg_data);
+        return MOSQ_ERR_SUCCESS;
+    }
+    spill__advance(db, msg_data, &m.rec);
+
+    if(m.rec.expiry_time){
+        now = time(NULL);
+        if(now > m.rec.expiry_time){
+            goto dropped;
+        }
+        message_expiry_interval = (uint32_t)(m.rec.expiry_time - now);
+        if(message_expiry_interval == 0) message_expiry_interval = 1;
+    }
+    if(mosquitto_acl_check(db, context, m.topic, m.rec.payloadlen, UHPA_ACCESS(m.payload, m.rec.payloadlen),
+                m.rec.store_qos, m.rec.store_retain, MOSQ_ACL_READ) != MOSQ_ERR_SUCCESS){
+
+        goto dropped;
+    }
+
+    cmsg = mosquitto__pool_calloc(&client_msg_pool);
+    if(!cmsg){
+        spill__message_free(&m);
+        return MOSQ_ERR_NOMEM;
+    }
+
+    /* db__message_store() owns the topic, payload and properties from here. */
+    rc = db__message_store(db, &m.source, m.rec.source_mid, m.topic, m.rec.store_qos,
+            m.rec.payloadlen, &m.payload, m.rec.store_retain, &stored, message_expiry_interval,
+            m.store_properties, 0, (enum mosquitto_msg_origin)m.rec.origin);
+    m.topic = NULL;
+    m.store_properties = NULL;
+    m.rec.payloadlen = 0;
+    if(rc){
+        mosquitto__pool_free(&client_msg_pool, cmsg);
+        spill__message_free(&m);
+        return rc;
+    }
+
+    cmsg->store = stored;
+    db__msg_store_ref_inc(stored);
+    cmsg->properties = m.msg_properties;
+    m.msg_properties = NULL;
+    cmsg->mid = m.rec.mid;
+    cmsg->qos = m.rec.qos;
+    cmsg->retain = m.rec.retain;
+    cmsg->timestamp = mosquitto_time();
+    cmsg->direction = mosq_md_out;
+    cmsg->state = mosq_ms_queued;
+    cmsg->dup = false;
+
+    spill__message_free(&m);
+    *msg = cmsg;
+    return MOSQ_ERR_SUCCESS;
+
+dropped:
+    msg_data->msg_count--;
+    msg_data->msg_bytes -= m.rec.payloadlen;
+    if(m.rec.qos > 0){
+        msg_data->msg_count12--;
+        msg_data->msg_bytes12 -= m.rec.payloadlen;
+    }
+    spill__message_free(&m);
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Drop everything spilled for a client. The caller resets the counts in
+ * msg_data. */
+void spill__discard(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data)
+{
+    struct spill__record rec;
+
+    while(msg_data->spilled.count > 0){
+        if(spill__record_read(msg_data->spilled.head, &rec)){
+            db->msg_spilled_count -= msg_data->spilled.count;
+            db->msg_spilled_bytes -= msg_data->spilled.bytes;
+            break;
+        }
+        spill__advance(db, msg_data, &rec);
+    }
+    memset(&msg_data->spilled, 0, sizeof(struct mosquitto__spill));
+}
+
+
+void spill__cleanup(void)
+{
+    struct spill__segment *seg, *seg_tmp;
+
+    HASH_ITER(hh, segments, seg, seg_tmp){
+        HASH_DELETE(hh, segments, seg);
+        close(seg->fd);
+        mosquitto__free(seg);
+    }
+    active = NULL;
+}
+
+
+#ifdef WITH_PERSISTENCE
+/* Write each spilled message for a client as a message store chunk and a
+ * client message chunk, so a restore queues them again in the same order.
+ * The messages no longer have store ids, so new ones are used. This may be
+ * called in the child of a background save, which only reads the files. */
+int spill__persist(struct mosquitto_db *db, FILE *db_fptr, struct mosquitto *context)
+{
+    struct mosquitto_msg_store stored;
+    struct mosquitto_client_msg cmsg;
+    struct spill__message m;
+    uint64_t offset;
+    int i;
+    int rc;
+
+    offset = context->msgs_out.spilled.head;
+    for(i=0; i<context->msgs_out.spilled.count; i++){
+        rc = spill__message_read(offset, &m);
+        if(rc){
+            log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read queue spill file: %s.", strerror(errno));
+            return rc;
+        }
+
+        memset(&stored, 0, sizeof(struct mosquitto_msg_store));
+        stored.db_id = ++db->last_db_id;
+        stored.source_id = m.source.id;
+        stored.source_username = m.source.username;
+        stored.source_listener = m.rec.source_listener;
+        stored.topic = m.topic;
+        stored.properties = m.store_properties;
+        stored.payload = m.payload;
+        stored.payloadlen = m.rec.payloadlen;
+        stored.message_expiry_time = m.rec.expiry_time;
+        stored.source_mid = m.rec.source_mid;
+        stored.qos = m.rec.store_qos;
+        stored.retain = m.rec.store_retain;
+
+        memset(&cmsg, 0, sizeof(struct mosquitto_client_msg));
+        cmsg.store = &stored;
+        cmsg.properties = m.msg_properties;
+        cmsg.mid = m.rec.mid;
+        cmsg.qos = m.rec.qos;
+        cmsg.retain = m.rec.retain;
+        cmsg.direction = mosq_md_out;
+        cmsg.state = mosq_ms_queued;
+
+        rc = persist__message_store_write(db_fptr, &stored);
+        if(rc == MOSQ_ERR_SUCCESS){
+            rc = persist__client_message_write(db_fptr, context, &cmsg);
+        }
+        offset = m.rec.next;
+        spill__message_free(&m);
+        if(rc) return rc;
+    }
+
+    return MOSQ_ERR_SUCCESS;
+}
+#endif
@@ -58,12 +58,20 @@ Contributors:
 
 #include "utlist.h"
 
+/* Tokens point directly in to the topic string being tokenised, so topic is
+ * *not* 0 terminated and must only be accessed with topic_len. The tokens live
+ * in an array on the caller's stack, big enough for the hierarchy limit plus
+ * the "" root token and an empty token for a leading '/'. */
 struct sub__token {
     struct sub__token *next;
-    char *topic;
+    const char *topic;
     uint16_t topic_len;
 };
 
+#define SUB_TOKEN_MAX (TOPIC_HIERARCHY_LIMIT+2)
+
+struct mosquitto__pool subleaf_pool = MOSQUITTO__POOL_INIT("subscriptions", struct mosquitto__subleaf);
+
 
 static int subs__send(struct mosquitto_db *db, struct mosquitto__subleaf *leaf, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored)
 {
@@ -131,18 +139,23 @@ static int subs__shared_process(struct mosquitto_db *db, struct mosquitto__subhi
     return rc;
 }
 
-static int subs__process(struct mosquitto_db *db, struct mosquitto__subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
+static int subs__process(struct mosquitto_db *db, struct mosquitto__subhier *hier, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain, struct subs_cache_entry *cache)
 {
     int rc = 0;
     int rc2;
     struct mosquitto__subleaf *leaf;
 
+    if(cache && (hier->subs || hier->shared)){
+        subs_cache__append(cache, hier);
+    }
+
     if(retain && set_retain){
 #ifdef WITH_PERSISTENCE
         if(strncmp(topic, "$SYS", 4)){
             /* Retained messages count as a persistence change, but only if
              * they aren't for $SYS. */
             db->persistence_changes++;
+            persist__journal_retain(db, topic, stored);
         }
 #endif
         if(hier->retained){
@@ -183,122 +196,100 @@ static int subs__process(struct mosquitto_db *db, struct mosquitto__subhier *hie
     }
 }
 
-static struct sub__token *sub__topic_append(struct sub__token **tail, struct sub__token **topics, char *topic)
+static bool sub__token_is(const struct sub__token *token, const char *str, uint16_t len)
 {
-    struct sub__token *new_topic;
-
-    if(!topic){
-        return NULL;
-    }
-    new_topic = mosquitto__malloc(sizeof(struct sub__token));
-    if(!new_topic){
-        return NULL;
-    }
-    new_topic->next = NULL;
-    new_topic->topic_len = strlen(topic);
-    new_topic->topic = mosquitto__malloc(new_topic->topic_len+1);
-    if(!new_topic->topic){
-        mosquitto__free(new_topic);
-        return NULL;
-    }
-    strncpy(new_topic->topic, topic, new_topic->topic_len+1);
+    return token->topic_len == len && !memcmp(token->topic, str, len);
+}
 
-    if(*tail){
-        (*tail)->next = new_topic;
-        *tail = (*tail)->next;
-    }else{
-        *topics = new_topic;
-        *tail = new_topic;
+static void sub__topic_append(struct sub__token *tokens, int *count, const char *topic, uint16_t len)
+{
+    tokens[*count].next = NULL;
+    tokens[*count].topic = topic;
+    tokens[*count].topic_len = len;
+    if(*count > 0){
+        tokens[*count-1].next = &tokens[*count];
     }
-    return new_topic;
+    (*count)++;
 }
 
-static int sub__topic_tokenise(const char *subtopic, struct sub__token **topics)
+/* Split subtopic in to tokens, without copying. tokens must have room for
+ * SUB_TOKEN_MAX entries, and tokens[0] is the head of the resulting list. */
+static int sub__topic_tokenise(const char *subtopic, struct sub__token *tokens)
 {
-    struct sub__token *new_topic, *tail = NULL;
-    size_t len;
-    size_t start, stop, tlen;
-    int i;
-    char *topic;
+    const char *start, *c;
+    int token_count = 0;
     int count = 0;
 
     assert(subtopic);
-    assert(topics);
+    assert(tokens);
 
-    len = strlen(subtopic);
-    if(len == 0){
+    if(subtopic[0] == '\0'){
         return 1;
     }
 
     if(subtopic[0] != '$'){
-        new_topic = sub__topic_append(&tail, topics, "");
-        if(!new_topic) goto cleanup;
+        sub__topic_append(tokens, &token_count, "", 0);
     }
 
     if(subtopic[0] == '/'){
-        new_topic = sub__topic_append(&tail, topics, "");
-        if(!new_topic) goto cleanup;
-
-        start = 1;
+        sub__topic_append(tokens, &token_count, "", 0);
+        start = &subtopic[1];
     }else{
-        start = 0;
+        start = subtopic;
     }
 
-    for(i=start; i<len+1; i++){
-        if(subtopic[i] == '/' || subtopic[i] == '\0'){
-            stop = i;
+    for(c=start; ; c++){
+        if(*c == '/' || *c == '\0'){
             count++;
-
-            if(start != stop){
-                tlen = stop-start;
-
-                topic = mosquitto__malloc(tlen+1);
-                if(!topic) goto cleanup;
-                memcpy(topic, &subtopic[start], tlen);
-                topic[tlen] = '\0';
-                new_topic = sub__topic_append(&tail, topics, topic);
-                mosquitto__free(topic);
-            }else{
-                new_topic = sub__topic_append(&tail, topics, "");
+            if(count > TOPIC_HIERARCHY_LIMIT){
+                /* Set limit on hierarchy levels, to restrict stack usage. */
+                return 1;
+            }
+            if(c - start > UINT16_MAX){
+                return 1;
             }
-            if(!new_topic) goto cleanup;
-            start = i+1;
+            sub__topic_append(tokens, &token_count, start, (uint16_t)(c - start));
+            if(*c == '\0'){
+                break;
+            }
+            start = c+1;
         }
     }
 
-    if(count > TOPIC_HIERARCHY_LIMIT){
-        /* Set limit on hierarchy levels, to restrict stack usage. */
-        goto cleanup;
-    }
+    return MOSQ_ERR_SUCCESS;
+}
 
-    if(*topics != NULL){
-        return MOSQ_ERR_SUCCESS;
-    }else{
-        return 1;
-    }
 
-cleanup:
-    tail = *topics;
-    *topics = NULL;
-    while(tail){
-        mosquitto__free(tail->topic);
-        new_topic = tail->next;
-        mosquitto__free(tail);
-        tail = new_topic;
+/* If tokens starts with $share/<name>/, strip those tokens and return the
+ * share name. The token after the share name becomes the "" root token. */
+static int sub__topic_shared_split(struct sub__token **tokens, const char **sharename, uint16_t *sharename_len)
+{
+    *sharename = NULL;
+    *sharename_len = 0;
+
+    if(sub__token_is(*tokens, "$share", 6)){
+        if(!(*tokens)->next || !(*tokens)->next->next){
+            return MOSQ_ERR_PROTOCOL;
+        }
+        *tokens = (*tokens)->next;
+        *sharename = (*tokens)->topic;
+        *sharename_len = (*tokens)->topic_len;
+        (*tokens)->topic = "";
+        (*tokens)->topic_len = 0;
     }
-    return 1;
+    return MOSQ_ERR_SUCCESS;
 }
 
-static void sub__topic_tokens_free(struct sub__token *tokens)
-{
-    struct sub__token *tail;
 
-    while(tokens){
-        tail = tokens->next;
-        mosquitto__free(tokens->topic);
-        mosquitto__free(tokens);
-        tokens = tail;
+static void sub__remove_hier_entry(struct mosquitto__subhier *parent, struct mosquitto__subhier *child)
+{
+    if(parent->child_plus == child){
+        parent->child_plus = NULL;
+    }else if(parent->child_hash == child){
+        parent->child_hash = NULL;
     }
+    HASH_DELETE(hh, parent->children, child);
+    mosquitto__free(child);
 }
 
 
@@ -320,7 +311,7 @@ static int sub__add_leaf(struct mosquitto *context, int qos, uint32_t identifier
         }
         leaf = leaf->next;
     }
-    leaf = mosquitto__calloc(1, sizeof(struct mosquitto__subleaf));
+    leaf = mosquitto__pool_calloc(&subleaf_pool);
     if(!leaf) return MOSQ_ERR_NOMEM;
     leaf->context = context;
     leaf->qos = qos;
@@ -343,32 +334,32 @@ static void sub__remove_shared_leaf(struct mosquitto__subhier *subhier, struct m
         mosquitto__free(shared->name);
         mosquitto__free(shared);
     }
-    mosquitto__free(leaf);
+    mosquitto__pool_free(&subleaf_pool, leaf);
 }
 
 
-static int sub__add_shared(struct mosquitto_db *db, struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, char *sharename)
+static int sub__add_shared(struct mosquitto_db *db, struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, const char *sharename, uint16_t slen)
 {
     struct mosquitto__subleaf *newleaf;
     struct mosquitto__subshared *shared = NULL;
     struct mosquitto__subshared_ref **shared_subs;
     struct mosquitto__subshared_ref *shared_ref;
     int i;
-    unsigned int slen;
     int rc;
 
-    slen = strlen(sharename);
-
     HASH_FIND(hh, subhier->shared, sharename, slen, shared);
-    if(shared){
-        mosquitto__free(sharename);
-    }else{
+    if(!shared){
         shared = mosquitto__calloc(1, sizeof(struct mosquitto__subshared));
         if(!shared){
-            mosquitto__free(sharename);
             return MOSQ_ERR_NOMEM;
         }
-        shared->name = sharename;
+        shared->name = mosquitto__malloc(slen+1);
+        if(!shared->name){
+            mosquitto__free(shared);
+            return MOSQ_ERR_NOMEM;
+        }
+        memcpy(shared->name, sharename, slen);
+        shared->name[slen] = '\0';
 
         HASH_ADD_KEYPTR(hh, subhier->shared, shared->name, slen, shared);
     }
@@ -446,7 +437,7 @@ static int sub__add_normal(struct mosquitto_db *db, struct mosquitto *context, i
             subs = mosquitto__realloc(context->subs, sizeof(struct mosquitto__subhier *)*(context->sub_count + 1));
             if(!subs){
                 DL_DELETE(subhier->subs, newleaf);
-                mosquitto__free(newleaf);
+                mosquitto__pool_free(&subleaf_pool, newleaf);
                 return MOSQ_ERR_NOMEM;
             }
             context->subs = subs;
@@ -468,26 +459,35 @@ static int sub__add_normal(struct mosquitto_db *db, struct mosquitto *context, i
 }
 
 
-static int sub__add_context(struct mosquitto_db *db, struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, struct sub__token *tokens, char *sharename)
+/* Find the leaf node for tokens below subhier, adding any that are missing. */
+static struct mosquitto__subhier *sub__add_branch(struct mosquitto__subhier *subhier, struct sub__token *tokens)
 {
     struct mosquitto__subhier *branch;
 
-    /* Find leaf node */
     while(tokens){
         HASH_FIND(hh, subhier->children, tokens->topic, tokens->topic_len, branch);
         if(!branch){
             /* Not found */
             branch = sub__add_hier_entry(subhier, &subhier->children, tokens->topic, tokens->topic_len);
-            if(!branch) return MOSQ_ERR_NOMEM;
+            if(!branch) return NULL;
         }
         subhier = branch;
         tokens = tokens ->next;
     }
+    return subhier;
+}
+
+
+static int sub__add_context(struct mosquitto_db *db, struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, struct sub__token *tokens, const char *sharename, uint16_t sharename_len)
+{
+    /* Find leaf node */
+    subhier = sub__add_branch(subhier, tokens);
+    if(!subhier) return MOSQ_ERR_NOMEM;
 
     /* Add add our context */
     if(context && context->id){
         if(sharename){
-            return sub__add_shared(db, context, qos, identifier, options, subhier, sharename);
+            return sub__add_shared(db, context, qos, identifier, options, subhier, sharename, sharename_len);
         }else{
             return sub__add_normal(db, context, qos, identifier, options, subhier);
         }
@@ -509,7 +509,7 @@ static int sub__remove_normal(struct mosquitto_db *db, struct mosquitto *context
             db->subscription_count--;
 #endif
             DL_DELETE(subhier->subs, leaf);
-            mosquitto__free(leaf);
+            mosquitto__pool_free(&subleaf_pool, leaf);
 
             /* Remove the reference to the sub that the client is keeping.
              * It would be nice to be able to use the reference directly,
@@ -530,14 +530,13 @@ static int sub__remove_normal(struct mosquitto_db *db, struct mosquitto *context
 }
 
 
-static int sub__remove_shared(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__subhier *subhier, uint8_t *reason, char *sharename)
+static int sub__remove_shared(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__subhier *subhier, uint8_t *reason, const char *sharename, uint16_t sharename_len)
 {
     struct mosquitto__subshared *shared;
     struct mosquitto__subleaf *leaf;
     int i;
 
-    HASH_FIND(hh, subhier->shared, sharename, strlen(sharename), shared);
-    mosquitto__free(sharename);
+    HASH_FIND(hh, subhier->shared, sharename, sharename_len, shared);
     if(shared){
         leaf = shared->subs;
         while(leaf){
@@ -546,7 +545,7 @@ static int sub__remove_shared(struct mosquitto_db *db, struct mosquitto *context
                 db->shared_subscription_count--;
 #endif
                 DL_DELETE(shared->subs, leaf);
-                mosquitto__free(leaf);
+                mosquitto__pool_free(&subleaf_pool, leaf);
 
                 /* Remove the reference to the sub that the client is keeping.
                 * It would be nice to be able to use the reference directly,
@@ -581,13 +580,13 @@ static int sub__remove_shared(struct mosquitto_db *db, struct mosquitto *context
 }
 
 
-static int sub__remove_recurse(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__subhier *subhier, struct sub__token *tokens, uint8_t *reason, char *sharename)
+static int sub__remove_recurse(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto__subhier *subhier, struct sub__token *tokens, uint8_t *reason, const char *sharename, uint16_t sharename_len)
 {
     struct mosquitto__subhier *branch;
 
     if(!tokens){
         if(sharename){
-            return sub__remove_shared(db, context, subhier, reason, sharename);
+            return sub__remove_shared(db, context, subhier, reason, sharename, sharename_len);
         }else{
             return sub__remove_normal(db, context, subhier, reason);
         }
@@ -595,17 +594,15 @@ static int sub__remove_recurse(struct mosquitto_db *db, struct mosquitto *contex
 
     HASH_FIND(hh, subhier->children, tokens->topic, tokens->topic_len, branch);
     if(branch){
-        sub__remove_recurse(db, context, branch, tokens->next, reason, sharename);
+        sub__remove_recurse(db, context, branch, tokens->next, reason, sharename, sharename_len);
         if(!branch->children && !branch->subs && !branch->retained && !branch->shared){
-            HASH_DELETE(hh, subhier->children, branch);
-            mosquitto__free(branch->topic);
-            mosquitto__free(branch);
+            sub__remove_hier_entry(subhier, branch);
         }
     }
     return MOSQ_ERR_SUCCESS;
 }
 
-static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhier, struct sub__token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain)
+static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhier, struct sub__token *tokens, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store *stored, bool set_retain, struct subs_cache_entry *cache)
 {
     /* FIXME - need to take into account source_id if the client is a bridge */
     struct mosquitto__subhier *branch;
@@ -617,14 +614,14 @@ static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhi
         HASH_FIND(hh, subhier->children, tokens->topic, tokens->topic_len, branch);
 
         if(branch){
-            rc = sub__search(db, branch, tokens->next, source_id, topic, qos, retain, stored, set_retain);
+            rc = sub__search(db, branch, tokens->next, source_id, topic, qos, retain, stored, set_retain, cache);
             if(rc == MOSQ_ERR_SUCCESS){
                 have_subscribers = true;
             }else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
                 return rc;
             }
             if(!tokens->next){
-                rc = subs__process(db, branch, source_id, topic, qos, retain, stored, set_retain);
+                rc = subs__process(db, branch, source_id, topic, qos, retain, stored, set_retain, cache);
                 if(rc == MOSQ_ERR_SUCCESS){
                     have_subscribers = true;
                 }else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
@@ -634,17 +631,17 @@ static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhi
         }
 
         /* Check for + match */
-        HASH_FIND(hh, subhier->children, "+", 1, branch);
+        branch = subhier->child_plus;
 
         if(branch){
-            rc = sub__search(db, branch, tokens->next, source_id, topic, qos, retain, stored, false);
+            rc = sub__search(db, branch, tokens->next, source_id, topic, qos, retain, stored, false, cache);
             if(rc == MOSQ_ERR_SUCCESS){
                 have_subscribers = true;
             }else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
                 return rc;
             }
             if(!tokens->next){
-                rc = subs__process(db, branch, source_id, topic, qos, retain, stored, false);
+                rc = subs__process(db, branch, source_id, topic, qos, retain, stored, false, cache);
                 if(rc == MOSQ_ERR_SUCCESS){
                     have_subscribers = true;
                 }else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
@@ -655,13 +652,13 @@ static int sub__search(struct mosquitto_db *db, struct mosquitto__subhier *subhi
     }
 
     /* Check for # match */
-    HASH_FIND(hh, subhier->children, "#", 1, branch);
+    branch = subhier->child_hash;
     if(branch && !branch->children){
         /* The topic matches due to a # wildcard - process the
          * subscriptions but *don't* return. Although this branch has ended
          * there may still be other subscriptions to deal with.
          */
-        rc = subs__process(db, branch, source_id, topic, qos, retain, stored, false);
+        rc = subs__process(db, branch, source_id, topic, qos, retain, stored, false, cache);
         if(rc == MOSQ_ERR_SUCCESS){
             have_subscribers = true;
         }else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
@@ -683,25 +680,29 @@ struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent
 
     assert(sibling);
 
-    child = mosquitto__calloc(1, sizeof(struct mosquitto__subhier));
+    /* The topic is allocated along with the node, so comparing the key during
+     * a lookup doesn't need to touch another cache line. */
+    child = mosquitto__calloc(1, sizeof(struct mosquitto__subhier) + len + 1);
     if(!child){
         log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
         return NULL;
     }
     child->parent = parent;
     child->topic_len = len;
-    child->topic = mosquitto__malloc(len+1);
-    if(!child->topic){
-        child->topic_len = 0;
-        mosquitto__free(child);
-        log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
-        return NULL;
-    }else{
-        strncpy(child->topic, topic, child->topic_len+1);
-    }
+    child->topic = (char *)&child[1];
+    memcpy(child->topic, topic, len);
+    child->topic[len] = '\0';
 
     HASH_ADD_KEYPTR(hh, *sibling, child->topic, child->topic_len, child);
 
+    if(parent && len == 1){
+        if(topic[0] == '+'){
+            parent->child_plus = child;
+        }else if(topic[0] == '#'){
+            parent->child_hash = child;
+        }
+    }
+
     return child;
 }
 
@@ -710,107 +711,175 @@ int sub__add(struct mosquitto_db *db, struct mosquitto *context, const char *sub
 {
     int rc = 0;
     struct mosquitto__subhier *subhier;
-    struct sub__token *tokens = NULL, *t;
-    char *sharename = NULL;
+    struct sub__token token_array[SUB_TOKEN_MAX];
+    struct sub__token *tokens = token_array;
+    const char *sharename = NULL;
+    uint16_t sharename_len;
 
     assert(root);
     assert(*root);
     assert(sub);
 
-    if(sub__topic_tokenise(sub, &tokens)) return 1;
+    if(sub__topic_tokenise(sub, tokens)) return 1;
 
-    if(!strcmp(tokens->topic, "$share")){
-        if(!tokens->next || !tokens->next->next){
-            sub__topic_tokens_free(tokens);
-            return MOSQ_ERR_PROTOCOL;
-        }
-        t = tokens->next;
-        mosquitto__free(tokens->topic);
-        mosquitto__free(tokens);
-        tokens = t;
+    rc = sub__topic_shared_split(&tokens, &sharename, &sharename_len);
+    if(rc) return rc;
 
-        sharename = tokens->topic;
-
-        tokens->topic = mosquitto__strdup("");
-        if(!tokens->topic){
-            tokens->topic = sharename;
-            sub__topic_tokens_free(tokens);
-            return MOSQ_ERR_PROTOCOL;
-        }
-        tokens->topic_len = 0;
-    }
+    subs_cache__invalidate();
 
     HASH_FIND(hh, *root, tokens->topic, tokens->topic_len, subhier);
     if(!subhier){
         subhier = sub__add_hier_entry(NULL, root, tokens->topic, tokens->topic_len);
         if(!subhier){
-            sub__topic_tokens_free(tokens);
             log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
             return MOSQ_ERR_NOMEM;
         }
 
     }
-    rc = sub__add_context(db, context, qos, identifier, options, subhier, tokens, sharename);
+    rc = sub__add_context(db, context, qos, identifier, options, subhier, tokens, sharename, sharename_len);
+#ifdef WITH_PERSISTENCE
+    if(context && sharename == NULL && (rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_SUB_EXISTS)){
+        persist__journal_sub(db, context, sub, qos, identifier, options & (MQTT_SUB_OPT_NO_LOCAL | MQTT_SUB_OPT_RETAIN_AS_PUBLISHED));
+    }
+#endif
+    return rc;
+}
 
-    sub__topic_tokens_free(tokens);
 
-    return rc;
+/* Find the node for the non-shared subscription topic sub, adding it to the
+ * tree if needed. Used with sub__add_restored(). */
+struct mosquitto__subhier *sub__add_hier(struct mosquitto_db *db, const char *sub)
+{
+    struct mosquitto__subhier *subhier;
+    struct sub__token tokens[SUB_TOKEN_MAX];
+
+    if(sub__topic_tokenise(sub, tokens)) return NULL;
+
+    HASH_FIND(hh, db->subs, tokens[0].topic, tokens[0].topic_len, subhier);
+    if(!subhier){
+        subhier = sub__add_hier_entry(NULL, &db->subs, tokens[0].topic, tokens[0].topic_len);
+        if(!subhier) return NULL;
+    }
+    return sub__add_branch(subhier, tokens);
+}
+
+
+/* Add a subscription restored from the persistent database to the node
+ * returned by sub__add_hier(). The database holds each subscription once and
+ * the client has no gaps in its list of subscriptions, so unlike sub__add()
+ * there is nothing to search for and restoring is linear in the number of
+ * subscriptions. Not for use with the journal, which can repeat them. */
+int sub__add_restored(struct mosquitto_db *db, struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier)
+{
+    struct mosquitto__subleaf *leaf;
+    struct mosquitto__subhier **subs;
+
+    leaf = mosquitto__pool_calloc(&subleaf_pool);
+    if(!leaf) return MOSQ_ERR_NOMEM;
+
+    subs = mosquitto__realloc(context->subs, sizeof(struct mosquitto__subhier *)*(context->sub_count + 1));
+    if(!subs){
+        mosquitto__pool_free(&subleaf_pool, leaf);
+        return MOSQ_ERR_NOMEM;
+    }
+    context->subs = subs;
+    context->subs[context->sub_count] = subhier;
+    context->sub_count++;
+
+    leaf->context = context;
+    leaf->qos = qos;
+    leaf->identifier = identifier;
+    leaf->no_local = ((options & MQTT_SUB_OPT_NO_LOCAL) != 0);
+    leaf->retain_as_published = ((options & MQTT_SUB_OPT_RETAIN_AS_PUBLISHED) != 0);
+    DL_APPEND(subhier->subs, leaf);
+
+    subs_cache__invalidate();
+#ifdef WITH_SYS_TREE
+    db->subscription_count++;
+#endif
+    return MOSQ_ERR_SUCCESS;
 }
 
 int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct mosquitto__subhier *root, uint8_t *reason)
 {
     int rc = 0;
     struct mosquitto__subhier *subhier;
-    struct sub__token *tokens = NULL, *t;
-    char *sharename = NULL;
+    struct sub__token token_array[SUB_TOKEN_MAX];
+    struct sub__token *tokens = token_array;
+    const char *sharename = NULL;
+    uint16_t sharename_len;
 
     assert(root);
     assert(sub);
 
-    if(sub__topic_tokenise(sub, &tokens)) return 1;
+    if(sub__topic_tokenise(sub, tokens)) return 1;
 
-    if(!strcmp(tokens->topic, "$share")){
-        if(!tokens->next || !tokens->next->next){
-            sub__topic_tokens_free(tokens);
-            return MOSQ_ERR_PROTOCOL;
-        }
-        t = tokens->next;
-        mosquitto__free(tokens->topic);
-        mosquitto__free(tokens);
-        tokens = t;
+    rc = sub__topic_shared_split(&tokens, &sharename, &sharename_len);
+    if(rc) return rc;
 
-        sharename = tokens->topic;
-
-        tokens->topic = mosquitto__strdup("");
-        if(!tokens->topic){
-            tokens->topic = sharename;
-            sub__topic_tokens_free(tokens);
-            return MOSQ_ERR_PROTOCOL;
-        }
-        tokens->topic_len = 0;
-    }
+    subs_cache__invalidate();
 
     HASH_FIND(hh, root, tokens->topic, tokens->topic_len, subhier);
     if(subhier){
         *reason = MQTT_RC_NO_SUBSCRIPTION_EXISTED;
-        rc = sub__remove_recurse(db, context, subhier, tokens, reason, sharename);
+        rc = sub__remove_recurse(db, context, subhier, tokens, reason, sharename, sharename_len);
+#ifdef WITH_PERSISTENCE
+        if(rc == MOSQ_ERR_SUCCESS && *reason == MQTT_RC_SUCCESS && sharename == NULL){
+            persist__journal_sub_delete(db, context, sub);
+        }
+#endif
     }
 
-    sub__topic_tokens_free(tokens);
-
     return rc;
 }
 
+/* Deliver to the subhier nodes a previous sub__search() found for this topic,
+ * in the same order. */
+static int sub__cache_process(struct mosquitto_db *db, struct subs_cache_entry *cache, const char *source_id, const char *topic, int qos, struct mosquitto_msg_store *stored)
+{
+    int i;
+    int rc;
+    bool have_subscribers = false;
+
+    for(i=0; i<cache->hier_count; i++){
+        rc = subs__process(db, cache->hiers[i], source_id, topic, qos, 0, stored, false, NULL);
+        if(rc == MOSQ_ERR_SUCCESS){
+            have_subscribers = true;
+        }else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
+            return rc;
+        }
+    }
+
+    if(have_subscribers){
+        return MOSQ_ERR_SUCCESS;
+    }else{
+        return MOSQ_ERR_NO_SUBSCRIBERS;
+    }
+}
+
+
 int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store **stored)
 {
     int rc = 0;
     struct mosquitto__subhier *subhier;
-    struct sub__token *tokens = NULL;
+    struct sub__token tokens[SUB_TOKEN_MAX];
+    struct subs_cache_entry *cache = NULL;
 
     assert(db);
     assert(topic);
 
-    if(sub__topic_tokenise(topic, &tokens)) return 1;
+    /* Retained messages modify the tree, so always take the long way. */
+    if(!retain){
+        cache = subs_cache__find(topic);
+        if(cache){
+            db__msg_store_ref_inc(*stored);
+            rc = sub__cache_process(db, cache, source_id, topic, qos, *stored);
+            db__msg_store_ref_dec(db, stored);
+            return rc;
+        }
+    }
+
+    if(sub__topic_tokenise(topic, tokens)) return 1;
 
     /* Protect this message until we have sent it to all
     clients - this is required because websockets client calls
@@ -818,17 +887,21 @@ int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const ch
     */
     db__msg_store_ref_inc(*stored);
 
-    HASH_FIND(hh, db->subs, tokens->topic, tokens->topic_len, subhier);
+    HASH_FIND(hh, db->subs, tokens[0].topic, tokens[0].topic_len, subhier);
     if(subhier){
         if(retain){
             /* We have a message that needs to be retained, so ensure that the subscription
              * tree for its topic exists.
              */
-            sub__add_context(db, NULL, 0, 0, 0, subhier, tokens, NULL);
+            sub__add_context(db, NULL, 0, 0, 0, subhier, tokens, NULL, 0);
+        }else{
+            cache = subs_cache__add(db, topic);
+        }
+        rc = sub__search(db, subhier, tokens, source_id, topic, qos, retain, *stored, true, cache);
+        if(cache && rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_NO_SUBSCRIBERS){
+            subs_cache__discard(cache);
         }
-        rc = sub__search(db, subhier, tokens, source_id, topic, qos, retain, *stored, true);
     }
-    sub__topic_tokens_free(tokens);
 
     /* Remove our reference and free if needed. */
     db__msg_store_ref_dec(db, stored);
@@ -851,9 +924,7 @@ static struct mosquitto__subhier *tmp_remove_subs(struct mosquitto__subhier *sub
     }
 
     parent = sub->parent;
-    HASH_DELETE(hh, parent->children, sub);
-    mosquitto__free(sub->topic);
-    mosquitto__free(sub);
+    sub__remove_hier_entry(parent, sub);
 
     if(parent->subs == NULL
             && parent->children == NULL
@@ -918,6 +989,10 @@ int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context)
     struct mosquitto__subleaf *leaf;
     struct mosquitto__subhier *hier;
 
+    if(context->sub_count || context->shared_sub_count){
+        subs_cache__invalidate();
+    }
+
     for(i=0; i<context->sub_count; i++){
         if(context->subs[i] == NULL){
             continue;
@@ -929,7 +1004,7 @@ int sub__clean_session(struct mosquitto_db *db, struct mosquitto *context)
                 db->subscription_count--;
 #endif
                 DL_DELETE(context->subs[i]->subs, leaf);
-                mosquitto__free(leaf);
+                mosquitto__pool_free(&subleaf_pool, leaf);
                 break;
             }
             leaf = leaf->next;
@@ -1055,7 +1130,7 @@ static int retain__search(struct mosquitto_db *db, struct mosquitto__subhier *su
     struct mosquitto__subhier *branch, *branch_tmp;
     int flag = 0;
 
-    if(!strcmp(tokens->topic, "#") && !tokens->next){
+    if(sub__token_is(tokens, "#", 1) && !tokens->next){
         HASH_ITER(hh, subhier->children, branch, branch_tmp){
             /* Set flag to indicate that we should check for retained messages
              * on "foo" when we are subscribing to e.g. "foo/#" and then exit
@@ -1070,11 +1145,11 @@ static int retain__search(struct mosquitto_db *db, struct mosquitto__subhier *su
             }
         }
     }else{
-        if(!strcmp(tokens->topic, "+")){
+        if(sub__token_is(tokens, "+", 1)){
             HASH_ITER(hh, subhier->children, branch, branch_tmp){
                 if(tokens->next){
                     if(retain__search(db, branch, tokens->next, context, sub, sub_qos, subscription_identifier, now, level+1) == -1
-                            || (tokens->next && !strcmp(tokens->next->topic, "#") && level>0)){
+                            || (tokens->next && sub__token_is(tokens->next, "#", 1) && level>0)){
 
                         if(branch->retained){
                             retain__process(db, branch, context, sub_qos, subscription_identifier, now);
@@ -1091,7 +1166,7 @@ static int retain__search(struct mosquitto_db *db, struct mosquitto__subhier *su
             if(branch){
                 if(tokens->next){
                     if(retain__search(db, branch, tokens->next, context, sub, sub_qos, subscription_identifier, now, level+1) == -1
-                            || (tokens->next && !strcmp(tokens->next->topic, "#") && level>0)){
+                            || (tokens->next && sub__token_is(tokens->next, "#", 1) && level>0)){
 
                         if(branch->retained){
                             retain__process(db, branch, context, sub_qos, subscription_identifier, now);
@@ -1108,30 +1183,49 @@ static int retain__search(struct mosquitto_db *db, struct mosquitto__subhier *su
     return flag;
 }
 
+/* Remove the retained message for topic, if there is one. */
+void sub__retain_clear(struct mosquitto_db *db, const char *topic)
+{
+    struct mosquitto__subhier *subhier, *parent;
+    struct sub__token tokens[SUB_TOKEN_MAX];
+    struct sub__token *token;
+
+    if(sub__topic_tokenise(topic, tokens)) return;
+
+    HASH_FIND(hh, db->subs, tokens[0].topic, tokens[0].topic_len, subhier);
+    /* The first token is both the root and its first child, as in
+     * sub__add_context(). */
+    for(token=&tokens[0]; subhier && token; token=token->next){
+        parent = subhier;
+        HASH_FIND(hh, parent->children, token->topic, token->topic_len, subhier);
+    }
+    if(subhier && subhier->retained){
+        db__msg_store_ref_dec(db, &subhier->retained);
+        subhier->retained = NULL;
+#ifdef WITH_SYS_TREE
+        db->retained_count--;
+#endif
+    }
+}
+
 int sub__retain_queue(struct mosquitto_db *db, struct mosquitto *context, const char *sub, int sub_qos, uint32_t subscription_identifier)
 {
     struct mosquitto__subhier *subhier;
-    struct sub__token *tokens = NULL, *tail;
+    struct sub__token tokens[SUB_TOKEN_MAX];
     time_t now;
 
     assert(db);
     assert(context);
     assert(sub);
 
-    if(sub__topic_tokenise(sub, &tokens)) return 1;
+    if(sub__topic_tokenise(sub, tokens)) return 1;
 
-    HASH_FIND(hh, db->subs, tokens->topic, tokens->topic_len, subhier);
+    HASH_FIND(hh, db->subs, tokens[0].topic, tokens[0].topic_len, subhier);
 
     if(subhier){
         now = time(NULL);
         retain__search(db, subhier, tokens, context, sub, sub_qos, subscription_identifier, now, 0);
     }
-    while(tokens){
-        tail = tokens->next;
-        mosquitto__free(tokens->topic);
-        mosquitto__free(tokens);
-        tokens = tail;
-    }
 
     return MOSQ_ERR_SUCCESS;
 }
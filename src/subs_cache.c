@@ -0,0 +1,150 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <string.h>
+#include <utlist.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+
+/* Cache of the result of matching a topic against the subscription tree.
+ *
+ * Each entry holds the subhier nodes that had subscribers when the topic was
+ * last looked up, in the order sub__search() found them. Any change to the
+ * tree bumps the generation, which makes every existing entry stale - stale
+ * entries are refilled the next time their topic is published to, or evicted
+ * in least recently used order once the cache is full. The node pointers in a
+ * stale entry may no longer be valid, so they must never be used.
+ */
+
+static struct subs_cache_entry *cache_by_topic = NULL;
+static struct subs_cache_entry *lru = NULL; /* Most recently used first */
+static int cache_count = 0;
+static uint64_t generation = 1;
+
+
+static void subs_cache__entry_free(struct subs_cache_entry *entry)
+{
+    HASH_DELETE(hh, cache_by_topic, entry);
+    DL_DELETE(lru, entry);
+    cache_count--;
+    mosquitto__free(entry->topic);
+    mosquitto__free(entry->hiers);
+    mosquitto__free(entry);
+}
+
+
+/* Returns the cache entry for topic if it is still valid, or NULL. */
+struct subs_cache_entry *subs_cache__find(const char *topic)
+{
+    struct subs_cache_entry *entry;
+
+    HASH_FIND(hh, cache_by_topic, topic, strlen(topic), entry);
+    if(entry == NULL || entry->generation != generation){
+        return NULL;
+    }
+    if(entry != lru){
+        DL_DELETE(lru, entry);
+        DL_PREPEND(lru, entry);
+    }
+    return entry;
+}
+
+
+/* Returns an empty entry for topic, ready to be filled with
+ * subs_cache__append(), or NULL if the cache is disabled. */
+struct subs_cache_entry *subs_cache__add(struct mosquitto_db *db, const char *topic)
+{
+    struct subs_cache_entry *entry;
+    size_t len;
+
+    while(lru && cache_count >= db->config->subscription_cache_size){
+        /* lru->prev is the tail of the list */
+        subs_cache__entry_free(lru->prev);
+    }
+    if(db->config->subscription_cache_size <= 0){
+        return NULL;
+    }
+
+    len = strlen(topic);
+    HASH_FIND(hh, cache_by_topic, topic, len, entry);
+    if(entry){
+        DL_DELETE(lru, entry);
+    }else{
+        entry = mosquitto__calloc(1, sizeof(struct subs_cache_entry));
+        if(!entry) return NULL;
+        entry->topic = mosquitto__strdup(topic);
+        if(!entry->topic){
+            mosquitto__free(entry);
+            return NULL;
+        }
+        HASH_ADD_KEYPTR(hh, cache_by_topic, entry->topic, len, entry);
+        cache_count++;
+    }
+    DL_PREPEND(lru, entry);
+
+    entry->hier_count = 0;
+    entry->generation = generation;
+
+    return entry;
+}
+
+
+void subs_cache__append(struct subs_cache_entry *entry, struct mosquitto__subhier *hier)
+{
+    struct mosquitto__subhier **hiers;
+    int hier_max;
+
+    if(entry->generation != generation){
+        return;
+    }
+    if(entry->hier_count == entry->hier_max){
+        hier_max = entry->hier_max ? entry->hier_max*2 : 4;
+        hiers = mosquitto__realloc(entry->hiers, sizeof(struct mosquitto__subhier *)*hier_max);
+        if(!hiers){
+            /* An incomplete entry must not be used. */
+            subs_cache__discard(entry);
+            return;
+        }
+        entry->hiers = hiers;
+        entry->hier_max = hier_max;
+    }
+    entry->hiers[entry->hier_count] = hier;
+    entry->hier_count++;
+}
+
+
+void subs_cache__discard(struct subs_cache_entry *entry)
+{
+    entry->generation = 0;
+}
+
+
+/* Call whenever subscriptions are added or removed, or subhier nodes freed. */
+void subs_cache__invalidate(void)
+{
+    generation++;
+}
+
+
+void subs_cache__cleanup(void)
+{
+    while(lru){
+        subs_cache__entry_free(lru);
+    }
+}
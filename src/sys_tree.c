@@ -20,6 +20,8 @@ Contributors:
 
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
@@ -28,19 +30,19 @@ Contributors:
 #define BUFLEN 100
 
 #define SYS_TREE_QOS 2
+#define SYS_TREE_POOLS_MAX 8
 
-uint64_t g_bytes_received = 0;
-uint64_t g_bytes_sent = 0;
-uint64_t g_pub_bytes_received = 0;
-uint64_t g_pub_bytes_sent = 0;
-unsigned long g_msgs_received = 0;
-unsigned long g_msgs_sent = 0;
-unsigned long g_pub_msgs_received = 0;
-unsigned long g_pub_msgs_sent = 0;
-unsigned long g_msgs_dropped = 0;
-int g_clients_expired = 0;
-unsigned int g_socket_connections = 0;
-unsigned int g_connection_count = 0;
+/* Counted with db_mutex held. */
+struct mosquitto__stats g_stats;
+
+
+uint64_t stats__now_us(void)
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return (uint64_t)tp.tv_sec*1000000 + (uint64_t)tp.tv_nsec/1000;
+}
 
 void sys_tree__init(struct mosquitto_db *db)
 {
@@ -55,10 +57,10 @@ void sys_tree__init(struct mosquitto_db *db)
     db__messages_easy_queue(db, NULL, "$SYS/broker/version", SYS_TREE_QOS, strlen(buf), buf, 1, 0, NULL);
 }
 
-static void sys_tree__update_clients(struct mosquitto_db *db, char *buf)
+static void sys_tree__update_clients(struct mosquitto_db *db, char *buf, unsigned long expired)
 {
     static int client_count = -1;
-    static int clients_expired = -1;
+    static unsigned long clients_expired = -1;
     static int client_max = 0;
     static int disconnected_count = -1;
     static int connected_count = -1;
@@ -99,9 +101,9 @@ static void sys_tree__update_clients(struct mosquitto_db *db, char *buf)
         db__messages_easy_queue(db, NULL, "$SYS/broker/clients/active", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         db__messages_easy_queue(db, NULL, "$SYS/broker/clients/connected", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
     }
-    if(g_clients_expired != clients_expired){
-        clients_expired = g_clients_expired;
-        snprintf(buf, BUFLEN, "%d", clients_expired);
+    if(expired != clients_expired){
+        clients_expired = expired;
+        snprintf(buf, BUFLEN, "%lu", clients_expired);
         db__messages_easy_queue(db, NULL, "$SYS/broker/clients/expired", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
     }
 }
@@ -128,6 +130,69 @@ static void sys_tree__update_memory(struct mosquitto_db *db, char *buf)
 }
 #endif
 
+/* Objects handed out from, and waiting on the free lists of, each of the
+ * allocation pools. Pools are added to the list when first used, so the last
+ * published values are looked up by pool rather than by position. */
+static void sys_tree__update_pools(struct mosquitto_db *db, char *buf)
+{
+    static struct {
+        struct mosquitto__pool *pool;
+        unsigned long in_use;
+        unsigned long available;
+    } last[SYS_TREE_POOLS_MAX];
+    struct mosquitto__pool *pool;
+    char topic[BUFLEN];
+    int i;
+
+    for(pool=memory__pools(); pool; pool=pool->next){
+        for(i=0; i<SYS_TREE_POOLS_MAX; i++){
+            if(last[i].pool == pool) break;
+            if(last[i].pool == NULL){
+                last[i].pool = pool;
+                last[i].in_use = -1;
+                last[i].available = -1;
+                break;
+            }
+        }
+        if(i == SYS_TREE_POOLS_MAX){
+            continue;
+        }
+
+        if(last[i].in_use != pool->in_use){
+            last[i].in_use = pool->in_use;
+            snprintf(topic, BUFLEN, "$SYS/broker/heap/pools/%s/in use", pool->name);
+            snprintf(buf, BUFLEN, "%lu", pool->in_use);
+            db__messages_easy_queue(db, NULL, topic, SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+        }
+        if(last[i].available != pool->available){
+            last[i].available = pool->available;
+            snprintf(topic, BUFLEN, "$SYS/broker/heap/pools/%s/free", pool->name);
+            snprintf(buf, BUFLEN, "%lu", pool->available);
+            db__messages_easy_queue(db, NULL, topic, SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+        }
+    }
+}
+
+/* Log messages dropped because the log queue was full, or by log_rate_limit. */
+static void sys_tree__update_log(struct mosquitto_db *db, char *buf)
+{
+    static unsigned long queue_full = 0;
+    static unsigned long rate_limited = 0;
+    unsigned long value_queue, value_rate;
+
+    log__dropped(&value_queue, &value_rate);
+    if(value_queue != queue_full){
+        queue_full = value_queue;
+        snprintf(buf, BUFLEN, "%lu", queue_full);
+        db__messages_easy_queue(db, NULL, "$SYS/broker/log messages/dropped/queue full", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+    }
+    if(value_rate != rate_limited){
+        rate_limited = value_rate;
+        snprintf(buf, BUFLEN, "%lu", rate_limited);
+        db__messages_easy_queue(db, NULL, "$SYS/broker/log messages/dropped/rate limited", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+    }
+}
+
 static void calc_load(struct mosquitto_db *db, char *buf, const char *topic, bool initial, double exponent, double interval, double *current)
 {
     double new_value;
@@ -161,8 +226,14 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
 
     static int msg_store_count = -1;
     static unsigned long msg_store_bytes = -1;
+    static int msg_spilled_count = -1;
+    static unsigned long msg_spilled_bytes = -1;
     static unsigned long msgs_received = -1;
     static unsigned long msgs_sent = -1;
+    static unsigned long write_calls = -1;
+#ifdef WITH_PERSISTENCE
+    static unsigned long persistence_saves = -1;
+#endif
     static unsigned long publish_dropped = -1;
     static unsigned long pub_msgs_received = -1;
     static unsigned long pub_msgs_sent = -1;
@@ -170,6 +241,8 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
     static unsigned long long bytes_sent = -1;
     static unsigned long long pub_bytes_received = -1;
     static unsigned long long pub_bytes_sent = -1;
+    static unsigned long socket_connections = 0;
+    static unsigned long connection_count = 0;
     static int subscription_count = -1;
     static int shared_subscription_count = -1;
     static int retained_count = -1;
@@ -213,6 +286,7 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
 
     double exponent;
     double i_mult;
+    struct mosquitto__stats stats;
 
     now = mosquitto_time();
 
@@ -221,7 +295,8 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
         snprintf(buf, BUFLEN, "%d seconds", (int)uptime);
         db__messages_easy_queue(db, NULL, "$SYS/broker/uptime", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
 
-        sys_tree__update_clients(db, buf);
+        stats = g_stats;
+        sys_tree__update_clients(db, buf, stats.clients_expired);
         bool initial_publish = false;
         if(last_update == 0){
             initial_publish = true;
@@ -230,20 +305,20 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
         if(last_update > 0){
             i_mult = 60.0/(double)(now-last_update);
 
-            msgs_received_interval = (g_msgs_received - msgs_received)*i_mult;
-            msgs_sent_interval = (g_msgs_sent - msgs_sent)*i_mult;
-            publish_dropped_interval = (g_msgs_dropped - publish_dropped)*i_mult;
+            msgs_received_interval = (stats.msgs_received - msgs_received)*i_mult;
+            msgs_sent_interval = (stats.msgs_sent - msgs_sent)*i_mult;
+            publish_dropped_interval = (stats.msgs_dropped - publish_dropped)*i_mult;
 
-            publish_received_interval = (g_pub_msgs_received - pub_msgs_received)*i_mult;
-            publish_sent_interval = (g_pub_msgs_sent - pub_msgs_sent)*i_mult;
+            publish_received_interval = (stats.pub_msgs_received - pub_msgs_received)*i_mult;
+            publish_sent_interval = (stats.pub_msgs_sent - pub_msgs_sent)*i_mult;
 
-            bytes_received_interval = (g_bytes_received - bytes_received)*i_mult;
-            bytes_sent_interval = (g_bytes_sent - bytes_sent)*i_mult;
+            bytes_received_interval = (stats.bytes_received - bytes_received)*i_mult;
+            bytes_sent_interval = (stats.bytes_sent - bytes_sent)*i_mult;
 
-            socket_interval = g_socket_connections*i_mult;
-            g_socket_connections = 0;
-            connection_interval = g_connection_count*i_mult;
-            g_connection_count = 0;
+            socket_interval = (stats.socket_connections - socket_connections)*i_mult;
+            socket_connections = stats.socket_connections;
+            connection_interval = (stats.connection_count - connection_count)*i_mult;
+            connection_count = stats.connection_count;
 
             /* 1 minute load */
             exponent = exp(-1.0*(now-last_update)/60.0);
@@ -298,6 +373,18 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
             db__messages_easy_queue(db, NULL, "$SYS/broker/store/messages/bytes", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         }
 
+        if(db->msg_spilled_count != msg_spilled_count){
+            msg_spilled_count = db->msg_spilled_count;
+            snprintf(buf, BUFLEN, "%d", msg_spilled_count);
+            db__messages_easy_queue(db, NULL, "$SYS/broker/store/spilled/count", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+        }
+
+        if(db->msg_spilled_bytes != msg_spilled_bytes){
+            msg_spilled_bytes = db->msg_spilled_bytes;
+            snprintf(buf, BUFLEN, "%lu", msg_spilled_bytes);
+            db__messages_easy_queue(db, NULL, "$SYS/broker/store/spilled/bytes", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+        }
+
         if(db->subscription_count != subscription_count){
             subscription_count = db->subscription_count;
             snprintf(buf, BUFLEN, "%d", subscription_count);
@@ -319,57 +406,84 @@ void sys_tree__update(struct mosquitto_db *db, int interval, time_t start_time)
 #ifdef REAL_WITH_MEMORY_TRACKING
         sys_tree__update_memory(db, buf);
 #endif
+        sys_tree__update_pools(db, buf);
+        sys_tree__update_log(db, buf);
 
-        if(msgs_received != g_msgs_received){
-            msgs_received = g_msgs_received;
+        if(msgs_received != stats.msgs_received){
+            msgs_received = stats.msgs_received;
             snprintf(buf, BUFLEN, "%lu", msgs_received);
             db__messages_easy_queue(db, NULL, "$SYS/broker/messages/received", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         }
         
-        if(msgs_sent != g_msgs_sent){
-            msgs_sent = g_msgs_sent;
+        if(msgs_sent != stats.msgs_sent){
+            msgs_sent = stats.msgs_sent;
             snprintf(buf, BUFLEN, "%lu", msgs_sent);
             db__messages_easy_queue(db, NULL, "$SYS/broker/messages/sent", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         }
 
-        if(publish_dropped != g_msgs_dropped){
-            publish_dropped = g_msgs_dropped;
+        if(write_calls != stats.write_calls){
+            write_calls = stats.write_calls;
+            snprintf(buf, BUFLEN, "%lu", write_calls);
+            db__messages_easy_queue(db, NULL, "$SYS/broker/writes/calls", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+
+            if(msgs_sent > 0){
+                snprintf(buf, BUFLEN, "%.3f", (double)write_calls/(double)msgs_sent);
+                db__messages_easy_queue(db, NULL, "$SYS/broker/writes/per message", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+            }
+        }
+
+#ifdef WITH_PERSISTENCE
+        if(persistence_saves != db->persistence_saves){
+            persistence_saves = db->persistence_saves;
+            snprintf(buf, BUFLEN, "%lu", persistence_saves);
+            db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/saves", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+
+            snprintf(buf, BUFLEN, "%.3f", db->persistence_save_time);
+            db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/last save/seconds", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+
+            snprintf(buf, BUFLEN, "%ld", db->persistence_save_bytes);
+            db__messages_easy_queue(db, NULL, "$SYS/broker/persistence/last save/bytes", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
+        }
+#endif
+
+        if(publish_dropped != stats.msgs_dropped){
+            publish_dropped = stats.msgs_dropped;
             snprintf(buf, BUFLEN, "%lu", publish_dropped);
             db__messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/dropped", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         }
 
-        if(pub_msgs_received != g_pub_msgs_received){
-            pub_msgs_received = g_pub_msgs_received;
+        if(pub_msgs_received != stats.pub_msgs_received){
+            pub_msgs_received = stats.pub_msgs_received;
             snprintf(buf, BUFLEN, "%lu", pub_msgs_received);
             db__messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/received", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         }
         
-        if(pub_msgs_sent != g_pub_msgs_sent){
-            pub_msgs_sent = g_pub_msgs_sent;
+        if(pub_msgs_sent != stats.pub_msgs_sent){
+            pub_msgs_sent = stats.pub_msgs_sent;
             snprintf(buf, BUFLEN, "%lu", pub_msgs_sent);
             db__messages_easy_queue(db, NULL, "$SYS/broker/publish/messages/sent", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         }
 
-        if(bytes_received != g_bytes_received){
-            bytes_received = g_bytes_received;
+        if(bytes_received != stats.bytes_received){
+            bytes_received = stats.bytes_received;
             snprintf(buf, BUFLEN, "%llu", bytes_received);
             db__messages_easy_queue(db, NULL, "$SYS/broker/bytes/received", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         }
         
-        if(bytes_sent != g_bytes_sent){
-            bytes_sent = g_bytes_sent;
+        if(bytes_sent != stats.bytes_sent){
+            bytes_sent = stats.bytes_sent;
             snprintf(buf, BUFLEN, "%llu", bytes_sent);
             db__messages_easy_queue(db, NULL, "$SYS/broker/bytes/sent", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         }
         
-        if(pub_bytes_received != g_pub_bytes_received){
-            pub_bytes_received = g_pub_bytes_received;
+        if(pub_bytes_received != stats.pub_bytes_received){
+            pub_bytes_received = stats.pub_bytes_received;
             snprintf(buf, BUFLEN, "%llu", pub_bytes_received);
             db__messages_easy_queue(db, NULL, "$SYS/broker/publish/bytes/received", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         }
 
-        if(pub_bytes_sent != g_pub_bytes_sent){
-            pub_bytes_sent = g_pub_bytes_sent;
+        if(pub_bytes_sent != stats.pub_bytes_sent){
+            pub_bytes_sent = stats.pub_bytes_sent;
             snprintf(buf, BUFLEN, "%llu", pub_bytes_sent);
             db__messages_easy_queue(db, NULL, "$SYS/broker/publish/bytes/sent", SYS_TREE_QOS, strlen(buf), buf, 1, 60, NULL);
         }
@@ -18,46 +18,104 @@ Contributors:
 #define SYS_TREE_H
 
 #if defined(WITH_SYS_TREE) && defined(WITH_BROKER)
-extern uint64_t g_bytes_received;
-extern uint64_t g_bytes_sent;
-extern uint64_t g_pub_bytes_received;
-extern uint64_t g_pub_bytes_sent;
-extern unsigned long g_msgs_received;
-extern unsigned long g_msgs_sent;
-extern unsigned long g_pub_msgs_received;
-extern unsigned long g_pub_msgs_sent;
-extern unsigned long g_msgs_dropped;
-extern int g_clients_expired;
-extern unsigned int g_socket_connections;
-extern unsigned int g_connection_count;
-
-#define G_BYTES_RECEIVED_INC(A) (g_bytes_received+=(A))
-#define G_BYTES_SENT_INC(A) (g_bytes_sent+=(A))
-#define G_PUB_BYTES_RECEIVED_INC(A) (g_pub_bytes_received+=(A))
-#define G_PUB_BYTES_SENT_INC(A) (g_pub_bytes_sent+=(A))
-#define G_MSGS_RECEIVED_INC(A) (g_msgs_received+=(A))
-#define G_MSGS_SENT_INC(A) (g_msgs_sent+=(A))
-#define G_PUB_MSGS_RECEIVED_INC(A) (g_pub_msgs_received+=(A))
-#define G_PUB_MSGS_SENT_INC(A) (g_pub_msgs_sent+=(A))
-#define G_MSGS_DROPPED_INC() (g_msgs_dropped++)
-#define G_CLIENTS_EXPIRED_INC() (g_clients_expired++)
-#define G_SOCKET_CONNECTIONS_INC() (g_socket_connections++)
-#define G_CONNECTION_COUNT_INC() (g_connection_count++)
+
+#include <stdint.h>
+
+struct mosquitto_db;
+
+/* Histogram buckets are powers of two, bucket i counts values <= 2^i and the
+ * last bucket counts everything larger. */
+#define STATS_HIST_BUCKETS 24
+
+struct mosquitto__stats_hist{
+    uint64_t buckets[STATS_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+};
+
+/* Broker statistics, counted and read with db_mutex held. */
+struct mosquitto__stats{
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t pub_bytes_received;
+    uint64_t pub_bytes_sent;
+    uint64_t msgs_received;
+    uint64_t msgs_sent;
+    uint64_t pub_msgs_received;
+    uint64_t pub_msgs_sent;
+    uint64_t msgs_dropped;
+    uint64_t write_calls;
+    uint64_t clients_expired;
+    uint64_t socket_connections;
+    uint64_t connection_count;
+    struct mosquitto__stats_hist loop_time;     /* microseconds */
+    struct mosquitto__stats_hist deliver_time;  /* microseconds */
+    struct mosquitto__stats_hist queue_depth;   /* messages */
+};
+
+/* Per listener statistics, counted with db_mutex held. */
+struct mosquitto__listener_stats{
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint64_t pub_msgs_received;
+    uint64_t pub_msgs_sent;
+    uint64_t connection_count;
+};
+
+extern struct mosquitto__stats g_stats;
+
+uint64_t stats__now_us(void);
+
+static inline void stats__hist_add(struct mosquitto__stats_hist *hist, uint64_t value)
+{
+    int i = 0;
+
+    if(value > 1){
+        i = 64 - __builtin_clzll(value - 1);
+        if(i >= STATS_HIST_BUCKETS) i = STATS_HIST_BUCKETS-1;
+    }
+    hist->buckets[i]++;
+    hist->count++;
+    hist->sum += value;
+}
+
+#define G_LISTENER_INC(M, F, A) do{ if((M)->listener) (M)->listener->stats.F += (A); }while(0)
+
+#define G_BYTES_RECEIVED_INC(M, A) do{ g_stats.bytes_received += (A); G_LISTENER_INC(M, bytes_received, A); }while(0)
+#define G_BYTES_SENT_INC(M, A) do{ g_stats.bytes_sent += (A); G_LISTENER_INC(M, bytes_sent, A); }while(0)
+#define G_PUB_BYTES_RECEIVED_INC(A) (g_stats.pub_bytes_received+=(A))
+#define G_PUB_BYTES_SENT_INC(A) (g_stats.pub_bytes_sent+=(A))
+#define G_MSGS_RECEIVED_INC(A) (g_stats.msgs_received+=(A))
+#define G_MSGS_SENT_INC(A) (g_stats.msgs_sent+=(A))
+#define G_PUB_MSGS_RECEIVED_INC(M, A) do{ g_stats.pub_msgs_received += (A); G_LISTENER_INC(M, pub_msgs_received, A); }while(0)
+#define G_PUB_MSGS_SENT_INC(M, A) do{ g_stats.pub_msgs_sent += (A); G_LISTENER_INC(M, pub_msgs_sent, A); }while(0)
+#define G_MSGS_DROPPED_INC() (g_stats.msgs_dropped++)
+#define G_WRITE_CALLS_INC(A) (g_stats.write_calls+=(A))
+#define G_CLIENTS_EXPIRED_INC() (g_stats.clients_expired++)
+#define G_SOCKET_CONNECTIONS_INC() (g_stats.socket_connections++)
+#define G_CONNECTION_COUNT_INC(M) do{ g_stats.connection_count++; G_LISTENER_INC(M, connection_count, 1); }while(0)
+#define G_LOOP_TIME_ADD(A) stats__hist_add(&g_stats.loop_time, (A))
+#define G_DELIVER_TIME_ADD(A) stats__hist_add(&g_stats.deliver_time, (A))
+#define G_QUEUE_DEPTH_ADD(A) stats__hist_add(&g_stats.queue_depth, (A))
 
 #else
 
-#define G_BYTES_RECEIVED_INC(A)
-#define G_BYTES_SENT_INC(A)
+#define G_BYTES_RECEIVED_INC(M, A)
+#define G_BYTES_SENT_INC(M, A)
 #define G_PUB_BYTES_RECEIVED_INC(A)
 #define G_PUB_BYTES_SENT_INC(A)
 #define G_MSGS_RECEIVED_INC(A)
 #define G_MSGS_SENT_INC(A)
-#define G_PUB_MSGS_RECEIVED_INC(A)
-#define G_PUB_MSGS_SENT_INC(A)
+#define G_PUB_MSGS_RECEIVED_INC(M, A)
+#define G_PUB_MSGS_SENT_INC(M, A)
 #define G_MSGS_DROPPED_INC(A)
+#define G_WRITE_CALLS_INC(A)
 #define G_CLIENTS_EXPIRED_INC(A)
 #define G_SOCKET_CONNECTIONS_INC(A)
-#define G_CONNECTION_COUNT_INC(A)
+#define G_CONNECTION_COUNT_INC(M)
+#define G_LOOP_TIME_ADD(A)
+#define G_DELIVER_TIME_ADD(A)
+#define G_QUEUE_DEPTH_ADD(A)
 
 #endif
 
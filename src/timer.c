@@ -0,0 +1,150 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <time.h>
+#include <utlist.h>
+
+#include "mosquitto_broker_internal.h"
+#include "time_mosq.h"
+
+/* Two level timer wheel with one second resolution, based on mosquitto_time().
+ *
+ * wheel0 has one slot per second for timers due in the current block of
+ * TIMER_SLOTS seconds. wheel1 has one slot per block for timers due in the
+ * next TIMER_SLOTS-1 blocks, these are moved down to wheel0 when their block
+ * starts. Anything further away than that (about 12 days) goes on the overflow
+ * list, which is looked at once per lap of wheel1.
+ *
+ * Adding and removing timers is O(1), and each tick only touches the timers
+ * that are due, apart from the cascades at block boundaries which touch each
+ * timer at most twice in its lifetime.
+ */
+#define TIMER_BITS 10
+#define TIMER_SLOTS (1<<TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS-1)
+
+static struct mosquitto__timer *wheel0[TIMER_SLOTS];
+static struct mosquitto__timer *wheel1[TIMER_SLOTS];
+static struct mosquitto__timer *overflow = NULL;
+static struct mosquitto__timer *firing = NULL;
+static time_t current = 0;
+
+
+static void timer__insert(struct mosquitto__timer *timer)
+{
+    time_t block, current_block;
+
+    block = timer->expiry >> TIMER_BITS;
+    current_block = current >> TIMER_BITS;
+
+    if(timer->expiry <= current){
+        /* Already due, run on the next tick. */
+        timer->list = &wheel0[(current+1) & TIMER_MASK];
+    }else if(block == current_block){
+        timer->list = &wheel0[timer->expiry & TIMER_MASK];
+    }else if(block - current_block < TIMER_SLOTS){
+        timer->list = &wheel1[block & TIMER_MASK];
+    }else{
+        timer->list = &overflow;
+    }
+    DL_APPEND(*timer->list, timer);
+}
+
+
+static void timer__cascade(struct mosquitto__timer **list)
+{
+    struct mosquitto__timer *timer, *tmp;
+    struct mosquitto__timer *head;
+
+    head = *list;
+    *list = NULL;
+    DL_FOREACH_SAFE(head, timer, tmp){
+        DL_DELETE(head, timer);
+        timer__insert(timer);
+    }
+}
+
+
+/* Arrange for callback to be called once mosquitto_time() reaches expiry. If
+ * the timer was already pending it is rescheduled. */
+void timer__add(struct mosquitto__timer *timer, time_t expiry, void (*callback)(struct mosquitto_db *, struct mosquitto__timer *), void *data)
+{
+    if(current == 0){
+        current = mosquitto_time();
+    }
+    timer__remove(timer);
+    timer->callback = callback;
+    timer->data = data;
+    timer->expiry = expiry;
+    timer__insert(timer);
+}
+
+
+void timer__remove(struct mosquitto__timer *timer)
+{
+    if(timer->list){
+        DL_DELETE(*timer->list, timer);
+        timer->list = NULL;
+        timer->prev = NULL;
+        timer->next = NULL;
+    }
+}
+
+
+bool timer__pending(struct mosquitto__timer *timer)
+{
+    return timer->list != NULL;
+}
+
+
+void timer__check(struct mosquitto_db *db, time_t now)
+{
+    struct mosquitto__timer *timer;
+
+    if(current == 0){
+        current = now;
+        return;
+    }
+
+    while(current < now){
+        current++;
+
+        if((current & TIMER_MASK) == 0){
+            if(((current >> TIMER_BITS) & TIMER_MASK) == 0){
+                timer__cascade(&overflow);
+            }
+            timer__cascade(&wheel1[(current >> TIMER_BITS) & TIMER_MASK]);
+        }
+
+        /* Callbacks may add or remove any timer, including ones that are due
+         * this tick, so work from a separate list that they can delete from. */
+        firing = wheel0[current & TIMER_MASK];
+        wheel0[current & TIMER_MASK] = NULL;
+        DL_FOREACH(firing, timer){
+            timer->list = &firing;
+        }
+        while(firing){
+            timer = firing;
+            DL_DELETE(firing, timer);
+            timer->list = NULL;
+            timer->prev = NULL;
+            timer->next = NULL;
+            timer->callback(db, timer);
+        }
+    }
+}
@@ -240,6 +240,7 @@ static int callback_mqtt(struct libwebsocket_context *context,
             }
             mosq->sock = libwebsocket_get_socket_fd(wsi);
             HASH_ADD(hh_sock, db->contexts_by_sock, sock, sizeof(mosq->sock), mosq);
+            keepalive__add(mosq);
             break;
 
         case LWS_CALLBACK_CLOSED:
@@ -305,9 +306,7 @@ static int callback_mqtt(struct libwebsocket_context *context,
                     }
                     return 0;
                 }
-#ifdef WITH_SYS_TREE
-                g_bytes_sent += count;
-#endif
+                G_BYTES_SENT_INC(mosq, count);
                 packet->to_process -= count;
                 packet->pos += count;
                 if(packet->to_process > 0){
@@ -317,12 +316,10 @@ static int callback_mqtt(struct libwebsocket_context *context,
                     break;
                 }
 
-#ifdef WITH_SYS_TREE
-                g_msgs_sent++;
-                if(((packet->command)&0xF6) == CMD_PUBLISH){
-                    g_pub_msgs_sent++;
+                G_MSGS_SENT_INC(1);
+                if(((packet->command)&0xF0) == CMD_PUBLISH){
+                    G_PUB_MSGS_SENT_INC(mosq, 1);
                 }
-#endif
 
                 /* Free data and reset values */
                 mosq->current_out_packet = mosq->out_packet;
@@ -334,7 +331,7 @@ static int callback_mqtt(struct libwebsocket_context *context,
                 }
 
                 packet__cleanup(packet);
-                mosquitto__free(packet);
+                mosquitto__pool_free(&packet_pool, packet);
 
                 mosq->next_msg_out = mosquitto_time() + mosq->keepalive;
             }
@@ -353,7 +350,7 @@ static int callback_mqtt(struct libwebsocket_context *context,
             mosq = u->mosq;
             pos = 0;
             buf = (uint8_t *)in;
-            G_BYTES_RECEIVED_INC(len);
+            G_BYTES_RECEIVED_INC(mosq, len);
             while(pos < len){
                 if(!mosq->in_packet.command){
                     mosq->in_packet.command = buf[pos];
@@ -411,7 +408,7 @@ static int callback_mqtt(struct libwebsocket_context *context,
 #ifdef WITH_SYS_TREE
                 G_MSGS_RECEIVED_INC(1);
                 if(((mosq->in_packet.command)&0xF5) == CMD_PUBLISH){
-                    G_PUB_MSGS_RECEIVED_INC(1);
+                    G_PUB_MSGS_RECEIVED_INC(mosq, 1);
                 }
 #endif
                 rc = handle__packet(db, mosq);
@@ -662,6 +659,7 @@ static int callback_http(struct libwebsocket_context *context,
             HASH_FIND(hh_sock, db->contexts_by_sock, &pollargs->fd, sizeof(pollargs->fd), mosq);
             if(mosq && (pollargs->events & POLLOUT)){
                 mosq->ws_want_write = true;
+                worker__wake(mosq);
             }
             break;
 
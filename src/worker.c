@@ -0,0 +1,194 @@
+/*
+Copyright (c) 2020 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License v1.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   http://www.eclipse.org/legal/epl-v10.html
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+
+/* The broker is built against dummypthread.h so the per client mutexes in the
+ * shared library code compile away - all broker state is protected by
+ * db_mutex instead, which the main loop holds except while waiting in
+ * epoll. Threads of our own and of plugins take it before touching broker
+ * state, so need the real functions. */
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+
+static pthread_mutex_t db_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct mosquitto__worker main_worker;
+static int main_wakefd = -1;
+static __thread struct mosquitto__worker *current_worker = NULL;
+
+
+static int worker__wakefd_add(int epollfd, int *wakefd)
+{
+    struct epoll_event ev;
+
+    *wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(*wakefd == -1){
+        return 1;
+    }
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.data.fd = *wakefd;
+    ev.events = EPOLLIN;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, *wakefd, &ev) == -1){
+        close(*wakefd);
+        *wakefd = -1;
+        return 1;
+    }
+    return 0;
+}
+
+
+/* Called with db_mutex held, on the main thread. */
+int worker__start(struct mosquitto_db *db)
+{
+    current_worker = &main_worker;
+
+    /* Lets other threads wake the main loop from epoll_wait(), for plugins
+     * completing checks from threads of their own. */
+    if(worker__wakefd_add(db->epollfd, &main_wakefd)){
+        log__printf(NULL, MOSQ_LOG_ERR, "Error creating wake fd: %s", strerror(errno));
+        return MOSQ_ERR_UNKNOWN;
+    }
+
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+void worker__stop(struct mosquitto_db *db)
+{
+    UNUSED(db);
+
+    if(main_wakefd != -1){
+        close(main_wakefd);
+        main_wakefd = -1;
+    }
+    current_worker = NULL;
+}
+
+
+void worker__lock(void)
+{
+    pthread_mutex_lock(&db_mutex);
+}
+
+
+void worker__unlock(void)
+{
+    pthread_mutex_unlock(&db_mutex);
+}
+
+
+struct mosquitto__worker *worker__main(void)
+{
+    return &main_worker;
+}
+
+
+/* Put context on the dirty list of the main loop, so it calls
+ * loop__write_context() on it. May be called from any thread. */
+void worker__wake(struct mosquitto *context)
+{
+    struct mosquitto__worker *worker = &main_worker;
+    uint64_t u = 1;
+
+    if(context->sock == INVALID_SOCKET){
+        return;
+    }
+    if(__atomic_exchange_n(&context->wake_pending, true, __ATOMIC_ACQ_REL)){
+        /* Already queued */
+        return;
+    }
+
+    context->wake_next = __atomic_load_n(&worker->wake_list, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&worker->wake_list, &context->wake_next, context,
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+    }
+
+    if(worker != current_worker && main_wakefd != -1){
+        if(write(main_wakefd, &u, sizeof(u))){
+        }
+    }
+}
+
+
+bool worker__wake_waiting(struct mosquitto__worker *worker)
+{
+    return __atomic_load_n(&worker->wake_list, __ATOMIC_ACQUIRE) != NULL;
+}
+
+
+/* Move everything queued so far on to the private batch for this pass of the
+ * loop, restoring the order the clients were woken in. */
+void worker__wake_take(struct mosquitto__worker *worker)
+{
+    struct mosquitto *context, *next;
+
+    context = __atomic_exchange_n(&worker->wake_list, NULL, __ATOMIC_ACQ_REL);
+    while(context){
+        next = context->wake_next;
+        context->wake_next = worker->wake_batch;
+        worker->wake_batch = context;
+        context = next;
+    }
+}
+
+
+struct mosquitto *worker__wake_pop(struct mosquitto__worker *worker)
+{
+    struct mosquitto *context;
+
+    context = worker->wake_batch;
+    if(context){
+        worker->wake_batch = context->wake_next;
+        context->wake_next = NULL;
+        __atomic_store_n(&context->wake_pending, false, __ATOMIC_RELEASE);
+    }
+    return context;
+}
+
+
+void worker__wake_drain(int wakefd)
+{
+    uint64_t u;
+
+    if(read(wakefd, &u, sizeof(u))){
+    }
+}
+
+
+bool worker__is_main_wakefd(int fd)
+{
+    return main_wakefd != -1 && fd == main_wakefd;
+}
+
+
+/* Whether the calling thread is the main thread, which already holds db_mutex
+ * whenever it calls out to plugins. */
+bool worker__is_broker_thread(void)
+{
+    return current_worker != NULL;
+}
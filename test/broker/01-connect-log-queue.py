@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+
+# Test logging through the log thread with log_queue_size. Connection messages
+# should still be published on $SYS/broker/log/N and written to stderr,
+# including those logged as the broker exits.
+
+from mosq_test_helper import *
+import select
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("log_queue_size 16\n")
+        f.write("log_dest stderr\n")
+        f.write("log_dest topic\n")
+
+def expect_log(sock, text):
+    # The payload starts with a timestamp, so look for the text in whatever
+    # arrives on the log topic.
+    data = b""
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        (r, w, x) = select.select([sock], [], [], 0.1)
+        if r:
+            data += sock.recv(4096)
+            if text in data:
+                return True
+    print("FAIL: %s not logged to topic" % (text))
+    return False
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 10
+connect_packet = mosq_test.gen_connect("log-sub", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/log/N", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+other_connect_packet = mosq_test.gen_connect("log-other", keepalive=keepalive)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=10, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    other_sock = mosq_test.do_client_connect(other_connect_packet, connack_packet, timeout=10, port=port)
+    other_sock.close()
+
+    if expect_log(sock, b"as log-other"):
+        rc = 0
+
+    sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    stde = stde.decode('utf-8')
+    if "as log-other" not in stde or "terminating" not in stde:
+        print("FAIL: messages missing from stderr")
+        rc = 1
+    if rc:
+        print(stde)
+
+
+exit(rc)
@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+
+# Test whether PBKDF2 ($7$) and plain SHA512 ($6$) password file entries are
+# checked correctly, both on the thread that owns the client and on the
+# password check threads.
+
+from mosq_test_helper import *
+import base64
+import hashlib
+
+def write_config(filename, port, threads):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("password_file %s\n" % (filename.replace('.conf', '.pwfile')))
+        f.write("password_check_threads %d\n" % (threads))
+        f.write("allow_anonymous false\n")
+
+def pbkdf2_entry(username, password, iterations):
+    salt = os.urandom(12)
+    h = hashlib.pbkdf2_hmac('sha512', password.encode('utf-8'), salt, iterations)
+    return "%s:$7$%d$%s$%s\n" % (username, iterations,
+            base64.b64encode(salt).decode('utf-8'), base64.b64encode(h).decode('utf-8'))
+
+def write_pwfile(filename):
+    with open(filename, 'w') as f:
+        f.write(pbkdf2_entry("pbkdf2", "password", 1000))
+        # Only the first entry for a user is used.
+        f.write(pbkdf2_entry("pbkdf2", "second", 1000))
+        f.write(pbkdf2_entry("pbkdf2-one", "password", 1))
+        # Username user, password password
+        f.write("user:$6$LIg/OiUz2yPftClP$dQu0vVNqRHOcMOzDLuqv4e+5rTFW83DFm3s+C8fy9F7Ip73cdIGUlsNGBs4MtKWNjtMl8LnT+pIQZ7ic1ZttyQ==\n")
+        # Invalid iteration count, removed.
+        f.write("bad-iterations:$7$0$LIg/OiUz2yPftClP$dQu0vVNqRHOcMOzDLuqv4e+5rTFW83DFm3s+C8fy9F7Ip73cdIGUlsNGBs4MtKWNjtMl8LnT+pIQZ7ic1ZttyQ==\n")
+
+def do_test(port, connack_rc, username, password):
+    connect_packet = mosq_test.gen_connect("pbkdf2-test", keepalive=10, username=username, password=password)
+    connack_packet = mosq_test.gen_connack(rc=connack_rc)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    sock.close()
+
+def all_tests(threads):
+    rc = 1
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    pw_file = os.path.basename(__file__).replace('.py', '.pwfile')
+    write_config(conf_file, port, threads)
+    write_pwfile(pw_file)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        do_test(port, 0, "pbkdf2", "password")
+        do_test(port, 5, "pbkdf2", "second")
+        do_test(port, 5, "pbkdf2", "bad")
+        do_test(port, 0, "pbkdf2-one", "password")
+        do_test(port, 5, "pbkdf2-one", "bad")
+        do_test(port, 0, "user", "password")
+        do_test(port, 5, "user", "bad")
+        do_test(port, 5, "bad-iterations", "password")
+        do_test(port, 5, "missing", "password")
+        rc = 0
+    finally:
+        os.remove(conf_file)
+        os.remove(pw_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+all_tests(0)
+all_tests(2)
+exit(0)
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+
+# Test whether the subscription match cache is kept up to date when
+# subscriptions are added and removed.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("subscription_cache_size 10\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 60
+connect1_packet = mosq_test.gen_connect("subpub-cache-1", keepalive=keepalive)
+connect2_packet = mosq_test.gen_connect("subpub-cache-2", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe1_packet = mosq_test.gen_subscribe(mid, "cache/+/a", 0)
+suback1_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 2
+subscribe2_packet = mosq_test.gen_subscribe(mid, "cache/x/a", 0)
+suback2_packet = mosq_test.gen_suback(mid, 0)
+
+mid = 3
+unsubscribe1_packet = mosq_test.gen_unsubscribe(mid, "cache/+/a")
+unsuback1_packet = mosq_test.gen_unsuback(mid)
+
+publish_packet = mosq_test.gen_publish("cache/x/a", qos=0, payload="message")
+
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock1 = mosq_test.do_client_connect(connect1_packet, connack_packet, timeout=20, port=port)
+    sock2 = mosq_test.do_client_connect(connect2_packet, connack_packet, timeout=20, port=port)
+
+    mosq_test.do_send_receive(sock1, subscribe1_packet, suback1_packet, "suback1")
+
+    # First publish fills the cache, second uses it.
+    sock2.send(publish_packet)
+    mosq_test.expect_packet(sock1, "publish1", publish_packet)
+    sock2.send(publish_packet)
+    mosq_test.expect_packet(sock1, "publish2", publish_packet)
+
+    # New subscription must be seen
+    mosq_test.do_send_receive(sock2, subscribe2_packet, suback2_packet, "suback2")
+    sock1.send(publish_packet)
+    mosq_test.expect_packet(sock1, "publish3", publish_packet)
+    mosq_test.expect_packet(sock2, "publish4", publish_packet)
+
+    # Removed subscription must not be delivered to
+    mosq_test.do_send_receive(sock1, unsubscribe1_packet, unsuback1_packet, "unsuback1")
+    sock2.send(publish_packet)
+    mosq_test.expect_packet(sock2, "publish5", publish_packet)
+    mosq_test.do_send_receive(sock1, pingreq_packet, pingresp_packet, "pingresp")
+
+    rc = 0
+
+    sock2.close()
+    sock1.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
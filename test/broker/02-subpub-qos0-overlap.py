@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+
+# Test whether clients with overlapping subscriptions receive each message only
+# once when allow_duplicate_messages is false, which is the default.
+
+from mosq_test_helper import *
+
+def do_test():
+    rc = 1
+    keepalive = 60
+    connect1_packet = mosq_test.gen_connect("overlap-1", keepalive=keepalive)
+    connect2_packet = mosq_test.gen_connect("overlap-2", keepalive=keepalive)
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    subscribe1_packet = mosq_test.gen_subscribe(1, "overlap/a", 0)
+    suback1_packet = mosq_test.gen_suback(1, 0)
+    subscribe2_packet = mosq_test.gen_subscribe(2, "overlap/+", 0)
+    suback2_packet = mosq_test.gen_suback(2, 0)
+    subscribe3_packet = mosq_test.gen_subscribe(3, "overlap/#", 0)
+    suback3_packet = mosq_test.gen_suback(3, 0)
+
+    publish1_packet = mosq_test.gen_publish("overlap/a", qos=0, payload="message1")
+    publish2_packet = mosq_test.gen_publish("overlap/a", qos=0, payload="message2")
+
+    pingreq_packet = mosq_test.gen_pingreq()
+    pingresp_packet = mosq_test.gen_pingresp()
+
+    port = mosq_test.get_port()
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port)
+
+    try:
+        sock1 = mosq_test.do_client_connect(connect1_packet, connack_packet, timeout=20, port=port)
+        sock2 = mosq_test.do_client_connect(connect2_packet, connack_packet, timeout=20, port=port)
+
+        for sock in [sock1, sock2]:
+            mosq_test.do_send_receive(sock, subscribe1_packet, suback1_packet, "suback1")
+            mosq_test.do_send_receive(sock, subscribe2_packet, suback2_packet, "suback2")
+            mosq_test.do_send_receive(sock, subscribe3_packet, suback3_packet, "suback3")
+
+        sock1.send(publish1_packet)
+        sock1.send(publish2_packet)
+
+        for sock in [sock1, sock2]:
+            mosq_test.expect_packet(sock, "publish1", publish1_packet)
+            mosq_test.expect_packet(sock, "publish2", publish2_packet)
+            # A duplicate would arrive before the PINGRESP
+            mosq_test.do_send_receive(sock, pingreq_packet, pingresp_packet, "pingresp")
+
+        rc = 0
+
+        sock1.close()
+        sock2.close()
+    finally:
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
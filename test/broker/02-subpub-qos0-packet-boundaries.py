@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+
+# Test whether the broker copes with packets arriving in unusual pieces:
+# several packets in one read, packets split part way through, packets sent
+# a byte at a time, and packets that are larger than the receive buffer.
+
+from mosq_test_helper import *
+import time
+
+rc = 1
+keepalive = 60
+connect1_packet = mosq_test.gen_connect("subpub-boundaries-1", keepalive=keepalive)
+connect2_packet = mosq_test.gen_connect("subpub-boundaries-2", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "boundaries/#", 0)
+suback_packet = mosq_test.gen_suback(mid, 0)
+
+publish1_packet = mosq_test.gen_publish("boundaries/1", qos=0, payload="message1")
+publish2_packet = mosq_test.gen_publish("boundaries/2", qos=0, payload="message2")
+publish3_packet = mosq_test.gen_publish("boundaries/3", qos=0, payload="message3")
+publish4_packet = mosq_test.gen_publish("boundaries/4", qos=0, payload="message4"*100)
+publish5_packet = mosq_test.gen_publish("boundaries/5", qos=0, payload="message5"*5000)
+
+pingreq_packet = mosq_test.gen_pingreq()
+pingresp_packet = mosq_test.gen_pingresp()
+
+port = mosq_test.get_port()
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port)
+
+try:
+    sock1 = mosq_test.do_client_connect(connect1_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock1, subscribe_packet, suback_packet, "suback")
+
+    # Several packets in one go, starting with CONNECT.
+    sock2 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock2.settimeout(20)
+    sock2.connect(("localhost", port))
+    sock2.send(connect2_packet + publish1_packet + publish2_packet + pingreq_packet)
+    mosq_test.expect_packet(sock2, "connack", connack_packet)
+    mosq_test.expect_packet(sock2, "pingresp1", pingresp_packet)
+    mosq_test.expect_packet(sock1, "publish1", publish1_packet)
+    mosq_test.expect_packet(sock1, "publish2", publish2_packet)
+
+    # A byte at a time.
+    for i in range(len(publish3_packet)):
+        sock2.send(publish3_packet[i:i+1])
+        time.sleep(0.01)
+    mosq_test.expect_packet(sock1, "publish3", publish3_packet)
+
+    # A packet split part way through its remaining length, then the rest of
+    # it followed by another packet.
+    sock2.send(publish4_packet[0:2])
+    time.sleep(0.1)
+    sock2.send(publish4_packet[2:] + pingreq_packet)
+    mosq_test.expect_packet(sock2, "pingresp2", pingresp_packet)
+    mosq_test.expect_packet(sock1, "publish4", publish4_packet)
+
+    # A packet bigger than the receive buffer, with another packet straight
+    # after it.
+    sock2.send(publish5_packet[0:3000])
+    time.sleep(0.1)
+    sock2.send(publish5_packet[3000:] + pingreq_packet)
+    mosq_test.expect_packet(sock2, "pingresp3", pingresp_packet)
+    mosq_test.expect_packet(sock1, "publish5", publish5_packet)
+
+    mosq_test.do_send_receive(sock1, pingreq_packet, pingresp_packet, "pingresp4")
+
+    rc = 0
+
+    sock2.close()
+    sock1.close()
+finally:
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
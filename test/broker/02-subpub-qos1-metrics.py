@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+
+# Test the metrics_listener endpoint. After a QoS 1 message has been passed
+# from one client to another, a GET should give the broker and per listener
+# counters and the histograms in the Prometheus text format. Anything other
+# than a GET is refused, and connections that never finish their request are
+# closed so they can't use up every slot.
+
+from mosq_test_helper import *
+
+def write_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port1))
+        f.write("metrics_listener %d\n" % (port2))
+        f.write("sys_interval 0\n")
+
+def http_request(port, method):
+    sock = socket.create_connection(("localhost", port), timeout=10)
+    sock.send(("%s /metrics HTTP/1.0\r\nHost: localhost\r\n\r\n" % (method)).encode('utf-8'))
+    response = b""
+    while True:
+        data = sock.recv(4096)
+        if not data:
+            break
+        response += data
+    sock.close()
+    (header, body) = response.decode('utf-8').split("\r\n\r\n", 1)
+    return (header.split("\r\n")[0], body)
+
+def parse_metrics(body):
+    samples = {}
+    for line in body.splitlines():
+        if line.startswith("#") or line == "":
+            continue
+        (name, value) = line.rsplit(" ", 1)
+        samples[name] = float(value)
+    return samples
+
+def expect_value(samples, name, value):
+    if samples.get(name) != value:
+        raise ValueError("%s: expected %s, got %s" % (name, value, samples.get(name)))
+
+(port1, port2) = mosq_test.get_port(2)
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port1, port2)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("metrics-sub", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "metrics/qos1", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+pub_connect_packet = mosq_test.gen_connect("metrics-pub", keepalive=keepalive)
+publish_packet = mosq_test.gen_publish("metrics/qos1", qos=1, mid=1, payload="message")
+puback_packet = mosq_test.gen_puback(1)
+publish_recv_packet = mosq_test.gen_publish("metrics/qos1", qos=1, mid=1, payload="message")
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port1)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=10, port=port1)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=10, port=port1)
+    mosq_test.do_send_receive(pub_sock, publish_packet, puback_packet, "puback")
+
+    if mosq_test.expect_packet(sock, "publish", publish_recv_packet):
+        sock.send(puback_packet)
+        mosq_test.do_ping(sock)
+
+        (status, body) = http_request(port2, "GET")
+        if status != "HTTP/1.0 200 OK":
+            raise ValueError("GET: %s" % (status))
+
+        samples = parse_metrics(body)
+        listener = '{listener="0",port="%d"}' % (port1)
+        expect_value(samples, "mosquitto_publish_messages_received_total", 1)
+        expect_value(samples, "mosquitto_publish_messages_sent_total", 1)
+        expect_value(samples, "mosquitto_publish_bytes_received_total", 7)
+        expect_value(samples, "mosquitto_connections_total", 2)
+        expect_value(samples, "mosquitto_listener_publish_messages_received_total" + listener, 1)
+        expect_value(samples, "mosquitto_listener_connections_total" + listener, 2)
+        expect_value(samples, "mosquitto_listener_clients" + listener, 2)
+        expect_value(samples, "mosquitto_clients_connected", 2)
+        expect_value(samples, "mosquitto_subscriptions", 1)
+        expect_value(samples, "mosquitto_publish_delivery_latency_seconds_count", 1)
+        expect_value(samples, 'mosquitto_publish_delivery_latency_seconds_bucket{le="+Inf"}', 1)
+        expect_value(samples, "mosquitto_client_queue_depth_messages_count", 1)
+        expect_value(samples, 'mosquitto_client_queue_depth_messages_bucket{le="1"}', 1)
+        if samples.get("mosquitto_loop_duration_seconds_count", 0) < 1:
+            raise ValueError("no loop iterations recorded")
+
+        (status, body) = http_request(port2, "POST")
+        if status != "HTTP/1.0 405 Method Not Allowed":
+            raise ValueError("POST: %s" % (status))
+
+        idle_socks = []
+        for i in range(8):
+            idle_sock = socket.create_connection(("localhost", port2), timeout=10)
+            idle_sock.send(b"GET /metrics HTTP/1.0\r\n")
+            idle_socks.append(idle_sock)
+        time.sleep(7)
+        (status, body) = http_request(port2, "GET")
+        for idle_sock in idle_socks:
+            idle_sock.close()
+        if status != "HTTP/1.0 200 OK":
+            raise ValueError("GET after idle connections: %s" % (status))
+
+        rc = 0
+
+    sock.close()
+    pub_sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+
+exit(rc)
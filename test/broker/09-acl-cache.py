@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+
+# Check that cached ACL results are used, and are forgotten when the ACLs are
+# reloaded, for a client that stays connected throughout.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+        f.write("acl_cache_size 100\n")
+
+def write_acl(filename, en):
+    with open(filename, 'w') as f:
+        f.write('user username\n')
+        f.write('topic readwrite topic/one\n')
+        if en:
+            f.write('topic readwrite topic/two\n')
+
+def publish_receive(sock, topic, mid, payload):
+    publish_packet = mosq_test.gen_publish(topic=topic, mid=mid, qos=1, payload=payload)
+    puback_packet = mosq_test.gen_puback(mid)
+    mosq_test.do_send_receive(sock, publish_packet, puback_packet, "puback%d" % (mid))
+    mosq_test.expect_packet(sock, "publish%d" % (mid), publish_packet)
+    sock.send(puback_packet)
+
+keepalive = 60
+connect_packet = mosq_test.gen_connect("acl-cache", keepalive=keepalive, username="username")
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid=mid, topic="topic/#", qos=1)
+suback_packet = mosq_test.gen_suback(mid=mid, qos=1)
+
+mid = 10
+publish_denied_packet = mosq_test.gen_publish(topic="topic/two", mid=mid, qos=1, payload="denied")
+puback_denied_packet = mosq_test.gen_puback(mid)
+
+rc = 1
+
+port = mosq_test.get_port()
+
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+acl_file = os.path.basename(__file__).replace('.py', '.acl')
+write_acl(acl_file, True)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    # The second publish to each topic is answered from the cache. That can't
+    # be seen from here, 09-plugin-acl-cache.py checks it.
+    publish_receive(sock, "topic/one", 1, "message1")
+    publish_receive(sock, "topic/two", 2, "message2")
+    publish_receive(sock, "topic/one", 3, "message3")
+    publish_receive(sock, "topic/two", 4, "message4")
+
+    # Reload ACLs with topic/two now disabled
+    write_acl(acl_file, False)
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(0.5)
+
+    publish_receive(sock, "topic/one", 5, "message5")
+
+    # The cached result for topic/two must not be used.
+    mosq_test.do_send_receive(sock, publish_denied_packet, puback_denied_packet, "puback denied")
+    mosq_test.do_ping(sock)
+
+    sock.close()
+    rc = 0
+
+finally:
+    os.remove(conf_file)
+    os.remove(acl_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
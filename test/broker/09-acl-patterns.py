@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+
+# Check pattern and wildcard ACLs, including client ids that span more than one
+# topic level when substituted.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("acl_file %s\n" % (filename.replace('.conf', '.acl')))
+
+def write_acl(filename):
+    with open(filename, 'w') as f:
+        f.write('topic readwrite open/#\n')
+        f.write('topic readwrite +/wild\n')
+        f.write('pattern readwrite clients/%c/#\n')
+        f.write('pattern readwrite users/%u-%c\n')
+
+def single_test(port, client_id, username, topic, expect_deny):
+    rc = 1
+
+    keepalive = 60
+    connect_packet = mosq_test.gen_connect(client_id, keepalive=keepalive, username=username)
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    mid = 1
+    subscribe_packet = mosq_test.gen_subscribe(mid=mid, topic=topic, qos=1)
+    suback_packet = mosq_test.gen_suback(mid=mid, qos=1)
+
+    mid = 2
+    publish1s_packet = mosq_test.gen_publish(topic=topic, mid=mid, qos=1, payload="message")
+    puback1s_packet = mosq_test.gen_puback(mid)
+
+    mid = 1
+    publish1r_packet = mosq_test.gen_publish(topic=topic, mid=mid, qos=1, payload="message")
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    mosq_test.do_send_receive(sock, publish1s_packet, puback1s_packet, "puback")
+    if expect_deny:
+        mosq_test.do_ping(sock)
+    else:
+        mosq_test.expect_packet(sock, "publish1r", publish1r_packet)
+    sock.close()
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+acl_file = os.path.basename(__file__).replace('.py', '.acl')
+write_config(conf_file, port)
+write_acl(acl_file)
+
+rc = 1
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    # "open/#" also matches "open".
+    single_test(port, "acl-check", None, "open", expect_deny=False)
+    single_test(port, "acl-check", None, "open/a/b", expect_deny=False)
+    single_test(port, "acl-check", None, "opened", expect_deny=True)
+
+    # "+" matches an empty level, but not a topic beginning with $.
+    single_test(port, "acl-check", None, "/wild", expect_deny=False)
+    single_test(port, "acl-check", None, "$x/wild", expect_deny=True)
+
+    single_test(port, "acl-check", None, "clients/acl-check", expect_deny=False)
+    single_test(port, "acl-check", None, "clients/acl-check/a", expect_deny=False)
+    single_test(port, "acl-check", None, "clients/other", expect_deny=True)
+    single_test(port, "acl-check", None, "clients/acl-check-2", expect_deny=True)
+
+    # A client id containing '/' covers more than one level.
+    single_test(port, "multi/level", None, "clients/multi/level/a", expect_deny=False)
+    single_test(port, "multi/level", None, "clients/multi", expect_deny=True)
+
+    single_test(port, "acl-check", "user", "users/user-acl-check", expect_deny=False)
+    single_test(port, "acl-check", "user", "users/other-acl-check", expect_deny=True)
+    single_test(port, "acl-check", None, "users/-acl-check", expect_deny=True)
+
+    rc = 0
+finally:
+    os.remove(conf_file)
+    os.remove(acl_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+
+# Check that ACL results from a plugin are cached for each topic, QoS and
+# retain flag, and are forgotten when the plugin calls
+# mosquitto_acl_cache_clear() or changes the username of the client. The
+# plugin only allows the first publish check for each topic, so a repeated
+# publish is only delivered if it was answered from the cache.
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("auth_plugin c/auth_plugin_acl_cache.so\n")
+        f.write("acl_cache_size 100\n")
+
+def publish(topic, qos, retain):
+    global pub_mid
+    pub_mid += 1
+    publish_packet = mosq_test.gen_publish(topic=topic, mid=pub_mid, qos=qos, retain=retain, payload="message")
+    if qos == 1:
+        puback_packet = mosq_test.gen_puback(pub_mid)
+        mosq_test.do_send_receive(pub_sock, publish_packet, puback_packet, "puback%d" % (pub_mid))
+    else:
+        pub_sock.send(publish_packet)
+        mosq_test.do_ping(pub_sock)
+
+def allowed(topic, qos=1, retain=False):
+    global sub_mid
+    publish(topic, qos, retain)
+    sub_mid += 1
+    publish_packet = mosq_test.gen_publish(topic=topic, mid=sub_mid, qos=1, payload="message")
+    mosq_test.expect_packet(sub_sock, "publish%d" % (sub_mid), publish_packet)
+    sub_sock.send(mosq_test.gen_puback(sub_mid))
+
+def denied(topic, qos=1, retain=False):
+    publish(topic, qos, retain)
+    mosq_test.do_ping(sub_sock)
+
+rc = 1
+keepalive = 60
+pub_mid = 0
+sub_mid = 0
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    connect_packet = mosq_test.gen_connect("acl-cache-sub", keepalive=keepalive)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    sub_sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+
+    subscribe_packet = mosq_test.gen_subscribe(mid=1, topic="topic/#", qos=1)
+    suback_packet = mosq_test.gen_suback(mid=1, qos=1)
+    mosq_test.do_send_receive(sub_sock, subscribe_packet, suback_packet, "suback")
+
+    connect_packet = mosq_test.gen_connect("acl-cache-pub", keepalive=keepalive)
+    pub_sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+
+    # First check asks the plugin, the second is answered from the cache.
+    allowed("topic/one")
+    allowed("topic/one")
+
+    # A different retain flag or QoS is a separate cache entry, so the plugin
+    # is asked again.
+    denied("topic/one", retain=True)
+    denied("topic/one", qos=0)
+    allowed("topic/one")
+
+    # The plugin clears the cache for this client.
+    publish("cache/clear", 1, False)
+    denied("topic/one")
+
+    allowed("topic/two")
+    allowed("topic/two")
+
+    # The plugin changes the username of this client, which clears the cache.
+    publish("cache/rename", 1, False)
+    denied("topic/two")
+
+    sub_sock.close()
+    pub_sock.close()
+    rc = 0
+
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+
+# Test a version 5 plugin that answers checks later with
+# mosquitto_unpwd_check_complete() and mosquitto_acl_check_complete(). Clients
+# waiting for an answer should have their packets held in order, and other
+# clients should be served in the meantime.
+
+from mosq_test_helper import *
+import select
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("auth_plugin c/auth_plugin_v5_pending.so\n")
+        f.write("allow_anonymous false\n")
+
+def assert_held(sock):
+    (r, w, x) = select.select([sock], [], [], 0.1)
+    if r:
+        raise ValueError("expected no reply yet")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 10
+connect_good_packet = mosq_test.gen_connect("pending-good", keepalive=keepalive, username="pending", password="good")
+connack_good_packet = mosq_test.gen_connack(rc=0)
+
+connect_bad_packet = mosq_test.gen_connect("pending-bad", keepalive=keepalive, username="pending", password="bad")
+connack_bad_packet = mosq_test.gen_connack(rc=5)
+
+connect_other_packet = mosq_test.gen_connect("other", keepalive=keepalive, username="other")
+connack_other_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "pending/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+publish_allow_packet = mosq_test.gen_publish("pending/allow", qos=1, mid=1, payload="allow")
+puback_allow_packet = mosq_test.gen_puback(1)
+publish_after_packet = mosq_test.gen_publish("pending/after", qos=1, mid=2, payload="after")
+puback_after_packet = mosq_test.gen_puback(2)
+publish_deny_packet = mosq_test.gen_publish("pending/deny", qos=1, mid=3, payload="deny")
+puback_deny_packet = mosq_test.gen_puback(3)
+publish_last_packet = mosq_test.gen_publish("pending/last", qos=1, mid=4, payload="last")
+puback_last_packet = mosq_test.gen_puback(4)
+
+publish_allow_recv_packet = mosq_test.gen_publish("pending/allow", qos=1, mid=1, payload="allow")
+puback_allow_recv_packet = mosq_test.gen_puback(1)
+publish_after_recv_packet = mosq_test.gen_publish("pending/after", qos=1, mid=2, payload="after")
+puback_after_recv_packet = mosq_test.gen_puback(2)
+publish_last_recv_packet = mosq_test.gen_publish("pending/last", qos=1, mid=3, payload="last")
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    # Connect with the password check pending, another client connects and
+    # is served while it waits.
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    sock.settimeout(10)
+    sock.connect(("localhost", port))
+    sock.send(connect_good_packet)
+
+    sock_other = mosq_test.do_client_connect(connect_other_packet, connack_other_packet, timeout=10, port=port)
+    mosq_test.do_send_receive(sock_other, subscribe_packet, suback_packet, "suback")
+    assert_held(sock)
+
+    if mosq_test.expect_packet(sock, "connack good", connack_good_packet):
+        sock_bad = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock_bad.settimeout(10)
+        sock_bad.connect(("localhost", port))
+        sock_bad.send(connect_bad_packet)
+        mosq_test.do_ping(sock_other)
+        if mosq_test.expect_packet(sock_bad, "connack bad", connack_bad_packet):
+            sock_bad.close()
+
+            # The second publish needs no waiting, but mustn't overtake the
+            # first.
+            sock.send(publish_allow_packet + publish_after_packet)
+            mosq_test.do_ping(sock_other)
+            assert_held(sock)
+
+            if mosq_test.expect_packet(sock, "puback allow", puback_allow_packet) \
+                    and mosq_test.expect_packet(sock, "puback after", puback_after_packet) \
+                    and mosq_test.expect_packet(sock_other, "publish allow", publish_allow_recv_packet):
+
+                sock_other.send(puback_allow_recv_packet)
+                if mosq_test.expect_packet(sock_other, "publish after", publish_after_recv_packet):
+                    sock_other.send(puback_after_recv_packet)
+
+                    # A denied publish is still acknowledged, but not
+                    # delivered.
+                    sock.send(publish_deny_packet)
+                    if mosq_test.expect_packet(sock, "puback deny", puback_deny_packet):
+                        mosq_test.do_send_receive(sock, publish_last_packet, puback_last_packet, "puback last")
+                        if mosq_test.expect_packet(sock_other, "publish last", publish_last_recv_packet):
+                            rc = 0
+
+    sock.close()
+    sock_other.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+
+exit(rc)
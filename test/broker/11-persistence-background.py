@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+
+# Test whether autosaves written in the background by a forked child can be
+# restored, and are reported in $SYS.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("persistence true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("autosave_background true\n")
+        f.write("autosave_interval 1\n")
+        f.write("sys_interval 1\n")
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+db_file = 'mosquitto-%d.db' % (port)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistence-background-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+connack_packet2 = mosq_test.gen_connack(rc=0, flags=1)  # session present
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "background/queued", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+pub_connect_packet = mosq_test.gen_connect("persistence-background-pub", keepalive=keepalive)
+
+mid = 2
+publish_packet = mosq_test.gen_publish("background/queued", qos=1, mid=mid, payload="queued message")
+puback_packet = mosq_test.gen_puback(mid)
+
+mid = 1
+publish_packet2 = mosq_test.gen_publish("background/queued", qos=1, mid=mid, payload="queued message")
+
+sys_connect_packet = mosq_test.gen_connect("persistence-background-sys", keepalive=keepalive)
+mid = 3
+sys_subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/persistence/last save/bytes", 0)
+sys_suback_packet = mosq_test.gen_suback(mid, 0)
+
+if os.path.exists(db_file):
+    os.unlink(db_file)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    sock.close()
+
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(pub_sock, publish_packet, puback_packet, "puback")
+    pub_sock.close()
+
+    # Wait for at least one complete background save after the publish, and
+    # for $SYS to be updated.
+    time.sleep(5)
+
+    sys_publish_packet = mosq_test.gen_publish("$SYS/broker/persistence/last save/bytes", qos=0,
+            payload=str(os.path.getsize(db_file)), retain=True)
+    sys_sock = mosq_test.do_client_connect(sys_connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sys_sock, sys_subscribe_packet, sys_suback_packet, "suback sys")
+    mosq_test.expect_packet(sys_sock, "sys publish", sys_publish_packet)
+    sys_sock.close()
+
+    broker.send_signal(signal.SIGKILL)
+    broker.wait()
+    broker.communicate()
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet2, timeout=20, port=port)
+    if mosq_test.expect_packet(sock, "publish2", publish_packet2):
+        rc = 0
+
+    sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+    if os.path.exists(db_file):
+        os.unlink(db_file)
+
+
+exit(rc)
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+
+# Test whether persistent sessions and retained messages are restored from the
+# persistence journal when the broker is killed before writing its database.
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port))
+        f.write("persistence true\n")
+        f.write("persistence_journal true\n")
+        f.write("persistence_file mosquitto-%d.db\n" % (port))
+        f.write("autosave_on_changes true\n")
+        f.write("autosave_interval 1\n")
+
+def cleanup(port):
+    for f in ['mosquitto-%d.db' % (port), 'mosquitto-%d.db.journal' % (port)]:
+        if os.path.exists(f):
+            os.unlink(f)
+
+port = mosq_test.get_port()
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("persistence-journal-test", keepalive=keepalive, clean_session=False)
+connack_packet = mosq_test.gen_connack(rc=0)
+connack_packet2 = mosq_test.gen_connack(rc=0, flags=1)  # session present
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "journal/queued", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+pub_connect_packet = mosq_test.gen_connect("persistence-journal-pub", keepalive=keepalive)
+
+mid = 2
+publish_packet = mosq_test.gen_publish("journal/queued", qos=1, mid=mid, payload="queued message")
+puback_packet = mosq_test.gen_puback(mid)
+
+mid = 3
+retain_packet = mosq_test.gen_publish("journal/retain", qos=1, mid=mid, payload="retained message", retain=True)
+retain_puback_packet = mosq_test.gen_puback(mid)
+
+mid = 4
+clear_packet = mosq_test.gen_publish("journal/cleared", qos=1, mid=mid, payload="cleared message", retain=True)
+clear_puback_packet = mosq_test.gen_puback(mid)
+mid = 5
+clear2_packet = mosq_test.gen_publish("journal/cleared", qos=1, mid=mid, payload="", retain=True)
+clear2_puback_packet = mosq_test.gen_puback(mid)
+
+mid = 1
+publish_packet2 = mosq_test.gen_publish("journal/queued", qos=1, mid=mid, payload="queued message")
+puback_packet2 = mosq_test.gen_puback(mid)
+
+mid = 6
+subscribe_retain_packet = mosq_test.gen_subscribe(mid, "journal/+", 0)
+suback_retain_packet = mosq_test.gen_suback(mid, 0)
+retained_packet = mosq_test.gen_publish("journal/retain", qos=0, payload="retained message", retain=True)
+
+cleanup(port)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+try:
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    sock.close()
+
+    pub_sock = mosq_test.do_client_connect(pub_connect_packet, connack_packet, timeout=20, port=port)
+    mosq_test.do_send_receive(pub_sock, publish_packet, puback_packet, "puback")
+    mosq_test.do_send_receive(pub_sock, retain_packet, retain_puback_packet, "puback retain")
+    mosq_test.do_send_receive(pub_sock, clear_packet, clear_puback_packet, "puback clear")
+    mosq_test.do_send_receive(pub_sock, clear2_packet, clear2_puback_packet, "puback clear2")
+    pub_sock.close()
+
+    # Give the broker a chance to sync the journal, then kill it before it
+    # can save its database.
+    time.sleep(0.5)
+    broker.send_signal(signal.SIGKILL)
+    broker.wait()
+    broker.communicate()
+
+    if os.path.exists('mosquitto-%d.db' % (port)):
+        raise ValueError("database written before shutdown")
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet2, timeout=20, port=port)
+    mosq_test.expect_packet(sock, "publish2", publish_packet2)
+    sock.send(puback_packet2)
+    mosq_test.do_send_receive(sock, subscribe_retain_packet, suback_retain_packet, "suback retain")
+    if mosq_test.expect_packet(sock, "retained", retained_packet):
+        rc = 0
+
+    sock.close()
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+    cleanup(port)
+
+
+exit(rc)
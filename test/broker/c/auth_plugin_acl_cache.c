@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <string.h>
+#include <mosquitto.h>
+#include <mosquitto_broker.h>
+#include <mosquitto_plugin.h>
+
+/* Counts the publish checks made for each topic, and only allows the first
+ * one. A publish that is allowed a second time must have been answered from
+ * the broker's ACL cache. */
+
+#define MAX_TOPICS 20
+
+static char topics[MAX_TOPICS][100];
+static int counts[MAX_TOPICS];
+
+static int check_count(const char *topic)
+{
+	int i;
+
+	for(i=0; i<MAX_TOPICS; i++){
+		if(topics[i][0] == '\0'){
+			snprintf(topics[i], sizeof(topics[i]), "%s", topic);
+		}
+		if(!strcmp(topics[i], topic)){
+			counts[i]++;
+			return counts[i];
+		}
+	}
+	return MAX_TOPICS;
+}
+
+int mosquitto_auth_plugin_version(void)
+{
+	return MOSQ_AUTH_PLUGIN_VERSION;
+}
+
+int mosquitto_auth_plugin_init(void **user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_plugin_cleanup(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_init(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_acl_check(void *user_data, int access, struct mosquitto *client, const struct mosquitto_acl_msg *msg)
+{
+	if(access != MOSQ_ACL_WRITE){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(!strcmp(msg->topic, "cache/clear")){
+		mosquitto_acl_cache_clear(client);
+		return MOSQ_ERR_SUCCESS;
+	}else if(!strcmp(msg->topic, "cache/rename")){
+		mosquitto_set_username(client, "renamed");
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(check_count(msg->topic) == 1){
+		return MOSQ_ERR_SUCCESS;
+	}else{
+		return MOSQ_ERR_ACL_DENIED;
+	}
+}
+
+int mosquitto_auth_unpwd_check(void *user_data, struct mosquitto *client, const char *username, const char *password)
+{
+	return MOSQ_ERR_PLUGIN_DEFER;
+}
+
+int mosquitto_auth_psk_key_get(void *user_data, struct mosquitto *client, const char *hint, const char *identity, char *key, int max_key_len)
+{
+	return MOSQ_ERR_AUTH;
+}
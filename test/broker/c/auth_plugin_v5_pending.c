@@ -0,0 +1,103 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mosquitto.h>
+#include <mosquitto_broker.h>
+#include <mosquitto_plugin.h>
+
+/* Answers checks for the "pending" user, and publishes to pending/allow and
+ * pending/deny, from a thread of its own after a delay. */
+
+struct answer {
+	struct mosquitto *client;
+	int result;
+	bool acl;
+};
+
+static void *answer_thread(void *arg)
+{
+	struct answer *a = arg;
+
+	usleep(500000);
+	if(a->acl){
+		mosquitto_acl_check_complete(a->client, a->result);
+	}else{
+		mosquitto_unpwd_check_complete(a->client, a->result);
+	}
+	free(a);
+	return NULL;
+}
+
+static int answer_later(struct mosquitto *client, int result, bool acl)
+{
+	struct answer *a;
+	pthread_t thread;
+
+	a = malloc(sizeof(struct answer));
+	if(!a) return MOSQ_ERR_NOMEM;
+
+	a->client = client;
+	a->result = result;
+	a->acl = acl;
+	if(pthread_create(&thread, NULL, answer_thread, a)){
+		free(a);
+		return MOSQ_ERR_UNKNOWN;
+	}
+	pthread_detach(thread);
+	return MOSQ_ERR_PLUGIN_PENDING;
+}
+
+int mosquitto_auth_plugin_version(void)
+{
+	return 5;
+}
+
+int mosquitto_auth_plugin_init(void **user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_plugin_cleanup(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_init(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_security_cleanup(void *user_data, struct mosquitto_opt *auth_opts, int auth_opt_count, bool reload)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_acl_check(void *user_data, int access, struct mosquitto *client, const struct mosquitto_acl_msg *msg)
+{
+	if(access == MOSQ_ACL_WRITE){
+		if(!strcmp(msg->topic, "pending/allow")){
+			return answer_later(client, MOSQ_ERR_SUCCESS, true);
+		}else if(!strcmp(msg->topic, "pending/deny")){
+			return answer_later(client, MOSQ_ERR_ACL_DENIED, true);
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_unpwd_check(void *user_data, struct mosquitto *client, const char *username, const char *password)
+{
+	if(username && !strcmp(username, "pending")){
+		if(password && !strcmp(password, "good")){
+			return answer_later(client, MOSQ_ERR_SUCCESS, false);
+		}else{
+			return answer_later(client, MOSQ_ERR_AUTH, false);
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_auth_psk_key_get(void *user_data, struct mosquitto *client, const char *hint, const char *identity, char *key, int max_key_len)
+{
+	return MOSQ_ERR_AUTH;
+}
@@ -16,6 +16,7 @@ tests = [
     (1, './01-connect-invalid-id-utf8.py'),
     (1, './01-connect-invalid-protonum.py'),
     (1, './01-connect-invalid-reserved.py'),
+    (1, './01-connect-log-queue.py'),
     (1, './01-connect-success-v5.py'),
     (1, './01-connect-success.py'),
     (1, './01-connect-uname-invalid-utf8.py'),
@@ -23,13 +24,17 @@ tests = [
     (1, './01-connect-uname-no-password-denied.py'),
     (1, './01-connect-uname-password-denied-no-will.py'),
     (1, './01-connect-uname-password-denied.py'),
+    (1, './01-connect-uname-password-pbkdf2.py'),
     (1, './01-connect-uname-password-success.py'),
     (1, './01-connect-uname-pwd-no-flag.py'),
     (2, './01-connect-zero-length-id.py'),
 
     (1, './02-shared-qos0-v5.py'),
     (1, './02-subhier-crash.py'),
+    (1, './02-subpub-qos0-cache.py'),
     (1, './02-subpub-qos0-long-topic.py'),
+    (1, './02-subpub-qos0-overlap.py'),
+    (1, './02-subpub-qos0-packet-boundaries.py'),
     (1, './02-subpub-qos0-retain-as-publish.py'),
     (1, './02-subpub-qos0-send-retain.py'),
     (1, './02-subpub-qos0-subscription-id.py'),
@@ -42,6 +47,7 @@ tests = [
     (1, './02-subpub-qos1-message-expiry-retain.py'),
     (1, './02-subpub-qos1-message-expiry-will.py'),
     (1, './02-subpub-qos1-message-expiry.py'),
+    (2, './02-subpub-qos1-metrics.py'),
     (1, './02-subpub-qos1-nolocal.py'),
     (1, './02-subpub-qos1-v5.py'),
     (1, './02-subpub-qos1.py'),
@@ -70,6 +76,7 @@ tests = [
     (1, './02-unsubscribe-qos2.py'),
 
     #(1, './03-publish-qos1-queued-bytes.py'),
+    (1, './03-publish-qos1-queued-spill.py'),
     (1, './03-pattern-matching.py'),
     (1, './03-publish-b2c-disconnect-qos1.py'),
     (1, './03-publish-b2c-disconnect-qos2.py'),
@@ -143,14 +150,17 @@ tests = [
     (3, './08-tls-psk-bridge.py'),
 
     (1, './09-acl-access-variants.py'),
+    (1, './09-acl-cache.py'),
     (1, './09-acl-change.py'),
     (1, './09-acl-empty-file.py'),
+    (1, './09-acl-patterns.py'),
     (1, './09-auth-bad-method.py'),
     (1, './09-extended-auth-change-username.py'),
     (1, './09-extended-auth-multistep-reauth.py'),
     (1, './09-extended-auth-multistep.py'),
     (1, './09-extended-auth-single.py'),
     (1, './09-extended-auth-unsupported.py'),
+    (1, './09-plugin-acl-cache.py'),
     (1, './09-plugin-auth-acl-pub.py'),
     (1, './09-plugin-auth-acl-sub-denied.py'),
     (1, './09-plugin-auth-acl-sub.py'),
@@ -162,6 +172,7 @@ tests = [
     (1, './09-plugin-auth-unpwd-success.py'),
     (1, './09-plugin-auth-v2-unpwd-fail.py'),
     (1, './09-plugin-auth-v2-unpwd-success.py'),
+    (1, './09-plugin-auth-v5-pending.py'),
     (1, './09-pwfile-parse-invalid.py'),
 
     (2, './10-listener-mount-point.py'),
@@ -170,6 +181,9 @@ tests = [
     (1, './11-persistent-subscription.py'),
     (1, './11-persistent-subscription-v5.py'),
     (1, './11-persistent-subscription-no-local.py'),
+    (1, './11-persistence-journal.py'),
+    (1, './11-persistence-background.py'),
+    (1, './11-persistence-spill.py'),
     (1, './11-pub-props.py'),
     (1, './11-subscription-id.py'),
 
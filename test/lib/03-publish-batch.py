@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+
+# Test whether a client sends correct PUBLISH messages with
+# mosquitto_publish_batch().
+
+# The client should connect to port 1888 with keepalive=60, clean session set,
+# and client id publish-batch-test
+# The test will send a CONNACK message to the client with rc=0. Upon receiving
+# the CONNACK the client should verify that rc==0. If not, it should exit with
+# return code=1.
+# On a successful CONNACK, the client should first try to publish a batch that
+# includes an invalid topic, which should fail without anything being sent.
+# It should then publish a batch of three messages, to topics "batch/0",
+# "batch/1" and "batch/2" with payloads "message 0", "message 1" and
+# "message 2", at QoS 0, 1 and 2 respectively. These should arrive in order.
+# Once the QoS 1 and QoS 2 flows are complete, the client should send a
+# DISCONNECT message.
+
+from mosq_test_helper import *
+
+port = mosq_test.get_lib_port()
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("publish-batch-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+disconnect_packet = mosq_test.gen_disconnect()
+
+publish0_packet = mosq_test.gen_publish("batch/0", qos=0, payload="message 0")
+publish1_packet = mosq_test.gen_publish("batch/1", qos=1, mid=2, payload="message 1")
+puback1_packet = mosq_test.gen_puback(2)
+publish2_packet = mosq_test.gen_publish("batch/2", qos=2, mid=3, payload="message 2")
+pubrec2_packet = mosq_test.gen_pubrec(3)
+pubrel2_packet = mosq_test.gen_pubrel(3)
+pubcomp2_packet = mosq_test.gen_pubcomp(3)
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+sock.settimeout(10)
+sock.bind(('', port))
+sock.listen(5)
+
+client_args = sys.argv[1:]
+env = dict(os.environ)
+env['LD_LIBRARY_PATH'] = '../../lib:../../lib/cpp'
+try:
+    pp = env['PYTHONPATH']
+except KeyError:
+    pp = ''
+env['PYTHONPATH'] = '../../lib/python:'+pp
+client = mosq_test.start_client(filename=sys.argv[1].replace('/', '-'), cmd=client_args, env=env, port=port)
+
+try:
+    (conn, address) = sock.accept()
+    conn.settimeout(10)
+
+    if mosq_test.expect_packet(conn, "connect", connect_packet):
+        conn.send(connack_packet)
+
+        if mosq_test.expect_packet(conn, "publish 0", publish0_packet) \
+                and mosq_test.expect_packet(conn, "publish 1", publish1_packet) \
+                and mosq_test.expect_packet(conn, "publish 2", publish2_packet):
+
+            conn.send(puback1_packet)
+            conn.send(pubrec2_packet)
+
+            if mosq_test.expect_packet(conn, "pubrel", pubrel2_packet):
+                conn.send(pubcomp2_packet)
+
+                if mosq_test.expect_packet(conn, "disconnect", disconnect_packet):
+                    rc = 0
+
+    conn.close()
+finally:
+    client.terminate()
+    client.wait()
+    if rc:
+        (stdo, stde) = client.communicate()
+        print(stde)
+    sock.close()
+
+exit(rc)
@@ -0,0 +1,79 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mosquitto.h>
+
+static int run = -1;
+static int sent = 0;
+
+static void message_set(struct mosquitto_message *msg, const char *topic, const char *payload, int qos)
+{
+	memset(msg, 0, sizeof(struct mosquitto_message));
+	msg->topic = (char *)topic;
+	msg->payload = (void *)payload;
+	msg->payloadlen = strlen(payload);
+	msg->qos = qos;
+}
+
+void on_connect(struct mosquitto *mosq, void *obj, int rc)
+{
+	struct mosquitto_message msgs[3];
+
+	if(rc){
+		exit(1);
+	}
+
+	/* The bad topic in the middle means nothing should be sent. */
+	message_set(&msgs[0], "batch/0", "message 0", 0);
+	message_set(&msgs[1], "batch/+", "message 1", 1);
+	message_set(&msgs[2], "batch/2", "message 2", 2);
+	if(mosquitto_publish_batch(mosq, msgs, 3, NULL) != MOSQ_ERR_INVAL){
+		exit(1);
+	}
+
+	message_set(&msgs[1], "batch/1", "message 1", 1);
+	if(mosquitto_publish_batch(mosq, msgs, 3, NULL) != MOSQ_ERR_SUCCESS){
+		exit(1);
+	}
+	if(msgs[0].mid != 1 || msgs[1].mid != 2 || msgs[2].mid != 3){
+		exit(1);
+	}
+}
+
+void on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+	sent++;
+	if(sent == 3){
+		mosquitto_disconnect(mosq);
+	}
+}
+
+void on_disconnect(struct mosquitto *mosq, void *obj, int rc)
+{
+	run = 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int rc;
+	struct mosquitto *mosq;
+
+	int port = atoi(argv[1]);
+
+	mosquitto_lib_init();
+
+	mosq = mosquitto_new("publish-batch-test", true, NULL);
+	mosquitto_connect_callback_set(mosq, on_connect);
+	mosquitto_disconnect_callback_set(mosq, on_disconnect);
+	mosquitto_publish_callback_set(mosq, on_publish);
+
+	rc = mosquitto_connect(mosq, "localhost", port, 60);
+
+	while(run == -1){
+		mosquitto_loop(mosq, 300, 1);
+	}
+
+	mosquitto_lib_cleanup();
+	return run;
+}
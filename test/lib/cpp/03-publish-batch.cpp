@@ -0,0 +1,85 @@
+#include <cstring>
+
+#include <mosquittopp.h>
+
+static int run = -1;
+static int sent = 0;
+
+class mosquittopp_test : public mosqpp::mosquittopp
+{
+	public:
+		mosquittopp_test(const char *id);
+
+		void on_connect(int rc);
+		void on_disconnect(int rc);
+		void on_publish(int mid);
+};
+
+mosquittopp_test::mosquittopp_test(const char *id) : mosqpp::mosquittopp(id)
+{
+}
+
+static void message_set(struct mosquitto_message *msg, const char *topic, const char *payload, int qos)
+{
+	memset(msg, 0, sizeof(struct mosquitto_message));
+	msg->topic = (char *)topic;
+	msg->payload = (void *)payload;
+	msg->payloadlen = strlen(payload);
+	msg->qos = qos;
+}
+
+void mosquittopp_test::on_connect(int rc)
+{
+	struct mosquitto_message msgs[3];
+
+	if(rc){
+		exit(1);
+	}
+
+	/* The bad topic in the middle means nothing should be sent. */
+	message_set(&msgs[0], "batch/0", "message 0", 0);
+	message_set(&msgs[1], "batch/+", "message 1", 1);
+	message_set(&msgs[2], "batch/2", "message 2", 2);
+	if(publish_batch(msgs, 3) != MOSQ_ERR_INVAL){
+		exit(1);
+	}
+
+	message_set(&msgs[1], "batch/1", "message 1", 1);
+	if(publish_batch(msgs, 3) != MOSQ_ERR_SUCCESS){
+		exit(1);
+	}
+}
+
+void mosquittopp_test::on_disconnect(int rc)
+{
+	run = 0;
+}
+
+void mosquittopp_test::on_publish(int mid)
+{
+	sent++;
+	if(sent == 3){
+		disconnect();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct mosquittopp_test *mosq;
+
+	int port = atoi(argv[1]);
+
+	mosqpp::lib_init();
+
+	mosq = new mosquittopp_test("publish-batch-test");
+
+	mosq->connect("localhost", port, 60);
+
+	while(run == -1){
+		mosq->loop();
+	}
+
+	mosqpp::lib_cleanup();
+
+	return run;
+}
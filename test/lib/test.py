@@ -24,6 +24,7 @@ tests = [
     (1, ['./03-publish-b2c-qos1.py', 'c/03-publish-b2c-qos1.test']),
     (1, ['./03-publish-b2c-qos2-len.py', 'c/03-publish-b2c-qos2-len.test']),
     (1, ['./03-publish-b2c-qos2.py', 'c/03-publish-b2c-qos2.test']),
+    (1, ['./03-publish-batch.py', 'c/03-publish-batch.test']),
     (1, ['./03-publish-c2b-qos1-disconnect.py', 'c/03-publish-c2b-qos1-disconnect.test']),
     (1, ['./03-publish-c2b-qos1-len.py', 'c/03-publish-c2b-qos1-len.test']),
     (1, ['./03-publish-c2b-qos1-receive-maximum.py', 'c/03-publish-c2b-qos1-receive-maximum.test']),
@@ -68,6 +69,7 @@ tests = [
 
     (1, ['./03-publish-b2c-qos1.py', 'cpp/03-publish-b2c-qos1.test']),
     (1, ['./03-publish-b2c-qos2.py', 'cpp/03-publish-b2c-qos2.test']),
+    (1, ['./03-publish-batch.py', 'cpp/03-publish-batch.test']),
     (1, ['./03-publish-c2b-qos1-disconnect.py', 'cpp/03-publish-c2b-qos1-disconnect.test']),
     (1, ['./03-publish-c2b-qos2-disconnect.py', 'cpp/03-publish-c2b-qos2-disconnect.test']),
     (1, ['./03-publish-c2b-qos2.py', 'cpp/03-publish-c2b-qos2.test']),
@@ -0,0 +1,149 @@
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include <memory_mosq.h>
+
+#define SLAB_OBJECTS 64
+
+struct obj{
+	char data[40];
+};
+
+
+/* Every slab holds SLAB_OBJECTS objects, in use or free. */
+static unsigned long slab_count(struct mosquitto__pool *pool)
+{
+	return (pool->in_use + pool->available)/SLAB_OBJECTS;
+}
+
+
+static void TEST_alloc_free(void)
+{
+	struct mosquitto__pool pool = MOSQUITTO__POOL_INIT("test", struct obj);
+	struct obj *objs[SLAB_OBJECTS*4];
+	int i;
+
+	for(i=0; i<SLAB_OBJECTS*4; i++){
+		objs[i] = mosquitto__pool_calloc(&pool);
+		CU_ASSERT_PTR_NOT_NULL(objs[i]);
+		memset(objs[i], i, sizeof(struct obj));
+	}
+	CU_ASSERT_EQUAL(pool.in_use, SLAB_OBJECTS*4);
+	CU_ASSERT_EQUAL(pool.available, 0);
+	CU_ASSERT_EQUAL(slab_count(&pool), 4);
+	for(i=0; i<SLAB_OBJECTS*4; i++){
+		CU_ASSERT_EQUAL(objs[i]->data[0], (char)i);
+		CU_ASSERT_EQUAL(objs[i]->data[sizeof(struct obj)-1], (char)i);
+	}
+
+	/* Emptied slabs are released, other than one kept spare. */
+	for(i=0; i<SLAB_OBJECTS*4; i++){
+		mosquitto__pool_free(&pool, objs[i]);
+	}
+	CU_ASSERT_EQUAL(pool.in_use, 0);
+	CU_ASSERT_EQUAL(pool.available, SLAB_OBJECTS);
+	CU_ASSERT_EQUAL(slab_count(&pool), 1);
+
+	memory__pools_cleanup();
+	CU_ASSERT_PTR_NULL(pool.slabs);
+	CU_ASSERT_EQUAL(pool.available, 0);
+}
+
+
+static void TEST_reuse_before_grow(void)
+{
+	struct mosquitto__pool pool = MOSQUITTO__POOL_INIT("test", struct obj);
+	struct obj *objs[SLAB_OBJECTS*2];
+	struct obj *obj;
+	int i;
+
+	for(i=0; i<SLAB_OBJECTS*2; i++){
+		objs[i] = mosquitto__pool_calloc(&pool);
+		CU_ASSERT_PTR_NOT_NULL(objs[i]);
+	}
+	CU_ASSERT_EQUAL(slab_count(&pool), 2);
+
+	/* A freed object in a full slab is used again rather than growing. */
+	mosquitto__pool_free(&pool, objs[3]);
+	CU_ASSERT_EQUAL(pool.available, 1);
+	obj = mosquitto__pool_calloc(&pool);
+	CU_ASSERT_PTR_EQUAL(obj, objs[3]);
+	CU_ASSERT_EQUAL(pool.available, 0);
+	CU_ASSERT_EQUAL(slab_count(&pool), 2);
+
+	for(i=0; i<SLAB_OBJECTS*2; i++){
+		mosquitto__pool_free(&pool, objs[i]);
+	}
+	CU_ASSERT_EQUAL(pool.in_use, 0);
+	memory__pools_cleanup();
+}
+
+
+static void TEST_release_middle_slab(void)
+{
+	struct mosquitto__pool pool = MOSQUITTO__POOL_INIT("test", struct obj);
+	struct obj *objs[SLAB_OBJECTS*3];
+	int i;
+
+	for(i=0; i<SLAB_OBJECTS*3; i++){
+		objs[i] = mosquitto__pool_calloc(&pool);
+		CU_ASSERT_PTR_NOT_NULL(objs[i]);
+		memset(objs[i], 0xAA, sizeof(struct obj));
+	}
+
+	/* The first slab to empty is kept as the spare. */
+	for(i=SLAB_OBJECTS; i<SLAB_OBJECTS*2; i++){
+		mosquitto__pool_free(&pool, objs[i]);
+	}
+	CU_ASSERT_EQUAL(pool.available, SLAB_OBJECTS);
+	CU_ASSERT_EQUAL(slab_count(&pool), 3);
+
+	/* With the spare there, the next to empty is released. */
+	for(i=0; i<SLAB_OBJECTS; i++){
+		mosquitto__pool_free(&pool, objs[i]);
+	}
+	CU_ASSERT_EQUAL(pool.available, SLAB_OBJECTS);
+	CU_ASSERT_EQUAL(slab_count(&pool), 2);
+
+	/* The spare is used before a new slab is allocated. */
+	for(i=0; i<SLAB_OBJECTS; i++){
+		objs[i] = mosquitto__pool_calloc(&pool);
+		CU_ASSERT_PTR_NOT_NULL(objs[i]);
+	}
+	CU_ASSERT_EQUAL(pool.available, 0);
+	CU_ASSERT_EQUAL(slab_count(&pool), 2);
+
+	/* Objects in the slab that was never emptied are untouched. */
+	for(i=SLAB_OBJECTS*2; i<SLAB_OBJECTS*3; i++){
+		CU_ASSERT_EQUAL((unsigned char)objs[i]->data[0], 0xAA);
+	}
+	memory__pools_cleanup();
+}
+
+
+/* ========================================================================
+ * TEST SUITE SETUP
+ * ======================================================================== */
+
+int init_memory_pool_tests(void)
+{
+	CU_pSuite test_suite = NULL;
+
+	test_suite = CU_add_suite("Memory pool", NULL, NULL);
+	if(!test_suite){
+		printf("Error adding CUnit memory pool test suite.\n");
+		return 1;
+	}
+
+	if(0
+			|| !CU_add_test(test_suite, "Alloc free", TEST_alloc_free)
+			|| !CU_add_test(test_suite, "Reuse before grow", TEST_reuse_before_grow)
+			|| !CU_add_test(test_suite, "Release middle slab", TEST_release_middle_slab)
+			){
+
+		printf("Error adding Memory pool CUnit tests.\n");
+		return 1;
+	}
+
+	return 0;
+}
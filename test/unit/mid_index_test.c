@@ -0,0 +1,153 @@
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include <mid_index_mosq.h>
+
+struct msg{
+	uint16_t mid;
+};
+
+
+static void TEST_empty(void)
+{
+	struct mosquitto__mid_index index;
+	struct msg m = {1};
+
+	memset(&index, 0, sizeof(index));
+	CU_ASSERT_PTR_NULL(mid_index__find(&index, 1));
+	CU_ASSERT_EQUAL(mid_index__remove(&index, 1, &m), MOSQ_ERR_NOT_FOUND);
+	mid_index__cleanup(&index);
+}
+
+
+static void TEST_add_find_remove(void)
+{
+	struct mosquitto__mid_index index;
+	struct msg msgs[1000];
+	int i;
+
+	memset(&index, 0, sizeof(index));
+	for(i=0; i<1000; i++){
+		msgs[i].mid = (uint16_t)(i+1);
+		CU_ASSERT_EQUAL(mid_index__add(&index, msgs[i].mid, &msgs[i]), MOSQ_ERR_SUCCESS);
+	}
+	CU_ASSERT_EQUAL(index.count, 1000);
+	for(i=0; i<1000; i++){
+		CU_ASSERT_PTR_EQUAL(mid_index__find(&index, msgs[i].mid), &msgs[i]);
+	}
+	CU_ASSERT_PTR_NULL(mid_index__find(&index, 1001));
+
+	/* Remove every other message, the rest must still be found. */
+	for(i=0; i<1000; i+=2){
+		CU_ASSERT_EQUAL(mid_index__remove(&index, msgs[i].mid, &msgs[i]), MOSQ_ERR_SUCCESS);
+	}
+	CU_ASSERT_EQUAL(index.count, 500);
+	for(i=0; i<1000; i++){
+		if(i%2){
+			CU_ASSERT_PTR_EQUAL(mid_index__find(&index, msgs[i].mid), &msgs[i]);
+		}else{
+			CU_ASSERT_PTR_NULL(mid_index__find(&index, msgs[i].mid));
+		}
+	}
+	for(i=1; i<1000; i+=2){
+		CU_ASSERT_EQUAL(mid_index__remove(&index, msgs[i].mid, &msgs[i]), MOSQ_ERR_SUCCESS);
+	}
+	CU_ASSERT_EQUAL(index.count, 0);
+	CU_ASSERT_EQUAL(index.stored, 0);
+	mid_index__cleanup(&index);
+}
+
+
+static void TEST_collisions(void)
+{
+	struct mosquitto__mid_index index;
+	struct msg msgs[8];
+	int i;
+
+	/* All of these hash to the same slot in the smallest table, and the last
+	 * run wraps around the end of the table. */
+	memset(&index, 0, sizeof(index));
+	for(i=0; i<4; i++){
+		msgs[i].mid = (uint16_t)(16 + i*16);
+		CU_ASSERT_EQUAL(mid_index__add(&index, msgs[i].mid, &msgs[i]), MOSQ_ERR_SUCCESS);
+	}
+	for(i=4; i<8; i++){
+		msgs[i].mid = (uint16_t)(15 + i*16);
+		CU_ASSERT_EQUAL(mid_index__add(&index, msgs[i].mid, &msgs[i]), MOSQ_ERR_SUCCESS);
+	}
+	CU_ASSERT_EQUAL(index.size, 16);
+
+	CU_ASSERT_EQUAL(mid_index__remove(&index, msgs[4].mid, &msgs[4]), MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(mid_index__remove(&index, msgs[0].mid, &msgs[0]), MOSQ_ERR_SUCCESS);
+	for(i=1; i<8; i++){
+		if(i != 4){
+			CU_ASSERT_PTR_EQUAL(mid_index__find(&index, msgs[i].mid), &msgs[i]);
+		}
+	}
+	mid_index__cleanup(&index);
+}
+
+
+static void TEST_duplicate_mid(void)
+{
+	struct mosquitto__mid_index index;
+	struct msg a = {7}, b = {7};
+
+	memset(&index, 0, sizeof(index));
+	CU_ASSERT_EQUAL(mid_index__add(&index, 7, &a), MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(mid_index__add(&index, 7, &b), MOSQ_ERR_SUCCESS);
+	CU_ASSERT_PTR_EQUAL(mid_index__find(&index, 7), &a);
+	CU_ASSERT_EQUAL(mid_index__remove(&index, 7, &a), MOSQ_ERR_SUCCESS);
+	CU_ASSERT_PTR_EQUAL(mid_index__find(&index, 7), &b);
+	CU_ASSERT_EQUAL(mid_index__remove(&index, 7, &a), MOSQ_ERR_NOT_FOUND);
+	CU_ASSERT_EQUAL(mid_index__remove(&index, 7, &b), MOSQ_ERR_SUCCESS);
+	CU_ASSERT_PTR_NULL(mid_index__find(&index, 7));
+	mid_index__cleanup(&index);
+}
+
+
+static void TEST_mid_zero(void)
+{
+	struct mosquitto__mid_index index;
+	struct msg a = {0}, b = {0};
+
+	memset(&index, 0, sizeof(index));
+	CU_ASSERT_EQUAL(mid_index__add(&index, 0, &a), MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(mid_index__add(&index, 0, &b), MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(index.count, 2);
+	CU_ASSERT_EQUAL(index.stored, 0);
+	CU_ASSERT_PTR_NULL(mid_index__find(&index, 0));
+	CU_ASSERT_EQUAL(mid_index__remove(&index, 0, &a), MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(index.count, 1);
+	mid_index__cleanup(&index);
+}
+
+
+/* ========================================================================
+ * TEST SUITE SETUP
+ * ======================================================================== */
+
+int init_mid_index_tests(void)
+{
+	CU_pSuite test_suite = NULL;
+
+	test_suite = CU_add_suite("Mid index", NULL, NULL);
+	if(!test_suite){
+		printf("Error adding CUnit mid index test suite.\n");
+		return 1;
+	}
+
+	if(0
+			|| !CU_add_test(test_suite, "Empty", TEST_empty)
+			|| !CU_add_test(test_suite, "Add find remove", TEST_add_find_remove)
+			|| !CU_add_test(test_suite, "Collisions", TEST_collisions)
+			|| !CU_add_test(test_suite, "Duplicate mid", TEST_duplicate_mid)
+			|| !CU_add_test(test_suite, "Mid zero", TEST_mid_zero)
+			){
+
+		printf("Error adding Mid index CUnit tests.\n");
+		return 1;
+	}
+
+	return 0;
+}
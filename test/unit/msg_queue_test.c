@@ -0,0 +1,106 @@
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+
+#include <msg_queue.h>
+
+/* The queue only stores pointers, so any addresses will do. */
+static char msgs[1000];
+#define MSG(i) ((struct mosquitto_client_msg *)&msgs[(i)])
+
+
+static void TEST_empty(void)
+{
+	struct mosquitto__msg_queue queue;
+
+	memset(&queue, 0, sizeof(queue));
+	CU_ASSERT_PTR_NULL(msg_queue__first(&queue));
+	CU_ASSERT_PTR_NULL(msg_queue__pop(&queue));
+	CU_ASSERT_PTR_NULL(msg_queue__get(&queue, 0));
+	msg_queue__cleanup(&queue);
+}
+
+
+static void TEST_fifo_grow_shrink(void)
+{
+	struct mosquitto__msg_queue queue;
+	int i;
+
+	memset(&queue, 0, sizeof(queue));
+	for(i=0; i<1000; i++){
+		CU_ASSERT_EQUAL(msg_queue__push(&queue, MSG(i)), MOSQ_ERR_SUCCESS);
+	}
+	CU_ASSERT_EQUAL(queue.count, 1000);
+	CU_ASSERT_EQUAL(queue.size, 1024);
+	for(i=0; i<1000; i++){
+		CU_ASSERT_PTR_EQUAL(msg_queue__get(&queue, i), MSG(i));
+	}
+	CU_ASSERT_PTR_NULL(msg_queue__get(&queue, 1000));
+
+	for(i=0; i<990; i++){
+		CU_ASSERT_PTR_EQUAL(msg_queue__pop(&queue), MSG(i));
+	}
+	CU_ASSERT_EQUAL(queue.count, 10);
+	CU_ASSERT_EQUAL(queue.size, 64);
+	CU_ASSERT_PTR_EQUAL(msg_queue__first(&queue), MSG(990));
+	for(i=990; i<1000; i++){
+		CU_ASSERT_PTR_EQUAL(msg_queue__pop(&queue), MSG(i));
+	}
+	CU_ASSERT_PTR_NULL(msg_queue__pop(&queue));
+	msg_queue__cleanup(&queue);
+}
+
+
+static void TEST_wrap(void)
+{
+	struct mosquitto__msg_queue queue;
+	int i, next_push = 0, next_pop = 0;
+
+	/* Keep between 10 and 16 messages queued so the ring wraps many times
+	 * without growing, then grow it while wrapped. */
+	memset(&queue, 0, sizeof(queue));
+	for(i=0; i<10; i++){
+		msg_queue__push(&queue, MSG(next_push++));
+	}
+	for(i=0; i<100; i++){
+		CU_ASSERT_EQUAL(msg_queue__push(&queue, MSG(next_push++)), MOSQ_ERR_SUCCESS);
+		CU_ASSERT_PTR_EQUAL(msg_queue__pop(&queue), MSG(next_pop++));
+	}
+	CU_ASSERT_EQUAL(queue.size, 16);
+	for(i=0; i<20; i++){
+		msg_queue__push(&queue, MSG(next_push++));
+	}
+	CU_ASSERT_EQUAL(queue.size, 32);
+	while(queue.count){
+		CU_ASSERT_PTR_EQUAL(msg_queue__pop(&queue), MSG(next_pop++));
+	}
+	CU_ASSERT_EQUAL(next_pop, next_push);
+	msg_queue__cleanup(&queue);
+}
+
+
+/* ========================================================================
+ * TEST SUITE SETUP
+ * ======================================================================== */
+
+int init_msg_queue_tests(void)
+{
+	CU_pSuite test_suite = NULL;
+
+	test_suite = CU_add_suite("Message queue", NULL, NULL);
+	if(!test_suite){
+		printf("Error adding CUnit message queue test suite.\n");
+		return 1;
+	}
+
+	if(0
+			|| !CU_add_test(test_suite, "Empty", TEST_empty)
+			|| !CU_add_test(test_suite, "FIFO grow shrink", TEST_fifo_grow_shrink)
+			|| !CU_add_test(test_suite, "Wrap", TEST_wrap)
+			){
+
+		printf("Error adding Message queue CUnit tests.\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -9,6 +9,8 @@
 #include <send_mosq.h>
 #include <time_mosq.h>
 
+struct mosquitto__pool client_msg_pool = MOSQUITTO__POOL_INIT("client messages", struct mosquitto_client_msg);
+
 extern uint64_t last_retained;
 extern char *last_sub;
 extern int last_qos;
@@ -78,7 +80,6 @@ int db__message_store(struct mosquitto_db *db, const struct mosquitto *source, u
         temp->message_expiry_time = 0;
     }
 
-    temp->dest_ids = NULL;
     temp->dest_id_count = 0;
     db->msg_store_count++;
     db->msg_store_bytes += payloadlen;
@@ -134,6 +135,22 @@ int sub__add(struct mosquitto_db *db, struct mosquitto *context, const char *sub
 	return MOSQ_ERR_SUCCESS;
 }
 
+struct mosquitto__subhier *sub__add_hier(struct mosquitto_db *db, const char *sub)
+{
+	static struct mosquitto__subhier subhier;
+
+	last_sub = strdup(sub);
+	return &subhier;
+}
+
+int sub__add_restored(struct mosquitto_db *db, struct mosquitto *context, int qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier)
+{
+	last_qos = qos;
+	last_identifier = identifier;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
 int sub__messages_queue(struct mosquitto_db *db, const char *source_id, const char *topic, int qos, int retain, struct mosquitto_msg_store **stored)
 {
 	if(retain){
@@ -148,3 +165,31 @@ void db__msg_store_ref_inc(struct mosquitto_msg_store *store)
 	store->ref_count++;
 }
 
+
+void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store)
+{
+	(*store)->ref_count--;
+}
+
+void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool do_free)
+{
+}
+
+int sub__remove(struct mosquitto_db *db, struct mosquitto *context, const char *sub, struct mosquitto__subhier *root, uint8_t *reason)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+void sub__retain_clear(struct mosquitto_db *db, const char *topic)
+{
+}
+
+bool spill__wanted(struct mosquitto_db *db, struct mosquitto *context, struct mosquitto_msg_data *msg_data, struct mosquitto_msg_store *stored)
+{
+	return false;
+}
+
+int spill__push(struct mosquitto_db *db, struct mosquitto_msg_data *msg_data, struct mosquitto_msg_store *stored, uint16_t mid, int qos, bool retain, mosquitto_property *properties)
+{
+	return MOSQ_ERR_NOT_SUPPORTED;
+}
@@ -745,6 +745,112 @@ static void TEST_v5_sub(void)
 	}
 }
 
+static void TEST_v6_config_ok(void)
+{
+	struct mosquitto_db db;
+	struct mosquitto__config config;
+	int rc;
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	db.config = &config;
+
+	config.persistence = true;
+	config.persistence_filepath = "files/persist_read/v6-cfg.test-db";
+
+	rc = persist__restore(&db);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(db.last_db_id, 0x7856341200000000);
+}
+
+
+static void TEST_v6_config_bad_crc(void)
+{
+	struct mosquitto_db db;
+	struct mosquitto__config config;
+	int rc;
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	db.config = &config;
+
+	config.persistence = true;
+	config.persistence_filepath = "files/persist_read/v6-cfg-bad-crc.test-db";
+
+	rc = persist__restore(&db);
+	CU_ASSERT_EQUAL(rc, 1);
+	CU_ASSERT_EQUAL(db.last_db_id, 0);
+}
+
+
+static void TEST_v6_message_store(void)
+{
+	struct mosquitto_db db;
+	struct mosquitto__config config;
+	int rc;
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	db.config = &config;
+
+	config.persistence = true;
+	config.persistence_filepath = "files/persist_read/v6-message-store.test-db";
+
+	rc = persist__restore(&db);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(db.msg_store_count, 1);
+	CU_ASSERT_EQUAL(db.msg_store_bytes, 7);
+	CU_ASSERT_PTR_NOT_NULL(db.msg_store);
+	if(db.msg_store){
+		CU_ASSERT_EQUAL(db.msg_store->db_id, 1);
+		CU_ASSERT_STRING_EQUAL(db.msg_store->source_id, "source_id");
+		CU_ASSERT_EQUAL(db.msg_store->source_mid, 2);
+		CU_ASSERT_EQUAL(db.msg_store->qos, 2);
+		CU_ASSERT_EQUAL(db.msg_store->retain, 1);
+		CU_ASSERT_STRING_EQUAL(db.msg_store->topic, "topic");
+		CU_ASSERT_EQUAL(db.msg_store->payloadlen, 7);
+		if(db.msg_store->payloadlen == 7){
+			CU_ASSERT_NSTRING_EQUAL(UHPA_ACCESS_PAYLOAD(db.msg_store), "payload", 7);
+		}
+	}
+}
+
+
+static void TEST_v6_message_store_compressed(void)
+{
+	struct mosquitto_db db;
+	struct mosquitto__config config;
+	char payload[218];
+	int i;
+	int rc;
+
+	for(i=0; i<210; i++){
+		payload[i] = 'a' + i%10;
+	}
+	memcpy(&payload[210], "ZYXWVUTS", 8);
+
+	memset(&db, 0, sizeof(struct mosquitto_db));
+	memset(&config, 0, sizeof(struct mosquitto__config));
+	db.config = &config;
+
+	config.persistence = true;
+	config.persistence_filepath = "files/persist_read/v6-message-store-compressed.test-db";
+
+	rc = persist__restore(&db);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(db.msg_store_count, 1);
+	CU_ASSERT_EQUAL(db.msg_store_bytes, 218);
+	CU_ASSERT_PTR_NOT_NULL(db.msg_store);
+	if(db.msg_store){
+		CU_ASSERT_EQUAL(db.msg_store->db_id, 1);
+		CU_ASSERT_STRING_EQUAL(db.msg_store->topic, "topic");
+		CU_ASSERT_EQUAL(db.msg_store->payloadlen, 218);
+		if(db.msg_store->payloadlen == 218){
+			CU_ASSERT_NSTRING_EQUAL(UHPA_ACCESS_PAYLOAD(db.msg_store), payload, 218);
+		}
+	}
+}
+
 /* ========================================================================
  * TEST SUITE SETUP
  * ======================================================================== */
@@ -785,6 +891,10 @@ int init_persist_read_tests(void)
 			|| !CU_add_test(test_suite, "v5 client message+props", TEST_v5_client_message_props)
 			|| !CU_add_test(test_suite, "v5 retain", TEST_v5_retain)
 			|| !CU_add_test(test_suite, "v5 sub", TEST_v5_sub)
+			|| !CU_add_test(test_suite, "v6 config ok", TEST_v6_config_ok)
+			|| !CU_add_test(test_suite, "v6 config bad crc", TEST_v6_config_bad_crc)
+			|| !CU_add_test(test_suite, "v6 message store", TEST_v6_message_store)
+			|| !CU_add_test(test_suite, "v6 message store compressed", TEST_v6_message_store_compressed)
 			){
 
 		printf("Error adding persist CUnit tests.\n");
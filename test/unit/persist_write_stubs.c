@@ -49,7 +49,7 @@ int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context)
 }
 
 
-int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval)
+int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint32_t payloadlen, const void *payload, int qos, bool retain, bool dup, const mosquitto_property *cmsg_props, const mosquitto_property *store_props, uint32_t expiry_interval, struct mosquitto_msg_store *store)
 {
 	return MOSQ_ERR_SUCCESS;
 }
@@ -69,3 +69,19 @@ int send__pubrel(struct mosquitto *mosq, uint16_t mid)
 	return MOSQ_ERR_SUCCESS;
 }
 
+void worker__wake(struct mosquitto *context)
+{
+}
+
+void packet__cork(struct mosquitto *mosq)
+{
+}
+
+int packet__uncork(struct mosquitto *mosq)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+void context__cleanup(struct mosquitto_db *db, struct mosquitto *context, bool do_free)
+{
+}
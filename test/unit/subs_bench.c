@@ -0,0 +1,159 @@
+/* Benchmark for the subscription tree.
+ *
+ * Adds a large number of subscriptions spread over a three level tree, with a
+ * sprinkling of + and # wildcards, then times matching published topics
+ * against it. Message delivery is stubbed out, so this only measures the
+ * tree itself.
+ *
+ * Usage: ./subs_bench [subscription count] [publish count] [cache size] [topic count]
+ *
+ * Publishes go to topic count different topics, chosen at random, which
+ * defaults to the subscription count.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+
+#define SUBS_PER_CLIENT 100
+
+static unsigned long deliveries = 0;
+
+
+int db__message_insert(struct mosquitto_db *db, struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, int qos, bool retain, struct mosquitto_msg_store *stored, mosquitto_property *properties)
+{
+	deliveries++;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void db__msg_store_ref_inc(struct mosquitto_msg_store *store)
+{
+}
+
+void db__msg_store_ref_dec(struct mosquitto_db *db, struct mosquitto_msg_store **store)
+{
+}
+
+int log__printf(struct mosquitto *mosq, int priority, const char *fmt, ...)
+{
+	return 0;
+}
+
+uint16_t mosquitto__mid_generate(struct mosquitto *mosq)
+{
+	return 1;
+}
+
+int mosquitto_acl_check(struct mosquitto_db *db, struct mosquitto *context, const char *topic, long payloadlen, void* payload, int qos, bool retain, int access)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int acl__find_acls(struct mosquitto_db *db, struct mosquitto *context)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+int mosquitto_property_add_varint(mosquitto_property **proplist, int identifier, uint32_t value)
+{
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
+
+static void sub_topic(char *buf, size_t len, long i)
+{
+	switch(i%1000){
+		case 1:
+			snprintf(buf, len, "bench/%ld/+/+", i%100);
+			break;
+		case 2:
+			snprintf(buf, len, "bench/%ld/#", i%100);
+			break;
+		default:
+			snprintf(buf, len, "bench/%ld/%ld/%ld", i%100, (i/100)%100, i/10000);
+			break;
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct mosquitto_db db;
+	struct mosquitto__config config;
+	struct mosquitto_msg_store stored, *storedp;
+	struct mosquitto *contexts;
+	struct timespec start;
+	long sub_count = 1000000;
+	long pub_count = 1000000;
+	long client_count;
+	long topic_count;
+	long i, i_pub;
+	unsigned long seed = 1;
+	char topic[100];
+	double t;
+
+	if(argc > 1) sub_count = atol(argv[1]);
+	if(argc > 2) pub_count = atol(argv[2]);
+	if(sub_count < SUBS_PER_CLIENT) sub_count = SUBS_PER_CLIENT;
+
+	memset(&db, 0, sizeof(db));
+	memset(&config, 0, sizeof(config));
+	if(argc > 3) config.subscription_cache_size = atoi(argv[3]);
+	topic_count = sub_count;
+	if(argc > 4) topic_count = atol(argv[4]);
+	if(topic_count < 1 || topic_count > sub_count) topic_count = sub_count;
+	memset(&stored, 0, sizeof(stored));
+	db.config = &config;
+
+	if(!sub__add_hier_entry(NULL, &db.subs, "", strlen(""))
+			|| !sub__add_hier_entry(NULL, &db.subs, "$SYS", strlen("$SYS"))){
+
+		return 1;
+	}
+
+	client_count = sub_count/SUBS_PER_CLIENT;
+	contexts = calloc(client_count, sizeof(struct mosquitto));
+	if(!contexts) return 1;
+	for(i=0; i<client_count; i++){
+		contexts[i].id = malloc(30);
+		snprintf(contexts[i].id, 30, "client-%ld", i);
+		contexts[i].protocol = mosq_p_mqtt311;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0; i<client_count*SUBS_PER_CLIENT; i++){
+		sub_topic(topic, sizeof(topic), i);
+		if(sub__add(&db, &contexts[i/SUBS_PER_CLIENT], topic, 0, 0, 0, &db.subs) < 0){
+			fprintf(stderr, "Error adding subscription %s\n", topic);
+			return 1;
+		}
+	}
+	t = elapsed(&start);
+	printf("subscribe: %ld subscriptions in %.3fs (%.0f/s)\n", client_count*SUBS_PER_CLIENT, t, client_count*SUBS_PER_CLIENT/t);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0; i<pub_count; i++){
+		seed = seed*1103515245 + 12345;
+		i_pub = (long)((seed>>8) % (unsigned long)topic_count);
+		snprintf(topic, sizeof(topic), "bench/%ld/%ld/%ld", i_pub%100, (i_pub/100)%100, i_pub/10000);
+		storedp = &stored;
+		sub__messages_queue(&db, "publisher", topic, 0, 0, &storedp);
+	}
+	t = elapsed(&start);
+	printf("publish: %ld topics in %.3fs (%.0f/s, %.0f ns each), %lu deliveries\n", pub_count, t, pub_count/t, t*1e9/pub_count, deliveries);
+
+	return 0;
+}
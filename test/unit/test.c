@@ -13,6 +13,9 @@ int init_property_write_tests(void);
 int init_utf8_tests(void);
 int init_util_topic_tests(void);
 int init_misc_trim_tests(void);
+int init_memory_pool_tests(void);
+int init_mid_index_tests(void);
+int init_msg_queue_tests(void);
 
 int main(int argc, char *argv[])
 {
@@ -33,6 +36,9 @@ int main(int argc, char *argv[])
 			|| init_property_write_tests()
 			|| init_util_topic_tests()
 			|| init_misc_trim_tests()
+			|| init_memory_pool_tests()
+			|| init_mid_index_tests()
+			|| init_msg_queue_tests()
 			){
 
         CU_cleanup_registry();
@@ -445,6 +445,44 @@ void TEST_utf8_mqtt_1_5_4_3(void)
 }
 
 
+void TEST_utf8_long(void)
+{
+	char buf[100];
+	int i;
+
+	/* Strings long enough to take the block at a time ASCII path, with the
+	 * interesting byte moved through every position of the blocks. */
+	memset(buf, 'a', sizeof(buf));
+	utf8_helper_len(buf, sizeof(buf), MOSQ_ERR_SUCCESS);
+
+	for(i=0; i<(int)sizeof(buf); i++){
+		buf[i] = 0x01;
+		utf8_helper_len(buf, sizeof(buf), MOSQ_ERR_MALFORMED_UTF8);
+		buf[i] = 0x7F;
+		utf8_helper_len(buf, sizeof(buf), MOSQ_ERR_MALFORMED_UTF8);
+		buf[i] = '\0';
+		utf8_helper_len(buf, sizeof(buf), MOSQ_ERR_MALFORMED_UTF8);
+		buf[i] = 0x80;
+		utf8_helper_len(buf, sizeof(buf), MOSQ_ERR_MALFORMED_UTF8);
+		buf[i] = 0xC3;
+		if(i < (int)sizeof(buf)-1){
+			utf8_helper_len(buf, sizeof(buf), MOSQ_ERR_MALFORMED_UTF8);
+			buf[i+1] = 0xA9;
+			utf8_helper_len(buf, sizeof(buf), MOSQ_ERR_SUCCESS);
+			buf[i+1] = 'a';
+		}else{
+			utf8_helper_len(buf, sizeof(buf), MOSQ_ERR_MALFORMED_UTF8);
+		}
+		if(i < (int)sizeof(buf)-2){
+			buf[i] = 0xE2; buf[i+1] = 0x82; buf[i+2] = 0xAC;
+			utf8_helper_len(buf, sizeof(buf), MOSQ_ERR_SUCCESS);
+			buf[i+1] = 'a'; buf[i+2] = 'a';
+		}
+		buf[i] = 'a';
+	}
+}
+
+
 /* ========================================================================
  * TEST SUITE SETUP
  * ======================================================================== */
@@ -470,6 +508,7 @@ int init_utf8_tests(void)
 			|| !CU_add_test(test_suite, "UTF-8 control characters", TEST_utf8_control_characters)
 			|| !CU_add_test(test_suite, "UTF-8 MQTT-1.5.4-2", TEST_utf8_mqtt_1_5_4_2)
 			|| !CU_add_test(test_suite, "UTF-8 MQTT-1.5.4-3", TEST_utf8_mqtt_1_5_4_3)
+			|| !CU_add_test(test_suite, "UTF-8 long", TEST_utf8_long)
 			){
 
 		printf("Error adding UTF-8 CUnit tests.\n");
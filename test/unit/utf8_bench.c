@@ -0,0 +1,105 @@
+/* Benchmark for UTF-8 validation and topic checks.
+ *
+ * Times mosquitto_validate_utf8(), mosquitto_pub_topic_check2() and
+ * mosquitto_sub_topic_check2() on topics of the given length, made of levels
+ * of eight characters. Runs once with plain ASCII topics, and once with a two
+ * byte UTF-8 character in every level.
+ *
+ * Usage: ./utf8_bench [topic length] [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mosquitto.h"
+
+
+static double elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
+
+static void make_topic(char *topic, int len, int utf8)
+{
+	int i;
+
+	for(i=0; i<len; i++){
+		if(i%9 == 8){
+			topic[i] = '/';
+		}else if(utf8 && i%9 == 3 && i+1 < len){
+			/* U+00E9 */
+			topic[i] = (char)0xC3;
+			topic[i+1] = (char)0xA9;
+			i++;
+		}else{
+			topic[i] = 'a' + i%26;
+		}
+	}
+	topic[len] = '\0';
+}
+
+
+static void run(const char *name, const char *topic, int len, long count)
+{
+	struct timespec start;
+	long i;
+	int rc = 0;
+	double t;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0; i<count; i++){
+		rc |= mosquitto_validate_utf8(topic, len);
+	}
+	t = elapsed(&start);
+	printf("%s validate_utf8: %.1f ns each, %.2f GB/s\n", name, t*1e9/count, (double)len*count/t/1e9);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0; i<count; i++){
+		rc |= mosquitto_pub_topic_check2(topic, len);
+	}
+	t = elapsed(&start);
+	printf("%s pub_topic_check2: %.1f ns each, %.2f GB/s\n", name, t*1e9/count, (double)len*count/t/1e9);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0; i<count; i++){
+		rc |= mosquitto_sub_topic_check2(topic, len);
+	}
+	t = elapsed(&start);
+	printf("%s sub_topic_check2: %.1f ns each, %.2f GB/s\n", name, t*1e9/count, (double)len*count/t/1e9);
+
+	if(rc){
+		fprintf(stderr, "Error: %s topic failed a check\n", name);
+		exit(1);
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	int len = 256;
+	long count = 2000000;
+	char *topic;
+
+	if(argc > 1) len = atoi(argv[1]);
+	if(argc > 2) count = atol(argv[2]);
+	if(len < 1 || len > 65535) len = 256;
+	if(count < 1) count = 1;
+
+	topic = malloc(len+1);
+	if(!topic) return 1;
+
+	printf("topic length %d, %ld iterations\n", len, count);
+	make_topic(topic, len, 0);
+	run("ascii", topic, len, count);
+	make_topic(topic, len, 1);
+	run("utf8 ", topic, len, count);
+
+	free(topic);
+	return 0;
+}
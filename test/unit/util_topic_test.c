@@ -218,6 +218,42 @@ static void TEST_pub_topic_invalid(void)
 	pub_topic_helper("+/pub/topic", MOSQ_ERR_INVAL);
 }
 
+static void TEST_pub_topic_long(void)
+{
+	char topic[100];
+	int i;
+
+	/* Long enough to be checked a block at a time, with the wildcard moved
+	 * through every position of the blocks. */
+	for(i=0; i<(int)sizeof(topic)-1; i++){
+		topic[i] = (i%5 == 4)?'/':'a';
+	}
+	topic[sizeof(topic)-1] = '\0';
+	pub_topic_helper(topic, MOSQ_ERR_SUCCESS);
+
+	for(i=0; i<(int)sizeof(topic)-1; i++){
+		topic[i] = '+';
+		pub_topic_helper(topic, MOSQ_ERR_INVAL);
+		topic[i] = '#';
+		pub_topic_helper(topic, MOSQ_ERR_INVAL);
+		topic[i] = (i%5 == 4)?'/':'a';
+	}
+}
+
+static void TEST_pub_topic_nul(void)
+{
+	char topic[100];
+
+	memset(topic, 'a', sizeof(topic));
+	topic[3] = '\0';
+	CU_ASSERT_EQUAL(mosquitto_pub_topic_check2(topic, 9), MOSQ_ERR_INVAL);
+	CU_ASSERT_EQUAL(mosquitto_pub_topic_check2(topic, sizeof(topic)), MOSQ_ERR_INVAL);
+	topic[3] = 'a';
+	topic[70] = '\0';
+	CU_ASSERT_EQUAL(mosquitto_pub_topic_check2(topic, sizeof(topic)), MOSQ_ERR_INVAL);
+	CU_ASSERT_EQUAL(mosquitto_pub_topic_check2(topic, 70), MOSQ_ERR_SUCCESS);
+}
+
 
 /* ========================================================================
  * SUB TOPIC CHECK
@@ -263,6 +299,53 @@ static void TEST_sub_topic_invalid(void)
 	sub_topic_helper("#/sub/topic", MOSQ_ERR_INVAL);
 }
 
+static void TEST_sub_topic_long(void)
+{
+	char topic[100];
+	int i;
+
+	/* Long enough to be checked a block at a time, with the wildcards moved
+	 * through every position of the blocks. Levels are "aaaa". */
+	for(i=0; i<(int)sizeof(topic)-1; i++){
+		topic[i] = (i%5 == 4)?'/':'a';
+	}
+	topic[sizeof(topic)-1] = '\0';
+	sub_topic_helper(topic, MOSQ_ERR_SUCCESS);
+
+	for(i=0; i<(int)sizeof(topic)-1; i++){
+		topic[i] = '+';
+		sub_topic_helper(topic, MOSQ_ERR_INVAL);
+		topic[i] = '#';
+		sub_topic_helper(topic, MOSQ_ERR_INVAL);
+		topic[i] = (i%5 == 4)?'/':'a';
+	}
+	for(i=0; i<(int)sizeof(topic)-1; i+=5){
+		/* "aaaa" to "+" */
+		memmove(&topic[i+1], &topic[i+4], sizeof(topic)-i-4);
+		topic[i] = '+';
+		sub_topic_helper(topic, MOSQ_ERR_SUCCESS);
+		memmove(&topic[i+4], &topic[i+1], sizeof(topic)-i-4);
+		memset(&topic[i], 'a', 4);
+	}
+	topic[95] = '#';
+	topic[96] = '\0';
+	sub_topic_helper(topic, MOSQ_ERR_SUCCESS);
+}
+
+static void TEST_sub_topic_nul(void)
+{
+	char topic[100];
+
+	memset(topic, 'a', sizeof(topic));
+	topic[3] = '\0';
+	CU_ASSERT_EQUAL(mosquitto_sub_topic_check2(topic, 9), MOSQ_ERR_INVAL);
+	CU_ASSERT_EQUAL(mosquitto_sub_topic_check2(topic, sizeof(topic)), MOSQ_ERR_INVAL);
+	topic[3] = 'a';
+	topic[70] = '\0';
+	CU_ASSERT_EQUAL(mosquitto_sub_topic_check2(topic, sizeof(topic)), MOSQ_ERR_INVAL);
+	CU_ASSERT_EQUAL(mosquitto_sub_topic_check2(topic, 70), MOSQ_ERR_SUCCESS);
+}
+
 /* ========================================================================
  * TEST SUITE SETUP
  * ======================================================================== */
@@ -285,8 +368,12 @@ int init_util_topic_tests(void)
 			|| !CU_add_test(test_suite, "Matching: Invalid", TEST_invalid)
 			|| !CU_add_test(test_suite, "Pub topic: Valid", TEST_pub_topic_valid)
 			|| !CU_add_test(test_suite, "Pub topic: Invalid", TEST_pub_topic_invalid)
+			|| !CU_add_test(test_suite, "Pub topic: Long", TEST_pub_topic_long)
+			|| !CU_add_test(test_suite, "Pub topic: NUL", TEST_pub_topic_nul)
 			|| !CU_add_test(test_suite, "Sub topic: Valid", TEST_sub_topic_valid)
 			|| !CU_add_test(test_suite, "Sub topic: Invalid", TEST_sub_topic_invalid)
+			|| !CU_add_test(test_suite, "Sub topic: Long", TEST_sub_topic_long)
+			|| !CU_add_test(test_suite, "Sub topic: NUL", TEST_sub_topic_nul)
 			){
 
 		printf("Error adding util topic CUnit tests.\n");